@@ -0,0 +1,513 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* sbig-calib - build and list master calibration frames
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/combine.h"
+#include "src/common/libini/ini.h"
+
+struct options {
+    CCD_REQUEST chip;
+    READOUT_BINNING_MODE readout_mode;
+    double partial;
+    double t;
+    int count;
+    enum combine_method method;
+    double kappa;
+    char *filter;
+    char *imagedir;
+    char *calibdir;
+    double temp_step;
+    bool verbose;
+};
+
+#define DEFAULT_COUNT   16
+#define DEFAULT_KAPPA   3.0
+#define FLAT_MIN        0.01    /* floor for normalized flat pixels */
+
+#define OPTIONS "hn:t:C:r:p:m:F:d:"
+static const struct option longopts[] = {
+    {"help",           no_argument,        0, 'h'},
+    {"count",          required_argument,  0, 'n'},
+    {"exposure-time",  required_argument,  0, 't'},
+    {"ccd-chip",       required_argument,  0, 'C'},
+    {"resolution",     required_argument,  0, 'r'},
+    {"partial",        required_argument,  0, 'p'},
+    {"method",         required_argument,  0, 'm'},
+    {"filter",         required_argument,  0, 'F'},
+    {"calib-directory", required_argument, 0, 'd'},
+    {0, 0, 0, 0},
+};
+
+static volatile bool interrupted = false;
+
+int config_cb (void *user, const char *section, const char *name,
+               const char *value);
+bool parse_method (const char *s, struct options *opt);
+void list (struct options *opt);
+void build (sbig_t *sb, struct options *opt, enum sbig_calib_type type);
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-calib [OPTIONS] bias|dark|flat|list\n"
+"  -n, --count N              frames to combine (default 16)\n"
+"  -t, --exposure-time SEC    dark or flat exposure time (default 1.0)\n"
+"  -C, --ccd-chip CHIP        use imaging, tracking, or ext-tracking\n"
+"  -r, --resolution RES       select hi, med, or lo resolution\n"
+"  -p, --partial N            take centered partial frame (0 < N <= 1.0)\n"
+"  -m, --method METHOD        median or sigma[:KAPPA] (default sigma:3)\n"
+"  -F, --filter NAME          filter a flat is taken through\n"
+"  -d, --calib-directory DIR  calibration library (default IMAGEDIR/calib)\n"
+);
+    exit (1);
+}
+
+void handle_sigint (int signal)
+{
+    msg ("interrupted: aborting");
+    interrupted = true;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *sbig_udrv = getenv ("SBIG_UDRV");
+    const char *sbig_device = getenv ("SBIG_DEVICE");
+    const char *config_filename = getenv ("SBIG_CONFIG_FILE");
+    enum sbig_calib_type type = SBIG_CALIB_DARK;
+    int e, ch;
+    sbig_t *sb;
+    CAMERA_TYPE camtype;
+    struct options *opt;
+    struct sigaction sa;
+
+    log_init ("sbig-calib");
+
+    /* Set default option values.
+     */
+    opt = xzmalloc (sizeof (*opt));
+    opt->chip = CCD_IMAGING;
+    opt->readout_mode = RM_1X1;
+    opt->partial = 1.0;
+    opt->t = 1.0;
+    opt->count = DEFAULT_COUNT;
+    opt->method = COMBINE_SIGMA_CLIP;
+    opt->kappa = DEFAULT_KAPPA;
+    opt->imagedir = xstrdup ("/tmp");
+    opt->temp_step = SBIG_CALIB_TEMP_STEP;
+    opt->verbose = true;
+
+    /* Override defaults with config file
+     */
+    if (!config_filename)
+        msg_exit ("SBIG_CONFIG_FILE is not set");
+    if (ini_parse (config_filename, config_cb, opt) < 0)
+        msg ("warning - cannot load %s", config_filename);
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n': /* --count N */
+                opt->count = strtol (optarg, NULL, 10);
+                if (opt->count < 1 || opt->count > COMBINE_MAX_FRAMES)
+                    msg_exit ("error parsing --count argument (1-%d)",
+                              COMBINE_MAX_FRAMES);
+                break;
+            case 't': /* --exposure-time SEC */
+                opt->t = strtod (optarg, NULL);
+                if (opt->t < 0 || opt->t > 86400)
+                    msg_exit ("error parsing --exposure-time argument");
+                break;
+            case 'C': /* --ccd-chip CHIP */
+                if (!strcmp (optarg, "imaging"))
+                    opt->chip = CCD_IMAGING;
+                else if (!strcmp (optarg, "tracking"))
+                    opt->chip = CCD_TRACKING;
+                else if (!strcmp (optarg, "ext-tracking"))
+                    opt->chip = CCD_EXT_TRACKING;
+                else
+                    msg_exit ("error parsing --ccd-chip argument (imaging, tracking, ext-tracking)");
+                break;
+            case 'r': /* --resolution hi|med|lo */
+                if (!strcmp (optarg, "hi"))
+                    opt->readout_mode = RM_1X1;
+                else if (!strcmp (optarg, "med"))
+                    opt->readout_mode = RM_2X2;
+                else if (!strcmp (optarg, "lo"))
+                    opt->readout_mode = RM_3X3;
+                else
+                    msg_exit ("error parsing --resolution (hi, med, lo)");
+                break;
+            case 'p': /* --partial N */
+                opt->partial = strtod (optarg, NULL);
+                if (opt->partial <= 0 || opt->partial > 1.0)
+                    usage ();
+                break;
+            case 'm': /* --method median|sigma[:KAPPA] */
+                if (!parse_method (optarg, opt))
+                    msg_exit ("error parsing --method (median, sigma[:KAPPA])");
+                break;
+            case 'F': /* --filter NAME */
+                free (opt->filter);
+                opt->filter = xstrdup (optarg);
+                break;
+            case 'd': /* --calib-directory DIR */
+                free (opt->calibdir);
+                opt->calibdir = xstrdup (optarg);
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc - 1)
+        usage ();
+    if (!opt->calibdir) {
+        opt->calibdir = xzmalloc (strlen (opt->imagedir) + 7);
+        sprintf (opt->calibdir, "%s/calib", opt->imagedir);
+    }
+
+    if (!strcmp (argv[optind], "list")) {
+        list (opt);
+        goto free_opt;
+    } else if (!strcmp (argv[optind], "bias"))
+        type = SBIG_CALIB_BIAS;
+    else if (!strcmp (argv[optind], "dark"))
+        type = SBIG_CALIB_DARK;
+    else if (!strcmp (argv[optind], "flat"))
+        type = SBIG_CALIB_FLAT;
+    else
+        usage ();
+
+    /* Connect to driver
+     */
+    if (!sbig_device)
+        msg_exit ("SBIG_DEVICE is not set");
+    if (!(sb = sbig_new ()))
+        err_exit ("sbig_new");
+    if (sbig_dlopen (sb, sbig_udrv) != 0)
+        msg_exit ("%s", dlerror ());
+    if ((e = sbig_open_driver (sb)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_driver: %s", sbig_get_error_string (sb, e));
+
+    sa.sa_handler = &handle_sigint;
+    sa.sa_flags = 0;
+    sigfillset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0)
+        err_exit ("sigaction");
+
+    /* Open camera
+     */
+    if ((e = sbig_open_device (sb, sbig_device)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_device: %s", sbig_get_error_string (sb, e));
+    if (opt->verbose)
+        msg ("Device open");
+    if ((e = sbig_establish_link (sb, &camtype)) != CE_NO_ERROR)
+        msg_exit ("sbig_establish_link: %s", sbig_get_error_string (sb, e));
+    if (opt->verbose)
+        msg ("Link established to %s", sbig_strcam (camtype));
+
+    build (sb, opt, type);
+
+    if ((e = sbig_close_device (sb)) != 0)
+        msg_exit ("sbig_close_device: %s", sbig_get_error_string (sb, e));
+    if (opt->verbose)
+        msg ("Device closed");
+    sbig_destroy (sb);
+free_opt:
+    free (opt->filter);
+    free (opt->imagedir);
+    free (opt->calibdir);
+    free (opt);
+    log_fini ();
+    return 0;
+}
+
+int config_cb (void *user, const char *section, const char *name,
+               const char *value)
+{
+    struct options *opt = user;
+
+    if (!strcmp (section, "system")) {
+        if (!strcmp (name, "imagedir")) {
+            free (opt->imagedir);
+            opt->imagedir = xstrdup (value);
+        } else if (!strcmp (name, "calibdir")) {
+            free (opt->calibdir);
+            opt->calibdir = xstrdup (value);
+        } else if (!strcmp (name, "calib_temp_step")) {
+            opt->temp_step = strtod (value, NULL);
+            if (opt->temp_step <= 0) {
+                msg ("warning - config: bad calib_temp_step '%s'", value);
+                opt->temp_step = SBIG_CALIB_TEMP_STEP;
+            }
+        }
+    } else if (!strcmp (section, "config")) {
+        if (!strcmp (name, "filter")) {
+            free (opt->filter);
+            opt->filter = xstrdup (value);
+        }
+    }
+    return 0; /* 0=success, 1=error */
+}
+
+bool parse_method (const char *s, struct options *opt)
+{
+    char *endptr;
+
+    if (!strcasecmp (s, "median"))
+        opt->method = COMBINE_MEDIAN;
+    else if (!strncasecmp (s, "sigma", 5)) {
+        opt->method = COMBINE_SIGMA_CLIP;
+        opt->kappa = DEFAULT_KAPPA;
+        if (s[5] == ':') {
+            opt->kappa = strtod (s + 6, &endptr);
+            if (endptr == s + 6 || *endptr != '\0' || opt->kappa <= 0)
+                return false;
+        } else if (s[5] != '\0')
+            return false;
+    } else
+        return false;
+    return true;
+}
+
+static void list_one (const struct sbig_calib_info *info, void *arg)
+{
+    const struct sbig_calib_key *k = &info->key;
+    char created[32], cond[48];
+    struct tm tm;
+
+    strftime (created, sizeof (created), "%Y-%m-%d %H:%M",
+              localtime_r (&info->created, &tm));
+    if (info->type == SBIG_CALIB_FLAT)
+        snprintf (cond, sizeof (cond), "filter %s",
+                  k->filter[0] ? k->filter : "none");
+    else if (info->type == SBIG_CALIB_DARK)
+        snprintf (cond, sizeof (cond), "%.3fs %+.1fC", k->exposure, k->temp);
+    else
+        snprintf (cond, sizeof (cond), "%+.1fC", k->temp);
+    printf ("%-4s %-10s %s mode %04x %ux%u+%u+%u %-18s %3d frames  %s\n",
+            sbig_calib_strtype (info->type), k->serial,
+            k->chip == CCD_IMAGING ? "img" : k->chip == CCD_TRACKING ? "trk"
+                                                                     : "ext",
+            k->readout_mode, k->width, k->height, k->left, k->top,
+            cond, info->nframes, created);
+}
+
+void list (struct options *opt)
+{
+    sbig_calib_lib_t *lib;
+
+    if (!(lib = sbig_calib_lib_open (opt->calibdir, opt->temp_step)))
+        err_exit ("%s", opt->calibdir);
+    if (sbig_calib_lib_list (lib, list_one, NULL) < 0)
+        err_exit ("%s", opt->calibdir);
+    sbig_calib_lib_close (lib);
+}
+
+double get_temp (sbig_t *sb, CCD_REQUEST chip)
+{
+    QueryTemperatureStatusResults2 temp;
+    int e;
+
+    if ((e = sbig_temp_get_info (sb, &temp)) != CE_NO_ERROR)
+        msg_exit ("sbig_temp_get_info: %s", sbig_get_error_string (sb, e));
+    if (chip == CCD_TRACKING)
+        return temp.trackingCCDTemperature;
+    if (chip == CCD_EXT_TRACKING)
+        return temp.externalTrackingCCDTemperature;
+    return temp.imagingCCDTemperature;
+}
+
+/* Expose and read out one frame into 'buf'.
+ * Returns false if interrupted.
+ */
+bool take_frame (sbig_t *sb, sbig_ccd_t *ccd, double t, ushort *buf)
+{
+    ushort height, width;
+    ushort *data;
+    int e;
+
+    if ((e = sbig_ccd_start_exposure (ccd, 0, t)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_start_exposure: %s", sbig_get_error_string (sb, e));
+    e = sbig_ccd_wait_exposure (ccd, &interrupted);
+    if (interrupted) {
+        (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
+        return false;
+    }
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_wait_exposure: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_end_exposure (ccd, 0)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_readout (ccd)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_readout: %s", sbig_get_error_string (sb, e));
+    data = sbig_ccd_get_data (ccd, &height, &width);
+    memcpy (buf, data, (size_t)height * width * sizeof (*buf));
+    return true;
+}
+
+/* Subtract the master dark for the flat's exposure, or failing that the
+ * master bias, then normalize to a mean of 1.
+ */
+void normalize_flat (sbig_calib_lib_t *lib, struct sbig_calib_key *key,
+                     float *out)
+{
+    size_t i, len = (size_t)key->height * key->width;
+    sbig_calib_frame_t *f;
+    const ushort *sub = NULL;
+    struct sbig_calib_info info;
+    double sum = 0;
+
+    if ((f = sbig_calib_load (lib, SBIG_CALIB_DARK, key))
+                    || (f = sbig_calib_load (lib, SBIG_CALIB_BIAS, key))) {
+        sbig_calib_get_info (f, &info);
+        msg ("flat: subtracting %s", info.path);
+        sub = sbig_calib_get_data (f);
+    } else
+        msg ("flat: warning - no master dark or bias to subtract");
+    for (i = 0; i < len; i++) {
+        if (sub)
+            out[i] -= sub[i];
+        sum += out[i];
+    }
+    if (sum <= 0)
+        msg_exit ("flat: no signal");
+    for (i = 0; i < len; i++)
+        out[i] = fmaxf (out[i] * len / sum, FLAT_MIN);
+}
+
+void build (sbig_t *sb, struct options *opt, enum sbig_calib_type type)
+{
+    sbig_calib_lib_t *lib;
+    struct sbig_calib_key key;
+    sbig_ccd_t *ccd;
+    ushort **frames;
+    float *out;
+    ushort *dark;
+    size_t i, len;
+    double t, t0, t1;
+    int e, n;
+
+    if (!(lib = sbig_calib_lib_open (opt->calibdir, opt->temp_step)))
+        err_exit ("%s", opt->calibdir);
+    if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_end_exposure (ccd, ABORT_DONT_END)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_set_readout_mode (ccd, opt->readout_mode)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+    if (opt->partial < 1.0) {
+        if ((e = sbig_ccd_set_partial_frame (ccd, opt->partial)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_set_partial_frame: %s", sbig_get_error_string (sb, e));
+    }
+    e = sbig_ccd_set_shutter_mode (ccd, type == SBIG_CALIB_FLAT
+                                        ? SC_OPEN_SHUTTER : SC_CLOSE_SHUTTER);
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_shutter_mode: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_calib_key_init (sb, ccd, &key)) != CE_NO_ERROR)
+        msg_exit ("sbig_calib_key_init: %s", sbig_get_error_string (sb, e));
+    if (type == SBIG_CALIB_FLAT && opt->filter)
+        snprintf (key.filter, sizeof (key.filter), "%s", opt->filter);
+    t = type == SBIG_CALIB_BIAS ? sbig_ccd_get_min_exposure (ccd) : opt->t;
+    key.exposure = t;
+
+    len = (size_t)key.height * key.width;
+    frames = xzmalloc (opt->count * sizeof (frames[0]));
+    for (n = 0; n < opt->count; n++)
+        frames[n] = xzmalloc (len * sizeof (ushort));
+    out = xzmalloc (len * sizeof (float));
+
+    t0 = get_temp (sb, opt->chip);
+    for (n = 0; n < opt->count && !interrupted; n++) {
+        if (opt->verbose)
+            msg ("[%d]exposure: %s (%.3fs)", n,
+                 sbig_calib_strtype (type), t);
+        if (!take_frame (sb, ccd, t, frames[n]))
+            break;
+    }
+    t1 = get_temp (sb, opt->chip);
+    if (interrupted)
+        goto done;
+    key.temp = (t0 + t1) / 2;
+    if (type != SBIG_CALIB_FLAT && fabs (t1 - t0) > opt->temp_step / 2)
+        msg ("warning: ccd temperature drifted from %.1fC to %.1fC",
+             t0, t1);
+
+    if (opt->verbose)
+        msg ("combining %d frames (%s)", opt->count,
+             opt->method == COMBINE_MEDIAN ? "median" : "sigma clip");
+    if (combine_frames ((const ushort *const *)frames, opt->count,
+                        key.height, key.width, opt->method, opt->kappa,
+                        out) < 0)
+        err_exit ("combine_frames");
+    if (type == SBIG_CALIB_FLAT) {
+        normalize_flat (lib, &key, out);
+        e = sbig_calib_save (lib, type, &key, opt->count, out);
+    } else {
+        dark = frames[0]; /* reuse for the rounded result */
+        for (i = 0; i < len; i++)
+            dark[i] = lrintf (out[i]);
+        e = sbig_calib_save (lib, type, &key, opt->count, dark);
+    }
+    if (e < 0)
+        err_exit ("sbig_calib_save");
+    if (opt->verbose) {
+        sbig_calib_frame_t *f = sbig_calib_load (lib, type, &key);
+        struct sbig_calib_info info;
+
+        if (!f)
+            err_exit ("sbig_calib_load");
+        sbig_calib_get_info (f, &info);
+        msg ("wrote %s", info.path);
+    }
+done:
+    for (n = 0; n < opt->count; n++)
+        free (frames[n]);
+    free (frames);
+    free (out);
+    sbig_ccd_destroy (ccd);
+    sbig_calib_lib_close (lib);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,323 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* sbig-daemon - hold the driver, device, and link open for other commands
+ *
+ * Commands connect over a Unix domain socket (see libsbig/remote.h) and
+ * their driver calls are executed here, one at a time.  Opening and
+ * closing the driver and device are no-ops for clients, and establishing
+ * the link returns the result cached at startup.  A chip is reserved for
+ * a client from the start of its exposure to the end of its readout;
+ * if the client goes away, the exposure and readout are ended for it.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+
+#define MAX_CLIENTS     32
+#define MAX_CHIPS       3   /* CCD_IMAGING, CCD_TRACKING, CCD_EXT_TRACKING */
+
+struct daemon {
+    sbig_t *sb;
+    EstablishLinkResults link;
+    struct client *owner[MAX_CHIPS];
+};
+
+struct client {
+    int fd;
+    struct daemon *d;
+};
+
+static const char *chipname[MAX_CHIPS] = {
+    "imaging", "tracking", "external tracking"
+};
+
+static volatile sig_atomic_t terminated = 0;
+
+static int listen_socket (const char *path);
+static void client_release (struct daemon *d, struct client *c);
+static int dispatch (short cmd, void *parm, void *result, void *arg);
+
+#define OPTIONS "hs:"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"socket",        required_argument,     0, 's'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-daemon [OPTIONS]\n"
+"  -s, --socket PATH    listen on PATH (default %s)\n",
+             sbig_remote_path ());
+    exit (1);
+}
+
+static void sigterm_handler (int sig)
+{
+    terminated = 1;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *sbig_udrv = getenv ("SBIG_UDRV");
+    const char *sbig_device = getenv ("SBIG_DEVICE");
+    const char *path = NULL;
+    struct daemon d;
+    struct client *clients[MAX_CLIENTS];
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    struct sigaction sa;
+    CAMERA_TYPE type;
+    int nclients = 0;
+    int ch, e, i, fd;
+
+    log_init ("sbig-daemon");
+
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 's': /* --socket PATH */
+                path = optarg;
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc)
+        usage ();
+    if (!path)
+        path = sbig_remote_path ();
+    if (!sbig_device)
+        msg_exit ("SBIG_DEVICE is not set");
+
+    memset (&d, 0, sizeof (d));
+    if (setenv ("SBIG_NO_DAEMON", "1", 1) < 0)
+        err_exit ("setenv");
+    if (!(d.sb = sbig_new ()))
+        err_exit ("sbig_new");
+    if (sbig_dlopen (d.sb, sbig_udrv) != 0)
+        msg_exit ("%s", dlerror ());
+    if ((e = sbig_open_driver (d.sb)) != 0)
+        msg_exit ("sbig_open_driver: %s", sbig_get_error_string (d.sb, e));
+    if ((e = sbig_open_device (d.sb, sbig_device)) != 0)
+        msg_exit ("sbig_open_device: %s", sbig_get_error_string (d.sb, e));
+    if ((e = sbig_establish_link (d.sb, &type)) != 0)
+        msg_exit ("sbig_establish_link: %s", sbig_get_error_string (d.sb, e));
+    d.link.cameraType = type;
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = sigterm_handler;
+    sigemptyset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0 || sigaction (SIGTERM, &sa, NULL) < 0)
+        err_exit ("sigaction");
+    signal (SIGPIPE, SIG_IGN);
+
+    pfd[0].fd = listen_socket (path);
+    pfd[0].events = POLLIN;
+    msg ("%s on %s, listening on %s", sbig_strcam (type), sbig_device, path);
+
+    while (!terminated) {
+        for (i = 0; i < nclients; i++) {
+            pfd[i + 1].fd = clients[i]->fd;
+            pfd[i + 1].events = POLLIN;
+        }
+        if (poll (pfd, nclients + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err_exit ("poll");
+        }
+        for (i = nclients - 1; i >= 0; i--) {
+            if (!pfd[i + 1].revents)
+                continue;
+            if (sbig_remote_serve (clients[i]->fd, dispatch, clients[i]) == 0)
+                continue;
+            if (errno != 0)
+                err ("client %d", clients[i]->fd);
+            client_release (&d, clients[i]);
+            close (clients[i]->fd);
+            free (clients[i]);
+            clients[i] = clients[--nclients];
+        }
+        if ((pfd[0].revents & POLLIN)) {
+            if ((fd = accept4 (pfd[0].fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+                if (errno != EINTR && errno != ECONNABORTED)
+                    err ("accept");
+            } else if (nclients == MAX_CLIENTS) {
+                msg ("too many clients");
+                close (fd);
+            } else {
+                if (!(clients[nclients] = calloc (1, sizeof (struct client))))
+                    oom ();
+                clients[nclients]->d = &d;
+                clients[nclients++]->fd = fd;
+            }
+        }
+    }
+    msg ("shutting down");
+
+    close (pfd[0].fd);
+    unlink (path);
+    for (i = 0; i < nclients; i++) {
+        client_release (&d, clients[i]);
+        close (clients[i]->fd);
+        free (clients[i]);
+    }
+    if ((e = sbig_close_device (d.sb)) != 0)
+        msg ("sbig_close_device: %s", sbig_get_error_string (d.sb, e));
+    if ((e = sbig_close_driver (d.sb)) != 0)
+        msg ("sbig_close_driver: %s", sbig_get_error_string (d.sb, e));
+    sbig_destroy (d.sb);
+    log_fini ();
+    return 0;
+}
+
+/* Refuse to replace the socket of a running daemon, but remove a stale one.
+ */
+static int listen_socket (const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (addr.sun_path))
+        msg_exit ("%s: socket path is too long", path);
+    strcpy (addr.sun_path, path);
+    if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        err_exit ("socket");
+    if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+        msg_exit ("%s: sbig-daemon is already running", path);
+    if (unlink (path) < 0 && errno != ENOENT)
+        err_exit ("%s", path);
+    mask = umask (0077);
+    if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+        err_exit ("%s", path);
+    umask (mask);
+    if (listen (fd, MAX_CLIENTS) < 0)
+        err_exit ("listen");
+    return fd;
+}
+
+/* End any exposure or readout left in progress by a departing client.
+ */
+static void client_release (struct daemon *d, struct client *c)
+{
+    int chip;
+
+    for (chip = 0; chip < MAX_CHIPS; chip++) {
+        if (d->owner[chip] != c)
+            continue;
+        EndExposureParams ee = { .ccd = chip };
+        EndReadoutParams er = { .ccd = chip };
+        (void)sbig_command (d->sb, CC_END_EXPOSURE, &ee, NULL);
+        (void)sbig_command (d->sb, CC_END_READOUT, &er, NULL);
+        d->owner[chip] = NULL;
+        msg ("client %d: ended %s ccd exposure", c->fd, chipname[chip]);
+    }
+}
+
+/* Return the chip a command addresses, or -1 if it doesn't address one.
+ * The ccd field also carries flags such as START_SKIP_VDD in its high bits.
+ */
+static int chip_of (short cmd, void *parm)
+{
+    ushort ccd;
+
+    switch (cmd) {
+        case CC_START_EXPOSURE2:
+            ccd = ((StartExposureParams2 *)parm)->ccd;
+            break;
+        case CC_END_EXPOSURE:
+            ccd = ((EndExposureParams *)parm)->ccd;
+            break;
+        case CC_START_READOUT:
+            ccd = ((StartReadoutParams *)parm)->ccd;
+            break;
+        case CC_READOUT_LINE:
+        case CC_READ_SUBTRACT_LINE:
+            ccd = ((ReadoutLineParams *)parm)->ccd;
+            break;
+        case CC_DUMP_LINES:
+            ccd = ((DumpLinesParams *)parm)->ccd;
+            break;
+        case CC_END_READOUT:
+            ccd = ((EndReadoutParams *)parm)->ccd;
+            break;
+        default:
+            return -1;
+    }
+    ccd &= 0xff;
+    return ccd < MAX_CHIPS ? ccd : -1;
+}
+
+static int dispatch (short cmd, void *parm, void *result, void *arg)
+{
+    struct client *c = arg;
+    struct daemon *d = c->d;
+    int chip, e;
+
+    switch (cmd) {
+        case CC_OPEN_DRIVER:
+        case CC_CLOSE_DRIVER:
+        case CC_OPEN_DEVICE:
+        case CC_CLOSE_DEVICE:
+            return CE_NO_ERROR;
+        case CC_ESTABLISH_LINK:
+            memcpy (result, &d->link, sizeof (d->link));
+            return CE_NO_ERROR;
+    }
+    if ((chip = chip_of (cmd, parm)) >= 0 && d->owner[chip]
+                                          && d->owner[chip] != c)
+        return CE_EXPOSURE_IN_PROGRESS;
+    e = sbig_command (d->sb, cmd, parm, result);
+    if (chip >= 0 && e == CE_NO_ERROR) {
+        if (cmd == CC_START_EXPOSURE2)
+            d->owner[chip] = c;
+        else if (cmd == CC_END_READOUT)
+            d->owner[chip] = NULL;
+    }
+    return e;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
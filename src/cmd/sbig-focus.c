@@ -35,13 +35,16 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <pwd.h>
 #include <time.h>
+#include <math.h>
 
 #include "src/common/libsbig/sbig.h"
 #include "src/common/libutil/log.h"
 #include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/preview.h"
+#include "src/common/libutil/hfd.h"
+#include "src/common/libutil/star.h"
 #include "src/common/libsbig/sbfits.h"
 
 struct options {
@@ -51,9 +54,14 @@ struct options {
     double t;
     bool verbose;
     char *color_convert;
+    int roi;            /* fast focus window size, or 0 */
 };
 
-#define OPTIONS "ht:C:r:p:x:"
+#define ROI_DEFAULT     64
+#define ROI_MAX_MISSES  3   /* bad frames in a row before reacquiring */
+#define ACQUIRE_STARS   32  /* brightest stars considered for focusing */
+
+#define OPTIONS "ht:C:r:p:x:R::"
 static const struct option longopts[] = {
     {"help",          no_argument,           0, 'h'},
     {"exposure-time", required_argument,     0, 't'},
@@ -61,12 +69,15 @@ static const struct option longopts[] = {
     {"resolution",    required_argument,     0, 'r'},
     {"partial",       required_argument,     0, 'p'},
     {"color-convert", required_argument,     0, 'x'},
+    {"roi",           optional_argument,     0, 'R'},
     {0, 0, 0, 0},
 };
 
-static bool interrupted = false;
+static volatile bool interrupted = false;
+static preview_t *preview = NULL;
 
 void snap_series (sbig_t *sb, const struct options *opt);
+void roi_series (sbig_t *sb, const struct options *opt);
 
 void usage (void)
 {
@@ -77,6 +88,7 @@ void usage (void)
 "  -r, --resolution RES      select hi, med, or lo resolution\n"
 "  -p, --partial N           take centered partial frame (0 < N <= 1.0)\n"
 "  -x, --color-convert=mono  convert raw single shot color to monochrome\n"
+"  -R, --roi[=N]             fast focus on NxN window around a star (default 64)\n"
 );
     exit (1);
 }
@@ -144,6 +156,12 @@ int main (int argc, char *argv[])
             case 'x': /* --color-convert=monochrome */
                 opt->color_convert = xstrdup (optarg);
                 break;
+            case 'R': /* --roi[=N] */
+                opt->roi = optarg ? strtol (optarg, NULL, 10) : ROI_DEFAULT;
+                if (opt->roi < 16 || opt->roi > 2 * HFD_MAX_RADIUS)
+                    msg_exit ("error parsing --roi argument (16-%d)",
+                              2 * HFD_MAX_RADIUS);
+                break;
             case 'h': /* --help */
             default:
                 usage ();
@@ -182,7 +200,10 @@ int main (int argc, char *argv[])
 
     /* Take pictures.
      */
-    snap_series (sb, opt);
+    if (opt->roi)
+        roi_series (sb, opt);
+    else
+        snap_series (sb, opt);
 
     if ((e = sbig_close_device (sb)) != 0)
         msg_exit ("sbig_close_device: %s", sbig_get_error_string (sb, e));
@@ -197,65 +218,49 @@ int main (int argc, char *argv[])
 
 bool exposure_wait (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
 {
-    PAR_COMMAND_STATUS status;
-    int e;
+    int e = sbig_ccd_wait_exposure (ccd, &interrupted);
 
-    usleep (1E6 * opt->t);
-    do {
-        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
-            msg_exit ("sbig_get_exposure_status: %s", sbig_get_error_string (sb, e));
-        if (status != CS_INTEGRATION_COMPLETE)
-            usleep (1E3 * 500); /* 500ms */
-    } while (status != CS_INTEGRATION_COMPLETE && !interrupted);
+    if (e != CE_NO_ERROR && !interrupted)
+        msg_exit ("sbig_ccd_wait_exposure: %s", sbig_get_error_string (sb, e));
     return !interrupted;
 }
 
+/* Send the image to ds9 from memory.  If ds9 hasn't taken the last one
+ * yet, it is replaced by this one.
+ */
 void preview_ds9 (sbfits_t *sbf)
 {
-    char *cmd;
-    int status;
-
-    if (asprintf (&cmd, "xpaset ds9 fits <%s", sbfits_get_filename (sbf))<0)
-        oom ();
-    if ((status = system (cmd)) < 0)
-        err ("preview");
-    else if (WIFEXITED (status)) {
-        if (WEXITSTATUS (status) != 0)
-            msg ("preview: xpaset exited with rc=%d", WEXITSTATUS (status));
-    } else if (WIFSIGNALED (status)) {
-        msg ("preview: killed by %s", strsignal (WTERMSIG (status)));
-    } else if (WIFSTOPPED (status)) {
-        msg ("preview: stopped");
-    } else if (WIFCONTINUED (status)) {
-        msg ("preview: continued");
+    void *buf;
+    size_t len;
+
+    if (sbfits_write_mem (sbf, &buf, &len) < 0) {
+        msg ("preview: %s", sbfits_get_errstr (sbf));
+        return;
     }
-    free (cmd);
+    (void)preview_send (preview, buf, len);
 }
 
-bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
+/* Expose and read out the current window.  Returns false if interrupted.
+ */
+bool expose (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+             bool verbose)
 {
     int e;
     int flags = START_SKIP_VDD;
-    sbfits_t *sbf;
-    const char *tmpdir = getenv ("TMPDIR");
-    if (!tmpdir)
-        tmpdir = "/tmp";
-
-    sbf = sbfits_create ();
-    if (sbfits_create_file (sbf, tmpdir, "FOCUS") < 0)
-        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
 
     if ((e = sbig_ccd_set_shutter_mode (ccd, SC_OPEN_SHUTTER)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_set_shutter_mode: %s", sbig_get_error_string (sb, e));
-    if (opt->verbose)
+    if (verbose)
         msg ("exposure (%.0fs)", opt->t);
     if ((e = sbig_ccd_start_exposure (ccd, flags, opt->t)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_start_exposure: %s", sbig_get_error_string (sb, e));
-    if (!exposure_wait (sb, ccd, opt))
-        goto abort;
+    if (!exposure_wait (sb, ccd, opt)) {
+        (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
+        return false;
+    }
     if ((e = sbig_ccd_end_exposure (ccd, 0)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
-    if (opt->verbose)
+    if (verbose)
         msg ("readout");
     if ((e = sbig_ccd_readout (ccd)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_readout: %s", sbig_get_error_string (sb, e));
@@ -265,44 +270,217 @@ bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
             msg_exit ("sbig_ccd_color_convert: %s",
                       sbig_get_error_string (sb, e));
     }
+    return true;
+}
+
+bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
+{
+    int e;
+    sbfits_t *sbf;
+    struct sbig_ccd_stats st;
+    long cblack, cwhite;
+
+    if (!expose (sb, ccd, opt, opt->verbose))
+        return false;
+    if ((e = sbig_ccd_get_stats (ccd, &st)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_stats: %s", sbig_get_error_string (sb, e));
+    if (opt->verbose)
+        msg ("max %u mean %.1f stddev %.1f saturated %lu",
+             st.max, st.mean, st.stddev, st.saturated);
+    if ((e = sbig_ccd_auto_contrast (ccd, &cblack, &cwhite)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_auto_contrast: %s", sbig_get_error_string (sb, e));
+    sbf = sbfits_create ();
     sbfits_set_ccdinfo (sbf, ccd);
-    if (sbfits_write_file (sbf) < 0)
-        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
-    if (sbfits_close_file (sbf))
-        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+    sbfits_set_contrast (sbf, cblack, cwhite);
 
     msg ("previewing image");
     preview_ds9 (sbf);
-    (void)unlink (sbfits_get_filename (sbf));
     sbfits_destroy (sbf);
     return true;
-abort:
-    (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
-    (void)unlink (sbfits_get_filename (sbf));
-    sbfits_destroy (sbf);
-    return false;
 }
 
-void snap_series (sbig_t *sb, const struct options *opt)
+sbig_ccd_t *ccd_open (sbig_t *sb, const struct options *opt)
 {
     int e;
     sbig_ccd_t *ccd;
+    const char *ring = getenv ("SBIG_RING");
 
     if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
+    if (ring) {
+        if ((e = sbig_ccd_set_ring (ccd, ring, 0)) == CE_SHARE_ERROR)
+            msg ("frame ring %s is in use, not publishing", ring);
+        else if (e != CE_NO_ERROR)
+            msg ("frame ring %s: %s", ring, sbig_get_error_string (sb, e));
+    }
     if ((e = sbig_ccd_end_exposure (ccd, ABORT_DONT_END)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
+    return ccd;
+}
+
+/* Select the readout mode and the (full or partial) acquisition frame.
+ */
+void set_frame (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
+{
+    int e;
+
     if ((e = sbig_ccd_set_readout_mode (ccd, opt->readout_mode)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
     if (opt->partial < 1.0) {
         if ((e = sbig_ccd_set_partial_frame (ccd, opt->partial)) != CE_NO_ERROR)
             msg_exit ("sbig_ccd_set_partial_frame: %s", sbig_get_error_string (sb, e));
     }
+}
+
+void snap_series (sbig_t *sb, const struct options *opt)
+{
+    sbig_ccd_t *ccd = ccd_open (sb, opt);
+
+    set_frame (sb, ccd, opt);
+    if (!(preview = preview_create ("ds9")))
+        msg_exit ("preview_create failed");
     msg ("Type ctrl-C to interrupt");
     while (!interrupted) {
         snap (sb, ccd, opt);
     }
+    preview_destroy (preview);
+
+    sbig_ccd_destroy (ccd);
+}
+
+/* Take an acquisition frame and find the brightest star that is
+ * unsaturated, clear of the edge, and not obviously blended.
+ * Returns true with its position in unbinned full frame pixels.
+ */
+bool acquire (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+              star_extractor_t *ex, int bin, double *xp, double *yp)
+{
+    const struct star_catalog *cat;
+    ushort top, left, height, width;
+    ushort *data;
+    int i;
+
+    set_frame (sb, ccd, opt);
+    if (!expose (sb, ccd, opt, false))
+        return false;
+    (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
+    data = sbig_ccd_get_data (ccd, &height, &width);
+    if (!(cat = star_extract (ex, data, height, width)))
+        err_exit ("star_extract");
+    for (i = 0; i < cat->count; i++) {
+        if (!(cat->flags[i] & (STAR_SATURATED | STAR_EDGE))
+                                && cat->elongation[i] < 1.5)
+            break;
+    }
+    if (i == cat->count)
+        return false;
+    *xp = (left + cat->x[i]) * bin + (bin - 1) / 2.0;
+    *yp = (top + cat->y[i]) * bin + (bin - 1) / 2.0;
+    return true;
+}
+
+/* Center an n x n window on (x, y), keeping it on the chip.
+ */
+void set_roi (sbig_t *sb, sbig_ccd_t *ccd, int n, int height, int width,
+              double x, double y, ushort *topp, ushort *leftp)
+{
+    int top = lround (y) - n / 2;
+    int left = lround (x) - n / 2;
+    ushort h, w;
+    int e;
+
+    top = top < 0 ? 0 : top > height - n ? height - n : top;
+    left = left < 0 ? 0 : left > width - n ? width - n : left;
+    if ((e = sbig_ccd_set_window (ccd, top, left, n, n)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_window: %s", sbig_get_error_string (sb, e));
+    (void)sbig_ccd_get_window (ccd, topp, leftp, &h, &w);
+}
+
+/* Fast focus: read only a small unbinned window around a star, and print
+ * its half flux diameter and FWHM for each frame.  The window follows the
+ * star as it drifts; if the star is lost for several frames, take a new
+ * acquisition frame.
+ */
+void roi_series (sbig_t *sb, const struct options *opt)
+{
+    sbig_ccd_t *ccd = ccd_open (sb, opt);
+    ushort full_height, full_width, height, width, top, left;
+    ushort *data;
+    star_extractor_t *ex;
+    struct star_params sp = { 0 };
+    int n, e, bin, count = 0, misses = 0;
+    int radius;
+    bool tracking = false;
+    double x = 0, y = 0;
+    struct hfd_star s;
+    struct timespec t0, t1;
+    double elapsed = 0;
+
+    /* Binning factor of the acquisition frame, from its width.
+     */
+    if ((e = sbig_ccd_set_readout_mode (ccd, RM_1X1)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+    (void)sbig_ccd_get_window (ccd, &top, &left, &full_height, &full_width);
+    if ((e = sbig_ccd_set_readout_mode (ccd, opt->readout_mode)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+    (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
+    bin = MAX (full_width / width, 1);
+    sp.datamax = sbig_ccd_get_datamax (ccd);
+    ex = star_extractor_create (height, width, ACQUIRE_STARS, &sp);
+
+    n = MIN (opt->roi, MIN (full_height, full_width));
+    radius = n / 2 - 2;
+
+    msg ("Type ctrl-C to interrupt");
+    printf ("%6s %8s %6s %6s %7s %6s\n",
+            "frame", "time", "hfd", "fwhm", "peak", "snr");
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    while (!interrupted) {
+        if (!tracking) {
+            if (!acquire (sb, ccd, opt, ex, bin, &x, &y)) {
+                if (!interrupted)
+                    msg ("no unsaturated star found, retrying");
+                continue;
+            }
+            if ((e = sbig_ccd_set_readout_mode (ccd, RM_1X1)) != CE_NO_ERROR)
+                msg_exit ("sbig_ccd_set_readout_mode: %s",
+                          sbig_get_error_string (sb, e));
+            set_roi (sb, ccd, n, full_height, full_width, x, y, &top, &left);
+            msg ("star at (%.0f,%.0f), reading %dx%d window", x, y, n, n);
+            tracking = true;
+            misses = 0;
+        }
+        if (!expose (sb, ccd, opt, false))
+            break;
+        data = sbig_ccd_get_data (ccd, &height, &width);
+        if (hfd_measure (data, height, width, x - left, y - top, radius,
+                         &s) < 0 || s.snr < 5) {
+            if (++misses == ROI_MAX_MISSES) {
+                msg ("star lost");
+                tracking = false;
+            }
+            continue;
+        }
+        misses = 0;
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        elapsed = (t1.tv_sec - t0.tv_sec) + 1E-9 * (t1.tv_nsec - t0.tv_nsec);
+        printf ("%6d %8.2f %6.2f %6.2f %7.0f %6.0f%s\n", ++count, elapsed,
+                s.hfd, s.fwhm, s.peak, s.snr,
+                s.background + s.peak >= sbig_ccd_get_datamax (ccd)
+                ? " saturated" : "");
+        fflush (stdout);
+
+        /* Follow the star once it strays from the middle of the window.
+         */
+        x = left + s.x;
+        y = top + s.y;
+        if (fabs (s.x - n / 2) > n / 8 || fabs (s.y - n / 2) > n / 8)
+            set_roi (sb, ccd, n, full_height, full_width, x, y, &top, &left);
+    }
+    if (count > 0 && elapsed > 0)
+        msg ("%d frames in %.1fs (%.1f/s)", count, elapsed, count / elapsed);
 
+    star_extractor_destroy (ex);
     sbig_ccd_destroy (ccd);
 }
 
@@ -0,0 +1,516 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+
+struct options {
+    CCD_REQUEST chip;
+    struct sbig_guide_params p;
+    struct sbig_ao_params ao;
+    bool have_cal;
+    struct sbig_guide_cal cal;
+};
+
+#define GUIDE_MAX_MISSES    5   /* lost frames in a row before reacquiring */
+
+#define OPTIONS "ht:C:o:w:a:y:m:M:s:c:T:P:I:"
+static const struct option longopts[] = {
+    {"help",           no_argument,        0, 'h'},
+    {"exposure-time",  required_argument,  0, 't'},
+    {"ccd-chip",       required_argument,  0, 'C'},
+    {"output",         required_argument,  0, 'o'},
+    {"window",         required_argument,  0, 'w'},
+    {"aggression",     required_argument,  0, 'a'},
+    {"hysteresis",     required_argument,  0, 'y'},
+    {"min-move",       required_argument,  0, 'm'},
+    {"max-correction", required_argument,  0, 'M'},
+    {"cal-step",       required_argument,  0, 's'},
+    {"calibration",    required_argument,  0, 'c'},
+    {"ao-exposure",    required_argument,  0, 'T'},
+    {"kp",             required_argument,  0, 'P'},
+    {"ki",             required_argument,  0, 'I'},
+    {0, 0, 0, 0},
+};
+
+static volatile bool interrupted = false;
+
+void guide (sbig_t *sb, struct options *opt);
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-guide [OPTIONS]\n"
+"  -t, --exposure-time SEC    guide exposure time in seconds (default 1.0)\n"
+"  -C, --ccd-chip CHIP        use tracking (default), ext-tracking, or imaging\n"
+"  -o, --output relay|ao      correct with guide relays (default) or AO\n"
+"  -w, --window N             guide on an NxN window (default 32, AO 16)\n"
+"  -a, --aggression A         fraction of the error to correct (default 0.7)\n"
+"  -y, --hysteresis H         weight of the last correction (default 0.1)\n"
+"  -m, --min-move PIX         ignore smaller errors (default 0.15)\n"
+"  -M, --max-correction N     longest pulse in sec, or AO step in units\n"
+"  -s, --cal-step N           calibration pulse in sec, or AO step in units\n"
+"  -c, --calibration XX,XY,YX,YY  skip calibration and use these values\n"
+"  -T, --ao-exposure SEC      AO loop exposure time (default 0.05)\n"
+"  -P, --kp G                 AO loop proportional gain (default 0.3)\n"
+"  -I, --ki G                 AO loop integral gain (default 0.3)\n"
+);
+    exit (1);
+}
+
+void handle_sigint (int signal)
+{
+    interrupted = true;
+}
+
+double parse_double (const char *s, const char *name, double min, double max)
+{
+    char *endptr;
+    double d = strtod (s, &endptr);
+
+    if (*endptr != '\0' || endptr == s || d < min || d > max)
+        msg_exit ("error parsing --%s argument", name);
+    return d;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *sbig_udrv = getenv ("SBIG_UDRV");
+    const char *sbig_device = getenv ("SBIG_DEVICE");
+    int e, ch;
+    sbig_t *sb;
+    CAMERA_TYPE type;
+    struct options *opt;
+    struct sigaction sa;
+    double max_correction = 0, cal_step = 0;
+    struct sbig_guide_cal *cal;
+
+    log_init ("sbig-guide");
+
+    /* Set default option values.
+     */
+    opt = xzmalloc (sizeof (*opt));
+    opt->chip = CCD_TRACKING;
+    sbig_guide_params_init (&opt->p, SBIG_GUIDE_RELAY);
+    sbig_ao_params_init (&opt->ao);
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 't': /* --exposure-time SEC */
+                opt->p.exposure = parse_double (optarg, "exposure-time",
+                                                0.01, 3600);
+                break;
+            case 'C': /* --ccd-chip CHIP */
+                if (!strcmp (optarg, "imaging"))
+                    opt->chip = CCD_IMAGING;
+                else if (!strcmp (optarg, "tracking"))
+                    opt->chip = CCD_TRACKING;
+                else if (!strcmp (optarg, "ext-tracking"))
+                    opt->chip = CCD_EXT_TRACKING;
+                else
+                    msg_exit ("error parsing --ccd-chip argument (imaging, tracking, ext-tracking)");
+                break;
+            case 'o': { /* --output relay|ao */
+                struct sbig_guide_params p = opt->p;
+                if (!strcmp (optarg, "relay"))
+                    sbig_guide_params_init (&opt->p, SBIG_GUIDE_RELAY);
+                else if (!strcmp (optarg, "ao"))
+                    sbig_guide_params_init (&opt->p, SBIG_GUIDE_AO);
+                else
+                    msg_exit ("error parsing --output argument (relay, ao)");
+                opt->p.exposure = p.exposure;
+                opt->p.window = p.window;
+                opt->p.aggression = p.aggression;
+                opt->p.hysteresis = p.hysteresis;
+                opt->p.min_move = p.min_move;
+                break;
+            }
+            case 'w': /* --window N */
+                opt->p.window = parse_double (optarg, "window", 8, 128);
+                opt->ao.window = opt->p.window;
+                break;
+            case 'a': /* --aggression A */
+                opt->p.aggression = parse_double (optarg, "aggression", 0, 1);
+                break;
+            case 'y': /* --hysteresis H */
+                opt->p.hysteresis = parse_double (optarg, "hysteresis",
+                                                  0, 0.99);
+                break;
+            case 'm': /* --min-move PIX */
+                opt->p.min_move = parse_double (optarg, "min-move", 0, 100);
+                break;
+            case 'M': /* --max-correction N */
+                max_correction = parse_double (optarg, "max-correction",
+                                               0.01, 4095);
+                break;
+            case 's': /* --cal-step N */
+                cal_step = parse_double (optarg, "cal-step", 0.01, 4095);
+                break;
+            case 'c': /* --calibration XX,XY,YX,YY */
+                cal = &opt->cal;
+                if (sscanf (optarg, "%lf,%lf,%lf,%lf",
+                            &cal->m[0][0], &cal->m[0][1],
+                            &cal->m[1][0], &cal->m[1][1]) != 4)
+                    msg_exit ("error parsing --calibration argument");
+                opt->have_cal = true;
+                break;
+            case 'T': /* --ao-exposure SEC */
+                opt->ao.exposure = parse_double (optarg, "ao-exposure",
+                                                 0.01, 10);
+                break;
+            case 'P': /* --kp G */
+                opt->ao.kp = parse_double (optarg, "kp", 0, 2);
+                break;
+            case 'I': /* --ki G */
+                opt->ao.ki = parse_double (optarg, "ki", 0, 2);
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc)
+        usage ();
+    if (max_correction > 0)
+        opt->p.max_correction = max_correction;
+    if (cal_step > 0)
+        opt->p.cal_step = cal_step;
+
+    /* Connect to driver
+     */
+    if (!sbig_device)
+        msg_exit ("SBIG_DEVICE is not set");
+    if (!(sb = sbig_new ()))
+        err_exit ("sbig_new");
+    if (sbig_dlopen (sb, sbig_udrv) != 0)
+        msg_exit ("%s", dlerror ());
+    if ((e = sbig_open_driver (sb)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_driver: %s", sbig_get_error_string (sb, e));
+
+    sa.sa_handler = &handle_sigint;
+    sa.sa_flags = 0;
+    sigfillset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0)
+        err_exit ("sigaction");
+
+    /* Open camera
+     */
+    if ((e = sbig_open_device (sb, sbig_device)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_device: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_establish_link (sb, &type)) != CE_NO_ERROR)
+        msg_exit ("sbig_establish_link: %s", sbig_get_error_string (sb, e));
+    msg ("Link established to %s", sbig_strcam (type));
+
+    guide (sb, opt);
+
+    if ((e = sbig_close_device (sb)) != 0)
+        msg_exit ("sbig_close_device: %s", sbig_get_error_string (sb, e));
+
+    sbig_destroy (sb);
+    free (opt);
+    log_fini ();
+    return 0;
+}
+
+/* Acquire a guide star, retrying until one is found.
+ * Returns false if interrupted.
+ */
+bool acquire (sbig_t *sb, sbig_guide_t *g)
+{
+    bool found = false;
+    double x, y;
+    int e;
+
+    while (!found) {
+        e = sbig_guide_acquire (g, &interrupted, &found);
+        if (interrupted)
+            return false;
+        if (e != CE_NO_ERROR)
+            msg_exit ("sbig_guide_acquire: %s", sbig_get_error_string (sb, e));
+        if (!found)
+            msg ("no guide star found, retrying");
+    }
+    sbig_guide_get_lock (g, &x, &y);
+    msg ("guide star at (%.1f,%.1f)", x, y);
+    return true;
+}
+
+/* Totals for the summary printed at exit.
+ */
+struct summary {
+    int frames;
+    int lost;
+    double sum_dx2, sum_dy2;
+    double sum_latency, max_latency;
+    double sum_total;
+};
+
+void summary_add (struct summary *sum, const struct sbig_guide_cycle *c)
+{
+    const struct sbig_guide_latency *lat = &c->latency;
+    double latency = lat->readout + lat->centroid + lat->correct;
+
+    sum->frames++;
+    sum->sum_total += lat->total;
+    if (c->lost) {
+        sum->lost++;
+        return;
+    }
+    sum->sum_dx2 += c->dx * c->dx;
+    sum->sum_dy2 += c->dy * c->dy;
+    sum->sum_latency += latency;
+    if (latency > sum->max_latency)
+        sum->max_latency = latency;
+}
+
+void summary_print (const struct summary *sum)
+{
+    int n = sum->frames - sum->lost;
+
+    if (sum->frames == 0)
+        return;
+    msg ("%d frames (%d lost), %.2f/s", sum->frames, sum->lost,
+         sum->frames / sum->sum_total);
+    if (n == 0)
+        return;
+    msg ("rms error x %.3f y %.3f pixels", sqrt (sum->sum_dx2 / n),
+         sqrt (sum->sum_dy2 / n));
+    msg ("exposure end to correction: mean %.1fms max %.1fms",
+         1E3 * sum->sum_latency / n, 1E3 * sum->max_latency);
+}
+
+/* AO loop telemetry is printed by a thread of its own, once a second,
+ * so the loop itself doesn't have to.
+ */
+struct ao_stats {
+    uint32_t frames, lost, rail;
+    double sum_dx2, sum_dy2;
+    double sum_latency, max_latency;
+    double t0, t;               /* start of first frame, end of last */
+    ushort x, y;                /* last deflection */
+};
+
+struct ao_report {
+    sbig_ao_loop_t *l;
+    volatile bool done;
+    struct ao_stats all;
+    pthread_t t;
+};
+
+#define AO_REPORT_BATCH 64
+
+void ao_stats_add (struct ao_stats *st, const struct sbig_ao_sample *s)
+{
+    if (st->frames++ == 0)
+        st->t0 = s->t - s->period;
+    st->t = s->t;
+    st->x = s->x;
+    st->y = s->y;
+    if (s->flags & SBIG_AO_RAIL)
+        st->rail++;
+    if (s->flags & SBIG_AO_LOST) {
+        st->lost++;
+        return;
+    }
+    st->sum_dx2 += s->dx * s->dx;
+    st->sum_dy2 += s->dy * s->dy;
+    st->sum_latency += s->latency;
+    if (s->latency > st->max_latency)
+        st->max_latency = s->latency;
+}
+
+void *ao_report_thread (void *arg)
+{
+    struct ao_report *r = arg;
+    struct sbig_ao_sample s[AO_REPORT_BATCH];
+    struct timespec ts = { .tv_sec = 1 };
+    struct ao_stats st;
+    uint32_t next = 1;
+    bool done;
+    int i, n, m;
+
+    /* Latencies in milliseconds.
+     */
+    printf ("%8s %6s %6s %6s %6s %5s %5s %6s %6s %4s %4s\n",
+            "time", "frames", "rate", "dx", "dy", "x", "y",
+            "lat", "max", "lost", "rail");
+    do {
+        done = r->done;
+        if (!done)
+            (void)nanosleep (&ts, NULL);
+        memset (&st, 0, sizeof (st));
+        while ((n = sbig_ao_telemetry (r->l, &next, s, AO_REPORT_BATCH)) > 0) {
+            for (i = 0; i < n; i++) {
+                ao_stats_add (&st, &s[i]);
+                ao_stats_add (&r->all, &s[i]);
+            }
+        }
+        if (st.frames == 0)
+            continue;
+        m = st.frames - st.lost;
+        printf ("%8.2f %6u %6.1f %6.3f %6.3f %5u %5u %6.1f %6.1f %4u %4u\n",
+                st.t, st.frames, st.frames / (st.t - st.t0),
+                m ? sqrt (st.sum_dx2 / m) : 0, m ? sqrt (st.sum_dy2 / m) : 0,
+                st.x, st.y, m ? 1E3 * st.sum_latency / m : 0,
+                1E3 * st.max_latency, st.lost, st.rail);
+        fflush (stdout);
+    } while (!done);
+    return NULL;
+}
+
+/* Hand the guide star over to the AO loop, and run it until interrupted
+ * or the star is lost.
+ */
+void ao_loop (sbig_t *sb, sbig_ccd_t *ccd, sbig_guide_t *g,
+              struct options *opt)
+{
+    struct sbig_guide_cal cal;
+    struct ao_report r = { 0 };
+    const struct ao_stats *st = &r.all;
+    double x, y;
+    int e, err, m;
+
+    sbig_guide_get_cal (g, &cal);
+    sbig_guide_get_lock (g, &x, &y);
+    if ((e = sbig_ao_loop_create (sb, ccd, &opt->ao, &cal, x, y, &r.l))
+                                                            != CE_NO_ERROR)
+        msg_exit ("sbig_ao_loop_create: %s", sbig_get_error_string (sb, e));
+    if ((err = pthread_create (&r.t, NULL, ao_report_thread, &r)))
+        errn_exit (err, "pthread_create");
+    e = sbig_ao_loop_run (r.l, &interrupted);
+    r.done = true;
+    if ((err = pthread_join (r.t, NULL)))
+        errn_exit (err, "pthread_join");
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ao_loop_run: %s", sbig_get_error_string (sb, e));
+    if (!interrupted)
+        msg ("guide star lost");
+    sbig_ao_loop_destroy (r.l);
+
+    if ((m = st->frames - st->lost) == 0)
+        return;
+    msg ("%u frames (%u lost), %.1f/s", st->frames, st->lost,
+         st->frames / (st->t - st->t0));
+    msg ("rms error x %.3f y %.3f pixels", sqrt (st->sum_dx2 / m),
+         sqrt (st->sum_dy2 / m));
+    msg ("exposure end to correction: mean %.1fms max %.1fms",
+         1E3 * st->sum_latency / m, 1E3 * st->max_latency);
+}
+
+void guide (sbig_t *sb, struct options *opt)
+{
+    sbig_ccd_t *ccd;
+    sbig_guide_t *g;
+    struct sbig_guide_cal cal;
+    struct sbig_guide_cycle c;
+    struct summary sum = { 0 };
+    int e, misses = 0;
+    bool ok;
+
+    if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_guide_create (sb, ccd, &opt->p, &g)) != CE_NO_ERROR)
+        msg_exit ("sbig_guide_create: %s", sbig_get_error_string (sb, e));
+    if (opt->have_cal) {
+        if ((e = sbig_guide_set_cal (g, &opt->cal)) != CE_NO_ERROR)
+            msg_exit ("--calibration: axes are nearly parallel");
+    }
+    msg ("Type ctrl-C to interrupt");
+    if (!acquire (sb, g))
+        goto done;
+    if (!opt->have_cal) {
+        msg ("calibrating");
+        e = sbig_guide_calibrate (g, &interrupted, &ok);
+        if (interrupted)
+            goto done;
+        if (e != CE_NO_ERROR)
+            msg_exit ("sbig_guide_calibrate: %s",
+                      sbig_get_error_string (sb, e));
+        if (!ok)
+            msg_exit ("calibration failed: star lost or did not move");
+        sbig_guide_get_cal (g, &cal);
+        msg ("calibration: --calibration=%.4g,%.4g,%.4g,%.4g",
+             cal.m[0][0], cal.m[0][1], cal.m[1][0], cal.m[1][1]);
+    }
+    if (opt->p.output == SBIG_GUIDE_AO) {
+        ao_loop (sb, ccd, g, opt);
+        goto done;
+    }
+
+    /* Latencies in milliseconds.
+     */
+    printf ("%6s %8s %7s %7s %6s %6s %5s %7s %7s %6s %6s %6s %6s %6s\n",
+            "frame", "time", "x", "y", "dx", "dy", "snr", "xcorr", "ycorr",
+            "expose", "read", "cent", "corr", "total");
+    while (!interrupted) {
+        e = sbig_guide_cycle (g, &interrupted, &c);
+        if (interrupted)
+            break;
+        if (e != CE_NO_ERROR)
+            msg_exit ("sbig_guide_cycle: %s", sbig_get_error_string (sb, e));
+        summary_add (&sum, &c);
+        if (c.lost) {
+            printf ("%6u %8.2f lost\n", c.frame, c.t);
+            fflush (stdout);
+            if (++misses == GUIDE_MAX_MISSES) {
+                msg ("guide star lost");
+                if (!acquire (sb, g))
+                    break;
+                misses = 0;
+            }
+            continue;
+        }
+        misses = 0;
+        printf ("%6u %8.2f %7.2f %7.2f %6.2f %6.2f %5.0f %7.2f %7.2f"
+                " %6.1f %6.1f %6.1f %6.1f %6.1f\n",
+                c.frame, c.t, c.x, c.y, c.dx, c.dy, c.snr, c.xcorr, c.ycorr,
+                1E3 * c.latency.expose, 1E3 * c.latency.readout,
+                1E3 * c.latency.centroid, 1E3 * c.latency.correct,
+                1E3 * c.latency.total);
+        fflush (stdout);
+    }
+done:
+    summary_print (&sum);
+    sbig_guide_destroy (g);
+    sbig_ccd_destroy (ccd);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -35,18 +35,24 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <pwd.h>
 #include <time.h>
 #include <math.h> /* fabs */
+#include <pthread.h>
 
 #include "src/common/libsbig/sbig.h"
 #include "src/common/libutil/log.h"
 #include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/preview.h"
+#include "src/common/libutil/stack.h"
+#include "src/common/libutil/stats.h"
+#include "src/common/libutil/align.h"
+#include "src/common/libutil/ser.h"
 #include "src/common/libsbig/sbfits.h"
 #include "src/common/libini/ini.h"
 
 typedef enum { SNAP_DF, SNAP_LF, SNAP_AUTO } snap_type_t;
+typedef enum { FORMAT_FITS, FORMAT_SER, FORMAT_CUBE, FORMAT_MEF } format_t;
 
 struct options {
     CCD_REQUEST chip;
@@ -75,13 +81,54 @@ struct options {
     snap_type_t image_type;
     bool no_cooler;
     char *color_convert;
+    bool pipeline;
+    sbfits_compress_t compress;
+    double hcomp_scale;
+    char *calibdir;
+    double calib_temp_step;
+    bool autodark;
+    bool stack;
+    double stack_kappa;
+    int checkpoint;
+    bool drift;
+    format_t format;
 };
 
 const char *software_name = PACKAGE_NAME "-" PACKAGE_VERSION;
 const double TE_stable = 3.0; /* degrees C allowable diff from setpoint */
-static bool interrupted = false;
+static volatile bool interrupted = false;
+static preview_t *preview = NULL;
+static double integration_time = 0; /* total seconds exposed in series */
+static sbig_calib_lib_t *calib = NULL;
+static struct sbig_calib_key calib_key;
+static const float *flat_gain = NULL; /* master flat, if any */
 
-#define OPTIONS "ht:d:C:r:b:n:D:m:O:fp:PT:cx:"
+#define DARK_PEDESTAL   100 /* added by CC_READ_SUBTRACT_LINE */
+
+/* Frames are added to the stack by whichever thread finishes them (the
+ * pipeline worker, if any), and the stack is written by the main thread.
+ */
+static stacker_t *stacker = NULL;
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t stack_start;      /* of the first frame */
+
+#define STACK_KAPPA     3.0 /* default rejection threshold, sigma */
+
+/* Drift of each image from the first, measured by whichever thread
+ * finishes the images, and summarized by the main thread at the end.
+ */
+struct drift {
+    align_t *align;
+    struct timespec t0;
+    int images, lost;
+    double max;
+    double st, stt, sx, sy, sxx, syy, stx, sty;
+};
+static struct drift drift;
+
+#define DRIFT_MIN_CONFIDENCE 0.2 /* below this, registration failed */
+
+#define OPTIONS "ht:d:C:r:b:n:D:m:O:fp:PT:cx:Qz::aS::k:RF:"
 static const struct option longopts[] = {
     {"help",          no_argument,           0, 'h'},
     {"exposure-time", required_argument,     0, 't'},
@@ -99,13 +146,21 @@ static const struct option longopts[] = {
     {"image-type",    required_argument,     0, 'T'},
     {"no-cooler",     no_argument,           0, 'c'},
     {"color-convert", required_argument,     0, 'x'},
+    {"pipeline",      no_argument,           0, 'Q'},
+    {"compress",      optional_argument,     0, 'z'},
+    {"autodark",      no_argument,           0, 'a'},
+    {"stack",         optional_argument,     0, 'S'},
+    {"checkpoint",    required_argument,     0, 'k'},
+    {"register",      no_argument,           0, 'R'},
+    {"format",        required_argument,     0, 'F'},
     {0, 0, 0, 0},
 };
 
 bool get_temp (sbig_t *sb, double *ccd_temp, double *setpoint);
-void snap_series (sbig_t *sb, struct options *snap);
+bool snap_series (sbig_t *sb, struct options *snap);
 int config_cb (void *user, const char *section, const char *name,
                const char *value);
+bool parse_compress (const char *s, struct options *opt);
 
 void usage (void)
 {
@@ -126,6 +181,15 @@ void usage (void)
 "  -T, --image-type TYPE      take df, lf, or auto (default auto)\n"
 "  -c, --no-cooler            allow TE to be disabled/unstable\n"
 "  -x, --color-convert=mono   convert raw single shot color to monochrome\n"
+"  -Q, --pipeline             expose next image while writing the last one\n"
+"  -z, --compress[=TYPE]      rice (default), hcompress[:SCALE], or none\n"
+"  -a, --autodark             take a dark for each image even if a master matches\n"
+"  -S, --stack[=KAPPA]        also write the mean of the series, rejecting\n"
+"                             outliers beyond KAPPA sigma (default 3, 0=none)\n"
+"  -k, --checkpoint N         write the stack so far every N images\n"
+"  -R, --register             measure drift of each image from the first\n"
+"  -F, --format FORMAT        fits (default), or ser, cube, or mef to write\n"
+"                             the series to one file\n"
 );
     exit (1);
 }
@@ -147,6 +211,7 @@ int main (int argc, char *argv[])
     CAMERA_TYPE type;
     bool force = false;
     struct sigaction sa;
+    int rc = 0;
 
     log_init ("sbig-snap");
 
@@ -165,6 +230,7 @@ int main (int argc, char *argv[])
     opt->verbose = true;
     opt->partial = 1.0;
     opt->image_type = SNAP_AUTO;
+    opt->calib_temp_step = SBIG_CALIB_TEMP_STEP;
 
     /* Override defaults with config file
      */
@@ -255,6 +321,43 @@ int main (int argc, char *argv[])
                 free (opt->color_convert);
                 opt->color_convert = xstrdup (optarg);
                 break;
+            case 'Q': /* --pipeline */
+                opt->pipeline = true;
+                break;
+            case 'z': /* --compress[=rice|hcompress[:SCALE]|none] */
+                if (!parse_compress (optarg ? optarg : "rice", opt))
+                    msg_exit ("error parsing --compress (rice, hcompress[:SCALE], none)");
+                break;
+            case 'a': /* --autodark */
+                opt->autodark = true;
+                break;
+            case 'S': { /* --stack[=KAPPA] */
+                char *endptr = "";
+                opt->stack = true;
+                opt->stack_kappa = optarg ? strtod (optarg, &endptr)
+                                          : STACK_KAPPA;
+                if (*endptr != '\0' || opt->stack_kappa < 0)
+                    msg_exit ("error parsing --stack argument");
+                break;
+            }
+            case 'k': /* --checkpoint N */
+                opt->checkpoint = strtoul (optarg, NULL, 10);
+                break;
+            case 'R': /* --register */
+                opt->drift = true;
+                break;
+            case 'F': /* --format fits|ser|cube|mef */
+                if (!strcasecmp (optarg, "fits"))
+                    opt->format = FORMAT_FITS;
+                else if (!strcasecmp (optarg, "ser"))
+                    opt->format = FORMAT_SER;
+                else if (!strcasecmp (optarg, "cube"))
+                    opt->format = FORMAT_CUBE;
+                else if (!strcasecmp (optarg, "mef"))
+                    opt->format = FORMAT_MEF;
+                else
+                    msg_exit ("error parsing --format (fits, ser, cube, mef)");
+                break;
             case 'h': /* --help */
             default:
                 usage ();
@@ -262,6 +365,14 @@ int main (int argc, char *argv[])
     }
     if (optind != argc)
         usage ();
+    if (opt->stack && opt->count > STACK_MAX_FRAMES)
+        msg_exit ("--stack is limited to %d images", STACK_MAX_FRAMES);
+    if (opt->format != FORMAT_FITS && (opt->pipeline || opt->preview))
+        msg_exit ("--pipeline and --preview apply only to --format fits");
+    if (!opt->calibdir) {
+        opt->calibdir = xzmalloc (strlen (opt->imagedir) + 7);
+        sprintf (opt->calibdir, "%s/calib", opt->imagedir);
+    }
 
     /* Verify we have all the info we need for a complete FITS header.
      */
@@ -338,7 +449,8 @@ int main (int argc, char *argv[])
 
     /* Take pictures.
      */
-    snap_series (sb, opt);
+    if (!snap_series (sb, opt))
+        rc = 1;
 
 done:
     /* Clean up.
@@ -357,6 +469,7 @@ done:
         free (opt->filter);
     if (opt->imagedir)
         free (opt->imagedir);
+    free (opt->calibdir);
     if (opt->sitename)
         free (opt->sitename);
     if (opt->latitude)
@@ -371,7 +484,7 @@ done:
 
     sbig_destroy (sb);
     log_fini ();
-    return 0;
+    return rc;
 }
 
 int config_cb (void *user, const char *section, const char *name,
@@ -384,6 +497,18 @@ int config_cb (void *user, const char *section, const char *name,
             if (opt->imagedir)
                 free (opt->imagedir);
             opt->imagedir = xstrdup (value);
+        } else if (!strcmp (name, "compress")) {
+            if (!parse_compress (value, opt))
+                msg ("warning - config: unknown compress type '%s'", value);
+        } else if (!strcmp (name, "calibdir")) {
+            free (opt->calibdir);
+            opt->calibdir = xstrdup (value);
+        } else if (!strcmp (name, "calib_temp_step")) {
+            opt->calib_temp_step = strtod (value, NULL);
+            if (opt->calib_temp_step <= 0) {
+                msg ("warning - config: bad calib_temp_step '%s'", value);
+                opt->calib_temp_step = SBIG_CALIB_TEMP_STEP;
+            }
         }
     } else if (!strcmp (section, "cfw")) {
         int slot;
@@ -419,22 +544,40 @@ int config_cb (void *user, const char *section, const char *name,
     return 0; /* 0=success, 1=error */
 }
 
+/* Parse compression type: none, rice, or hcompress[:SCALE].
+ * HCOMPRESS is lossy with the default scale of 2.5 (x RMS noise),
+ * the same as fpack's suggestion; use hcompress:0 for lossless.
+ */
+bool parse_compress (const char *s, struct options *opt)
+{
+    char *endptr;
+
+    if (!strcasecmp (s, "none"))
+        opt->compress = SBFITS_COMPRESS_NONE;
+    else if (!strcasecmp (s, "rice"))
+        opt->compress = SBFITS_COMPRESS_RICE;
+    else if (!strncasecmp (s, "hcompress", 9)) {
+        opt->hcomp_scale = 2.5;
+        if (s[9] == ':') {
+            opt->hcomp_scale = strtod (s + 10, &endptr);
+            if (endptr == s + 10 || *endptr != '\0' || opt->hcomp_scale < 0)
+                return false;
+        } else if (s[9] != '\0')
+            return false;
+        opt->compress = SBFITS_COMPRESS_HCOMPRESS;
+    } else
+        return false;
+    return true;
+}
+
 /* Wait for an exposure in progress to complete.
- * We avoid polling the camera excessively.
  */
 bool exposure_wait (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
 {
-    PAR_COMMAND_STATUS status;
-    int e;
-
-    usleep (1E6 * opt->t);
-    do {
-        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
-            msg_exit ("sbig_get_exposure_status: %s", sbig_get_error_string (sb, e));
-        if (status != CS_INTEGRATION_COMPLETE)
-            usleep (1E3 * 500); /* 500ms */
-    } while (status != CS_INTEGRATION_COMPLETE && !interrupted);
+    int e = sbig_ccd_wait_exposure (ccd, &interrupted);
 
+    if (e != CE_NO_ERROR && !interrupted)
+        msg_exit ("sbig_ccd_wait_exposure: %s", sbig_get_error_string (sb, e));
     return !interrupted;
 }
 
@@ -466,6 +609,7 @@ bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
              opt->t);
     if (!exposure_wait (sb, ccd, opt))
         goto abort;
+    integration_time += opt->t;
 
     /* Finalize exposure, then read out from camera to sbig_ccd_t internal
      * buffer.  Subtract a previous DF left there if type is SNAP_AUTO.
@@ -481,21 +625,28 @@ bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
         e = sbig_ccd_readout (ccd);
     if (e != CE_NO_ERROR)
         msg_exit ("sbig_ccd_readout: %s", sbig_get_error_string (sb, e));
-
-    if (opt->color_convert && type != SNAP_DF) {
-        if (opt->verbose)
-            msg ("[%d]color_convert: to %s", seq, opt->color_convert);
-        e = sbig_ccd_color_convert (ccd, opt->color_convert);
-        if (e != CE_NO_ERROR)
-            msg_exit ("sbig_ccd_color_convert: %s",
-                      sbig_get_error_string (sb, e));
-    }
+    if (opt->verbose)
+        msg ("[%d]readout: %.0f rows/s", seq, sbig_ccd_get_readout_rate (ccd));
     return true;
 abort:
     (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
     return false;
 }
 
+/* Convert single shot color light frame in the ccd's internal buffer.
+ */
+void color_convert (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+                    int seq)
+{
+    int e;
+
+    if (opt->verbose)
+        msg ("[%d]color_convert: to %s", seq, opt->color_convert);
+    e = sbig_ccd_color_convert (ccd, opt->color_convert);
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_color_convert: %s", sbig_get_error_string (sb, e));
+}
+
 bool get_temp (sbig_t *sb, double *ccd_temp, double *setpoint)
 {
     QueryTemperatureStatusResults2 temp;
@@ -509,11 +660,14 @@ bool get_temp (sbig_t *sb, double *ccd_temp, double *setpoint)
     return temp.coolingEnabled;
 }
 
+/* Fill in FITS header from ccd and options.
+ * The image data is set from the ccd's internal buffer; see also
+ * update_contrast().
+ */
 void update_fitsheader (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd,
                         const struct options *opt,
                         double temp_setpoint, double temp)
 {
-    long cwhite, cblack;
     int e;
     CFW_POSITION cfw_pos = CFWP_UNKNOWN;
     CFW_ERROR cfwerr;
@@ -543,64 +697,321 @@ void update_fitsheader (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd,
     sbfits_set_site (sbf, opt->sitename, opt->latitude, opt->longitude,
                      opt->elevation);
     sbfits_set_swcreate (sbf, software_name);
-    sbfits_set_contrast (sbf, cblack, cwhite);
     sbfits_set_imagetype (sbf, opt->image_type == SNAP_DF ? SBFITS_TYPE_DF
                                                           : SBFITS_TYPE_LF);
-    if ((e = sbig_ccd_auto_contrast (ccd, &cwhite, &cblack)) != CE_NO_ERROR)
+    sbfits_set_pedestal (sbf, 0); /* update if DF subtracted */
+}
+
+/* Set CBLACK and CWHITE from the ccd's internal buffer.
+ */
+void update_contrast (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd)
+{
+    long cwhite, cblack;
+    int e;
+
+    if ((e = sbig_ccd_auto_contrast (ccd, &cblack, &cwhite)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_auto_contrast: %s", sbig_get_error_string (sb, e));
     sbfits_set_contrast (sbf, cblack, cwhite);
-    sbfits_set_pedestal (sbf, 0); /* update if DF subtracted */
 }
 
+/* Send the image to ds9 from memory.  If ds9 hasn't taken the last one
+ * yet, it is replaced by this one.
+ */
 void preview_ds9 (sbfits_t *sbf)
 {
-    char *cmd;
-    int status;
+    void *buf;
+    size_t len;
+
+    if (sbfits_write_mem (sbf, &buf, &len) < 0) {
+        msg ("preview: %s", sbfits_get_errstr (sbf));
+        return;
+    }
+    (void)preview_send (preview, buf, len);
+}
+
+/* Find the master dark in the calibration library matching the next
+ * exposure at ccd temperature 'temp', or return NULL to take a dark.
+ */
+const ushort *master_dark (const struct options *opt, double temp, int seq)
+{
+    sbig_calib_frame_t *f;
+    struct sbig_calib_info info;
+
+    if (!calib)
+        return NULL;
+    calib_key.exposure = opt->t;
+    calib_key.temp = temp;
+    if (!(f = sbig_calib_load (calib, SBIG_CALIB_DARK, &calib_key))) {
+        if (errno != ENOENT)
+            msg ("[%d]master dark: %s", seq, strerror (errno));
+        else if (opt->verbose)
+            msg ("[%d]master dark: none for %.3fs at %.1fC", seq, opt->t, temp);
+        return NULL;
+    }
+    if (opt->verbose) {
+        sbig_calib_get_info (f, &info);
+        msg ("[%d]master dark: %s (%d frames)", seq, info.path, info.nframes);
+    }
+    return sbig_calib_get_data (f);
+}
+
+/* Find the master flat for the series' filter, if any.
+ */
+const float *master_flat (const struct options *opt)
+{
+    struct sbig_calib_key key = calib_key;
+    sbig_calib_frame_t *f;
+    struct sbig_calib_info info;
+
+    if (!calib || !opt->filter || !strcmp (opt->filter, "cfw"))
+        return NULL;
+    snprintf (key.filter, sizeof (key.filter), "%s", opt->filter);
+    if (!(f = sbig_calib_load (calib, SBIG_CALIB_FLAT, &key)))
+        return NULL;
+    if (opt->verbose) {
+        sbig_calib_get_info (f, &info);
+        msg ("master flat: %s (%d frames)", info.path, info.nframes);
+    }
+    return sbig_calib_get_gain (f);
+}
+
+/* Add a finished image to the stack, if stacking.
+ */
+void stack_add (const struct options *opt, const ushort *data,
+                ushort height, ushort width, int seq)
+{
+    if (!opt->stack)
+        return;
+    pthread_mutex_lock (&stack_lock);
+    if (!stacker && !(stacker = stacker_create (height, width,
+                                                opt->stack_kappa,
+                                                STACK_REF_FRAMES)))
+        err_exit ("stacker_create");
+    if (stacker_add (stacker, data) < 0)
+        err_exit ("[%d]stacker_add", seq);
+    pthread_mutex_unlock (&stack_lock);
+}
+
+/* Measure a finished image's offset from the first, if registering.
+ */
+void drift_add (const struct options *opt, const ushort *data,
+                ushort height, ushort width, int seq)
+{
+    struct drift *d = &drift;
+    struct align_result r;
+    struct timespec now;
+    double t;
+
+    if (!opt->drift)
+        return;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (!d->align) {
+        if (!(d->align = align_create (height, width, 0)))
+            err_exit ("align_create");
+        if (align_set_reference (d->align, data) < 0)
+            err_exit ("align_set_reference");
+        d->t0 = now;
+        d->images++;
+        return;
+    }
+    if (align_measure (d->align, data, &r) < 0)
+        err_exit ("[%d]align_measure", seq);
+    d->images++;
+    if (r.confidence < DRIFT_MIN_CONFIDENCE) {
+        d->lost++;
+        msg ("[%d]drift: not measured (confidence %.2f)", seq, r.confidence);
+        return;
+    }
+    if (opt->verbose)
+        msg ("[%d]drift: x %+.2f y %+.2f pixels (confidence %.2f)", seq,
+             r.dx, r.dy, r.confidence);
+    t = (now.tv_sec - d->t0.tv_sec) + 1E-9 * (now.tv_nsec - d->t0.tv_nsec);
+    d->st += t;
+    d->stt += t * t;
+    d->sx += r.dx;
+    d->sy += r.dy;
+    d->sxx += r.dx * r.dx;
+    d->syy += r.dy * r.dy;
+    d->stx += t * r.dx;
+    d->sty += t * r.dy;
+    if (hypot (r.dx, r.dy) > d->max)
+        d->max = hypot (r.dx, r.dy);
+}
+
+/* Summarize drift over the series: a steady rate suggests polar alignment
+ * or guiding trouble, a large rms with no rate suggests wind or periodic
+ * error.  The first image counts as a measurement of zero drift.
+ */
+void drift_summary (void)
+{
+    struct drift *d = &drift;
+    int n = d->images - d->lost;
+    double den;
+
+    if (!d->align)
+        return;
+    msg ("drift: %d images (%d not measured)", d->images, d->lost);
+    msg ("drift: rms x %.2f y %.2f pixels, max %.2f",
+         sqrt (d->sxx / n), sqrt (d->syy / n), d->max);
+    den = n * d->stt - d->st * d->st;
+    if (n > 2 && den > 0)
+        msg ("drift: rate x %+.2f y %+.2f pixels/min",
+             60 * (n * d->stx - d->st * d->sx) / den,
+             60 * (n * d->sty - d->st * d->sy) / den);
+    align_destroy (d->align);
+    memset (d, 0, sizeof (*d));
+}
+
+/* Stack and register a finished image, as requested.
+ */
+void image_done (const struct options *opt, const ushort *data,
+                 ushort height, ushort width, int seq)
+{
+    stack_add (opt, data, height, width, seq);
+    drift_add (opt, data, height, width, seq);
+}
+
+/* The same for the image in the ccd's internal buffer.
+ */
+void image_done_ccd (sbig_ccd_t *ccd, const struct options *opt, int seq)
+{
+    ushort height, width;
+    ushort *data = sbig_ccd_get_data (ccd, &height, &width);
+
+    image_done (opt, data, height, width, seq);
+}
+
+/* Write the mean of the images stacked so far as a FITS file,
+ * with SNAPSHOT set to the number of images.
+ */
+void stack_write (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
+{
+    double temp, setpoint;
+    ushort height, width;
+    long cblack, cwhite;
+    ushort *data;
+    ulong rejected;
+    int count;
+    sbfits_t *sbf;
+    struct stats st;
+    char buf[80];
+
+    pthread_mutex_lock (&stack_lock);
+    if (!stacker || (count = stacker_get_count (stacker)) == 0) {
+        pthread_mutex_unlock (&stack_lock);
+        return;
+    }
+    (void)sbig_ccd_get_data (ccd, &height, &width);
+    data = xzmalloc ((size_t)height * width * sizeof (data[0]));
+    if (stacker_get_mean (stacker, data) < 0)
+        err_exit ("stacker_get_mean");
+    rejected = stacker_get_rejected (stacker);
+    pthread_mutex_unlock (&stack_lock);
+
+    sbf = sbfits_create ();
+    sbfits_set_compression (sbf, opt->compress, opt->hcomp_scale);
+    if (sbfits_create_file (sbf, opt->imagedir, "ST") < 0)
+        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    get_temp (sb, &temp, &setpoint);
+    update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    sbfits_set_data (sbf, data, height, width);
+    sbfits_set_start_time (sbf, stack_start);
+    sbfits_set_num_exposures (sbf, count);
+    /* The pipeline worker may be using the ccd's scratch for its own
+     * frame, so this gets its own.
+     */
+    stats_init (&st, 0);
+    if (sbig_ccd_auto_contrast_stats (ccd, &st, data, height, width,
+                                      &cblack, &cwhite) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_auto_contrast: failed");
+    stats_fini (&st);
+    sbfits_set_contrast (sbf, cblack, cwhite);
+    if (opt->image_type == SNAP_AUTO) {
+        sbfits_add_history (sbf, software_name, "Dark Subtraction");
+        if (flat_gain)
+            sbfits_add_history (sbf, software_name, "Flat Field");
+        sbfits_set_pedestal (sbf, -DARK_PEDESTAL);
+    }
+    if (opt->color_convert && opt->image_type != SNAP_DF)
+        sbfits_add_history (sbf, software_name, "One shot color conversion");
+    if (opt->stack_kappa > 0)
+        snprintf (buf, sizeof (buf), "Average %d images, %.1f sigma clip",
+                  count, opt->stack_kappa);
+    else
+        snprintf (buf, sizeof (buf), "Average %d images", count);
+    sbfits_add_history (sbf, software_name, buf);
+    if (sbfits_write_file (sbf) < 0)
+        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+    if (sbfits_close_file (sbf))
+        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+    if (opt->verbose)
+        msg ("wrote %s (%d images, %lu pixels rejected)",
+             sbfits_get_filename (sbf), count, rejected);
+    sbfits_destroy (sbf);
+    free (data);
+}
+
+/* Take DF, LF, subtracting the DF during readout, or if there is a
+ * matching master dark, take LF and have the ccd subtract that (and
+ * divide by the master flat, if any) as it reads out.
+ */
+bool snap_autodark (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+                    int seq, double *temp, double *setpoint, bool *masterp)
+{
+    const ushort *dark;
+    bool ok;
+    int e;
 
-    if (asprintf (&cmd, "xpaset ds9 fits <%s", sbfits_get_filename (sbf))<0)
-        oom ();
-    if ((status = system (cmd)) < 0)
-        err ("preview");
-    else if (WIFEXITED (status)) {
-        if (WEXITSTATUS (status) != 0)
-            msg ("preview: xpaset exited with rc=%d", WEXITSTATUS (status));
-    } else if (WIFSIGNALED (status)) {
-        msg ("preview: killed by %s", strsignal (WTERMSIG (status)));
-    } else if (WIFSTOPPED (status)) {
-        msg ("preview: stopped");
-    } else if (WIFCONTINUED (status)) {
-        msg ("preview: continued");
+    get_temp (sb, temp, setpoint);
+    if ((dark = master_dark (opt, *temp, seq))) {
+        *masterp = true;
+        e = sbig_ccd_set_calibration (ccd, dark, flat_gain, DARK_PEDESTAL);
+        if (e != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_set_calibration: %s",
+                      sbig_get_error_string (sb, e));
+        ok = snap (sb, ccd, opt, SNAP_LF, seq);
+        (void)sbig_ccd_set_calibration (ccd, NULL, NULL, 0);
+        return ok;
     }
-    free (cmd);
+    *masterp = false;
+    if (!snap (sb, ccd, opt, SNAP_DF, seq))
+        return false;
+    get_temp (sb, temp, setpoint); /* get temp for FITS */
+    return snap (sb, ccd, opt, SNAP_AUTO, seq);
 }
 
 void snap_one_autodark (sbig_t *sb, sbig_ccd_t *ccd,
                         const struct options *opt, int seq)
 {
     double temp, setpoint;
+    bool master;
     sbfits_t *sbf;
 
     /* Create FITS file for output.
      */
     sbf = sbfits_create ();
+    sbfits_set_compression (sbf, opt->compress, opt->hcomp_scale);
     if (sbfits_create_file (sbf, opt->imagedir, "LF") < 0)
         msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
 
-    /* Take DF, LF
+    /* Take DF, LF or LF only
      */
-    if (!snap (sb, ccd, opt, SNAP_DF, seq))
-        goto abort;
-    get_temp (sb, &temp, &setpoint); /* get temp for FITS */
-    if (!snap (sb, ccd, opt, SNAP_AUTO, seq))
+    if (!snap_autodark (sb, ccd, opt, seq, &temp, &setpoint, &master))
         goto abort;
+    if (opt->color_convert)
+        color_convert (sb, ccd, opt, seq);
+    image_done_ccd (ccd, opt, seq);
 
     /* Write out FITS file, optionally preview
      */
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    update_contrast (sb, sbf, ccd);
     sbfits_add_history (sbf, software_name, "Dark Subtraction");
+    if (master && flat_gain)
+        sbfits_add_history (sbf, software_name, "Flat Field");
     if (opt->color_convert)
         sbfits_add_history (sbf, software_name, "One shot color conversion");
-    sbfits_set_pedestal (sbf, -100); /* readout_subtract does this */
+    sbfits_set_pedestal (sbf, -DARK_PEDESTAL);
     if (sbfits_write_file (sbf) < 0)
         err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
     if (sbfits_close_file (sbf))
@@ -626,6 +1037,7 @@ void snap_one_df (sbig_t *sb, sbig_ccd_t *ccd,
     sbfits_t *sbf;
 
     sbf = sbfits_create ();
+    sbfits_set_compression (sbf, opt->compress, opt->hcomp_scale);
     if (sbfits_create_file (sbf, opt->imagedir, "DF") < 0)
         msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
 
@@ -633,8 +1045,10 @@ void snap_one_df (sbig_t *sb, sbig_ccd_t *ccd,
 
     if (!snap (sb, ccd, opt, SNAP_DF, seq))
         goto abort;
+    image_done_ccd (ccd, opt, seq);
 
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    update_contrast (sb, sbf, ccd);
     if (sbfits_write_file (sbf) < 0)
         err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
     if (sbfits_close_file (sbf))
@@ -643,6 +1057,7 @@ void snap_one_df (sbig_t *sb, sbig_ccd_t *ccd,
         msg ("wrote %s", sbfits_get_filename (sbf));
     if (opt->preview)
         preview_ds9 (sbf);
+    sbfits_destroy (sbf);
     return;
 abort:
     (void)unlink (sbfits_get_filename (sbf));
@@ -656,6 +1071,7 @@ void snap_one_lf (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
     sbfits_t *sbf;
 
     sbf = sbfits_create ();
+    sbfits_set_compression (sbf, opt->compress, opt->hcomp_scale);
     if (sbfits_create_file (sbf, opt->imagedir, "LF") < 0)
         msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
 
@@ -663,8 +1079,12 @@ void snap_one_lf (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
 
     if (!snap (sb, ccd, opt, SNAP_LF, seq))
         goto abort;
+    if (opt->color_convert)
+        color_convert (sb, ccd, opt, seq);
+    image_done_ccd (ccd, opt, seq);
 
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    update_contrast (sb, sbf, ccd);
     if (opt->color_convert)
         sbfits_add_history (sbf, software_name, "One shot color conversion");
     if (sbfits_write_file (sbf) < 0)
@@ -682,13 +1102,376 @@ abort:
     sbfits_destroy (sbf);
 }
 
-void snap_series (sbig_t *sb, struct options *opt)
+/* Video series:  append each image to a SER file, created when the first
+ * image is read out, with the exposure start time.
+ */
+void snap_one_ser (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+                   int seq, ser_t **serp)
+{
+    double temp, setpoint;
+    bool master;
+    ushort height, width;
+    ushort *data;
+    struct timespec t;
+
+    if (opt->image_type == SNAP_AUTO) {
+        if (!snap_autodark (sb, ccd, opt, seq, &temp, &setpoint, &master))
+            return;
+    } else if (!snap (sb, ccd, opt, opt->image_type, seq))
+        return;
+    if (opt->color_convert && opt->image_type != SNAP_DF)
+        color_convert (sb, ccd, opt, seq);
+    image_done_ccd (ccd, opt, seq);
+
+    data = sbig_ccd_get_data (ccd, &height, &width);
+    sbig_ccd_get_start_timespec (ccd, &t);
+    if (!*serp) {
+        GetCCDInfoResults0 info;
+        char path[PATH_MAX];
+        char ts[32];
+        struct tm tm;
+        int e;
+
+        if ((e = sbig_ccd_get_info0 (ccd, &info)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_info0: %s", sbig_get_error_string (sb, e));
+        strftime (ts, sizeof (ts), "%FT%T", gmtime_r (&t.tv_sec, &tm));
+        snprintf (path, sizeof (path), "%s/%s_%s.ser", opt->imagedir,
+                  opt->image_type == SNAP_DF ? "DF" : "LF", ts);
+        if (!(*serp = ser_create (path, height, width, opt->count,
+                                  opt->observer, info.name, opt->telescope)))
+            err_exit ("%s", path);
+        if (opt->verbose)
+            msg ("writing %s", path);
+    }
+    if (ser_write_frame (*serp, data, &t) < 0)
+        err_exit ("[%d]ser_write_frame", seq);
+}
+
+/* Sequence series:  append each image to one FITS file, a cube or a
+ * multi-extension file, created when the first image is read out.  The
+ * keys common to the series come from the first image.
+ */
+void snap_one_seq (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+                   int seq, sbfits_t **sbfp)
+{
+    double temp, setpoint;
+    bool master = false;
+    bool color = opt->color_convert && opt->image_type != SNAP_DF;
+
+    if (opt->image_type == SNAP_AUTO) {
+        if (!snap_autodark (sb, ccd, opt, seq, &temp, &setpoint, &master))
+            return;
+    } else {
+        get_temp (sb, &temp, &setpoint);
+        if (!snap (sb, ccd, opt, opt->image_type, seq))
+            return;
+    }
+    if (color)
+        color_convert (sb, ccd, opt, seq);
+    image_done_ccd (ccd, opt, seq);
+
+    if (!*sbfp) {
+        sbfits_t *sbf = sbfits_create ();
+
+        sbfits_set_compression (sbf, opt->compress, opt->hcomp_scale);
+        update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+        update_contrast (sb, sbf, ccd);
+        if (opt->image_type == SNAP_AUTO) {
+            sbfits_add_history (sbf, software_name, "Dark Subtraction");
+            if (master && flat_gain)
+                sbfits_add_history (sbf, software_name, "Flat Field");
+            sbfits_set_pedestal (sbf, -DARK_PEDESTAL);
+        }
+        if (color)
+            sbfits_add_history (sbf, software_name, "One shot color conversion");
+        if (sbfits_seq_create (sbf, opt->imagedir,
+                               opt->image_type == SNAP_DF ? "DF" : "LF",
+                               opt->format == FORMAT_CUBE ? SBFITS_SEQ_CUBE
+                                                          : SBFITS_SEQ_MEF,
+                               opt->count) < 0)
+            msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                      sbfits_get_errstr (sbf));
+        if (opt->verbose)
+            msg ("writing %s", sbfits_get_filename (sbf));
+        *sbfp = sbf;
+    } else
+        update_fitsheader (sb, *sbfp, ccd, opt, setpoint, temp);
+    if (sbfits_seq_write_frame (*sbfp) < 0)
+        msg_exit ("[%d]sbfits_seq_write_frame: %s", seq,
+                  sbfits_get_errstr (*sbfp));
+}
+
+/* Pipelined series:  the main thread runs the camera, and as soon as an
+ * image has been read out, hands its buffer to a worker thread and starts
+ * the next exposure.  The worker does color conversion and contrast, then
+ * queues the image to an asynchronous FITS writer, which writes the file
+ * and runs the preview.  All driver calls stay on the main thread.
+ * The FITS header is filled in on the main thread since it needs the
+ * driver (ccd info, CFW position), but the file is created by the writer.
+ * A failed write is reported back to the main thread, which stops the
+ * series once the images already taken are written.
+ */
+#define PIPELINE_DEPTH  1   /* images waiting for the worker */
+#define WRITER_DEPTH    2   /* images waiting for (or being) written */
+#define WRITER_THREADS  2   /* images compressed concurrently */
+
+struct job {
+    sbfits_t *sbf;
+    const char *prefix;     /* "LF" or "DF" */
+    ushort *data;           /* from sbig_ccd_take_data() */
+    ushort height, width;
+    bool convert;
+    int seq;
+    struct pipeline *p;
+    struct job *next;
+};
+
+struct pipeline {
+    pthread_t t;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *head, *tail;
+    int count;
+    bool done;
+    sbig_ccd_t *ccd;
+    const struct options *opt;
+    sbfits_writer_t *writer;
+    bool failed;            /* a file could not be written */
+};
+
+static void pipeline_set_failed (struct pipeline *p)
+{
+    pthread_mutex_lock (&p->lock);
+    p->failed = true;
+    pthread_mutex_unlock (&p->lock);
+}
+
+static bool pipeline_failed (struct pipeline *p)
+{
+    bool failed;
+
+    pthread_mutex_lock (&p->lock);
+    failed = p->failed;
+    pthread_mutex_unlock (&p->lock);
+    return failed;
+}
+
+/* Called from the writer thread when the file is on disk.
+ */
+static void pipeline_written (sbfits_t *sbf, int rc, void *arg)
+{
+    struct job *job = arg;
+    struct pipeline *p = job->p;
+
+    if (rc < 0) {
+        msg ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+        (void)unlink (sbfits_get_filename (sbf));
+        pipeline_set_failed (p);
+    } else {
+        if (p->opt->verbose)
+            msg ("wrote %s", sbfits_get_filename (sbf));
+        if (p->opt->preview)
+            preview_ds9 (sbf);
+    }
+
+    sbig_ccd_release_data (p->ccd, job->data);
+    sbfits_destroy (sbf);
+    free (job);
+}
+
+static void pipeline_process (struct pipeline *p, struct job *job)
+{
+    const struct options *opt = p->opt;
+    long cblack, cwhite;
+
+    if (job->convert) {
+        if (opt->verbose)
+            msg ("[%d]color_convert: to %s", job->seq, opt->color_convert);
+        if (sbig_ccd_color_convert_data (p->ccd, opt->color_convert,
+                                         job->data, job->data,
+                                         job->height, job->width)
+                                                        != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_color_convert: unsupported conversion");
+    }
+    image_done (opt, job->data, job->height, job->width, job->seq);
+    if (sbig_ccd_auto_contrast_data (p->ccd, job->data,
+                                     job->height, job->width,
+                                     &cblack, &cwhite) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_auto_contrast: failed");
+    sbfits_set_contrast (job->sbf, cblack, cwhite);
+    sbfits_set_data (job->sbf, job->data, job->height, job->width);
+
+    job->p = p;
+    if (sbfits_writer_submit (p->writer, job->sbf, opt->imagedir, job->prefix,
+                              pipeline_written, job) < 0) {
+        msg ("[%d]sbfits_writer_submit: %s", job->seq, strerror (errno));
+        pipeline_set_failed (p);
+        sbig_ccd_release_data (p->ccd, job->data);
+        sbfits_destroy (job->sbf);
+        free (job);
+    }
+}
+
+/* Uncompressed output is limited by the disk, so one thread will do.
+ */
+static int writer_threads (const struct options *opt)
+{
+    return opt->compress != SBFITS_COMPRESS_NONE ? WRITER_THREADS : 1;
+}
+
+static void *pipeline_worker (void *arg)
+{
+    struct pipeline *p = arg;
+    struct job *job;
+    sigset_t sigs;
+
+    /* Leave SIGINT to the main thread so it can abort the exposure.
+     * The writer thread inherits this mask.
+     */
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    if (!(p->writer = sbfits_writer_create (WRITER_DEPTH,
+                                writer_threads (p->opt))))
+        err_exit ("sbfits_writer_create");
+
+    for (;;) {
+        pthread_mutex_lock (&p->lock);
+        while (!p->head && !p->done)
+            pthread_cond_wait (&p->cond, &p->lock);
+        if (!(job = p->head)) {
+            pthread_mutex_unlock (&p->lock);
+            break;
+        }
+        if (!(p->head = job->next))
+            p->tail = NULL;
+        p->count--;
+        pthread_cond_broadcast (&p->cond);
+        pthread_mutex_unlock (&p->lock);
+
+        pipeline_process (p, job);
+    }
+    sbfits_writer_destroy (p->writer);
+    return NULL;
+}
+
+/* Queue an image for the worker, blocking while it is backed up.
+ */
+static void pipeline_put (struct pipeline *p, struct job *job)
+{
+    pthread_mutex_lock (&p->lock);
+    while (p->count >= PIPELINE_DEPTH)
+        pthread_cond_wait (&p->cond, &p->lock);
+    if (p->tail)
+        p->tail->next = job;
+    else
+        p->head = job;
+    p->tail = job;
+    p->count++;
+    pthread_cond_broadcast (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+}
+
+static void pipeline_start (struct pipeline *p, sbig_ccd_t *ccd,
+                            const struct options *opt)
+{
+    int e;
+
+    memset (p, 0, sizeof (*p));
+    p->ccd = ccd;
+    p->opt = opt;
+    pthread_mutex_init (&p->lock, NULL);
+    pthread_cond_init (&p->cond, NULL);
+    if ((e = pthread_create (&p->t, NULL, pipeline_worker, p)) != 0)
+        errn_exit (e, "pthread_create");
+}
+
+/* Let the worker drain the queue, then clean up.
+ */
+static void pipeline_finish (struct pipeline *p)
+{
+    int e;
+
+    pthread_mutex_lock (&p->lock);
+    p->done = true;
+    pthread_cond_broadcast (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+    if ((e = pthread_join (p->t, NULL)) != 0)
+        errn_exit (e, "pthread_join");
+    pthread_mutex_destroy (&p->lock);
+    pthread_cond_destroy (&p->cond);
+}
+
+/* Take one image (or DF + LF for autodark) and queue it for the worker.
+ * Returns false if interrupted.
+ */
+bool snap_one_pipelined (sbig_t *sb, sbig_ccd_t *ccd,
+                         const struct options *opt, int seq,
+                         struct pipeline *p)
+{
+    double temp, setpoint;
+    bool master = false;
+    struct job *job = xzmalloc (sizeof (*job));
+
+    job->sbf = sbfits_create ();
+    sbfits_set_compression (job->sbf, opt->compress, opt->hcomp_scale);
+    job->seq = seq;
+    job->prefix = opt->image_type == SNAP_DF ? "DF" : "LF";
+    job->convert = opt->color_convert && opt->image_type != SNAP_DF;
+
+    if (opt->image_type == SNAP_AUTO) {
+        if (!snap_autodark (sb, ccd, opt, seq, &temp, &setpoint, &master))
+            goto abort;
+    } else {
+        get_temp (sb, &temp, &setpoint);
+        if (!snap (sb, ccd, opt, opt->image_type, seq))
+            goto abort;
+    }
+
+    update_fitsheader (sb, job->sbf, ccd, opt, setpoint, temp);
+    if (opt->image_type == SNAP_AUTO) {
+        sbfits_add_history (job->sbf, software_name, "Dark Subtraction");
+        if (master && flat_gain)
+            sbfits_add_history (job->sbf, software_name, "Flat Field");
+        sbfits_set_pedestal (job->sbf, -DARK_PEDESTAL);
+    }
+    if (job->convert)
+        sbfits_add_history (job->sbf, software_name,
+                            "One shot color conversion");
+
+    if (!(job->data = sbig_ccd_take_data (ccd, &job->height, &job->width)))
+        msg_exit ("sbig_ccd_take_data: no free buffers");
+    pipeline_put (p, job);
+    return true;
+abort:
+    sbfits_destroy (job->sbf);
+    free (job);
+    return false;
+}
+
+/* Returns false if the series was stopped by a write error.
+ */
+bool snap_series (sbig_t *sb, struct options *opt)
 {
     int e, i;
     sbig_ccd_t *ccd;
+    const char *ring = getenv ("SBIG_RING");
+    struct pipeline p;
+    ser_t *ser = NULL;
+    sbfits_t *sbseq = NULL;
+    bool ok = true;
+    struct timespec t0, t1;
+    double elapsed;
 
     if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
+    if (ring) {
+        if ((e = sbig_ccd_set_ring (ccd, ring, 0)) == CE_SHARE_ERROR)
+            msg ("frame ring %s is in use, not publishing", ring);
+        else if (e != CE_NO_ERROR)
+            msg ("frame ring %s: %s", ring, sbig_get_error_string (sb, e));
+    }
 
     /* Abort any in-progress exposure
      */
@@ -706,20 +1489,94 @@ void snap_series (sbig_t *sb, struct options *opt)
             msg_exit ("sbig_ccd_set_partial_frame: %s", sbig_get_error_string (sb, e));
     }
 
+    /* Light frames are dark subtracted with a master dark from the
+     * calibration library where one matches, else with a fresh dark.
+     * A master flat for the filter is applied along with a master dark.
+     */
+    if (opt->image_type == SNAP_AUTO && !opt->autodark) {
+        if (!(calib = sbig_calib_lib_open (opt->calibdir,
+                                           opt->calib_temp_step)))
+            msg ("calibration library %s: %s", opt->calibdir,
+                 strerror (errno));
+        else if ((e = sbig_calib_key_init (sb, ccd, &calib_key))
+                                                        != CE_NO_ERROR) {
+            msg ("sbig_calib_key_init: %s", sbig_get_error_string (sb, e));
+            sbig_calib_lib_close (calib);
+            calib = NULL;
+        }
+        flat_gain = master_flat (opt);
+    }
+
     /* Take series of images and write them out as FITS files.
      * Optionally increase the exposure time by time_delta on each exposure.
      */
+    if (opt->preview && !(preview = preview_create ("ds9")))
+        msg_exit ("preview_create failed");
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if (opt->pipeline)
+        pipeline_start (&p, ccd, opt);
     for (i = 0; i < opt->count && !interrupted; i++) {
-        if (opt->image_type == SNAP_AUTO)
+        if (opt->pipeline && pipeline_failed (&p)) {
+            msg ("write failed: stopping series");
+            break;
+        }
+        if (opt->format == FORMAT_SER)
+            snap_one_ser (sb, ccd, opt, i, &ser);
+        else if (opt->format == FORMAT_CUBE || opt->format == FORMAT_MEF)
+            snap_one_seq (sb, ccd, opt, i, &sbseq);
+        else if (opt->pipeline)
+            snap_one_pipelined (sb, ccd, opt, i, &p);
+        else if (opt->image_type == SNAP_AUTO)
             snap_one_autodark (sb, ccd, opt, i);
         else if (opt->image_type == SNAP_LF)
             snap_one_lf (sb, ccd, opt, i);
         else if (opt->image_type == SNAP_DF)
             snap_one_df (sb, ccd, opt, i);
+        if (i == 0)
+            stack_start = sbig_ccd_get_start_time (ccd);
+        if (opt->stack && opt->checkpoint > 0 && !interrupted
+                       && (i + 1) % opt->checkpoint == 0 && i + 1 < opt->count)
+            stack_write (sb, ccd, opt);
         opt->t += opt->time_delta;
     }
+    if (opt->pipeline) {
+        pipeline_finish (&p);
+        ok = !p.failed;
+    }
+    if (ser) {
+        int n = ser_get_count (ser);
+        if (ser_close (ser) < 0)
+            err_exit ("ser_close");
+        if (opt->verbose)
+            msg ("wrote %d images", n);
+    }
+    if (sbseq) {
+        if (sbfits_seq_close (sbseq) < 0)
+            msg_exit ("sbfits_seq_close: %s", sbfits_get_errstr (sbseq));
+        if (opt->verbose)
+            msg ("wrote %d images to %s", sbfits_seq_get_count (sbseq),
+                 sbfits_get_filename (sbseq));
+        sbfits_destroy (sbseq);
+    }
+    if (opt->stack) {
+        stack_write (sb, ccd, opt);
+        stacker_destroy (stacker);
+        stacker = NULL;
+    }
+    drift_summary ();
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    if (preview)
+        preview_destroy (preview);
+    sbig_calib_lib_close (calib);
+    calib = NULL;
+    flat_gain = NULL;
+    elapsed = (t1.tv_sec - t0.tv_sec) + 1E-9 * (t1.tv_nsec - t0.tv_nsec);
+    if (opt->verbose && elapsed > 0)
+        msg ("series: %.2fs exposed in %.2fs (%.0f%% duty cycle)",
+             integration_time, elapsed, 100 * integration_time / elapsed);
 
     sbig_ccd_destroy (ccd);
+    return ok;
 }
 
 /*
@@ -46,6 +46,9 @@ struct options {
     char *device;
     char *sbigudrv;
     char *xpa_nsinet;
+    char *threads;
+    char *socket;
+    char *ring;
 };
 
 static char *prog;
@@ -89,6 +92,9 @@ static void help (void)
 "   cfw        Select a filter on CFW device\n"
 "   snap       Take a picture\n"
 "   focus      Preview images quickly in a loop\n"
+"   guide      Autoguide with the tracking CCD\n"
+"   calib      Build master bias, dark, and flat frames\n"
+"   daemon     Keep the camera open for other commands\n"
 );
 }
 
@@ -169,6 +175,18 @@ int main (int argc, char *argv[])
     }
     if (setenv ("SBIG_DEVICE", opt->device, 1) < 0)
         err_exit ("setenv");
+    if (opt->threads) {
+        if (setenv ("SBIG_THREADS", opt->threads, 0) < 0)
+            err_exit ("setenv");
+    }
+    if (opt->socket) {
+        if (setenv ("SBIG_SOCKET", opt->socket, 0) < 0)
+            err_exit ("setenv");
+    }
+    if (opt->ring) {
+        if (setenv ("SBIG_RING", opt->ring, 0) < 0)
+            err_exit ("setenv");
+    }
 
     if (!strcmp (dir_self (), X_BINDIR)) {
         if (setenv ("SBIG_EXEC_DIR", EXEC_DIR, 0) < 0)
@@ -213,6 +231,18 @@ int config_cb (void *user, const char *section, const char *name,
             if (opt->device)
                 free (opt->device);
             opt->device = xstrdup (value);
+        } else if (!strcmp (name, "threads")) {
+            if (opt->threads)
+                free (opt->threads);
+            opt->threads = xstrdup (value);
+        } else if (!strcmp (name, "socket")) {
+            if (opt->socket)
+                free (opt->socket);
+            opt->socket = xstrdup (value);
+        } else if (!strcmp (name, "ring")) {
+            if (opt->ring)
+                free (opt->ring);
+            opt->ring = xstrdup (value);
         }
     } else if (!strcmp (section, "ds9")) {
         if (!strcmp (name, "xpa_nsinet")) {
@@ -23,6 +23,265 @@
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "handle.h"
+#include "handle_impl.h"
+#include "sbigudrv.h"
+#include "camera.h"
+#include "guide.h"
+#include "ao.h"
+
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/hfd.h"
+
+#define AO_MIN_SNR      6.0
+
+/* Telemetry slots carry their sample's sequence number, which is zeroed
+ * while the slot is being written, as in ring.c.
+ */
+struct sbig_ao_loop {
+    sbig_t *sb;
+    sbig_ccd_t *ccd;
+    struct sbig_ao_params p;
+    double inv[2][2];           /* pixels to AO units */
+    double lock_x, lock_y;
+    double x, y;                /* last position of the star */
+    ushort top, left, n;        /* window */
+    double integral[2];         /* AO units */
+    ushort ao[2];
+    int misses;
+    struct timespec epoch;
+    struct timespec last;       /* exposure complete, previous frame */
+    uint32_t seq;               /* last sample written */
+    struct sbig_ao_sample telemetry[SBIG_AO_TELEMETRY];
+};
+
+int sbig_ao_tip_tilt (sbig_t *sb, ushort x, ushort y)
+{
+    AOTipTiltParams in = { .xDeflection = x, .yDeflection = y };
+
+    if (x > SBIG_AO_MAX || y > SBIG_AO_MAX)
+        return CE_BAD_PARAMETER;
+    return sb->fun (CC_AO_TIP_TILT, &in, NULL);
+}
+
+int sbig_ao_center (sbig_t *sb)
+{
+    return sb->fun (CC_AO_CENTER, NULL, NULL);
+}
+
+int sbig_ao_delay (sbig_t *sb, ulong usec)
+{
+    AODelayParams in = { .delay = usec };
+
+    return sb->fun (CC_AO_DELAY, &in, NULL);
+}
+
+static double since (const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + 1E-9 * (t1->tv_nsec - t0->tv_nsec);
+}
+
+void sbig_ao_params_init (struct sbig_ao_params *p)
+{
+    p->exposure = 0.05;
+    p->window = 16;
+    p->kp = 0.3;
+    p->ki = 0.3;
+    p->max_misses = 10;
+}
+
+int sbig_ao_loop_create (sbig_t *sb, sbig_ccd_t *ccd,
+                         const struct sbig_ao_params *p,
+                         const struct sbig_guide_cal *cal,
+                         double x, double y, sbig_ao_loop_t **lp)
+{
+    sbig_ao_loop_t *l;
+    const double (*m)[2] = cal->m;
+    double det = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+    ushort top, left, height, width;
+    int t, lf, e;
+
+    if (p->window < 8 || p->window > 2 * HFD_MAX_RADIUS || p->exposure <= 0
+                      || p->kp < 0 || p->ki < 0 || det == 0)
+        return CE_BAD_PARAMETER;
+    if ((e = sbig_ccd_set_readout_mode (ccd, RM_1X1)) != CE_NO_ERROR)
+        return e;
+    (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
+    if (p->window > height || p->window > width)
+        return CE_BAD_PARAMETER;
+    t = lround (y) - p->window / 2;
+    lf = lround (x) - p->window / 2;
+    t = t < 0 ? 0 : t > height - p->window ? height - p->window : t;
+    lf = lf < 0 ? 0 : lf > width - p->window ? width - p->window : lf;
+    if ((e = sbig_ccd_set_window (ccd, t, lf, p->window, p->window))
+                                                            != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ao_center (sb)) != CE_NO_ERROR)
+        return e;
+    l = xzmalloc (sizeof (*l));
+    l->sb = sb;
+    l->ccd = ccd;
+    l->p = *p;
+    l->inv[0][0] = m[1][1] / det;
+    l->inv[0][1] = -m[0][1] / det;
+    l->inv[1][0] = -m[1][0] / det;
+    l->inv[1][1] = m[0][0] / det;
+    l->x = l->lock_x = x;
+    l->y = l->lock_y = y;
+    (void)sbig_ccd_get_window (ccd, &l->top, &l->left, &height, &width);
+    l->n = p->window;
+    l->ao[0] = l->ao[1] = SBIG_AO_CENTER;
+    (void)sbig_ccd_set_shutter_mode (ccd, sbig_ccd_get_chip (ccd)
+                                          == CCD_IMAGING ? SC_OPEN_SHUTTER
+                                                         : SC_LEAVE_SHUTTER);
+    clock_gettime (CLOCK_MONOTONIC, &l->epoch);
+    l->last = l->epoch;
+    *lp = l;
+    return CE_NO_ERROR;
+}
+
+void sbig_ao_loop_destroy (sbig_ao_loop_t *l)
+{
+    if (l) {
+        (void)sbig_ao_center (l->sb);
+        free (l);
+    }
+}
+
+static void publish (sbig_ao_loop_t *l, const struct sbig_ao_sample *s)
+{
+    uint32_t seq = l->seq + 1;
+    struct sbig_ao_sample *slot = &l->telemetry[seq % SBIG_AO_TELEMETRY];
+
+    __atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    *slot = *s;     /* s->seq is 0 */
+    __atomic_store_n (&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n (&l->seq, seq, __ATOMIC_RELEASE);
+}
+
+int sbig_ao_telemetry (sbig_ao_loop_t *l, uint32_t *next,
+                       struct sbig_ao_sample *buf, int max)
+{
+    uint32_t last = __atomic_load_n (&l->seq, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    if (*next == 0)
+        *next = 1;
+    if ((int32_t)(last - *next) >= SBIG_AO_TELEMETRY)
+        *next = last - SBIG_AO_TELEMETRY + 1;
+    while (n < max && (int32_t)(last - *next) >= 0) {
+        const struct sbig_ao_sample *slot;
+        uint32_t seq = *next;
+
+        slot = &l->telemetry[seq % SBIG_AO_TELEMETRY];
+        (*next)++;
+        if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        memcpy (&buf[n], slot, sizeof (buf[n]));
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        buf[n].seq = seq;
+        n++;
+    }
+    return n;
+}
+
+/* Proportional-integral correction of the error (dx, dy) in pixels.
+ * The integral only accumulates while the deflection is within travel,
+ * so it doesn't wind up at the end of travel.
+ */
+static uint32_t control (sbig_ao_loop_t *l, double dx, double dy)
+{
+    uint32_t flags = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        double err = l->inv[i][0] * dx + l->inv[i][1] * dy;
+        double integral = l->integral[i] + l->p.ki * err;
+        double u = SBIG_AO_CENTER - (l->p.kp * err + integral);
+
+        if (u < 0 || u > SBIG_AO_MAX) {
+            u = u < 0 ? 0 : SBIG_AO_MAX;
+            flags |= SBIG_AO_RAIL;
+        } else
+            l->integral[i] = integral;
+        l->ao[i] = lround (u);
+    }
+    return flags;
+}
+
+int sbig_ao_loop_step (sbig_ao_loop_t *l, const volatile bool *cancel)
+{
+    struct sbig_ao_sample s;
+    struct hfd_star star;
+    struct timespec t0, t1;
+    ushort height, width;
+    ushort *data;
+    int e;
+
+    memset (&s, 0, sizeof (s));
+    if ((e = sbig_ccd_start_exposure (l->ccd, START_SKIP_VDD,
+                                      l->p.exposure)) != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ccd_wait_exposure (l->ccd, cancel)) != CE_NO_ERROR) {
+        (void)sbig_ccd_end_exposure (l->ccd, ABORT_DONT_END);
+        return cancel && *cancel ? CE_NO_ERROR : e;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if ((e = sbig_ccd_end_exposure (l->ccd, 0)) != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ccd_readout (l->ccd)) != CE_NO_ERROR)
+        return e;
+    data = sbig_ccd_get_data (l->ccd, &height, &width);
+    if (hfd_measure (data, height, width, l->x - l->left, l->y - l->top,
+                     l->n / 2 - 2, &star) < 0 || star.snr < AO_MIN_SNR) {
+        s.flags = SBIG_AO_LOST;
+        l->x = l->lock_x;
+        l->y = l->lock_y;
+        l->misses++;
+    } else {
+        l->x = l->left + star.x;
+        l->y = l->top + star.y;
+        s.dx = l->x - l->lock_x;
+        s.dy = l->y - l->lock_y;
+        s.snr = star.snr;
+        s.flags = control (l, s.dx, s.dy);
+        if ((e = sbig_ao_tip_tilt (l->sb, l->ao[0], l->ao[1])) != CE_NO_ERROR)
+            return e;
+        l->misses = 0;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    s.t = since (&l->epoch, &t0);
+    s.latency = since (&t0, &t1);
+    s.period = since (&l->last, &t0);
+    s.x = l->ao[0];
+    s.y = l->ao[1];
+    l->last = t0;
+    publish (l, &s);
+    return CE_NO_ERROR;
+}
+
+int sbig_ao_loop_run (sbig_ao_loop_t *l, const volatile bool *cancel)
+{
+    int e;
+
+    l->misses = 0;
+    while (!(cancel && *cancel) && l->misses < l->p.max_misses) {
+        if ((e = sbig_ao_loop_step (l, cancel)) != CE_NO_ERROR)
+            return e;
+    }
+    return CE_NO_ERROR;
+}
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
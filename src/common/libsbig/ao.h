@@ -1,9 +1,98 @@
 #ifndef _SBIG_AO_H
 #define _SBIG_AO_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #include "handle.h"
+#include "camera.h"
+#include "guide.h"
 #include "sbigudrv.h"
 
+/* Deflect the AO tip-tilt element.  Deflections run from 0 to
+ * SBIG_AO_MAX in each axis, with SBIG_AO_CENTER centered.
+ */
+#define SBIG_AO_CENTER      2048
+#define SBIG_AO_MAX         4095
+
+int sbig_ao_tip_tilt (sbig_t *sb, ushort x, ushort y);
+
+/* Center the tip-tilt element.
+ */
+int sbig_ao_center (sbig_t *sb);
+
+/* Set the delay in microseconds the AO allows for the element to settle
+ * after each move.
+ */
+int sbig_ao_delay (sbig_t *sb, ulong usec);
+
+/* Closed loop tip-tilt correction: repeatedly expose a small window of
+ * 'ccd' around the guide star, centroid it, and deflect the AO element
+ * by a proportional-integral correction of the star's offset from its
+ * lock position.
+ *
+ * All memory is allocated by sbig_ao_loop_create(), and the loop neither
+ * allocates nor logs, so it can run at the rate the camera allows.  Each
+ * frame's error and correction are written to a telemetry ring that
+ * other threads may read without locking and without slowing the loop.
+ */
+typedef struct sbig_ao_loop sbig_ao_loop_t;
+
+struct sbig_ao_params {
+    double exposure;            /* seconds */
+    int window;                 /* subframe size, pixels */
+    double kp;                  /* proportional gain */
+    double ki;                  /* integral gain, per frame */
+    int max_misses;             /* frames without the star before stopping */
+};
+
+enum {
+    SBIG_AO_LOST = 1,           /* no star in the window; no correction */
+    SBIG_AO_RAIL = 2,           /* deflection limited at the end of travel */
+};
+
+struct sbig_ao_sample {
+    uint32_t seq;               /* frame number, from 1 */
+    uint32_t flags;
+    double t;                   /* seconds since the loop was created */
+    float dx, dy;               /* error from the lock position, pixels */
+    float snr;
+    float latency;              /* exposure complete to correction, sec */
+    float period;               /* since the previous frame, sec */
+    ushort x, y;                /* deflection after correction */
+};
+
+#define SBIG_AO_TELEMETRY   1024    /* samples kept, a power of 2 */
+
+/* Fill in default parameters.
+ */
+void sbig_ao_params_init (struct sbig_ao_params *p);
+
+/* Create a loop locked on (x, y) in unbinned pixels of the full frame,
+ * with 'cal' giving star motion in pixels per AO unit (see
+ * sbig_guide_calibrate() with SBIG_GUIDE_AO).  The AO is centered.
+ */
+int sbig_ao_loop_create (sbig_t *sb, sbig_ccd_t *ccd,
+                         const struct sbig_ao_params *p,
+                         const struct sbig_guide_cal *cal,
+                         double x, double y, sbig_ao_loop_t **lp);
+void sbig_ao_loop_destroy (sbig_ao_loop_t *l);
+
+/* Run one frame, or frames until *cancel becomes true or the star has
+ * been missing for max_misses frames in a row.  Return CE_NO_ERROR in
+ * either case, or a driver error.
+ */
+int sbig_ao_loop_step (sbig_ao_loop_t *l, const volatile bool *cancel);
+int sbig_ao_loop_run (sbig_ao_loop_t *l, const volatile bool *cancel);
+
+/* Read telemetry samples from sequence number *next onward (start at 1)
+ * into 'buf', advancing *next.  Samples overwritten before they were
+ * read are skipped, leaving a gap in sequence numbers.  Returns the
+ * number of samples copied.  May be called from any thread.
+ */
+int sbig_ao_telemetry (sbig_ao_loop_t *l, uint32_t *next,
+                       struct sbig_ao_sample *buf, int max);
+
 #endif
 
 /*
@@ -0,0 +1,505 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Master calibration frame library.
+ *
+ * File layout: a header padded to CALIB_DATA_OFFSET, then height rows of
+ * width pixels, in host byte order like the frame ring.  The data offset
+ * is a page multiple so a mapped frame's pixels are page aligned.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <math.h>
+
+#include "handle.h"
+#include "handle_impl.h"
+#include "sbigudrv.h"
+#include "camera.h"
+#include "calib.h"
+
+#include "src/common/libutil/xzmalloc.h"
+
+#define CALIB_MAGIC         "SBCALIB1"
+#define CALIB_DATA_OFFSET   4096
+#define CALIB_SUFFIX        ".cal"
+
+struct calib_hdr {
+    char magic[8];
+    uint32_t type;
+    uint32_t nframes;
+    uint16_t chip;
+    uint16_t readout_mode;
+    uint16_t top, left;
+    uint16_t height, width;
+    double exposure;
+    double temp;
+    int64_t created;
+    char serial[32];
+    char filter[32];
+};
+
+struct sbig_calib_frame {
+    struct sbig_calib_info info;
+    char path[PATH_MAX];
+    void *map;
+    size_t len;
+    float *gain;                        /* flat reciprocal, on demand */
+    struct sbig_calib_frame *next;
+};
+
+struct sbig_calib_lib {
+    char *dir;
+    double temp_step;
+    struct sbig_calib_frame *frames;    /* loaded */
+};
+
+static const char *typestr[] = { "bias", "dark", "flat" };
+
+const char *sbig_calib_strtype (enum sbig_calib_type type)
+{
+    if (type < SBIG_CALIB_BIAS || type > SBIG_CALIB_FLAT)
+        return "unknown";
+    return typestr[type];
+}
+
+int sbig_calib_key_init (sbig_t *sb, sbig_ccd_t *ccd,
+                         struct sbig_calib_key *key)
+{
+    GetCCDInfoParams in = { .request = CCD_INFO_EXTENDED };
+    GetCCDInfoResults2 info2;
+    int e;
+
+    memset (key, 0, sizeof (*key));
+    if ((e = sb->fun (CC_GET_CCD_INFO, &in, &info2)) != CE_NO_ERROR)
+        return e;
+    snprintf (key->serial, sizeof (key->serial), "%.*s",
+              (int)sizeof (info2.serialNumber), info2.serialNumber);
+    key->chip = sbig_ccd_get_chip (ccd);
+    if ((e = sbig_ccd_get_readout_mode (ccd, &key->readout_mode))
+                                                        != CE_NO_ERROR)
+        return e;
+    return sbig_ccd_get_window (ccd, &key->top, &key->left,
+                                &key->height, &key->width);
+}
+
+static size_t pixel_size (enum sbig_calib_type type)
+{
+    return type == SBIG_CALIB_FLAT ? sizeof (float) : sizeof (ushort);
+}
+
+/* Make a string safe for a file name.
+ */
+static void sanitize (char *dst, size_t len, const char *src)
+{
+    size_t i;
+
+    for (i = 0; i < len - 1 && src[i] != '\0'; i++) {
+        char c = src[i];
+        dst[i] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+              || (c >= '0' && c <= '9') || c == '-' || c == '.' ? c : '_';
+    }
+    dst[i] = '\0';
+}
+
+static double temp_bucket (sbig_calib_lib_t *lib, double temp)
+{
+    double t = lib->temp_step * round (temp / lib->temp_step);
+
+    return t == 0 ? 0 : t; /* no -0.0 */
+}
+
+/* <dir>/<serial>/<type>_<chip>_<mode>_<top>_<left>_<height>x<width>
+ * followed by _<ms>ms and/or _<temp>C for biases and darks, or
+ * _<filter> for flats.
+ */
+static int calib_path (sbig_calib_lib_t *lib, enum sbig_calib_type type,
+                       const struct sbig_calib_key *key,
+                       char *buf, size_t len, bool dir_only)
+{
+    char serial[32], filter[32];
+    const char *chip = key->chip == CCD_IMAGING ? "img"
+                     : key->chip == CCD_TRACKING ? "trk" : "ext";
+    int n;
+
+    sanitize (serial, sizeof (serial), key->serial[0] ? key->serial
+                                                       : "unknown");
+    if (dir_only)
+        n = snprintf (buf, len, "%s/%s", lib->dir, serial);
+    else if (type == SBIG_CALIB_FLAT) {
+        sanitize (filter, sizeof (filter), key->filter[0] ? key->filter
+                                                           : "none");
+        n = snprintf (buf, len, "%s/%s/%s_%s_%04x_%u_%u_%ux%u_%s%s",
+                      lib->dir, serial, typestr[type], chip,
+                      key->readout_mode, key->top, key->left,
+                      key->height, key->width, filter, CALIB_SUFFIX);
+    } else if (type == SBIG_CALIB_DARK) {
+        n = snprintf (buf, len, "%s/%s/%s_%s_%04x_%u_%u_%ux%u_%ldms_%+.1fC%s",
+                      lib->dir, serial, typestr[type], chip,
+                      key->readout_mode, key->top, key->left,
+                      key->height, key->width, lround (key->exposure * 1000),
+                      temp_bucket (lib, key->temp), CALIB_SUFFIX);
+    } else {
+        n = snprintf (buf, len, "%s/%s/%s_%s_%04x_%u_%u_%ux%u_%+.1fC%s",
+                      lib->dir, serial, typestr[type], chip,
+                      key->readout_mode, key->top, key->left,
+                      key->height, key->width,
+                      temp_bucket (lib, key->temp), CALIB_SUFFIX);
+    }
+    if (n < 0 || n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int mkdir_p (const char *path)
+{
+    char tmp[PATH_MAX];
+    char *p;
+
+    if (snprintf (tmp, sizeof (tmp), "%s", path) >= sizeof (tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir (tmp, 0755) < 0 && errno != EEXIST)
+                return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir (tmp, 0755) < 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+sbig_calib_lib_t *sbig_calib_lib_open (const char *dir, double temp_step)
+{
+    sbig_calib_lib_t *lib;
+
+    if (temp_step <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (mkdir_p (dir) < 0)
+        return NULL;
+    lib = xzmalloc (sizeof (*lib));
+    lib->dir = xstrdup (dir);
+    lib->temp_step = temp_step;
+    return lib;
+}
+
+void sbig_calib_lib_close (sbig_calib_lib_t *lib)
+{
+    if (lib) {
+        struct sbig_calib_frame *f;
+
+        while ((f = lib->frames)) {
+            lib->frames = f->next;
+            munmap (f->map, f->len);
+            free (f->gain);
+            free (f);
+        }
+        free (lib->dir);
+        free (lib);
+    }
+}
+
+static int write_all (int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write (fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int sbig_calib_save (sbig_calib_lib_t *lib, enum sbig_calib_type type,
+                     const struct sbig_calib_key *key, int nframes,
+                     const void *data)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    char block[CALIB_DATA_OFFSET];
+    struct calib_hdr *hdr = (struct calib_hdr *)block;
+    size_t len = (size_t)key->height * key->width * pixel_size (type);
+    int fd, saved_errno;
+
+    if (type < SBIG_CALIB_BIAS || type > SBIG_CALIB_FLAT
+                               || key->height == 0 || key->width == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (calib_path (lib, type, key, path, sizeof (path), true) < 0
+                                                || mkdir_p (path) < 0)
+        return -1;
+    if (calib_path (lib, type, key, path, sizeof (path), false) < 0)
+        return -1;
+    snprintf (tmp, sizeof (tmp), "%s.%d", path, (int)getpid ());
+
+    memset (block, 0, sizeof (block));
+    memcpy (hdr->magic, CALIB_MAGIC, sizeof (hdr->magic));
+    hdr->type = type;
+    hdr->nframes = nframes;
+    hdr->chip = key->chip;
+    hdr->readout_mode = key->readout_mode;
+    hdr->top = key->top;
+    hdr->left = key->left;
+    hdr->height = key->height;
+    hdr->width = key->width;
+    hdr->exposure = key->exposure;
+    hdr->temp = key->temp;
+    hdr->created = time (NULL);
+    memcpy (hdr->serial, key->serial, sizeof (hdr->serial));
+    memcpy (hdr->filter, key->filter, sizeof (hdr->filter));
+    hdr->serial[sizeof (hdr->serial) - 1] = '\0';
+    hdr->filter[sizeof (hdr->filter) - 1] = '\0';
+
+    if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+    if (write_all (fd, block, sizeof (block)) < 0
+                || write_all (fd, data, len) < 0 || fsync (fd) < 0)
+        goto error;
+    if (close (fd) < 0) {
+        fd = -1;
+        goto error;
+    }
+    if (rename (tmp, path) < 0) {
+        fd = -1;
+        goto error;
+    }
+    return 0;
+error:
+    saved_errno = errno;
+    if (fd >= 0)
+        (void)close (fd);
+    (void)unlink (tmp);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Read and check the header of an open file, filling in 'info' (except
+ * the path).  Returns the expected file size, or 0 with errno set.
+ */
+static size_t read_hdr (int fd, struct sbig_calib_info *info)
+{
+    struct calib_hdr hdr;
+    struct stat sb;
+    size_t len;
+
+    if (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)
+            || memcmp (hdr.magic, CALIB_MAGIC, sizeof (hdr.magic)) != 0
+            || hdr.type > SBIG_CALIB_FLAT
+            || hdr.height == 0 || hdr.width == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    len = CALIB_DATA_OFFSET
+        + (size_t)hdr.height * hdr.width * pixel_size (hdr.type);
+    if (fstat (fd, &sb) < 0)
+        return 0;
+    if (sb.st_size != len) {
+        errno = EINVAL;
+        return 0;
+    }
+    memset (info, 0, sizeof (*info));
+    info->type = hdr.type;
+    info->nframes = hdr.nframes;
+    info->created = hdr.created;
+    info->key.chip = hdr.chip;
+    info->key.readout_mode = hdr.readout_mode;
+    info->key.top = hdr.top;
+    info->key.left = hdr.left;
+    info->key.height = hdr.height;
+    info->key.width = hdr.width;
+    info->key.exposure = hdr.exposure;
+    info->key.temp = hdr.temp;
+    hdr.serial[sizeof (hdr.serial) - 1] = '\0';
+    hdr.filter[sizeof (hdr.filter) - 1] = '\0';
+    memcpy (info->key.serial, hdr.serial, sizeof (info->key.serial));
+    memcpy (info->key.filter, hdr.filter, sizeof (info->key.filter));
+    return len;
+}
+
+sbig_calib_frame_t *sbig_calib_load (sbig_calib_lib_t *lib,
+                                     enum sbig_calib_type type,
+                                     const struct sbig_calib_key *key)
+{
+    char path[PATH_MAX];
+    struct sbig_calib_frame *f;
+    struct sbig_calib_info info;
+    size_t len;
+    void *map;
+    int fd, saved_errno;
+
+    if (calib_path (lib, type, key, path, sizeof (path), false) < 0)
+        return NULL;
+    for (f = lib->frames; f != NULL; f = f->next) {
+        if (!strcmp (f->path, path))
+            return f;
+    }
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return NULL;
+    if (!(len = read_hdr (fd, &info)))
+        goto error;
+    if (info.type != type || info.key.height != key->height
+                          || info.key.width != key->width) {
+        errno = EINVAL;
+        goto error;
+    }
+    /* Fault the frame in now rather than during the first subtraction.
+     */
+    map = mmap (NULL, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto error;
+    (void)close (fd);
+
+    f = xzmalloc (sizeof (*f));
+    f->info = info;
+    snprintf (f->path, sizeof (f->path), "%s", path);
+    f->info.path = f->path;
+    f->map = map;
+    f->len = len;
+    f->next = lib->frames;
+    lib->frames = f;
+    return f;
+error:
+    saved_errno = errno;
+    (void)close (fd);
+    errno = saved_errno;
+    return NULL;
+}
+
+void sbig_calib_get_info (sbig_calib_frame_t *f, struct sbig_calib_info *info)
+{
+    *info = f->info;
+}
+
+const ushort *sbig_calib_get_data (sbig_calib_frame_t *f)
+{
+    if (f->info.type == SBIG_CALIB_FLAT)
+        return NULL;
+    return (const ushort *)((char *)f->map + CALIB_DATA_OFFSET);
+}
+
+const float *sbig_calib_get_flat (sbig_calib_frame_t *f)
+{
+    if (f->info.type != SBIG_CALIB_FLAT)
+        return NULL;
+    return (const float *)((char *)f->map + CALIB_DATA_OFFSET);
+}
+
+const float *sbig_calib_get_gain (sbig_calib_frame_t *f)
+{
+    const float *flat = sbig_calib_get_flat (f);
+
+    if (flat && !f->gain) {
+        size_t i, len = (size_t)f->info.key.height * f->info.key.width;
+
+        f->gain = xzmalloc (len * sizeof (f->gain[0]));
+        for (i = 0; i < len; i++)
+            f->gain[i] = flat[i] > 0 ? 1.0f / flat[i] : 0;
+    }
+    return f->gain;
+}
+
+static bool has_suffix (const char *s, const char *suffix)
+{
+    size_t n = strlen (s), m = strlen (suffix);
+
+    return n > m && !strcmp (s + n - m, suffix);
+}
+
+static void list_dir (const char *dir, sbig_calib_list_f fn, void *arg)
+{
+    char path[PATH_MAX];
+    struct sbig_calib_info info;
+    struct dirent *d;
+    DIR *dp;
+    int fd;
+
+    if (!(dp = opendir (dir)))
+        return;
+    while ((d = readdir (dp))) {
+        if (!has_suffix (d->d_name, CALIB_SUFFIX))
+            continue;
+        if (snprintf (path, sizeof (path), "%s/%s", dir, d->d_name)
+                                                        >= sizeof (path))
+            continue;
+        if ((fd = open (path, O_RDONLY)) < 0)
+            continue;
+        if (read_hdr (fd, &info) > 0) {
+            info.path = path;
+            fn (&info, arg);
+        }
+        (void)close (fd);
+    }
+    (void)closedir (dp);
+}
+
+int sbig_calib_lib_list (sbig_calib_lib_t *lib, sbig_calib_list_f fn,
+                         void *arg)
+{
+    char path[PATH_MAX];
+    struct dirent *d;
+    DIR *dp;
+
+    if (!(dp = opendir (lib->dir)))
+        return -1;
+    while ((d = readdir (dp))) {
+        if (d->d_name[0] == '.')
+            continue;
+        if (snprintf (path, sizeof (path), "%s/%s", lib->dir, d->d_name)
+                                                        >= sizeof (path))
+            continue;
+        list_dir (path, fn, arg);
+    }
+    (void)closedir (dp);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
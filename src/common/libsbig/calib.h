@@ -0,0 +1,108 @@
+#ifndef _SBIG_CALIB_H
+#define _SBIG_CALIB_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "handle.h"
+#include "camera.h"
+#include "sbigudrv.h"
+
+/* Calibration library: a directory of master bias, dark, and flat frames,
+ * one file per frame, named after the conditions it was taken under.
+ *
+ * Darks match on camera serial number, ccd, readout mode, window,
+ * exposure time (to the millisecond), and ccd temperature rounded to the
+ * library's temperature step; biases on the same except exposure time;
+ * flats on camera, ccd, readout mode, window, and filter.
+ *
+ * Bias and dark frames are stored as 16 bit pixels, flats as float
+ * normalized to a mean of 1.  Frames are memory mapped when loaded, with
+ * the pixel data page aligned, and stay mapped until the library is
+ * closed, so a series looks up its dark for each exposure without
+ * reading the file again.
+ *
+ * Unlike the driver wrappers, functions that touch only files return -1
+ * or NULL with errno set on failure.
+ */
+
+typedef struct sbig_calib_lib sbig_calib_lib_t;
+typedef struct sbig_calib_frame sbig_calib_frame_t;
+
+enum sbig_calib_type {
+    SBIG_CALIB_BIAS,
+    SBIG_CALIB_DARK,
+    SBIG_CALIB_FLAT,
+};
+
+struct sbig_calib_key {
+    char serial[32];
+    CCD_REQUEST chip;
+    READOUT_BINNING_MODE readout_mode;
+    ushort top, left, height, width;    /* binned pixels */
+    double exposure;                    /* seconds (darks) */
+    double temp;                        /* ccd temperature, C (bias, darks) */
+    char filter[32];                    /* (flats) */
+};
+
+struct sbig_calib_info {
+    enum sbig_calib_type type;
+    struct sbig_calib_key key;          /* temp is the measured value */
+    int nframes;                        /* frames combined */
+    time_t created;
+    const char *path;
+};
+
+#define SBIG_CALIB_TEMP_STEP    2.0     /* default, C */
+
+/* Fill in a key for the ccd's current readout mode and window, and the
+ * camera's serial number.  The caller sets exposure, temp, and filter.
+ */
+int sbig_calib_key_init (sbig_t *sb, sbig_ccd_t *ccd,
+                         struct sbig_calib_key *key);
+
+/* Open the library in 'dir', creating the directory if needed.
+ * Temperatures are grouped in buckets 'temp_step' degrees wide.
+ */
+sbig_calib_lib_t *sbig_calib_lib_open (const char *dir, double temp_step);
+void sbig_calib_lib_close (sbig_calib_lib_t *lib);
+
+/* Store a master frame of key->height rows of key->width pixels, replacing
+ * any with the same key.  'data' is ushort for a bias or dark, float for a
+ * flat.  The file is written under a temporary name and renamed, so a
+ * reader never sees a partial frame.
+ */
+int sbig_calib_save (sbig_calib_lib_t *lib, enum sbig_calib_type type,
+                     const struct sbig_calib_key *key, int nframes,
+                     const void *data);
+
+/* Find and map the master frame matching 'key'.  Returns NULL with
+ * errno = ENOENT if there is none.  The frame belongs to the library.
+ */
+sbig_calib_frame_t *sbig_calib_load (sbig_calib_lib_t *lib,
+                                     enum sbig_calib_type type,
+                                     const struct sbig_calib_key *key);
+
+void sbig_calib_get_info (sbig_calib_frame_t *f, struct sbig_calib_info *info);
+const ushort *sbig_calib_get_data (sbig_calib_frame_t *f);   /* bias, dark */
+const float *sbig_calib_get_flat (sbig_calib_frame_t *f);    /* flat */
+
+/* Get the reciprocal of a flat, as sbig_ccd_set_calibration() wants it.
+ * It is computed on first use and kept with the frame.
+ */
+const float *sbig_calib_get_gain (sbig_calib_frame_t *f);
+
+/* Call 'fn' for each frame in the library.
+ */
+typedef void (*sbig_calib_list_f)(const struct sbig_calib_info *info,
+                                  void *arg);
+int sbig_calib_lib_list (sbig_calib_lib_t *lib, sbig_calib_list_f fn,
+                         void *arg);
+
+const char *sbig_calib_strtype (enum sbig_calib_type type);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
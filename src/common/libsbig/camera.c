@@ -33,15 +33,48 @@
 #include <arpa/inet.h> /* htons */
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "handle.h"
 #include "handle_impl.h"
 #include "sbigudrv.h"
 #include "sbig.h"
+#include "ring.h"
 
 #include "src/common/libutil/bcd.h"
+#include "src/common/libutil/calibrate.h"
 #include "src/common/libutil/color.h"
 #include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/rowband.h"
+#include "src/common/libutil/stats.h"
+
+/* Max number of frame sized buffers per ccd: the current frame and
+ * several handed out to the caller, e.g. frames queued for conversion
+ * and for asynchronous FITS output.
+ */
+#define FRAME_POOL_SIZE 8
+
+/* Rows read out before they are handed to the calibration thread.
+ */
+#define CALIB_BAND_ROWS 16
+
+/* Calibration runs on its own thread alongside readout: the readout loop
+ * advances 'ready' every CALIB_BAND_ROWS rows, and the thread calibrates
+ * rows up to it.  At the end of readout the thread is stopped and any
+ * rows it hasn't reached are finished on the rowband pool.
+ */
+struct calib_stream {
+    pthread_t t;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ushort *data;                       /* frame being read out */
+    int ready;                          /* rows read out */
+    int done;                           /* rows calibrated */
+    bool busy;                          /* thread is calibrating rows */
+    bool stop;                          /* readout is over */
+    bool quit;
+};
 
 struct sbig_ccd {
     sbig_t *sb;
@@ -52,13 +85,35 @@ struct sbig_ccd {
     GetCCDInfoResults0 info0;
     ushort top, left, height, width;
     ushort *frame;
+    size_t frame_size;                  /* pixels in each pool buffer */
+    ushort *bufs[FRAME_POOL_SIZE];      /* all allocated buffers */
+    int nbufs;
+    ushort *pool[FRAME_POOL_SIZE];      /* free buffers */
+    int npool;
+    pthread_mutex_t pool_lock;
+    sbig_ring_t *ring;                  /* replaces the pool if set */
+    const ushort *cal_dark;             /* applied during readout */
+    const float *cal_gain;
+    int cal_pedestal;
+    READOUT_BINNING_MODE cal_readout_mode;  /* window calibrated for */
+    ushort cal_top, cal_left, cal_height, cal_width;
+    struct calib_stream *cs;
     ulong exp_flags;
     double exposureTime;
     time_t exposureStart;
+    struct timespec exposure_t0;        /* CLOCK_MONOTONIC at start */
+    struct timespec exposure_utc;       /* CLOCK_REALTIME at start */
+    double readout_time;
+    struct stats stats;                 /* of 'frame', if stats_valid */
+    struct stats data_stats;            /* scratch for ..._data() */
+    struct color color;                 /* scratch for color conversion */
+    struct color data_color;            /* same, for ..._data() */
     CFW_POSITION last_cfw_position;
     int restore_cfw_position:1;
     int has_eshutter:1;
     int color_bayer:1;
+    int stats_valid:1;
+    int imaging_abg:1;
     int color_truesense:1;
 };
 
@@ -86,18 +141,67 @@ static int lookup_roheight (sbig_ccd_t *ccd, READOUT_BINNING_MODE mode)
             if ( height > 0 )
                 return height;
         } else {
-            return ccd->height = ccd->info0.readoutInfo[ro_index].height;
+            return ccd->info0.readoutInfo[ro_index].height;
         }
     }
 
     return -1;
 }
 
-static void realloc_frame (sbig_ccd_t *ccd)
+/* Size of the largest frame among the readout modes.
+ * N.B. modes with vertical binning report a height of zero.
+ */
+static size_t max_frame_size (sbig_ccd_t *ccd)
+{
+    size_t size, max = 0;
+    int i;
+
+    for (i = 0; i < ccd->info0.readoutModes; i++) {
+        READOUT_INFO *ri = &ccd->info0.readoutInfo[i];
+        size = (size_t)ri->width * (ri->height > 0 ? ri->height
+                                        : ccd->info0.readoutInfo[0].height);
+        if (size > max)
+            max = size;
+    }
+    return max;
+}
+
+/* Frame buffers are allocated on demand, sized for any readout mode and
+ * window, then recycled for the life of the ccd.  New buffers are touched
+ * once here so page faults don't land in the readout loop.
+ * The pool is locked so buffers taken with sbig_ccd_take_data() may be
+ * released from another thread.  If a ring is attached, its slots are
+ * the buffers instead.
+ */
+static ushort *frame_get (sbig_ccd_t *ccd)
 {
-    if (ccd->frame)
-        free (ccd->frame);
-    ccd->frame = xzmalloc (sizeof (*ccd->frame) * ccd->height * ccd->width);
+    ushort *buf = NULL;
+
+    if (ccd->ring)
+        return sbig_ring_acquire (ccd->ring);
+    pthread_mutex_lock (&ccd->pool_lock);
+    if (ccd->npool > 0)
+        buf = ccd->pool[--ccd->npool];
+    else if (ccd->nbufs < FRAME_POOL_SIZE) {
+        if ((buf = malloc (ccd->frame_size * sizeof (*buf)))) {
+            memset (buf, 0, ccd->frame_size * sizeof (*buf));
+            ccd->bufs[ccd->nbufs++] = buf;
+        }
+    }
+    pthread_mutex_unlock (&ccd->pool_lock);
+    return buf;
+}
+
+static void frame_put (sbig_ccd_t *ccd, ushort *buf)
+{
+    if (ccd->ring) {
+        sbig_ring_release (ccd->ring, buf);
+        return;
+    }
+    pthread_mutex_lock (&ccd->pool_lock);
+    assert (ccd->npool < FRAME_POOL_SIZE);
+    ccd->pool[ccd->npool++] = buf;
+    pthread_mutex_unlock (&ccd->pool_lock);
 }
 
 /* FIXME: PixCel255/237 doesn't support info0 on tracking ccd
@@ -122,14 +226,25 @@ int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp)
         free (ccd);
         return e;
     }
-    e = sbig_ccd_get_info6 (ccd, &info6);
-    if (e != CE_NO_ERROR) {
-        free (ccd);
-        return e;
+    /* Extended info 3 describes the imaging ccd only.
+     */
+    memset (&info6, 0, sizeof (info6));
+    if (chip == CCD_IMAGING) {
+        e = sbig_ccd_get_info6 (ccd, &info6);
+        if (e != CE_NO_ERROR) {
+            free (ccd);
+            return e;
+        }
     }
 
     if ((info4.capabilitiesBits & CB_CCD_ESHUTTER_MASK) == CB_CCD_ESHUTTER_YES)
         ccd->has_eshutter = 1;
+    if (chip == CCD_IMAGING) {
+        GetCCDInfoResults2 info2;
+        if (sbig_ccd_get_info2 (ccd, &info2) == CE_NO_ERROR
+                                                    && info2.imagingABG)
+            ccd->imaging_abg = 1;
+    }
 
     ccd->abg_mode = ABG_LOW7;            /* ABG shut off during exposure */
     ccd->shutter_mode = SC_OPEN_SHUTTER; /* open during exp, close during r/o */
@@ -149,7 +264,13 @@ int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp)
     ccd->left = 0;
     ccd->height = ccd->info0.readoutInfo[0].height;
     ccd->width = ccd->info0.readoutInfo[0].width;
-    realloc_frame (ccd);
+    ccd->frame_size = max_frame_size (ccd);
+    pthread_mutex_init (&ccd->pool_lock, NULL);
+    if (!(ccd->frame = frame_get (ccd))) {
+        pthread_mutex_destroy (&ccd->pool_lock);
+        free (ccd);
+        return CE_MEMORY_ERROR;
+    }
 
     /* Note that this is a one-shot color camera with a Bayer matrix.
      */
@@ -158,17 +279,67 @@ int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp)
     else if ((info6.ccdBits & 0x3) == 3)
         ccd->color_truesense = 1;
 
+    stats_init (&ccd->stats, 0);
+    stats_init (&ccd->data_stats, 0);
+    color_init (&ccd->color);
+    color_init (&ccd->data_color);
+
     *ccdp = ccd;
     return CE_NO_ERROR;
 }
 
 void sbig_ccd_destroy (sbig_ccd_t *ccd)
 {
-    if (ccd->frame)
-        free (ccd->frame);
+    int i;
+
+    if (ccd->cs) {
+        pthread_mutex_lock (&ccd->cs->lock);
+        ccd->cs->quit = true;
+        pthread_cond_broadcast (&ccd->cs->cond);
+        pthread_mutex_unlock (&ccd->cs->lock);
+        pthread_join (ccd->cs->t, NULL);
+        pthread_mutex_destroy (&ccd->cs->lock);
+        pthread_cond_destroy (&ccd->cs->cond);
+        free (ccd->cs);
+    }
+    stats_fini (&ccd->stats);
+    stats_fini (&ccd->data_stats);
+    color_fini (&ccd->color);
+    color_fini (&ccd->data_color);
+    for (i = 0; i < ccd->nbufs; i++)
+        free (ccd->bufs[i]);
+    sbig_ring_destroy (ccd->ring);
+    pthread_mutex_destroy (&ccd->pool_lock);
     free (ccd);
 }
 
+CCD_REQUEST sbig_ccd_get_chip (sbig_ccd_t *ccd)
+{
+    return ccd->ccd;
+}
+
+int sbig_ccd_set_ring (sbig_ccd_t *ccd, const char *name, int nslots)
+{
+    sbig_ring_t *ring;
+    ushort *frame;
+
+    if (ccd->ring || ccd->npool != ccd->nbufs - 1)
+        return CE_BAD_PARAMETER;
+    if (nslots <= 0)
+        nslots = FRAME_POOL_SIZE;
+    if (!(ring = sbig_ring_create (name, nslots, ccd->frame_size)))
+        return errno == EBUSY ? CE_SHARE_ERROR : CE_OS_ERROR;
+    if (!(frame = sbig_ring_acquire (ring))) {
+        sbig_ring_destroy (ring);
+        return CE_MEMORY_ERROR;
+    }
+    memcpy (frame, ccd->frame, ccd->frame_size * sizeof (*frame));
+    frame_put (ccd, ccd->frame);
+    ccd->frame = frame;
+    ccd->ring = ring;
+    return CE_NO_ERROR;
+}
+
 int sbig_ccd_get_info0 (sbig_ccd_t *ccd, GetCCDInfoResults0 *info)
 {
     GetCCDInfoParams in;
@@ -253,7 +424,6 @@ int sbig_ccd_set_readout_mode (sbig_ccd_t *ccd, READOUT_BINNING_MODE mode)
     ccd->left = 0;
     ccd->height = ro_height;
     ccd->width = ccd->info0.readoutInfo[ro_index].width;
-    realloc_frame (ccd);
     return CE_NO_ERROR;
 }
 
@@ -312,23 +482,31 @@ int sbig_ccd_set_partial_frame (sbig_ccd_t *ccd, double part)
     ccd->left = left;
     if (ccd->color_bayer)
         align_bayer_matrix (ccd);
-    realloc_frame (ccd);
     return CE_NO_ERROR;
 }
 
+/* The window is checked against the full frame for the readout mode,
+ * not the current window, so it may be moved or grown again later.
+ */
 int sbig_ccd_set_window (sbig_ccd_t *ccd, ushort top, ushort left,
                          ushort height, ushort width)
 {
-    if (top > ccd->height || left > ccd->width || height > ccd->height
-                                               || width > ccd->width)
+    int ro_index = lookup_roinfo (ccd, ccd->readout_mode);
+    int ro_height = lookup_roheight (ccd, ccd->readout_mode);
+
+    if (ro_index == -1 || ro_height == -1)
+        return CE_BAD_PARAMETER;
+    if (ccd->color_bayer) {     /* as align_bayer_matrix(), but stay on chip */
+        top &= ~1;
+        left &= ~1;
+    }
+    if (height == 0 || width == 0 || top + height > ro_height
+                    || left + width > ccd->info0.readoutInfo[ro_index].width)
         return CE_BAD_PARAMETER;
     ccd->top = top;
     ccd->left = left;
     ccd->height = height;
     ccd->width = width;
-    if (ccd->color_bayer)
-        align_bayer_matrix (ccd);
-    realloc_frame (ccd);
     return CE_NO_ERROR;
 }
 
@@ -405,9 +583,21 @@ static double min_exposure (sbig_ccd_t *ccd)
     if (ccd->has_eshutter)
         m = 1E-3;
 
+    /* The minimum is set by the mechanical shutter, so doesn't apply to
+     * a tracking ccd exposure that leaves the shutter alone.
+     */
+    if (ccd->ccd != CCD_IMAGING && ccd->shutter_mode == SC_LEAVE_SHUTTER
+                                && m > 1E-2)
+        m = 1E-2;
+
     return m;
 }
 
+double sbig_ccd_get_min_exposure (sbig_ccd_t *ccd)
+{
+    return min_exposure (ccd);
+}
+
 int sbig_ccd_start_exposure (sbig_ccd_t *ccd, unsigned short flags,
                              double exposureTime)
 {
@@ -456,6 +646,8 @@ int sbig_ccd_start_exposure (sbig_ccd_t *ccd, unsigned short flags,
             ccd->restore_cfw_position = 1;
         }
     }
+    clock_gettime (CLOCK_MONOTONIC, &ccd->exposure_t0);
+    clock_gettime (CLOCK_REALTIME, &ccd->exposure_utc);
     return ccd->sb->fun (CC_START_EXPOSURE2, &in, NULL);
 }
 
@@ -473,6 +665,67 @@ int sbig_ccd_get_exposure_status (sbig_ccd_t *ccd, PAR_COMMAND_STATUS *sp)
     return e;
 }
 
+static void timespec_add (struct timespec *ts, double s)
+{
+    long ns = ts->tv_nsec + (long)((s - floor (s)) * 1E9);
+
+    ts->tv_sec += (time_t)floor (s) + ns / 1000000000L;
+    ts->tv_nsec = ns % 1000000000L;
+}
+
+static bool timespec_before (struct timespec *a, struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+        || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Sleep until the exposure should be finished, in steps of at most
+ * WAIT_STEP seconds so that a signal landing just before clock_nanosleep()
+ * is noticed promptly.  The driver only reports completion once the
+ * shutter has closed, so then poll, starting at WAIT_POLL_MIN and backing
+ * off to WAIT_POLL_MAX in case the camera is slow.
+ */
+#define WAIT_STEP       0.5
+#define WAIT_POLL_MIN   0.002
+#define WAIT_POLL_MAX   0.050
+
+int sbig_ccd_wait_exposure (sbig_ccd_t *ccd, const volatile bool *cancel)
+{
+    struct timespec deadline = ccd->exposure_t0;
+    struct timespec now, t;
+    double poll = WAIT_POLL_MIN;
+    PAR_COMMAND_STATUS status;
+    int e;
+
+    timespec_add (&deadline, ccd->exposureTime);
+    for (;;) {
+        if (cancel && *cancel)
+            return CE_EXPOSURE_IN_PROGRESS;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if (!timespec_before (&now, &deadline))
+            break;
+        t = now;
+        timespec_add (&t, WAIT_STEP);
+        if (timespec_before (&deadline, &t))
+            t = deadline;
+        (void)clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+    }
+    for (;;) {
+        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
+            return e;
+        if (status == CS_INTEGRATION_COMPLETE)
+            break;
+        if (cancel && *cancel)
+            return CE_EXPOSURE_IN_PROGRESS;
+        t.tv_sec = 0;
+        t.tv_nsec = poll * 1E9;
+        (void)clock_nanosleep (CLOCK_MONOTONIC, 0, &t, NULL);
+        if ((poll *= 2) > WAIT_POLL_MAX)
+            poll = WAIT_POLL_MAX;
+    }
+    return CE_NO_ERROR;
+}
+
 int sbig_ccd_end_exposure (sbig_ccd_t *ccd, ushort flags)
 {
     EndExposureParams in = { .ccd = ccd->ccd | flags };
@@ -507,76 +760,267 @@ static int end_readout (sbig_ccd_t *ccd)
     return ccd->sb->fun (CC_END_READOUT, &in, NULL);
 }
 
-static int readout_line (sbig_ccd_t *ccd, ushort start, ushort len, ushort *buf)
+/* Calibrate rows [first, last) of 'data' on the calling thread.
+ */
+static void calibrate_rows (sbig_ccd_t *ccd, ushort *data, int first, int last)
 {
-    ReadoutLineParams in = { .ccd = ccd->ccd, .readoutMode = ccd->readout_mode,
-                             .pixelStart = start, .pixelLength = len };
+    size_t offset = (size_t)first * ccd->width;
 
-    return ccd->sb->fun (CC_READOUT_LINE, &in, buf);
+    calibrate_pixels (data + offset,
+                      ccd->cal_dark ? ccd->cal_dark + offset : NULL,
+                      ccd->cal_gain ? ccd->cal_gain + offset : NULL,
+                      ccd->cal_pedestal, (size_t)(last - first) * ccd->width);
 }
 
-static int read_subtract_line (sbig_ccd_t *ccd, ushort start, ushort len, ushort *buf)
+static void *calib_thread (void *arg)
 {
-    ReadoutLineParams in = { .ccd = ccd->ccd, .readoutMode = ccd->readout_mode,
-                             .pixelStart = start, .pixelLength = len };
+    sbig_ccd_t *ccd = arg;
+    struct calib_stream *cs = ccd->cs;
+    int first, last;
+
+    pthread_mutex_lock (&cs->lock);
+    for (;;) {
+        while (!cs->quit && (cs->stop || cs->done == cs->ready))
+            pthread_cond_wait (&cs->cond, &cs->lock);
+        if (cs->quit)
+            break;
+        first = cs->done;
+        last = cs->ready;
+        cs->busy = true;
+        pthread_mutex_unlock (&cs->lock);
 
-    return ccd->sb->fun (CC_READ_SUBTRACT_LINE, &in, buf);
+        calibrate_rows (ccd, cs->data, first, last);
+
+        pthread_mutex_lock (&cs->lock);
+        cs->done = last;
+        cs->busy = false;
+        pthread_cond_broadcast (&cs->cond);
+    }
+    pthread_mutex_unlock (&cs->lock);
+    return NULL;
 }
 
-int sbig_ccd_readout (sbig_ccd_t *ccd)
+static int stream_begin (sbig_ccd_t *ccd)
 {
-    ushort *pp = ccd->frame;
-    int i, e;
+    struct calib_stream *cs = ccd->cs;
 
-    assert (pp != NULL);
+    if (!cs) {
+        sigset_t sigs, oldsigs;
+        int e;
 
-    e = start_readout (ccd);
-    for (i = 0; e == CE_NO_ERROR && i < ccd->height; i++) {
-        e = readout_line (ccd, ccd->left, ccd->width, pp);
-        pp += ccd->width;
+        cs = xzmalloc (sizeof (*cs));
+        pthread_mutex_init (&cs->lock, NULL);
+        pthread_cond_init (&cs->cond, NULL);
+        cs->stop = true;
+        ccd->cs = cs;
+        /* As in rowband.c, leave signals to the application's threads.
+         */
+        sigfillset (&sigs);
+        pthread_sigmask (SIG_SETMASK, &sigs, &oldsigs);
+        e = pthread_create (&cs->t, NULL, calib_thread, ccd);
+        pthread_sigmask (SIG_SETMASK, &oldsigs, NULL);
+        if (e != 0) {
+            pthread_mutex_destroy (&cs->lock);
+            pthread_cond_destroy (&cs->cond);
+            free (cs);
+            ccd->cs = NULL;
+            return CE_OS_ERROR;
+        }
     }
-    if (e == CE_NO_ERROR)
-        e = end_readout (ccd);
+    pthread_mutex_lock (&cs->lock);
+    cs->data = ccd->frame;
+    cs->ready = cs->done = 0;
+    cs->stop = false;
+    pthread_mutex_unlock (&cs->lock);
+    return CE_NO_ERROR;
+}
 
-    return e;
+static void stream_ready (sbig_ccd_t *ccd, int rows)
+{
+    struct calib_stream *cs = ccd->cs;
+
+    pthread_mutex_lock (&cs->lock);
+    cs->ready = rows;
+    pthread_cond_signal (&cs->cond);
+    pthread_mutex_unlock (&cs->lock);
 }
 
-int sbig_ccd_readout_subtract (sbig_ccd_t *ccd)
+/* Stop the thread and finish the rows it hasn't reached in parallel.
+ */
+static void stream_finish (sbig_ccd_t *ccd, int rows)
 {
+    struct calib_stream *cs = ccd->cs;
+    size_t offset;
+    int first;
+
+    pthread_mutex_lock (&cs->lock);
+    cs->stop = true;
+    while (cs->busy)
+        pthread_cond_wait (&cs->cond, &cs->lock);
+    first = cs->done;
+    pthread_mutex_unlock (&cs->lock);
+
+    if (first < rows) {
+        offset = (size_t)first * ccd->width;
+        calibrate_frame (ccd->frame + offset,
+                         ccd->cal_dark ? ccd->cal_dark + offset : NULL,
+                         ccd->cal_gain ? ccd->cal_gain + offset : NULL,
+                         ccd->cal_pedestal, rows - first, ccd->width);
+    }
+}
+
+int sbig_ccd_set_calibration (sbig_ccd_t *ccd, const ushort *dark,
+                              const float *gain, ushort pedestal)
+{
+    ccd->cal_dark = dark;
+    ccd->cal_gain = gain;
+    ccd->cal_pedestal = pedestal;
+    ccd->cal_readout_mode = ccd->readout_mode;
+    ccd->cal_top = ccd->top;
+    ccd->cal_left = ccd->left;
+    ccd->cal_height = ccd->height;
+    ccd->cal_width = ccd->width;
+    return CE_NO_ERROR;
+}
+
+static void ring_publish (sbig_ccd_t *ccd, uint32_t flags)
+{
+    struct sbig_ring_frame f = {
+        .flags = flags,
+        .ccd = ccd->ccd,
+        .readout_mode = ccd->readout_mode,
+        .shutter_mode = ccd->shutter_mode,
+        .top = ccd->top,
+        .left = ccd->left,
+        .height = ccd->height,
+        .width = ccd->width,
+        .exposure_time = ccd->exposureTime,
+        .readout_time = ccd->readout_time,
+        .start = ccd->exposureStart,
+    };
+    sbig_ring_publish (ccd->ring, ccd->frame, &f);
+}
+
+/* Read the current window into the frame buffer.  'cmd' is
+ * CC_READOUT_LINE, or CC_READ_SUBTRACT_LINE to subtract the frame already
+ * in the buffer.  SBIGUDrv has no multi-line readout command, so this is
+ * one driver call per row; everything that doesn't change from row to row
+ * is set up once, outside the loop.  With CC_READOUT_LINE, calibration
+ * set with sbig_ccd_set_calibration() is applied to rows as they arrive.
+ */
+static int readout_frame (sbig_ccd_t *ccd, PAR_COMMAND cmd)
+{
+    short (*fun)(short cmd, void *parm, void *result) = ccd->sb->fun;
+    ReadoutLineParams in = { .ccd = ccd->ccd, .readoutMode = ccd->readout_mode,
+                             .pixelStart = ccd->left,
+                             .pixelLength = ccd->width };
     ushort *pp = ccd->frame;
-    int i, e;
+    ushort *end;
+    struct timespec t0, t1;
+    bool stream = cmd == CC_READOUT_LINE && (ccd->cal_dark || ccd->cal_gain);
+    uint32_t flags = 0;
+    int e, rows = 0;
 
+    ccd->stats_valid = 0;
     assert (pp != NULL);
 
+    if (stream) {
+        /* The planes are only right for the window they were set for.
+         */
+        if (ccd->cal_readout_mode != ccd->readout_mode
+                || ccd->cal_top != ccd->top || ccd->cal_left != ccd->left
+                || ccd->cal_height != ccd->height
+                || ccd->cal_width != ccd->width)
+            return CE_BAD_PARAMETER;
+        if ((e = stream_begin (ccd)) != CE_NO_ERROR)
+            return e;
+        if (ccd->cal_dark)
+            flags |= SBIG_RING_SUBTRACTED;
+        if (ccd->cal_gain)
+            flags |= SBIG_RING_FLAT_FIELDED;
+    } else if (cmd == CC_READ_SUBTRACT_LINE)
+        flags |= SBIG_RING_SUBTRACTED;
+
+    end = pp + ccd->height * ccd->width;
+    ccd->readout_time = 0;
+    if (ccd->ring)
+        (void)sbig_ring_begin (ccd->ring, ccd->frame, NULL);
+    clock_gettime (CLOCK_MONOTONIC, &t0);
     e = start_readout (ccd);
-    for (i = 0; e == CE_NO_ERROR && i < ccd->height; i++) {
-        e = read_subtract_line (ccd, ccd->left, ccd->width, pp);
+    while (e == CE_NO_ERROR && pp < end) {
+        e = fun (cmd, &in, pp);
         pp += ccd->width;
+        if (stream && e == CE_NO_ERROR && ++rows % CALIB_BAND_ROWS == 0)
+            stream_ready (ccd, rows);
     }
+    if (stream)
+        stream_finish (ccd, rows);
     if (e == CE_NO_ERROR)
         e = end_readout (ccd);
-
+    if (e == CE_NO_ERROR) {
+        clock_gettime (CLOCK_MONOTONIC, &t1);
+        ccd->readout_time = (t1.tv_sec - t0.tv_sec)
+                          + 1E-9 * (t1.tv_nsec - t0.tv_nsec);
+        if (ccd->ring)
+            ring_publish (ccd, flags);
+    }
     return e;
 }
 
-int sbig_ccd_color_convert (sbig_ccd_t *ccd, const char *method)
+int sbig_ccd_readout (sbig_ccd_t *ccd)
+{
+    return readout_frame (ccd, CC_READOUT_LINE);
+}
+
+int sbig_ccd_readout_subtract (sbig_ccd_t *ccd)
+{
+    return readout_frame (ccd, CC_READ_SUBTRACT_LINE);
+}
+
+double sbig_ccd_get_readout_rate (sbig_ccd_t *ccd)
+{
+    if (ccd->readout_time <= 0)
+        return 0;
+    return ccd->height / ccd->readout_time;
+}
+
+static int color_convert (sbig_ccd_t *ccd, struct color *c, const char *method,
+                          ushort *src, ushort *dst,
+                          ushort height, ushort width)
 {
     if (!ccd->color_bayer) // FIXME: add support for Truesense (which cam?)
         return CE_BAD_PARAMETER;
 
     if (!strncasecmp (method, "monochrome", strlen (method))) {
-        ushort *xframe;
-
-        if (!(xframe = calloc (ccd->height*ccd->width, sizeof (ushort))))
-            return CE_OS_ERROR;
-        color_bayer_to_mono (ccd->frame, xframe, ccd->width, ccd->height);
-        free (ccd->frame);
-        ccd->frame = xframe;
+        struct sbig_ring_frame f;
+        bool republish = ccd->ring && src == dst
+                         && sbig_ring_begin (ccd->ring, dst, &f) == 0;
+
+        color_bayer_to_mono (c, src, dst, width, height);
+        if (republish) {
+            f.flags |= SBIG_RING_CONVERTED;
+            sbig_ring_publish (ccd->ring, dst, &f);
+        }
         return CE_NO_ERROR;
     }
     return CE_BAD_PARAMETER;
 }
 
+int sbig_ccd_color_convert_data (sbig_ccd_t *ccd, const char *method,
+                                 ushort *src, ushort *dst,
+                                 ushort height, ushort width)
+{
+    return color_convert (ccd, &ccd->data_color, method, src, dst,
+                          height, width);
+}
+
+int sbig_ccd_color_convert (sbig_ccd_t *ccd, const char *method)
+{
+    ccd->stats_valid = 0;
+    return color_convert (ccd, &ccd->color, method, ccd->frame, ccd->frame,
+                          ccd->height, ccd->width);
+}
+
 /* These two functions presume that SBIGUdrv gave us unsigned shorts
  * in host byte order.
  */
@@ -615,16 +1059,32 @@ static int add_comments (sbig_ccd_t *ccd, FILE *f)
     return 0;
 }
 
+struct swap_band {
+    const ushort *in;
+    ushort *out;
+    int width;
+};
+
+static void swap_band (int band, int first, int last, void *arg)
+{
+    struct swap_band *sw = arg;
+    size_t i;
+
+    for (i = (size_t)first * sw->width; i < (size_t)last * sw->width; i++)
+        sw->out[i] = htons (sw->in[i]);
+}
+
 int sbig_ccd_writepgm (sbig_ccd_t *ccd, const char *filename)
 {
-    ushort *pp = ccd->frame;
-    ushort *nrow;
-    FILE *f;
-    int i, j;
+    struct swap_band sw = { .in = ccd->frame, .width = ccd->width };
+    size_t len = (size_t)ccd->height * ccd->width;
+    FILE *f = NULL;
 
-    assert (pp != NULL);
+    assert (sw.in != NULL);
 
-    nrow = xzmalloc (sizeof (*nrow) * ccd->width);
+    if (!(sw.out = frame_get (ccd)))
+        return CE_MEMORY_ERROR;
+    rowband_run (ccd->height, swap_band, &sw);
 
     if (!(f = fopen (filename, "w+")))
         goto error;
@@ -632,16 +1092,14 @@ int sbig_ccd_writepgm (sbig_ccd_t *ccd, const char *filename)
         goto error;
     if (add_comments (ccd, f) < 0)
         goto error;
-    for (i = 0; i < ccd->height; i++) {
-        for (j = 0; j < ccd->width; j++)
-            nrow[j] = htons (*pp++);
-        if (fwrite (nrow, sizeof (*nrow), ccd->width, f) < ccd->width)
-            goto error;
-    }
-    if (fclose (f) != 0)
+    if (fwrite (sw.out, sizeof (*sw.out), len, f) < len)
         goto error;
+    frame_put (ccd, sw.out);
+    if (fclose (f) != 0)
+        return CE_OS_ERROR;
     return CE_NO_ERROR;
 error:
+    frame_put (ccd, sw.out);
     if (f)
         fclose (f);
     return CE_OS_ERROR;
@@ -654,61 +1112,131 @@ ushort *sbig_ccd_get_data (sbig_ccd_t *ccd, ushort *height, ushort *width)
     return ccd->frame;
 }
 
+ushort *sbig_ccd_take_data (sbig_ccd_t *ccd, ushort *height, ushort *width)
+{
+    ushort *xframe, *data;
+
+    if (!(xframe = frame_get (ccd)))
+        return NULL;
+    data = ccd->frame;
+    ccd->frame = xframe;
+    ccd->stats_valid = 0;
+    *height = ccd->height;
+    *width = ccd->width;
+    return data;
+}
+
+void sbig_ccd_release_data (sbig_ccd_t *ccd, ushort *data)
+{
+    frame_put (ccd, data);
+}
+
 time_t sbig_ccd_get_start_time (sbig_ccd_t *ccd)
 {
     return ccd->exposureStart;
 }
 
+void sbig_ccd_get_start_timespec (sbig_ccd_t *ccd, struct timespec *ts)
+{
+    *ts = ccd->exposure_utc;
+}
+
 double sbig_ccd_get_exposure_time (sbig_ccd_t *ccd)
 {
     return ccd->exposureTime;
 }
 
-int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *maxp)
+/* Ref: SBIG USB Camera manual rev 14, table 3.2, pp 37
+ *  provides info on ST7, ST8, ST9, ST10, ST2K
+ */
+ushort sbig_ccd_get_datamax (sbig_ccd_t *ccd)
 {
-    int i, j;
-    ushort max = 0;
-    ushort *pp = ccd->frame;
-    for (i = 0; i < ccd->height; i++) {
-        for (j = 0; j < ccd->width; j++)
-            if (*pp > max)
-                max = *pp;
+    switch (ccd->info0.cameraType) {
+        case ST7_CAMERA:
+        case ST8_CAMERA:
+            if (ccd->readout_mode == RM_1X1 && ccd->imaging_abg)
+                return 20000;
+            else if (ccd->readout_mode == RM_1X1 && !ccd->imaging_abg)
+                return 40000;
+            else
+                return 65000;
+        case ST10_CAMERA:
+            if (ccd->readout_mode == RM_1X1)
+                return 50000;
+            else
+                return 65000;
+        case ST9_CAMERA:
+        case ST2K_CAMERA:
+        default:
+            return 65000;
     }
-    *maxp = max;
+}
+
+/* Statistics of the internal buffer are computed on first use after
+ * a readout, then cached until the buffer changes.
+ */
+static struct stats *get_stats (sbig_ccd_t *ccd)
+{
+    if (!ccd->stats_valid) {
+        stats_compute (&ccd->stats, ccd->frame, ccd->height, ccd->width,
+                       sbig_ccd_get_datamax (ccd));
+        ccd->stats_valid = 1;
+    }
+    return &ccd->stats;
+}
+
+int sbig_ccd_get_stats (sbig_ccd_t *ccd, struct sbig_ccd_stats *sp)
+{
+    struct stats *st = get_stats (ccd);
+
+    sp->min = st->min;
+    sp->max = st->max;
+    sp->mean = st->mean;
+    sp->stddev = st->stddev;
+    sp->saturated = st->saturated;
+    sp->datamax = sbig_ccd_get_datamax (ccd);
+    return CE_NO_ERROR;
+}
+
+int sbig_ccd_get_percentile (sbig_ccd_t *ccd, double p, ushort *val)
+{
+    if (p < 0 || p > 100)
+        return CE_BAD_PARAMETER;
+    *val = stats_percentile (get_stats (ccd), p);
+    return CE_NO_ERROR;
+}
+
+const ulong *sbig_ccd_get_histogram (sbig_ccd_t *ccd, int *nbins)
+{
+    struct stats *st = get_stats (ccd);
+
+    *nbins = st->nbins;
+    return st->hist;
+}
+
+int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *maxp)
+{
+    *maxp = get_stats (ccd)->max;
     return CE_NO_ERROR;
 }
 
 /* Borrowed from CSBIGImg::AutoBackgroundAndRange() (sdk/app).
+ * The original uses a 4096 bin histogram; bin i of that holds pixel
+ * values 16i through 16i+15, so its 20% and 99% points are those of the
+ * full histogram shifted right by 4.
  */
-int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite)
+static void contrast_from_stats (const struct stats *st,
+                                 long *cblack, long *cwhite)
 {
-    ushort *pp = ccd->frame;
-    ulong hist[4096];
-    int i, j;
-    ulong totalPixels, histSum;
     ulong s20, s99;
     ushort p20, p99;
     long back, range;
 
-    // calculate the pixel histogram with 4096 bins
-    memset(hist, 0, sizeof(hist));
-    for (i = 0; i < ccd->height; i++)
-            for (j = 0; j < ccd->width; j++)
-                    hist[(*pp++) >> 4]++;
-
-    // integrate the histogram and find the 20% and 99% points
-    totalPixels = (unsigned long)ccd->width * ccd->height;
-    s20 = (20 * totalPixels) / 100;
-    s99 = (99 * totalPixels) / 100;
-    histSum = 0;
-    p20 = p99 = 65535;
-    for (i = 0; i < 4096; i++) {
-            histSum += hist[i];
-            if (histSum >= s20 && p20 == 65535)
-                    p20 = i;
-            if (histSum >= s99 && p99 == 65535)
-                    p99 = i;
-    }
+    // find the 20% and 99% points of the histogram
+    s20 = (20 * st->count) / 100;
+    s99 = (99 * st->count) / 100;
+    p20 = stats_rank (st, s20) >> 4;
+    p99 = stats_rank (st, s99) >> 4;
 
     // set the range to 110% of the difference between
     // the 99% and 20% histogram points, not letting
@@ -729,10 +1257,32 @@ int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite)
 
     *cblack = back;
     *cwhite = back + range;
+}
+
+int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite)
+{
+    contrast_from_stats (get_stats (ccd), cblack, cwhite);
+    return CE_NO_ERROR;
+}
 
+int sbig_ccd_auto_contrast_stats (sbig_ccd_t *ccd, struct stats *st,
+                                  const ushort *data,
+                                  ushort height, ushort width,
+                                  long *cblack, long *cwhite)
+{
+    stats_compute (st, data, height, width, sbig_ccd_get_datamax (ccd));
+    contrast_from_stats (st, cblack, cwhite);
     return CE_NO_ERROR;
 }
 
+int sbig_ccd_auto_contrast_data (sbig_ccd_t *ccd, const ushort *data,
+                                 ushort height, ushort width,
+                                 long *cblack, long *cwhite)
+{
+    return sbig_ccd_auto_contrast_stats (ccd, &ccd->data_stats, data,
+                                         height, width, cblack, cwhite);
+}
+
 int sbig_establish_link (sbig_t *sb, CAMERA_TYPE *type)
 {
     EstablishLinkParams in = { .sbigUseOnly = 0 };
@@ -2,6 +2,7 @@
 #define _SBIG_CAMERA_H
 
 #include <time.h>
+#include <stdbool.h>
 
 #include "handle.h"
 #include "sbigudrv.h"
@@ -24,6 +25,18 @@ const char *sbig_strcam (CAMERA_TYPE type);
 int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp);
 void sbig_ccd_destroy (sbig_ccd_t *ccd);
 
+/* Get the chip the handle was created for.
+ */
+CCD_REQUEST sbig_ccd_get_chip (sbig_ccd_t *ccd);
+
+/* Publish each frame to the shared memory ring 'name' (see ring.h),
+ * whose 'nslots' slots (0 selects a default) then serve as the ccd's
+ * frame buffers, so readout goes directly into shared memory.  Frames
+ * converted in place are published again.  Call before taking data.
+ * Returns CE_SHARE_ERROR if another process is writing the ring.
+ */
+int sbig_ccd_set_ring (sbig_ccd_t *ccd, const char *name, int nslots);
+
 /* Query ccd info
  * info0: all ccds
  * info2: imaging only (non-5C,237)
@@ -69,6 +82,7 @@ int sbig_ccd_get_shutter_mode (sbig_ccd_t *ccd, SHUTTER_COMMAND *modep);
 
 /* Set top most row to readout (0 based), left most pixel (0, based),
  * and image height and width in binned pixels (used on next exposure/readout)
+ * The window must fit within the full frame for the readout mode.
  * Note: reset to full size internally when readout mode is selected.
  * Default: full size for readout mode
  */
@@ -100,12 +114,41 @@ int sbig_ccd_start_exposure (sbig_ccd_t *ccd, ushort flags, double exposureTime)
 int sbig_ccd_get_exposure_status (sbig_ccd_t *ccd, PAR_COMMAND_STATUS *sp);
 int sbig_ccd_end_exposure (sbig_ccd_t *ccd, ushort flags);
 
+/* Get the shortest exposure sbig_ccd_start_exposure() accepts with the
+ * current shutter mode, e.g. for a bias frame.
+ */
+double sbig_ccd_get_min_exposure (sbig_ccd_t *ccd);
+
+/* Wait for the exposure started by sbig_ccd_start_exposure() to complete.
+ * Sleeps until the expected end of the exposure, then polls briefly.
+ * If *cancel becomes true (e.g. set by a signal handler installed
+ * without SA_RESTART), returns CE_EXPOSURE_IN_PROGRESS promptly.
+ */
+int sbig_ccd_wait_exposure (sbig_ccd_t *ccd, const volatile bool *cancel);
+
 /* Readout to internal buffer (start, iterate reading lines, stop).
  * Ref SBIGUDrv sec 3.2.3, 3.2.4, 3.2.5
  */
 int sbig_ccd_readout (sbig_ccd_t *ccd);
 int sbig_ccd_readout_subtract (sbig_ccd_t *ccd);
 
+/* Calibrate frames in software as sbig_ccd_readout() reads them:
+ *     pixel = (pixel - dark) * gain + pedestal
+ * clamped to 0-65535, where 'gain' is the reciprocal of a normalized flat
+ * (see calib.h).  Rows are calibrated on another thread as they arrive,
+ * so this adds little to the readout time.  'dark' and 'gain' must cover
+ * the current window and readout mode, which must not change while they
+ * are set (readout fails with CE_BAD_PARAMETER if it has); either may be
+ * NULL, and both NULL turns calibration off.  With a pedestal of
+ * 100, dark subtraction matches sbig_ccd_readout_subtract().
+ */
+int sbig_ccd_set_calibration (sbig_ccd_t *ccd, const ushort *dark,
+                              const float *gain, ushort pedestal);
+
+/* Get rows per second achieved by the last successful readout (0 if none).
+ */
+double sbig_ccd_get_readout_rate (sbig_ccd_t *ccd);
+
 /* Convert single shot color image.
  * Set 'option' to one of the following (or a substring):
  *   - monochrome - convert to to mono using 3x3 kernel from SBIGUDrv sec 5.2
@@ -116,10 +159,23 @@ int sbig_ccd_color_convert (sbig_ccd_t *ccd, const char *option);
  */
 ushort *sbig_ccd_get_data (sbig_ccd_t *ccd, ushort *height, ushort *width);
 
+/* Take ownership of the internal buffer, leaving a recycled buffer with
+ * undefined contents in its place.  Return it to the ccd with
+ * sbig_ccd_release_data() when finished (before sbig_ccd_destroy()).
+ * Returns NULL if all of the ccd's buffers are in use.
+ */
+ushort *sbig_ccd_take_data (sbig_ccd_t *ccd, ushort *height, ushort *width);
+void sbig_ccd_release_data (sbig_ccd_t *ccd, ushort *data);
+
 /* Get the system time recorded when start_exposure was called.
  */
 time_t sbig_ccd_get_start_time (sbig_ccd_t *ccd);
 
+/* Get the same to the nanosecond (CLOCK_REALTIME), taken just before the
+ * exposure was started.
+ */
+void sbig_ccd_get_start_timespec (sbig_ccd_t *ccd, struct timespec *ts);
+
 /* Get the exposure time in seconds recorded when start_exposure was called.
  */
 double sbig_ccd_get_exposure_time (sbig_ccd_t *ccd);
@@ -129,12 +185,59 @@ double sbig_ccd_get_exposure_time (sbig_ccd_t *ccd);
  */
 int sbig_ccd_writepgm (sbig_ccd_t *ccd, const char *filename);
 
+/* Statistics of the internal buffer.  They are computed in one pass
+ * on first use after a readout and cached until the buffer next changes,
+ * so calling several of these costs a single sweep of the frame.
+ */
+struct sbig_ccd_stats {
+    ushort min;
+    ushort max;
+    double mean;
+    double stddev;
+    ulong saturated;        /* pixels >= datamax */
+    ushort datamax;         /* saturation level */
+};
+int sbig_ccd_get_stats (sbig_ccd_t *ccd, struct sbig_ccd_stats *st);
 int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *max);
 
+/* Get the pixel value below which 'p' percent (0-100) of pixels fall.
+ */
+int sbig_ccd_get_percentile (sbig_ccd_t *ccd, double p, ushort *val);
+
+/* Get the 65536 bin histogram, valid until the buffer next changes.
+ */
+const ulong *sbig_ccd_get_histogram (sbig_ccd_t *ccd, int *nbins);
+
+/* Get the saturation level for the camera model and readout mode.
+ */
+ushort sbig_ccd_get_datamax (sbig_ccd_t *ccd);
+
 /* Calculate CWHITE and CBLACK values from image data.
  */
 int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite);
 
+/* Variants of color_convert and auto_contrast that work on a buffer
+ * obtained with sbig_ccd_take_data() rather than the internal one.
+ * They make no driver calls, so may be used from another thread (one
+ * at a time), and keep their own scratch space so they don't allocate.
+ * Color conversion may be done in place (src == dst).
+ */
+int sbig_ccd_color_convert_data (sbig_ccd_t *ccd, const char *option,
+                                 ushort *src, ushort *dst,
+                                 ushort height, ushort width);
+int sbig_ccd_auto_contrast_data (sbig_ccd_t *ccd, const ushort *data,
+                                 ushort height, ushort width,
+                                 long *cblack, long *cwhite);
+
+/* As sbig_ccd_auto_contrast_data(), but with the caller's scratch 'st'
+ * (see stats_init()), for a thread other than the one using the ccd's.
+ */
+struct stats;
+int sbig_ccd_auto_contrast_stats (sbig_ccd_t *ccd, struct stats *st,
+                                  const ushort *data,
+                                  ushort height, ushort width,
+                                  long *cblack, long *cwhite);
+
 #endif
 
 /*
@@ -0,0 +1,557 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Autoguider on a ccd window, correcting with guide relays or AO tip-tilt.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "handle.h"
+#include "handle_impl.h"
+#include "sbigudrv.h"
+#include "camera.h"
+#include "ao.h"
+#include "guide.h"
+
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/hfd.h"
+#include "src/common/libutil/star.h"
+
+#define ACQUIRE_STARS       16      /* brightest stars considered */
+#define GUIDE_MIN_SNR       6.0     /* fainter and the star is lost */
+#define CAL_MAX_STEPS       16      /* calibration steps per axis */
+#define CAL_MIN_DISTANCE    1.0     /* pixels of calibration travel */
+#define CAL_MAX_MISSES      3       /* frames without the star, per step */
+#define SETTLE_STEP         0.1     /* seconds between checks of *cancel */
+
+struct sbig_guide {
+    sbig_t *sb;
+    sbig_ccd_t *ccd;
+    struct sbig_guide_params p;
+    ushort full_height, full_width;
+    ushort top, left, n;            /* guide window */
+    star_extractor_t *ex;
+    bool locked;
+    double lock_x, lock_y;
+    double x, y;                    /* last position of the star */
+    bool calibrated;
+    struct sbig_guide_cal cal;
+    double inv[2][2];               /* pixels to units of correction */
+    double axis_len[2];             /* pixels per unit along each axis */
+    double prev[2];                 /* last filtered correction */
+    double ao[2];                   /* AO deflection */
+    struct timespec settle;         /* relays open again after this */
+    struct timespec epoch;
+    uint32_t frame;
+};
+
+int sbig_guide_relay (sbig_t *sb, double xplus, double xminus,
+                      double yplus, double yminus)
+{
+    ActivateRelayParams in;
+
+    if (xplus < 0 || xminus < 0 || yplus < 0 || yminus < 0
+                  || xplus > 655.35 || xminus > 655.35
+                  || yplus > 655.35 || yminus > 655.35)
+        return CE_BAD_PARAMETER;
+    in.tXPlus = lround (xplus * 100);
+    in.tXMinus = lround (xminus * 100);
+    in.tYPlus = lround (yplus * 100);
+    in.tYMinus = lround (yminus * 100);
+    return sb->fun (CC_ACTIVATE_RELAY, &in, NULL);
+}
+
+int sbig_guide_relay_active (sbig_t *sb, bool *activep)
+{
+    QueryCommandStatusParams in = { .command = CC_ACTIVATE_RELAY };
+    QueryCommandStatusResults out;
+    int e;
+
+    if ((e = sb->fun (CC_QUERY_COMMAND_STATUS, &in, &out)) != CE_NO_ERROR)
+        return e;
+    *activep = (out.status & 0x0f) != 0;
+    return CE_NO_ERROR;
+}
+
+static double since (const struct timespec *t0)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec) + 1E-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+static void timespec_add (struct timespec *ts, double s)
+{
+    long ns = ts->tv_nsec + (long)((s - floor (s)) * 1E9);
+
+    ts->tv_sec += (time_t)floor (s) + ns / 1000000000L;
+    ts->tv_nsec = ns % 1000000000L;
+}
+
+void sbig_guide_params_init (struct sbig_guide_params *p,
+                             enum sbig_guide_output output)
+{
+    p->output = output;
+    p->exposure = 1.0;
+    p->window = 32;
+    p->aggression = 0.7;
+    p->hysteresis = 0.1;
+    p->min_move = 0.15;
+    p->cal_distance = 5.0;
+    if (output == SBIG_GUIDE_AO) {
+        p->max_correction = 500;
+        p->cal_step = 250;
+    } else {
+        p->max_correction = 1.0;
+        p->cal_step = 0.5;
+    }
+}
+
+int sbig_guide_create (sbig_t *sb, sbig_ccd_t *ccd,
+                       const struct sbig_guide_params *p, sbig_guide_t **gp)
+{
+    sbig_guide_t *g;
+    struct star_params sp = { 0 };
+    ushort top, left;
+    int e;
+
+    if (p->window < 8 || p->window > 2 * HFD_MAX_RADIUS
+                      || p->exposure <= 0 || p->cal_step <= 0
+                      || p->aggression < 0 || p->aggression > 1
+                      || p->hysteresis < 0 || p->hysteresis >= 1)
+        return CE_BAD_PARAMETER;
+    if ((e = sbig_ccd_set_readout_mode (ccd, RM_1X1)) != CE_NO_ERROR)
+        return e;
+    g = xzmalloc (sizeof (*g));
+    g->sb = sb;
+    g->ccd = ccd;
+    g->p = *p;
+    (void)sbig_ccd_get_window (ccd, &top, &left, &g->full_height,
+                               &g->full_width);
+    g->n = p->window;
+    if (g->n > g->full_height)
+        g->n = g->full_height;
+    if (g->n > g->full_width)
+        g->n = g->full_width;
+    sp.datamax = sbig_ccd_get_datamax (ccd);
+    if (!(g->ex = star_extractor_create (g->full_height, g->full_width,
+                                         ACQUIRE_STARS, &sp))) {
+        free (g);
+        return CE_MEMORY_ERROR;
+    }
+    /* The tracking ccd must not operate the shutter, which belongs to
+     * the imaging exposure.
+     */
+    (void)sbig_ccd_set_shutter_mode (ccd, sbig_ccd_get_chip (ccd)
+                                          == CCD_IMAGING ? SC_OPEN_SHUTTER
+                                                         : SC_LEAVE_SHUTTER);
+    g->ao[0] = g->ao[1] = SBIG_AO_CENTER;
+    if (p->output == SBIG_GUIDE_AO) {
+        if ((e = sbig_ao_tip_tilt (sb, SBIG_AO_CENTER, SBIG_AO_CENTER))
+                                                        != CE_NO_ERROR) {
+            sbig_guide_destroy (g);
+            return e;
+        }
+    }
+    clock_gettime (CLOCK_MONOTONIC, &g->settle);
+    clock_gettime (CLOCK_MONOTONIC, &g->epoch);
+    *gp = g;
+    return CE_NO_ERROR;
+}
+
+void sbig_guide_destroy (sbig_guide_t *g)
+{
+    if (g) {
+        star_extractor_destroy (g->ex);
+        free (g);
+    }
+}
+
+/* Wait for the last relay pulse to finish, so the star isn't moving
+ * during the exposure.
+ */
+static int settle (sbig_guide_t *g, const volatile bool *cancel)
+{
+    struct timespec t;
+    double left;
+
+    for (;;) {
+        if (cancel && *cancel)
+            return CE_EXPOSURE_IN_PROGRESS;
+        if ((left = -since (&g->settle)) <= 0)
+            break;
+        if (left > SETTLE_STEP)
+            left = SETTLE_STEP;
+        t.tv_sec = 0;
+        t.tv_nsec = left * 1E9;
+        (void)clock_nanosleep (CLOCK_MONOTONIC, 0, &t, NULL);
+    }
+    return CE_NO_ERROR;
+}
+
+/* Expose and read out the current window.
+ */
+static int expose (sbig_guide_t *g, const volatile bool *cancel,
+                   struct sbig_guide_latency *lat)
+{
+    struct timespec t0;
+    int e;
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if ((e = sbig_ccd_start_exposure (g->ccd, START_SKIP_VDD,
+                                      g->p.exposure)) != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ccd_wait_exposure (g->ccd, cancel)) != CE_NO_ERROR) {
+        (void)sbig_ccd_end_exposure (g->ccd, ABORT_DONT_END);
+        return e;
+    }
+    lat->expose = since (&t0);
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if ((e = sbig_ccd_end_exposure (g->ccd, 0)) != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ccd_readout (g->ccd)) != CE_NO_ERROR)
+        return e;
+    lat->readout = since (&t0);
+    return CE_NO_ERROR;
+}
+
+/* Measure the star near its last position in the window just read out,
+ * updating the last position.  Returns false if it's gone.
+ */
+static bool measure (sbig_guide_t *g, struct hfd_star *s)
+{
+    ushort height, width;
+    ushort *data = sbig_ccd_get_data (g->ccd, &height, &width);
+
+    if (hfd_measure (data, height, width, g->x - g->left, g->y - g->top,
+                     g->n / 2 - 2, s) < 0 || s->snr < GUIDE_MIN_SNR)
+        return false;
+    g->x = g->left + s->x;
+    g->y = g->top + s->y;
+    return true;
+}
+
+/* Center the guide window on (x, y), keeping it on the chip.
+ */
+static int set_window (sbig_guide_t *g, double x, double y)
+{
+    int top = lround (y) - g->n / 2;
+    int left = lround (x) - g->n / 2;
+    ushort h, w;
+    int e;
+
+    top = top < 0 ? 0 : top > g->full_height - g->n
+                           ? g->full_height - g->n : top;
+    left = left < 0 ? 0 : left > g->full_width - g->n
+                             ? g->full_width - g->n : left;
+    if ((e = sbig_ccd_set_window (g->ccd, top, left, g->n, g->n))
+                                                    != CE_NO_ERROR)
+        return e;
+    return sbig_ccd_get_window (g->ccd, &g->top, &g->left, &h, &w);
+}
+
+int sbig_guide_acquire (sbig_guide_t *g, const volatile bool *cancel,
+                        bool *foundp)
+{
+    struct sbig_guide_latency lat;
+    const struct star_catalog *cat;
+    ushort height, width;
+    ushort *data;
+    int i, e;
+
+    g->locked = false;
+    if ((e = sbig_ccd_set_readout_mode (g->ccd, RM_1X1)) != CE_NO_ERROR)
+        return e;
+    g->top = g->left = 0;
+    if ((e = settle (g, cancel)) != CE_NO_ERROR)
+        return e;
+    if ((e = expose (g, cancel, &lat)) != CE_NO_ERROR)
+        return e;
+    data = sbig_ccd_get_data (g->ccd, &height, &width);
+    if (!(cat = star_extract (g->ex, data, height, width)))
+        return CE_BAD_PARAMETER;
+    for (i = 0; i < cat->count; i++) {
+        if (!(cat->flags[i] & (STAR_SATURATED | STAR_EDGE))
+                                && cat->elongation[i] < 1.5)
+            break;
+    }
+    if (i == cat->count) {
+        *foundp = false;
+        return CE_NO_ERROR;
+    }
+    g->x = g->lock_x = cat->x[i];
+    g->y = g->lock_y = cat->y[i];
+    if ((e = set_window (g, g->x, g->y)) != CE_NO_ERROR)
+        return e;
+    g->prev[0] = g->prev[1] = 0;
+    g->locked = true;
+    *foundp = true;
+    return CE_NO_ERROR;
+}
+
+void sbig_guide_get_lock (sbig_guide_t *g, double *xp, double *yp)
+{
+    *xp = g->lock_x;
+    *yp = g->lock_y;
+}
+
+/* Move the mount or AO by u[0] units in X and u[1] in Y.
+ */
+static int correct (sbig_guide_t *g, const double u[2])
+{
+    double t;
+    int i, e;
+
+    if (g->p.output == SBIG_GUIDE_AO) {
+        for (i = 0; i < 2; i++) {
+            g->ao[i] += u[i];
+            if (g->ao[i] < 0)
+                g->ao[i] = 0;
+            if (g->ao[i] > SBIG_AO_MAX)
+                g->ao[i] = SBIG_AO_MAX;
+        }
+        return sbig_ao_tip_tilt (g->sb, lround (g->ao[0]), lround (g->ao[1]));
+    }
+    if (u[0] == 0 && u[1] == 0)
+        return CE_NO_ERROR;
+    if ((e = sbig_guide_relay (g->sb, u[0] > 0 ? u[0] : 0,
+                                      u[0] < 0 ? -u[0] : 0,
+                                      u[1] > 0 ? u[1] : 0,
+                                      u[1] < 0 ? -u[1] : 0)) != CE_NO_ERROR)
+        return e;
+    t = fabs (u[0]) > fabs (u[1]) ? fabs (u[0]) : fabs (u[1]);
+    clock_gettime (CLOCK_MONOTONIC, &g->settle);
+    timespec_add (&g->settle, t);
+    return CE_NO_ERROR;
+}
+
+/* Expose and find the star, after the last correction has finished,
+ * allowing for a few poor frames.
+ */
+static int observe (sbig_guide_t *g, const volatile bool *cancel,
+                    struct hfd_star *s, bool *foundp)
+{
+    struct sbig_guide_latency lat;
+    int i, e;
+
+    *foundp = false;
+    for (i = 0; i < CAL_MAX_MISSES && !*foundp; i++) {
+        if ((e = settle (g, cancel)) != CE_NO_ERROR)
+            return e;
+        if ((e = expose (g, cancel, &lat)) != CE_NO_ERROR)
+            return e;
+        *foundp = measure (g, s);
+    }
+    return CE_NO_ERROR;
+}
+
+/* Step the star along 'axis' until it has moved cal_distance pixels (or,
+ * for AO, until the end of travel), then step it back.  Sets v to the
+ * motion in pixels per unit of correction.
+ */
+static int cal_axis (sbig_guide_t *g, const volatile bool *cancel, int axis,
+                     double v[2], bool *okp)
+{
+    struct hfd_star s;
+    double x0, y0, d = 0, total = 0;
+    double u[2] = { 0, 0 };
+    bool found;
+    int i, e;
+
+    if ((e = observe (g, cancel, &s, &found)) != CE_NO_ERROR)
+        return e;
+    if (!found)
+        goto lost;
+    x0 = g->x;
+    y0 = g->y;
+    for (i = 0; i < CAL_MAX_STEPS && d < g->p.cal_distance; i++) {
+        if (g->p.output == SBIG_GUIDE_AO
+                    && g->ao[axis] + g->p.cal_step > SBIG_AO_MAX)
+            break;
+        u[axis] = g->p.cal_step;
+        if ((e = correct (g, u)) != CE_NO_ERROR)
+            return e;
+        total += g->p.cal_step;
+        if ((e = observe (g, cancel, &s, &found)) != CE_NO_ERROR)
+            return e;
+        if (!found)
+            goto lost;
+        if ((e = set_window (g, g->x, g->y)) != CE_NO_ERROR)
+            return e;
+        d = hypot (g->x - x0, g->y - y0);
+    }
+    u[axis] = -total;
+    if ((e = correct (g, u)) != CE_NO_ERROR)
+        return e;
+    if (d < CAL_MIN_DISTANCE) {
+        *okp = false;
+        return CE_NO_ERROR;
+    }
+    v[0] = (g->x - x0) / total;
+    v[1] = (g->y - y0) / total;
+    *okp = true;
+    return CE_NO_ERROR;
+lost:
+    u[axis] = -total;
+    *okp = false;
+    return total > 0 ? correct (g, u) : CE_NO_ERROR;
+}
+
+int sbig_guide_calibrate (sbig_guide_t *g, const volatile bool *cancel,
+                          bool *okp)
+{
+    struct sbig_guide_cal cal;
+    double v[2] = { 0, 0 };
+    struct hfd_star s;
+    int i, e;
+
+    if (!g->locked)
+        return CE_BAD_PARAMETER;
+    for (i = 0; i < 2; i++) {
+        if ((e = cal_axis (g, cancel, i, v, okp)) != CE_NO_ERROR || !*okp)
+            return e;
+        cal.m[0][i] = v[0];
+        cal.m[1][i] = v[1];
+    }
+    if (sbig_guide_set_cal (g, &cal) != CE_NO_ERROR) {
+        *okp = false;
+        return CE_NO_ERROR;
+    }
+
+    /* Lock on the star where it ends up, which may not be quite where
+     * it started.
+     */
+    if ((e = observe (g, cancel, &s, okp)) != CE_NO_ERROR || !*okp)
+        return e;
+    g->lock_x = g->x;
+    g->lock_y = g->y;
+    return set_window (g, g->x, g->y);
+}
+
+void sbig_guide_get_cal (sbig_guide_t *g, struct sbig_guide_cal *cal)
+{
+    *cal = g->cal;
+}
+
+int sbig_guide_set_cal (sbig_guide_t *g, const struct sbig_guide_cal *cal)
+{
+    const double (*m)[2] = cal->m;
+    double det = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+    double lx = hypot (m[0][0], m[1][0]);
+    double ly = hypot (m[0][1], m[1][1]);
+
+    /* Refuse axes within about 10 degrees of parallel.
+     */
+    if (lx == 0 || ly == 0 || fabs (det) < 0.17 * lx * ly)
+        return CE_BAD_PARAMETER;
+    g->cal = *cal;
+    g->inv[0][0] = m[1][1] / det;
+    g->inv[0][1] = -m[0][1] / det;
+    g->inv[1][0] = -m[1][0] / det;
+    g->inv[1][1] = m[0][0] / det;
+    g->axis_len[0] = lx;
+    g->axis_len[1] = ly;
+    g->prev[0] = g->prev[1] = 0;
+    g->calibrated = true;
+    return CE_NO_ERROR;
+}
+
+/* Apply the control law to the error (dx, dy), giving the correction.
+ */
+static void control (sbig_guide_t *g, double dx, double dy, double u[2])
+{
+    const struct sbig_guide_params *p = &g->p;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        double want = -(g->inv[i][0] * dx + g->inv[i][1] * dy);
+        double f = (1 - p->hysteresis) * want + p->hysteresis * g->prev[i];
+
+        g->prev[i] = f;
+        if (fabs (want) * g->axis_len[i] < p->min_move) {
+            u[i] = 0;
+            continue;
+        }
+        u[i] = p->aggression * f;
+        if (u[i] > p->max_correction)
+            u[i] = p->max_correction;
+        if (u[i] < -p->max_correction)
+            u[i] = -p->max_correction;
+    }
+}
+
+int sbig_guide_cycle (sbig_guide_t *g, const volatile bool *cancel,
+                      struct sbig_guide_cycle *c)
+{
+    struct sbig_guide_latency *lat = &c->latency;
+    struct timespec t0, t;
+    struct hfd_star s;
+    double u[2];
+    int e;
+
+    memset (c, 0, sizeof (*c));
+    if (!g->locked || !g->calibrated)
+        return CE_BAD_PARAMETER;
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if ((e = settle (g, cancel)) != CE_NO_ERROR)
+        return e;
+    lat->settle = since (&t0);
+    if ((e = expose (g, cancel, lat)) != CE_NO_ERROR)
+        return e;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    c->frame = ++g->frame;
+    c->t = since (&g->epoch);
+    c->lost = !measure (g, &s);
+    lat->centroid = since (&t);
+    if (c->lost) {
+        g->x = g->lock_x;
+        g->y = g->lock_y;
+        lat->total = since (&t0);
+        return CE_NO_ERROR;
+    }
+    c->x = g->x;
+    c->y = g->y;
+    c->dx = g->x - g->lock_x;
+    c->dy = g->y - g->lock_y;
+    c->snr = s.snr;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    control (g, c->dx, c->dy, u);
+    if ((e = correct (g, u)) != CE_NO_ERROR)
+        return e;
+    c->xcorr = u[0];
+    c->ycorr = u[1];
+    lat->correct = since (&t);
+    lat->total = since (&t0);
+    return CE_NO_ERROR;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,118 @@
+#ifndef _SBIG_GUIDE_H
+#define _SBIG_GUIDE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "handle.h"
+#include "camera.h"
+#include "sbigudrv.h"
+
+/* Pulse the mount's guide relays for the given times in seconds (0.01s
+ * resolution).  The pulses run in the background; a new command replaces
+ * any still in progress.  'activep' is set true while any relay is closed.
+ */
+int sbig_guide_relay (sbig_t *sb, double xplus, double xminus,
+                      double yplus, double yminus);
+int sbig_guide_relay_active (sbig_t *sb, bool *activep);
+
+/* Autoguider: repeatedly expose a small window of 'ccd' around a guide
+ * star, measure the star's offset from its lock position, and correct it
+ * with the mount's guide relays or an AO tip-tilt element.
+ *
+ * On a dual ccd camera, guide with the tracking ccd while the imaging ccd
+ * exposes; the guider leaves the shutter alone (SC_LEAVE_SHUTTER) unless
+ * it is guiding on the imaging ccd.  Positions are in unbinned pixels from
+ * the top left of the full frame.
+ */
+typedef struct sbig_guide sbig_guide_t;
+
+enum sbig_guide_output {
+    SBIG_GUIDE_RELAY,           /* corrections in seconds of relay pulse */
+    SBIG_GUIDE_AO,              /* corrections in AO deflection units */
+};
+
+/* The control law, per mount axis: the correction that would cancel the
+ * error is averaged with the previous one, weighted by 'hysteresis', then
+ * scaled by 'aggression'.  Errors along the axis under 'min_move' pixels
+ * are left alone, and corrections are clipped to 'max_correction'.
+ */
+struct sbig_guide_params {
+    enum sbig_guide_output output;
+    double exposure;            /* seconds */
+    int window;                 /* guide window size, pixels */
+    double aggression;          /* 0-1 */
+    double hysteresis;          /* 0-1 */
+    double min_move;            /* pixels */
+    double max_correction;      /* seconds of pulse, or AO units */
+    double cal_step;            /* seconds of pulse, or AO units */
+    double cal_distance;        /* calibration travel per axis, pixels */
+};
+
+/* Star motion per unit of correction: column 0 for the X axis, column 1
+ * for the Y axis, as measured by sbig_guide_calibrate().
+ */
+struct sbig_guide_cal {
+    double m[2][2];             /* m[0][i] = dx, m[1][i] = dy */
+};
+
+/* Latency of each step of a guide cycle, in seconds.
+ */
+struct sbig_guide_latency {
+    double settle;              /* waiting for the last pulse to finish */
+    double expose;              /* start of exposure to exposure complete */
+    double readout;
+    double centroid;
+    double correct;             /* issuing the correction */
+    double total;
+};
+
+struct sbig_guide_cycle {
+    uint32_t frame;
+    double t;                   /* seconds since the guider was created */
+    bool lost;                  /* no star in the window; no correction */
+    double x, y;                /* star position */
+    double dx, dy;              /* error from the lock position */
+    double snr;
+    double xcorr, ycorr;        /* correction issued, signed */
+    struct sbig_guide_latency latency;
+};
+
+/* Fill in default parameters for 'output'.
+ */
+void sbig_guide_params_init (struct sbig_guide_params *p,
+                             enum sbig_guide_output output);
+
+int sbig_guide_create (sbig_t *sb, sbig_ccd_t *ccd,
+                       const struct sbig_guide_params *p, sbig_guide_t **gp);
+void sbig_guide_destroy (sbig_guide_t *g);
+
+/* Take a full frame exposure and lock on the brightest unsaturated star
+ * clear of the edges.  'foundp' is set false if there is none.
+ * Like sbig_ccd_wait_exposure(), functions that expose return
+ * CE_EXPOSURE_IN_PROGRESS if *cancel becomes true.
+ */
+int sbig_guide_acquire (sbig_guide_t *g, const volatile bool *cancel,
+                        bool *foundp);
+void sbig_guide_get_lock (sbig_guide_t *g, double *xp, double *yp);
+
+/* Step the guide star along each axis in turn until it has moved
+ * 'cal_distance' pixels, then return it.  'okp' is set false if the star
+ * was lost, barely moved, or moved the same way for both axes.
+ */
+int sbig_guide_calibrate (sbig_guide_t *g, const volatile bool *cancel,
+                          bool *okp);
+void sbig_guide_get_cal (sbig_guide_t *g, struct sbig_guide_cal *cal);
+int sbig_guide_set_cal (sbig_guide_t *g, const struct sbig_guide_cal *cal);
+
+/* Expose, measure, and correct once.  Requires a lock and a calibration
+ * (else CE_BAD_PARAMETER).
+ */
+int sbig_guide_cycle (sbig_guide_t *g, const volatile bool *cancel,
+                      struct sbig_guide_cycle *c);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
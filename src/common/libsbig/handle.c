@@ -34,6 +34,8 @@
 #include "handle.h"
 #include "handle_impl.h"
 #include "sbigudrv.h"
+#include "trace.h"
+#include "remote.h"
 
 sbig_t *sbig_new (void)
 {
@@ -48,23 +50,38 @@ sbig_t *sbig_new (void)
 
 int sbig_dlopen (sbig_t *sb, const char *path)
 {
-    if (!path)
-        path = "libsbig.so";
-    dlerror ();
-    if (!(sb->dso = dlopen (path, RTLD_LAZY | RTLD_LOCAL)))
-        return CE_OS_ERROR;
-    if (!(sb->fun = dlsym (sb->dso, "SBIGUnivDrvCommand")))
-        return CE_OS_ERROR;
+    if (getenv ("SBIG_NO_DAEMON")
+            || sbig_remote_connect (sb, sbig_remote_path ()) != CE_NO_ERROR) {
+        if (!path)
+            path = "libsbig.so";
+        dlerror ();
+        if (!(sb->dso = dlopen (path, RTLD_LAZY | RTLD_LOCAL)))
+            return CE_OS_ERROR;
+        if (!(sb->fun = dlsym (sb->dso, "SBIGUnivDrvCommand")))
+            return CE_OS_ERROR;
+    }
+    if (getenv ("SBIG_TRACE") || getenv ("SBIG_TRACE_FILE"))
+        return sbig_trace_enable (sb, getenv ("SBIG_TRACE_FILE"));
     return CE_NO_ERROR;
 }
 
 void sbig_destroy (sbig_t *sb)
 {
+    if (sb->trace) {
+        sbig_trace_summary (sb, stderr);
+        sbig_trace_disable (sb);
+    }
+    sbig_remote_disconnect (sb);
     if (sb->dso)
         dlclose (sb->dso);
     free (sb);
 }
 
+int sbig_command (sbig_t *sb, short cmd, void *parm, void *result)
+{
+    return sb->fun (cmd, parm, result);
+}
+
 const char *sbig_get_error_string (sbig_t *sb, unsigned short errorNo)
 {
     GetErrorStringParams in = { .errorNo = errorNo };
@@ -6,6 +6,8 @@
  *
  * Note that if the 'path' argument to sbig_dlopen() may be NULL to indicate
  * that the system dynamic library search path should be used (see dlopen(2)).
+ * If sbig-daemon is running, sbig_dlopen() connects to it instead and 'path'
+ * is unused (see remote.h).
  */
 
 typedef struct sbig sbig_t;
@@ -14,6 +16,11 @@ sbig_t *sbig_new (void);
 int sbig_dlopen (sbig_t *sb, const char *path);
 void sbig_destroy (sbig_t *sb);
 
+/* Issue a raw driver command (PAR_COMMAND) with its parameter and results
+ * structs, as the wrappers in this library do.
+ */
+int sbig_command (sbig_t *sb, short cmd, void *parm, void *result);
+
 const char *sbig_get_error_string (sbig_t *sb, unsigned short errorNo);
 #endif
 
@@ -4,6 +4,8 @@
 struct sbig {
     void *dso;
     short (*fun)(short cmd, void *parm, void *result);
+    struct sbig_trace *trace;
+    struct sbig_remote *remote;
 };
 
 #endif
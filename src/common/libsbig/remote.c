@@ -0,0 +1,383 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Driver calls forwarded over a Unix domain socket to sbig-daemon.
+ *
+ * When connected, sb->fun is replaced by remote_fun(), which sends the
+ * command and its parameter struct and waits for the error code and the
+ * results struct.  Struct sizes follow from the command (and for a few
+ * commands, the request field of the parameters), so each side can check
+ * what the other sends.  A reply carries no results only if the request
+ * was rejected before reaching the driver.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handle.h"
+#include "handle_impl.h"
+#include "sbigudrv.h"
+#include "remote.h"
+
+#define MAX_PARM_LEN    256
+
+struct sbig_remote {
+    int fd;
+    pthread_mutex_t lock;   /* one call in flight */
+};
+
+static struct sbig_remote *active = NULL;
+
+/* Determine parameter and result struct sizes for 'cmd'.
+ * Returns -1 if the command is not forwarded.
+ */
+static int call_size (short cmd, const void *parm, size_t *plen, size_t *rlen)
+{
+    *plen = *rlen = 0;
+    switch (cmd) {
+        case CC_OPEN_DRIVER:
+        case CC_CLOSE_DRIVER:
+        case CC_CLOSE_DEVICE:
+        case CC_AO_CENTER:
+            break;
+        case CC_OPEN_DEVICE:
+            *plen = sizeof (OpenDeviceParams);
+            break;
+        case CC_ESTABLISH_LINK:
+            *plen = sizeof (EstablishLinkParams);
+            *rlen = sizeof (EstablishLinkResults);
+            break;
+        case CC_GET_DRIVER_INFO: {
+            const GetDriverInfoParams *p = parm;
+            if (!p || (p->request != DRIVER_STD
+                                    && p->request != DRIVER_USB_LOADER))
+                return -1;
+            *plen = sizeof (*p);
+            *rlen = sizeof (GetDriverInfoResults0);
+            break;
+        }
+        case CC_GET_CCD_INFO: {
+            const GetCCDInfoParams *p = parm;
+            if (!p)
+                return -1;
+            *plen = sizeof (*p);
+            switch (p->request) {
+                case CCD_INFO_IMAGING:
+                case CCD_INFO_TRACKING:
+                    *rlen = sizeof (GetCCDInfoResults0);
+                    break;
+                case CCD_INFO_EXTENDED:
+                    *rlen = sizeof (GetCCDInfoResults2);
+                    break;
+                case CCD_INFO_EXTENDED_5C:
+                    *rlen = sizeof (GetCCDInfoResults3);
+                    break;
+                case CCD_INFO_EXTENDED2_IMAGING:
+                case CCD_INFO_EXTENDED2_TRACKING:
+                    *rlen = sizeof (GetCCDInfoResults4);
+                    break;
+                case CCD_INFO_EXTENDED3:
+                    *rlen = sizeof (GetCCDInfoResults6);
+                    break;
+                default:
+                    return -1;
+            }
+            break;
+        }
+        case CC_QUERY_COMMAND_STATUS:
+            *plen = sizeof (QueryCommandStatusParams);
+            *rlen = sizeof (QueryCommandStatusResults);
+            break;
+        case CC_GET_ERROR_STRING:
+            *plen = sizeof (GetErrorStringParams);
+            *rlen = sizeof (GetErrorStringResults);
+            break;
+        case CC_QUERY_USB:
+            *rlen = sizeof (QueryUSBResults);
+            break;
+        case CC_QUERY_ETHERNET:
+            *rlen = sizeof (QueryEthernetResults);
+            break;
+        case CC_START_EXPOSURE2:
+            *plen = sizeof (StartExposureParams2);
+            break;
+        case CC_END_EXPOSURE:
+            *plen = sizeof (EndExposureParams);
+            break;
+        case CC_START_READOUT:
+            *plen = sizeof (StartReadoutParams);
+            break;
+        case CC_READOUT_LINE:
+        case CC_READ_SUBTRACT_LINE: {
+            const ReadoutLineParams *p = parm;
+            if (!p)
+                return -1;
+            *plen = sizeof (*p);
+            *rlen = p->pixelLength * sizeof (unsigned short);
+            break;
+        }
+        case CC_DUMP_LINES:
+            *plen = sizeof (DumpLinesParams);
+            break;
+        case CC_END_READOUT:
+            *plen = sizeof (EndReadoutParams);
+            break;
+        case CC_SET_TEMPERATURE_REGULATION2:
+            *plen = sizeof (SetTemperatureRegulationParams2);
+            break;
+        case CC_QUERY_TEMPERATURE_STATUS: {
+            const QueryTemperatureStatusParams *p = parm;
+            if (!p)
+                return -1;
+            *plen = sizeof (*p);
+            if (p->request == TEMP_STATUS_STANDARD)
+                *rlen = sizeof (QueryTemperatureStatusResults);
+            else
+                *rlen = sizeof (QueryTemperatureStatusResults2);
+            break;
+        }
+        case CC_ACTIVATE_RELAY:
+            *plen = sizeof (ActivateRelayParams);
+            break;
+        case CC_AO_TIP_TILT:
+            *plen = sizeof (AOTipTiltParams);
+            break;
+        case CC_AO_SET_FOCUS:
+            *plen = sizeof (AOSetFocusParams);
+            break;
+        case CC_AO_DELAY:
+            *plen = sizeof (AODelayParams);
+            break;
+        case CC_CFW: {
+            const CFWParams *p = parm;
+            if (!p || p->outLength > 0 || p->inLength > 0)
+                return -1;
+            *plen = sizeof (*p);
+            *rlen = sizeof (CFWResults);
+            break;
+        }
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+static int read_all (int fd, void *buf, size_t len)
+{
+    size_t count = 0;
+    ssize_t n;
+
+    while (count < len) {
+        if ((n = read (fd, (char *)buf + count, len - count)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = count > 0 ? EPROTO : 0;
+            return -1;
+        }
+        count += n;
+    }
+    return 0;
+}
+
+/* N.B. send (MSG_NOSIGNAL) so a peer that went away is EPIPE, not SIGPIPE.
+ */
+static int write_all (int fd, const void *buf, size_t len)
+{
+    size_t count = 0;
+    ssize_t n;
+
+    while (count < len) {
+        n = send (fd, (const char *)buf + count, len - count, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        count += n;
+    }
+    return 0;
+}
+
+static int send_msg (int fd, int code, const void *parm, size_t plen,
+                     size_t rlen)
+{
+    char buf[sizeof (struct sbig_remote_hdr) + MAX_PARM_LEN];
+    struct sbig_remote_hdr hdr = { .code = code, .parm_len = plen,
+                                   .result_len = rlen };
+
+    memcpy (buf, &hdr, sizeof (hdr));
+    if (plen > 0)
+        memcpy (buf + sizeof (hdr), parm, plen);
+    return write_all (fd, buf, sizeof (hdr) + plen);
+}
+
+static short remote_fun (short cmd, void *parm, void *result)
+{
+    struct sbig_remote *rm = active;
+    struct sbig_remote_hdr hdr;
+    size_t plen, rlen;
+    short e = CE_SOCK_ERROR;
+
+    if (call_size (cmd, parm, &plen, &rlen) < 0 || plen > MAX_PARM_LEN
+                                                || (rlen > 0 && !result))
+        return CE_BAD_PARAMETER;
+    pthread_mutex_lock (&rm->lock);
+    if (rm->fd < 0)
+        goto done;
+    if (send_msg (rm->fd, cmd, parm, plen, rlen) < 0
+                        || read_all (rm->fd, &hdr, sizeof (hdr)) < 0
+                        || (hdr.result_len != rlen && hdr.result_len != 0)
+                        || (hdr.result_len > 0
+                            && read_all (rm->fd, result, rlen) < 0)) {
+        close (rm->fd);
+        rm->fd = -1;
+        goto done;
+    }
+    e = hdr.code;
+done:
+    pthread_mutex_unlock (&rm->lock);
+    return e;
+}
+
+const char *sbig_remote_path (void)
+{
+    static char path[sizeof (((struct sockaddr_un *)0)->sun_path)];
+    const char *s;
+
+    if ((s = getenv ("SBIG_SOCKET")))
+        return s;
+    if ((s = getenv ("XDG_RUNTIME_DIR")))
+        snprintf (path, sizeof (path), "%s/sbig.sock", s);
+    else
+        snprintf (path, sizeof (path), "/tmp/sbig-%d.sock", (int)getuid ());
+    return path;
+}
+
+int sbig_remote_connect (sbig_t *sb, const char *path)
+{
+    struct sockaddr_un addr;
+    struct sbig_remote *rm;
+    int fd;
+
+    if (sb->fun || sb->remote || active)
+        return CE_BAD_PARAMETER;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (addr.sun_path))
+        return CE_BAD_PARAMETER;
+    strcpy (addr.sun_path, path);
+    if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return CE_OS_ERROR;
+    if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+        close (fd);
+        return CE_SERVER_NOT_FOUND;
+    }
+    if (!(rm = calloc (1, sizeof (*rm)))) {
+        close (fd);
+        return CE_MEMORY_ERROR;
+    }
+    rm->fd = fd;
+    pthread_mutex_init (&rm->lock, NULL);
+    sb->remote = rm;
+    sb->fun = remote_fun;
+    active = rm;
+    return CE_NO_ERROR;
+}
+
+void sbig_remote_disconnect (sbig_t *sb)
+{
+    struct sbig_remote *rm = sb->remote;
+
+    if (!rm)
+        return;
+    if (sb->fun == remote_fun)
+        sb->fun = NULL;
+    sb->remote = NULL;
+    if (rm->fd >= 0)
+        close (rm->fd);
+    pthread_mutex_destroy (&rm->lock);
+    if (active == rm)
+        active = NULL;
+    free (rm);
+}
+
+int sbig_remote_serve (int fd, sbig_remote_f fun, void *arg)
+{
+    struct sbig_remote_hdr hdr;
+    uint64_t parm[MAX_PARM_LEN / sizeof (uint64_t)];
+    void *result = NULL;
+    size_t plen, rlen;
+    int e;
+
+    if (read_all (fd, &hdr, sizeof (hdr)) < 0)
+        return -1;
+    if (hdr.parm_len > MAX_PARM_LEN) {
+        errno = EPROTO;
+        return -1;
+    }
+    memset (parm, 0, sizeof (parm));
+    if (read_all (fd, parm, hdr.parm_len) < 0)
+        return -1;
+    if (call_size (hdr.code, parm, &plen, &rlen) < 0
+                    || plen != hdr.parm_len || rlen != hdr.result_len) {
+        e = CE_BAD_PARAMETER;
+        goto reply;
+    }
+    if (rlen > 0 && !(result = calloc (1, rlen))) {
+        e = CE_MEMORY_ERROR;
+        goto reply;
+    }
+    if (hdr.code == CC_CFW) {
+        CFWParams *p = (CFWParams *)parm;
+        p->outPtr = p->inPtr = NULL;
+    }
+    e = fun (hdr.code, plen > 0 ? parm : NULL, result, arg);
+reply:
+    if (!result)
+        rlen = 0;
+    if (send_msg (fd, e, NULL, 0, rlen) < 0
+                    || (rlen > 0 && write_all (fd, result, rlen) < 0)) {
+        free (result);
+        return -1;
+    }
+    free (result);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,50 @@
+#ifndef _SBIG_REMOTE_H
+#define _SBIG_REMOTE_H
+
+#include <stdint.h>
+
+#include "handle.h"
+
+/* Forward driver calls to sbig-daemon over a Unix domain socket, so the
+ * driver, device, and link stay open across commands.
+ *
+ * Each call is sent as a struct sbig_remote_hdr (code = PAR_COMMAND)
+ * followed by the parameter struct, and answered with a header
+ * (code = PAR_ERROR) followed by the results struct, in host byte order.
+ * Only the commands libsbig issues are forwarded; others fail with
+ * CE_BAD_PARAMETER.  CFW commands that pass data through outPtr/inPtr
+ * are not supported.
+ *
+ * sbig_dlopen() connects to the daemon unless SBIG_NO_DAEMON is set in
+ * the environment, falling back to loading the driver if that fails.
+ * The driver entry point carries no context pointer, so only one handle
+ * per process may be connected.
+ */
+
+struct sbig_remote_hdr {
+    int32_t code;
+    uint32_t parm_len;
+    uint32_t result_len;
+};
+
+/* Socket path: SBIG_SOCKET if set, else $XDG_RUNTIME_DIR/sbig.sock,
+ * else /tmp/sbig-UID.sock.
+ */
+const char *sbig_remote_path (void);
+
+int sbig_remote_connect (sbig_t *sb, const char *path);
+void sbig_remote_disconnect (sbig_t *sb);
+
+/* Daemon side: read one request from 'fd', call fun (cmd, parm, result,
+ * arg), and send the reply.  Returns 0 on success, or -1 on EOF (errno = 0)
+ * or error.
+ */
+typedef int (*sbig_remote_f)(short cmd, void *parm, void *result, void *arg);
+
+int sbig_remote_serve (int fd, sbig_remote_f fun, void *arg);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,457 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Shared memory frame ring.
+ *
+ * Layout: a header with one descriptor per slot, padded to a page, then
+ * the slots' pixel data, each padded to a page.  Slot descriptors form a
+ * seqlock: the writer zeroes a slot's seq before touching the slot and
+ * stores the new seq after, and readers check seq before and after.
+ * Readers re-read the geometry from the header on each call, so a writer
+ * may reuse the object with a different layout as long as it doesn't
+ * shrink it.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+#define MAX_SLOTS   64
+
+struct ring_slot {
+    uint32_t seq;               /* 0 while being written */
+    uint32_t flags;
+    uint16_t ccd;
+    uint16_t readout_mode;
+    uint16_t shutter_mode;
+    uint16_t top, left;
+    uint16_t height, width;
+    uint16_t pad;
+    double exposure_time;
+    double readout_time;
+    int64_t start;
+    int64_t published_sec;
+    int64_t published_nsec;
+    uint64_t offset;            /* of pixel data from start of object */
+};
+
+struct ring_hdr {
+    char magic[8];
+    uint32_t nslots;
+    uint32_t seq;               /* last published, futex word */
+    uint64_t slot_pixels;
+    int32_t pid;                /* writer, or 0 */
+    uint32_t pad;
+    struct ring_slot slot[];
+};
+
+struct sbig_ring {
+    int fd;
+    size_t size;
+    struct ring_hdr *hdr;
+    pthread_mutex_t lock;       /* writer: held/touched and publish */
+    bool held[MAX_SLOTS];
+    bool touched[MAX_SLOTS];
+    int nslots;
+    size_t slot_bytes;
+};
+
+static size_t page_round (size_t n)
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+
+    return (n + page - 1) / page * page;
+}
+
+static size_t header_size (int nslots)
+{
+    return page_round (sizeof (struct ring_hdr)
+                       + nslots * sizeof (struct ring_slot));
+}
+
+static int futex (uint32_t *uaddr, int op, uint32_t val,
+                  const struct timespec *timeout)
+{
+    return syscall (SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+sbig_ring_t *sbig_ring_open (const char *name)
+{
+    sbig_ring_t *r;
+    struct stat sb;
+    void *base;
+    int fd;
+
+    if ((fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0)) < 0)
+        return NULL;
+    if (fstat (fd, &sb) < 0)
+        goto error;
+    if (sb.st_size < sizeof (struct ring_hdr)) {
+        errno = EINVAL;
+        goto error;
+    }
+    base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        goto error;
+    if (memcmp (base, SBIG_RING_MAGIC, 8) != 0) {
+        munmap (base, sb.st_size);
+        errno = EINVAL;
+        goto error;
+    }
+    if (!(r = calloc (1, sizeof (*r)))) {
+        munmap (base, sb.st_size);
+        goto error;
+    }
+    r->fd = fd;
+    r->hdr = base;
+    r->size = sb.st_size;
+    return r;
+error:
+    close (fd);
+    return NULL;
+}
+
+void sbig_ring_close (sbig_ring_t *r)
+{
+    if (r) {
+        munmap (r->hdr, r->size);
+        close (r->fd);
+        free (r);
+    }
+}
+
+uint32_t sbig_ring_latest (sbig_ring_t *r)
+{
+    return __atomic_load_n (&r->hdr->seq, __ATOMIC_ACQUIRE);
+}
+
+uint32_t sbig_ring_wait (sbig_ring_t *r, uint32_t seq, double timeout)
+{
+    struct timespec now, deadline, ts;
+    uint32_t cur;
+
+    if (timeout >= 0) {
+        clock_gettime (CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)timeout;
+        deadline.tv_nsec += (timeout - (time_t)timeout) * 1E9;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    while ((cur = sbig_ring_latest (r)) == seq) {
+        if (timeout >= 0) {
+            clock_gettime (CLOCK_MONOTONIC, &now);
+            ts.tv_sec = deadline.tv_sec - now.tv_sec;
+            ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (ts.tv_nsec < 0) {
+                ts.tv_sec--;
+                ts.tv_nsec += 1000000000;
+            }
+            if (ts.tv_sec < 0)
+                break;
+        }
+        if (futex (&r->hdr->seq, FUTEX_WAIT, seq,
+                   timeout >= 0 ? &ts : NULL) < 0 && errno != EAGAIN)
+            break; /* ETIMEDOUT, EINTR */
+    }
+    return cur;
+}
+
+int sbig_ring_get (sbig_ring_t *r, uint32_t seq, struct sbig_ring_frame *f)
+{
+    struct ring_hdr *hdr = r->hdr;
+    struct ring_slot *slot;
+    uint32_t nslots = hdr->nslots;
+    int i;
+
+    if (seq == 0 || nslots > MAX_SLOTS || header_size (nslots) > r->size)
+        return -1;
+    for (i = 0; i < nslots; i++) {
+        slot = &hdr->slot[i];
+        if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        f->seq = seq;
+        f->flags = slot->flags;
+        f->ccd = slot->ccd;
+        f->readout_mode = slot->readout_mode;
+        f->shutter_mode = slot->shutter_mode;
+        f->top = slot->top;
+        f->left = slot->left;
+        f->height = slot->height;
+        f->width = slot->width;
+        f->exposure_time = slot->exposure_time;
+        f->readout_time = slot->readout_time;
+        f->start = slot->start;
+        f->published.tv_sec = slot->published_sec;
+        f->published.tv_nsec = slot->published_nsec;
+        if (slot->offset + (size_t)f->height * f->width * sizeof (uint16_t)
+                                                                > r->size)
+            return -1;
+        f->data = (const uint16_t *)((char *)hdr + slot->offset);
+        return sbig_ring_check (r, f) ? 0 : -1;
+    }
+    return -1;
+}
+
+bool sbig_ring_check (sbig_ring_t *r, const struct sbig_ring_frame *f)
+{
+    uint32_t nslots = r->hdr->nslots;
+    int i;
+
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    for (i = 0; i < nslots && i < MAX_SLOTS; i++) {
+        if (__atomic_load_n (&r->hdr->slot[i].seq, __ATOMIC_RELAXED) == f->seq)
+            return true;
+    }
+    return false;
+}
+
+/* The writer holds an exclusive flock on the object.  Existing contents
+ * are kept if the layout matches, so readers see the sequence continue.
+ */
+sbig_ring_t *sbig_ring_create (const char *name, int nslots,
+                               size_t slot_pixels)
+{
+    sbig_ring_t *r;
+    struct ring_hdr *hdr;
+    struct stat sb;
+    size_t hsize, size;
+    int fd, i;
+
+    if (nslots < 1 || nslots > MAX_SLOTS || slot_pixels == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    hsize = header_size (nslots);
+    size = hsize + nslots * page_round (slot_pixels * sizeof (uint16_t));
+
+    if ((fd = shm_open (name, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return NULL;
+    if (flock (fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            errno = EBUSY;
+        goto error;
+    }
+    if (fstat (fd, &sb) < 0)
+        goto error;
+    if (sb.st_size < size && ftruncate (fd, size) < 0)
+        goto error;
+    if (sb.st_size > size)
+        size = sb.st_size; /* never shrink under a reader */
+    hdr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        goto error;
+    if (!(r = calloc (1, sizeof (*r)))) {
+        munmap (hdr, size);
+        goto error;
+    }
+    r->fd = fd;
+    r->size = size;
+    r->hdr = hdr;
+    r->nslots = nslots;
+    r->slot_bytes = page_round (slot_pixels * sizeof (uint16_t));
+    pthread_mutex_init (&r->lock, NULL);
+
+    if (memcmp (hdr->magic, SBIG_RING_MAGIC, 8) != 0
+                || hdr->nslots != nslots || hdr->slot_pixels != slot_pixels) {
+        if (memcmp (hdr->magic, SBIG_RING_MAGIC, 8) != 0)
+            hdr->seq = 0;
+        for (i = 0; i < MAX_SLOTS && i < hdr->nslots; i++)
+            __atomic_store_n (&hdr->slot[i].seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        memcpy (hdr->magic, SBIG_RING_MAGIC, 8);
+        hdr->slot_pixels = slot_pixels;
+        for (i = 0; i < nslots; i++) {
+            memset (&hdr->slot[i], 0, sizeof (hdr->slot[i]));
+            hdr->slot[i].offset = hsize + i * r->slot_bytes;
+        }
+        __atomic_store_n (&hdr->nslots, nslots, __ATOMIC_RELEASE);
+    }
+    else {
+        for (i = 0; i < nslots; i++)
+            r->touched[i] = true;
+    }
+    hdr->pid = getpid ();
+    return r;
+error:
+    close (fd);
+    return NULL;
+}
+
+void sbig_ring_destroy (sbig_ring_t *r)
+{
+    if (r) {
+        r->hdr->pid = 0;
+        pthread_mutex_destroy (&r->lock);
+        munmap (r->hdr, r->size);
+        close (r->fd);
+        free (r);
+    }
+}
+
+static int slot_index (sbig_ring_t *r, uint16_t *data)
+{
+    char *p = (char *)data;
+    char *base = (char *)r->hdr + header_size (r->nslots);
+
+    if (p < base || p >= base + r->nslots * r->slot_bytes
+                 || (p - base) % r->slot_bytes != 0)
+        return -1;
+    return (p - base) / r->slot_bytes;
+}
+
+static void invalidate (struct ring_slot *slot)
+{
+    __atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/* Take the unheld slot with the oldest frame, so recent frames stay
+ * readable longest.  Slots are touched on first use, as frame buffers are.
+ */
+uint16_t *sbig_ring_acquire (sbig_ring_t *r)
+{
+    struct ring_hdr *hdr = r->hdr;
+    uint16_t *data;
+    int i, best = -1;
+
+    pthread_mutex_lock (&r->lock);
+    for (i = 0; i < r->nslots; i++) {
+        if (r->held[i])
+            continue;
+        if (best == -1 || (uint32_t)(hdr->slot[i].seq - hdr->slot[best].seq)
+                                                            > INT32_MAX)
+            best = i;
+    }
+    if (best == -1) {
+        pthread_mutex_unlock (&r->lock);
+        return NULL;
+    }
+    r->held[best] = true;
+    invalidate (&hdr->slot[best]);
+    data = (uint16_t *)((char *)hdr + hdr->slot[best].offset);
+    if (!r->touched[best]) {
+        memset (data, 0, r->slot_bytes);
+        r->touched[best] = true;
+    }
+    pthread_mutex_unlock (&r->lock);
+    return data;
+}
+
+void sbig_ring_release (sbig_ring_t *r, uint16_t *data)
+{
+    int i = slot_index (r, data);
+
+    if (i >= 0) {
+        pthread_mutex_lock (&r->lock);
+        r->held[i] = false;
+        pthread_mutex_unlock (&r->lock);
+    }
+}
+
+int sbig_ring_begin (sbig_ring_t *r, uint16_t *data,
+                     struct sbig_ring_frame *f)
+{
+    struct ring_slot *slot;
+    int i;
+
+    if ((i = slot_index (r, data)) < 0)
+        return -1;
+    slot = &r->hdr->slot[i];
+    invalidate (slot);
+    if (f) {
+        memset (f, 0, sizeof (*f));
+        f->flags = slot->flags;
+        f->ccd = slot->ccd;
+        f->readout_mode = slot->readout_mode;
+        f->shutter_mode = slot->shutter_mode;
+        f->top = slot->top;
+        f->left = slot->left;
+        f->height = slot->height;
+        f->width = slot->width;
+        f->exposure_time = slot->exposure_time;
+        f->readout_time = slot->readout_time;
+        f->start = slot->start;
+    }
+    return 0;
+}
+
+void sbig_ring_publish (sbig_ring_t *r, uint16_t *data,
+                        const struct sbig_ring_frame *f)
+{
+    struct ring_hdr *hdr = r->hdr;
+    struct ring_slot *slot;
+    struct timespec now;
+    uint32_t seq;
+    int i;
+
+    if ((i = slot_index (r, data)) < 0)
+        return;
+    slot = &hdr->slot[i];
+    clock_gettime (CLOCK_REALTIME, &now);
+    slot->flags = f->flags;
+    slot->ccd = f->ccd;
+    slot->readout_mode = f->readout_mode;
+    slot->shutter_mode = f->shutter_mode;
+    slot->top = f->top;
+    slot->left = f->left;
+    slot->height = f->height;
+    slot->width = f->width;
+    slot->exposure_time = f->exposure_time;
+    slot->readout_time = f->readout_time;
+    slot->start = f->start;
+    slot->published_sec = now.tv_sec;
+    slot->published_nsec = now.tv_nsec;
+
+    pthread_mutex_lock (&r->lock);
+    if ((seq = hdr->seq + 1) == 0)
+        seq = 1;
+    __atomic_store_n (&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n (&hdr->seq, seq, __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&r->lock);
+    futex (&hdr->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
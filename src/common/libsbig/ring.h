@@ -0,0 +1,87 @@
+#ifndef _SBIG_RING_H
+#define _SBIG_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Shared memory ring of frame slots, for passing frames to viewers,
+ * guiders, and other processes without copying them through files.
+ *
+ * The ring is a POSIX shared memory object (see shm_open(3)) holding a
+ * header, a descriptor per slot, and page aligned pixel data for each
+ * slot.  One process at a time may write a ring; any number may map it
+ * read-only.  Each published frame gets the next sequence number, and
+ * readers sleep on the header's sequence number with a futex.
+ *
+ * A slot is marked invalid (seq 0) before it is overwritten, so a reader
+ * copies or processes a frame, then calls sbig_ring_check() to confirm
+ * the frame wasn't overwritten in the meantime.
+ */
+
+#define SBIG_RING_MAGIC     "SBRING1"
+
+typedef struct sbig_ring sbig_ring_t;
+
+enum {
+    SBIG_RING_SUBTRACTED = 1,   /* dark frame subtracted during readout */
+    SBIG_RING_CONVERTED = 2,    /* color converted to monochrome */
+    SBIG_RING_FLAT_FIELDED = 4, /* divided by a flat during readout */
+};
+
+struct sbig_ring_frame {
+    uint32_t seq;
+    uint32_t flags;
+    uint16_t ccd;               /* CCD_REQUEST */
+    uint16_t readout_mode;      /* READOUT_BINNING_MODE */
+    uint16_t shutter_mode;      /* SHUTTER_COMMAND */
+    uint16_t top, left;         /* binned pixels */
+    uint16_t height, width;
+    double exposure_time;       /* seconds */
+    double readout_time;        /* seconds */
+    int64_t start;              /* exposure start, seconds since epoch */
+    struct timespec published;  /* CLOCK_REALTIME */
+    const uint16_t *data;       /* height rows of width pixels */
+};
+
+/* Reader side.
+ * sbig_ring_wait() returns the latest sequence number once it differs
+ * from 'seq', or 'seq' on timeout (timeout < 0 waits indefinitely) or
+ * when interrupted by a signal.
+ * sbig_ring_get() returns 0 and fills in 'f' if the frame with sequence
+ * number 'seq' is still in the ring, else -1.  f->data points into the
+ * ring and is valid only while sbig_ring_check() returns true.
+ */
+sbig_ring_t *sbig_ring_open (const char *name);
+void sbig_ring_close (sbig_ring_t *r);
+
+uint32_t sbig_ring_latest (sbig_ring_t *r);
+uint32_t sbig_ring_wait (sbig_ring_t *r, uint32_t seq, double timeout);
+int sbig_ring_get (sbig_ring_t *r, uint32_t seq, struct sbig_ring_frame *f);
+bool sbig_ring_check (sbig_ring_t *r, const struct sbig_ring_frame *f);
+
+/* Writer side.
+ * Create the ring, or reuse an existing one with the same geometry so
+ * readers stay attached (errno = EBUSY if another process is writing it).
+ * The writer acquires a slot to fill, which invalidates it, and releases
+ * it when finished with it; a released slot remains readable until it is
+ * acquired again.  To modify a published frame in place, call begin,
+ * which invalidates it and returns its descriptor, then publish it again.
+ * Begin returns -1 if 'data' is not a slot of the ring.
+ */
+sbig_ring_t *sbig_ring_create (const char *name, int nslots,
+                               size_t slot_pixels);
+void sbig_ring_destroy (sbig_ring_t *r);
+
+uint16_t *sbig_ring_acquire (sbig_ring_t *r);
+void sbig_ring_release (sbig_ring_t *r, uint16_t *data);
+int sbig_ring_begin (sbig_ring_t *r, uint16_t *data,
+                     struct sbig_ring_frame *f);
+void sbig_ring_publish (sbig_ring_t *r, uint16_t *data,
+                        const struct sbig_ring_frame *f);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
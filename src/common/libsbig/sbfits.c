@@ -42,6 +42,10 @@
 #include <time.h>
 #include <fitsio.h>
 #include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "sbig.h"
 #include "sbfits.h"
@@ -49,12 +53,28 @@
 #include "src/common/libutil/xzmalloc.h"
 #include "src/common/libutil/bcd.h"
 #include "src/common/libutil/list.h"
+#include "src/common/libutil/be16.h"
 
 struct history {
     char *sw;             /* software that modified image */
     char *hist;           /* history (goes with swmodify) */
 };
 
+struct seq_frame {
+    time_t t_obs;
+    double exposure_time;
+    double temperature;
+    char filter[32];
+};
+
+struct seq {
+    sbfits_seq_t type;
+    ushort height, width;        /* frame size, fixed by the first frame */
+    int nframes;                 /* (cube) planes in the data unit */
+    int count;                   /* frames written */
+    struct seq_frame *frames;    /* (cube) per-frame keys, for FRAMES table */
+};
+
 struct sbfits {
     fitsfile *fptr;
     int status;
@@ -83,13 +103,18 @@ struct sbfits {
     int top, left;               /* subframe origin */
     READOUT_BINNING_MODE readout_mode;
     GetCCDInfoResults0 info0;
-    GetCCDInfoResults2 info2;
     double focal_length;
     double aperture_diameter;
     double aperture_area;
     long cwhite, cblack;
     long pedestal;
     ushort datamax;
+    sbfits_compress_t compress;  /* tile compression algorithm */
+    double hcomp_scale;          /* HCOMPRESS quantization (0=lossless) */
+    struct seq *seq;             /* sequence being written, if any */
+    int fd;                      /* direct writer: file, else -1 */
+    void *map;                   /* direct writer: mapping of data unit */
+    size_t map_len;
 };
 
 const char *sbig_url = "http://diffractionlimited.com/wp-content/uploads/2016/11/sbfitsext_1r0.pdf";
@@ -109,6 +134,7 @@ sbfits_t *sbfits_create (void)
 {
     sbfits_t *sbf = xzmalloc (sizeof (*sbf));
     sbf->num_exposures = 1;
+    sbf->fd = -1;
     return sbf;
 }
 
@@ -117,32 +143,87 @@ void sbfits_destroy (sbfits_t *sbf)
     if (sbf) {
         if (sbf->history)
             list_destroy (sbf->history);
+        if (sbf->seq) {
+            free (sbf->seq->frames);
+            free (sbf->seq);
+        }
+        if (sbf->map)
+            (void)munmap (sbf->map, sbf->map_len);
+        if (sbf->fd >= 0)
+            (void)close (sbf->fd);
         free (sbf);
     }
 }
 
-int sbfits_create_file (sbfits_t *sbf, const char *imagedir,
-                                           const char *prefix)
+/* Set the file name and creation time, and claim the name by creating
+ * the file empty.  Names have one second resolution, so if the file
+ * already exists (several short exposures in a second, or a file left by
+ * an earlier run) the next of _1, _2, ... that doesn't is used instead.
+ * Creating with O_EXCL makes this safe against the async writer naming
+ * files for several sbfits_t's at once.
+ */
+static int name_file (sbfits_t *sbf, const char *imagedir, const char *prefix)
 {
+    char base[PATH_MAX];
     char buf[64];
-    int n;
-    int rc = -1;
+    char suffix[16] = "";
+    int n, fd, seq = 0;
 
     sbf->t_create = time (NULL);
-    n = snprintf (sbf->filename, sizeof (sbf->filename),
-                  "%s/%s_%s.fits", imagedir, prefix,
+    n = snprintf (base, sizeof (base), "%s/%s_%s", imagedir, prefix,
                   gmtime_str (sbf->t_create, buf, sizeof (buf)));
-    if (n >= sizeof (sbf->filename)) {
+    if (n >= sizeof (base)) {
         errno = EINVAL;
-        goto done;
+        return -1;
     }
-    (void)unlink (sbf->filename);
-    fits_create_file (&sbf->fptr, sbf->filename, &sbf->status);
-    if (sbf->status)
-        goto done;
-    rc = 0;
-done:
-    return rc;
+    for (;;) {
+        n = snprintf (sbf->filename, sizeof (sbf->filename), "%s%s.fits%s",
+                      base, suffix,
+                      sbf->compress != SBFITS_COMPRESS_NONE ? ".fz" : "");
+        if (n >= sizeof (sbf->filename)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((fd = open (sbf->filename, O_WRONLY | O_CREAT | O_EXCL,
+                        0666)) >= 0)
+            break;
+        if (errno != EEXIST) {
+            sbf->status = FILE_NOT_CREATED;
+            return -1;
+        }
+        snprintf (suffix, sizeof (suffix), "_%d", ++seq);
+    }
+    (void)close (fd);
+    return 0;
+}
+
+/* Open the file claimed by name_file().  cfitsio is told to overwrite
+ * it ("!"), since it refuses to create over an existing file.
+ */
+static int open_file (sbfits_t *sbf)
+{
+    char path[PATH_MAX + 1];
+
+    if (sbf->compress == SBFITS_COMPRESS_NONE && !sbf->seq) {
+        if ((sbf->fd = open (sbf->filename, O_RDWR | O_TRUNC)) < 0) {
+            sbf->status = FILE_NOT_CREATED;
+            return -1;
+        }
+    } else {
+        snprintf (path, sizeof (path), "!%s", sbf->filename);
+        fits_create_file (&sbf->fptr, path, &sbf->status);
+        if (sbf->status)
+            return -1;
+    }
+    return 0;
+}
+
+int sbfits_create_file (sbfits_t *sbf, const char *imagedir,
+                                           const char *prefix)
+{
+    if (name_file (sbf, imagedir, prefix) < 0)
+        return -1;
+    return open_file (sbf);
 }
 
 const char *sbfits_get_filename (sbfits_t *sbf)
@@ -156,9 +237,13 @@ const char *sbfits_get_errstr (sbfits_t *sbf)
     return sbf->error_string;
 }
 
+static int close_direct (sbfits_t *sbf);
+
 int sbfits_close_file (sbfits_t *sbf)
 {
     int rc = -1;
+    if (sbf->fd >= 0)
+        return close_direct (sbf);
     fits_close_file (sbf->fptr, &sbf->status);
     if (sbf->status)
         goto done;
@@ -175,37 +260,22 @@ void sbfits_set_ccdinfo (sbfits_t *sbf, sbig_ccd_t *ccd)
     sbf->data          = sbig_ccd_get_data (ccd, &sbf->height, &sbf->width);
     (void)sbig_ccd_get_readout_mode (ccd, &sbf->readout_mode); /* FIXME */
     (void)sbig_ccd_get_info0 (ccd, &sbf->info0); /* FIXME */
-    (void)sbig_ccd_get_info2 (ccd, &sbf->info2); /* FIXME */
     (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
     sbf->top = top;   /* need as int */
     sbf->left = left; /* need as int */
+    sbf->datamax = sbig_ccd_get_datamax (ccd);
+}
 
-    /* Ref: SBIG USB Camera manual rev 14, table 3.2, pp 37
-     *  provides info on ST7, ST8, ST9, ST10, ST2K
-     */
-    switch (sbf->info0.cameraType) {
-        case ST7_CAMERA:
-        case ST8_CAMERA:
-            if (sbf->readout_mode == RM_1X1 && sbf->info2.imagingABG)
-                sbf->datamax = 20000;
-            else if (sbf->readout_mode == RM_1X1 && !sbf->info2.imagingABG)
-                sbf->datamax = 40000;
-            else
-                sbf->datamax = 65000;
-            break;
-        case ST10_CAMERA:
-            if (sbf->readout_mode == RM_1X1)
-                sbf->datamax = 50000;
-            else
-                sbf->datamax = 65000;
-            break;
-        case ST9_CAMERA:
-        case ST2K_CAMERA:
-            sbf->datamax = 65000;
-            break;
-        default:
-            sbf->datamax = 65000;
-    }
+void sbfits_set_data (sbfits_t *sbf, ushort *data, ushort height, ushort width)
+{
+    sbf->data = data;
+    sbf->height = height;
+    sbf->width = width;
+}
+
+void sbfits_set_start_time (sbfits_t *sbf, time_t t_obs)
+{
+    sbf->t_obs = t_obs;
 }
 
 void sbfits_set_num_exposures (sbfits_t *sbf, ushort num_exposures)
@@ -304,15 +374,48 @@ void sbfits_set_contrast (sbfits_t *sbf, ulong cblack, ulong cwhite)
     sbf->cwhite = cwhite;
 }
 
+void sbfits_set_compression (sbfits_t *sbf, sbfits_compress_t type,
+                             double hcomp_scale)
+{
+    sbf->compress = type;
+    sbf->hcomp_scale = hcomp_scale;
+}
+
 void sbfits_set_pedestal (sbfits_t *sbf, ulong pedestal)
 {
     sbf->pedestal = pedestal;
 }
 
+/* With compression enabled, cfitsio writes an empty primary HDU followed
+ * by the image as a tile-compressed binary table extension (as fpack does).
+ * Rice uses cfitsio's default tiles of one row.  HCOMPRESS needs 2-D
+ * tiles, and is lossy if hcomp_scale is non-zero (units of RMS noise).
+ */
+static int set_compression (sbfits_t *sbf)
+{
+    long tile[2] = { sbf->width, MIN (sbf->height, 16) };
+
+    switch (sbf->compress) {
+        case SBFITS_COMPRESS_NONE:
+            break;
+        case SBFITS_COMPRESS_RICE:
+            fits_set_compression_type (sbf->fptr, RICE_1, &sbf->status);
+            break;
+        case SBFITS_COMPRESS_HCOMPRESS:
+            fits_set_compression_type (sbf->fptr, HCOMPRESS_1, &sbf->status);
+            fits_set_tile_dim (sbf->fptr, 2, tile, &sbf->status);
+            fits_set_hcomp_scale (sbf->fptr, sbf->hcomp_scale, &sbf->status);
+            break;
+    }
+    return sbf->status ? -1 : 0;
+}
+
 static int sbfits_write_image (sbfits_t *sbf)
 {
     long naxes[2] = { sbf->width, sbf->height };
 
+    if (set_compression (sbf) < 0)
+        return -1;
     fits_create_img (sbf->fptr, USHORT_IMG, 2, naxes, &sbf->status);
     fits_write_img (sbf->fptr, TUSHORT, 1,
                     sbf->height * sbf->width, sbf->data, &sbf->status);
@@ -331,7 +434,33 @@ static int lookup_readoutmode_index (sbfits_t *sbf)
     return -1;
 }
 
-static int sbfits_write_header (sbfits_t *sbf)
+/* Keys that describe one exposure rather than the camera setup.
+ */
+static void write_exposure_keys (sbfits_t *sbf)
+{
+    char buf[64];
+
+    fits_write_key(sbf->fptr, TSTRING, "DATE-OBS",
+                   gmtime_str (sbf->t_obs, buf, sizeof (buf)),
+                   "GMT start of exposure", &sbf->status);
+
+    fits_write_key (sbf->fptr, TDOUBLE, "EXPTIME", &sbf->exposure_time,
+                    "Exposure in seconds", &sbf->status);
+    fits_write_key (sbf->fptr, TDOUBLE, "CCD-TEMP", &sbf->temperature,
+                    "CCD temp in degress C", &sbf->status);
+}
+
+static void write_filter_key (sbfits_t *sbf)
+{
+    if (sbf->filter)
+        fits_write_key(sbf->fptr, TSTRING, "FILTER", (char *)sbf->filter,
+                       "Optical filter name", &sbf->status);
+}
+
+/* Write the header.  If 'frame' is false, leave out the per-exposure keys,
+ * as for the primary HDU of a multi-extension sequence.
+ */
+static int sbfits_write_header (sbfits_t *sbf, bool frame)
 {
     char buf[128];
 
@@ -350,14 +479,8 @@ static int sbfits_write_header (sbfits_t *sbf)
     fits_write_key(sbf->fptr, TSTRING, "DATE",
                    gmtime_str (sbf->t_create, buf, sizeof (buf)),
                    "GMT date when this file created", &sbf->status);
-    fits_write_key(sbf->fptr, TSTRING, "DATE-OBS",
-                   gmtime_str (sbf->t_obs, buf, sizeof (buf)),
-                   "GMT start of exposure", &sbf->status);
-
-    fits_write_key (sbf->fptr, TDOUBLE, "EXPTIME", &sbf->exposure_time,
-                    "Exposure in seconds", &sbf->status);
-    fits_write_key (sbf->fptr, TDOUBLE, "CCD-TEMP", &sbf->temperature,
-                    "CCD temp in degress C", &sbf->status);
+    if (frame)
+        write_exposure_keys (sbf);
     fits_write_key (sbf->fptr, TDOUBLE, "SET-TEMP", &sbf->setpoint,
                     "Setpoint for CCD temp in degress C", &sbf->status);
     fits_write_key (sbf->fptr, TSTRING, "IMAGETYP",
@@ -376,7 +499,6 @@ static int sbfits_write_header (sbfits_t *sbf)
 
         itr = list_iterator_create (sbf->history);
         while ((h = list_next (itr))) {
-            fprintf (stderr, "Add '%s' '%s'\n", h->sw, h->hist);
             fits_write_key (sbf->fptr, TSTRING, "SWMODIFY", h->sw,
                             "Software that modified this image", &sbf->status);
             fits_write_key (sbf->fptr, TSTRING, "HISTORY", h->hist,
@@ -403,9 +525,8 @@ static int sbfits_write_header (sbfits_t *sbf)
     if (sbf->telescope)
         fits_write_key(sbf->fptr, TSTRING, "TELESCOP", (char *)sbf->telescope,
                        "Telescope model", &sbf->status);
-    if (sbf->filter)
-        fits_write_key(sbf->fptr, TSTRING, "FILTER", (char *)sbf->filter,
-                       "Optical filter name", &sbf->status);
+    if (frame)
+        write_filter_key (sbf);
     if (sbf->observer)
         fits_write_key(sbf->fptr, TSTRING, "OBSERVER", (char *)sbf->observer,
                        "Telescope operator", &sbf->status);
@@ -483,15 +604,561 @@ static int sbfits_write_header (sbfits_t *sbf)
     return sbf->status ? -1 : 0;
 }
 
+/* Direct writer for uncompressed files.
+ * cfitsio writes the image through its own buffers, byte swapping into
+ * scratch space on the way.  Instead, the header alone is formatted by
+ * cfitsio in memory, the file is allocated at its final size, the header
+ * is written, and the data unit is mapped and filled in place with the
+ * pixels converted to FITS order, so the frame is copied once.  The
+ * mapping is synced and the file fsynced by sbfits_close_file().
+ */
+static int format_header (sbfits_t *sbf, char **hdrp, size_t *lenp)
+{
+    long naxes[2] = { sbf->width, sbf->height };
+    size_t size = 2880 * 8;
+    void *buf;
+    char *cards = NULL;
+    char *hdr;
+    int nkeys = 0;
+    size_t len;
+
+    if (!(buf = malloc (size))) {
+        sbf->status = MEMORY_ALLOCATION;
+        return -1;
+    }
+    fits_create_memfile (&sbf->fptr, &buf, &size, 2880 * 8, realloc,
+                         &sbf->status);
+    if (sbf->status) {
+        free (buf);
+        return -1;
+    }
+    fits_create_img (sbf->fptr, USHORT_IMG, 2, naxes, &sbf->status);
+    (void)sbfits_write_header (sbf, true);
+    fits_hdr2str (sbf->fptr, 0, NULL, 0, &cards, &nkeys, &sbf->status);
+    /* drop the data unit so closing doesn't fill it in memory */
+    fits_resize_img (sbf->fptr, USHORT_IMG, 0, naxes, &sbf->status);
+    fits_close_file (sbf->fptr, &sbf->status);
+    sbf->fptr = NULL;
+    free (buf);
+    if (sbf->status) {
+        free (cards);
+        return -1;
+    }
+    /* cards includes the END card */
+    len = ((size_t)nkeys * 80 + 2879) / 2880 * 2880;
+    hdr = xzmalloc (len);
+    memset (hdr, ' ', len);
+    memcpy (hdr, cards, (size_t)nkeys * 80);
+    free (cards);
+    *hdrp = hdr;
+    *lenp = len;
+    return 0;
+}
+
+static int write_direct (sbfits_t *sbf)
+{
+    size_t datalen = (size_t)sbf->height * sbf->width * sizeof (ushort);
+    long pagesize = sysconf (_SC_PAGESIZE);
+    size_t hdrlen;
+    off_t size, offset;
+    char *hdr;
+    ssize_t n;
+
+    if (format_header (sbf, &hdr, &hdrlen) < 0)
+        return -1;
+    size = hdrlen + (datalen + 2879) / 2880 * 2880;
+    /* Blocks must really be allocated before the data is stored through
+     * the mapping, or running out of space raises SIGBUS rather than an
+     * error.  Only where fallocate() is unsupported is the file extended
+     * sparse.
+     */
+    if (fallocate (sbf->fd, 0, 0, size) < 0) {
+        if ((errno != EOPNOTSUPP && errno != ENOSYS)
+                || ftruncate (sbf->fd, size) < 0) {
+            free (hdr);
+            goto error;
+        }
+    }
+    n = pwrite (sbf->fd, hdr, hdrlen, 0);
+    free (hdr);
+    if (n < 0 || n != hdrlen)
+        goto error;
+    if (datalen == 0)
+        return 0;
+    offset = hdrlen / pagesize * pagesize;
+    sbf->map_len = size - offset;
+    sbf->map = mmap (NULL, sbf->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     sbf->fd, offset);
+    if (sbf->map == MAP_FAILED) {
+        sbf->map = NULL;
+        goto error;
+    }
+    be16_store_frame ((char *)sbf->map + (hdrlen - offset), sbf->data,
+                      sbf->height, sbf->width);
+    return 0;
+error:
+    sbf->status = WRITE_ERROR;
+    return -1;
+}
+
+static int close_direct (sbfits_t *sbf)
+{
+    int rc = 0;
+
+    if (sbf->map) {
+        if (msync (sbf->map, sbf->map_len, MS_SYNC) < 0)
+            rc = -1;
+        (void)munmap (sbf->map, sbf->map_len);
+        sbf->map = NULL;
+    }
+    if (fsync (sbf->fd) < 0)
+        rc = -1;
+    if (close (sbf->fd) < 0)
+        rc = -1;
+    sbf->fd = -1;
+    if (rc < 0)
+        sbf->status = WRITE_ERROR;
+    return rc;
+}
+
 int sbfits_write_file (sbfits_t *sbf)
 {
+    if (sbf->fd >= 0)
+        return write_direct (sbf);
     if (sbfits_write_image (sbf) < 0)
         return -1;
-    if (sbfits_write_header (sbf) < 0)
+    if (sbfits_write_header (sbf, true) < 0)
         return -1;
     return 0;
 }
 
+/* Build the file in memory, uncompressed, with the same header as on disk.
+ * The buffer is sized up front so cfitsio needn't grow it.  A FITS file
+ * is its last HDU's data rounded up to a whole 2880 byte block.
+ */
+int sbfits_write_mem (sbfits_t *sbf, void **bufp, size_t *lenp)
+{
+    sbfits_compress_t compress = sbf->compress;
+    size_t size = 2880 * 8 + (size_t)sbf->height * sbf->width * sizeof (ushort);
+    void *buf;
+    LONGLONG headstart, datastart, dataend;
+
+    size = (size + 2879) / 2880 * 2880;
+    if (!(buf = malloc (size))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sbf->status = 0;
+    sbf->compress = SBFITS_COMPRESS_NONE;
+    fits_create_memfile (&sbf->fptr, &buf, &size, 2880 * 8, realloc,
+                         &sbf->status);
+    if (sbf->status)
+        goto error;
+    (void)sbfits_write_file (sbf);
+    fits_get_hduaddrll (sbf->fptr, &headstart, &datastart, &dataend,
+                        &sbf->status);
+    if (sbfits_close_file (sbf) < 0 || sbf->status)
+        goto error;
+    sbf->compress = compress;
+    *bufp = buf;
+    *lenp = (dataend + 2879) / 2880 * 2880;
+    return 0;
+error:
+    sbf->compress = compress;
+    free (buf);
+    return -1;
+}
+
+/* Asynchronous writer.
+ * Files are named when submitted, so the name and DATE reflect when the
+ * image was taken rather than when a writer got to it.  Requests are
+ * queued to a dedicated thread which creates, writes, closes, and fsyncs
+ * each file, then calls the requester's callback.
+ */
+
+struct sbfits_request {
+    sbfits_t *sbf;
+    sbfits_writer_f cb;
+    void *arg;
+};
+
+struct sbfits_writer {
+    pthread_t *t;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    List queue;
+    int busy;                   /* requests being written */
+    int depth;
+    bool shutdown;
+};
+
+/* cfitsio doesn't expose its file descriptor, so reopen to fsync.
+ */
+static int sync_file (const char *filename)
+{
+    int fd, rc;
+
+    if ((fd = open (filename, O_RDONLY)) < 0)
+        return -1;
+    rc = fsync (fd);
+    (void)close (fd);
+    return rc;
+}
+
+static int write_request (struct sbfits_request *req)
+{
+    sbfits_t *sbf = req->sbf;
+    bool direct;
+
+    if (open_file (sbf) < 0)
+        return -1;
+    direct = sbf->fd >= 0;
+    if (sbfits_write_file (sbf) < 0) {
+        int status = sbf->status;
+        (void)sbfits_close_file (sbf);
+        sbf->status = status;
+        return -1;
+    }
+    if (direct) /* synced on close */
+        return sbfits_close_file (sbf);
+    if (sbfits_close_file (sbf) < 0)
+        return -1;
+    if (sync_file (sbf->filename) < 0) {
+        sbf->status = WRITE_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+static void *writer_thread (void *arg)
+{
+    sbfits_writer_t *w = arg;
+    struct sbfits_request *req;
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock (&w->lock);
+        while (list_is_empty (w->queue) && !w->shutdown)
+            pthread_cond_wait (&w->cond, &w->lock);
+        if ((req = list_dequeue (w->queue)))
+            w->busy++;
+        pthread_mutex_unlock (&w->lock);
+        if (!req)
+            break;
+
+        rc = write_request (req);
+        if (req->cb)
+            req->cb (req->sbf, rc, req->arg);
+        free (req);
+
+        pthread_mutex_lock (&w->lock);
+        w->busy--;
+        pthread_cond_broadcast (&w->cond);
+        pthread_mutex_unlock (&w->lock);
+    }
+    return NULL;
+}
+
+static void writer_join (sbfits_writer_t *w)
+{
+    int i;
+
+    pthread_mutex_lock (&w->lock);
+    w->shutdown = true;
+    pthread_cond_broadcast (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    for (i = 0; i < w->nthreads; i++)
+        pthread_join (w->t[i], NULL);
+}
+
+static void writer_free (sbfits_writer_t *w)
+{
+    list_destroy (w->queue);
+    pthread_mutex_destroy (&w->lock);
+    pthread_cond_destroy (&w->cond);
+    free (w->t);
+    free (w);
+}
+
+sbfits_writer_t *sbfits_writer_create (int depth, int nthreads)
+{
+    sbfits_writer_t *w = xzmalloc (sizeof (*w));
+    int e;
+
+    /* A cfitsio built without --enable-reentrant shares compression
+     * buffers between open files, so it gets only one thread.
+     */
+    if (nthreads < 1 || !fits_is_reentrant ())
+        nthreads = 1;
+    w->depth = depth > nthreads ? depth : nthreads;
+    w->t = xzmalloc (sizeof (w->t[0]) * nthreads);
+    w->queue = list_create (NULL);
+    pthread_mutex_init (&w->lock, NULL);
+    pthread_cond_init (&w->cond, NULL);
+    while (w->nthreads < nthreads) {
+        if ((e = pthread_create (&w->t[w->nthreads], NULL,
+                                 writer_thread, w)) != 0) {
+            writer_join (w);
+            writer_free (w);
+            errno = e;
+            return NULL;
+        }
+        w->nthreads++;
+    }
+    return w;
+}
+
+int sbfits_writer_submit (sbfits_writer_t *w, sbfits_t *sbf,
+                          const char *imagedir, const char *prefix,
+                          sbfits_writer_f cb, void *arg)
+{
+    struct sbfits_request *req;
+
+    if (name_file (sbf, imagedir, prefix) < 0)
+        return -1;
+    req = xzmalloc (sizeof (*req));
+    req->sbf = sbf;
+    req->cb = cb;
+    req->arg = arg;
+
+    pthread_mutex_lock (&w->lock);
+    while (list_count (w->queue) + w->busy >= w->depth)
+        pthread_cond_wait (&w->cond, &w->lock);
+    list_enqueue (w->queue, req);
+    pthread_cond_broadcast (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    return 0;
+}
+
+void sbfits_writer_destroy (sbfits_writer_t *w)
+{
+    if (w) {
+        writer_join (w);
+        writer_free (w);
+    }
+}
+
+/* Sequences.
+ * A cube is a primary HDU with NAXIS3 = nframes, its header written before
+ * any data so cfitsio never has to move the data unit to make room, then
+ * filled a plane at a time with sequential writes.  Its header carries the
+ * first frame's exposure keys; every frame's are kept and written at close
+ * to a FRAMES binary table extension following the cube.  A multi-extension
+ * file has a primary HDU with no data and the keys common to the series,
+ * then an IMAGE extension per frame with only that frame's exposure keys.
+ */
+
+#define SEQ_HEADER_SIZE (2880 * 4)  /* allowance for the primary header */
+#define SEQ_ROW_SIZE    80          /* allowance for a FRAMES table row */
+
+static off_t round_block (off_t n)
+{
+    return (n + 2879) / 2880 * 2880;
+}
+
+/* Reserve the space the sequence is expected to take, so the file system
+ * can allocate it in large extents rather than a few blocks per write.
+ * cfitsio doesn't expose its file descriptor, so reopen.  Failure is not
+ * an error; the file just grows as it is written.
+ */
+static void reserve_file (sbfits_t *sbf, int nframes)
+{
+    off_t frame = (off_t)sbf->height * sbf->width * sizeof (ushort);
+    off_t size = SEQ_HEADER_SIZE;
+    int fd;
+
+    if (sbf->seq->type == SBFITS_SEQ_CUBE)
+        size += round_block (frame * nframes) + SEQ_HEADER_SIZE
+              + round_block ((off_t)nframes * SEQ_ROW_SIZE);
+    else
+        size += nframes * (2880 + round_block (frame));
+    if ((fd = open (sbf->filename, O_WRONLY)) < 0)
+        return;
+    (void)fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    (void)close (fd);
+}
+
+/* Release reserved space beyond the end of the file, and fsync.
+ */
+static int trim_file (const char *filename)
+{
+    struct stat st;
+    int fd, rc = -1;
+
+    if ((fd = open (filename, O_WRONLY)) < 0)
+        return -1;
+    if (fstat (fd, &st) == 0 && ftruncate (fd, st.st_size) == 0
+                             && fsync (fd) == 0)
+        rc = 0;
+    (void)close (fd);
+    return rc;
+}
+
+static void close_on_error (sbfits_t *sbf)
+{
+    int status = sbf->status;
+
+    (void)sbfits_close_file (sbf);
+    sbf->status = status;
+}
+
+int sbfits_seq_create (sbfits_t *sbf, const char *imagedir,
+                       const char *prefix, sbfits_seq_t type, int nframes)
+{
+    struct seq *seq = xzmalloc (sizeof (*seq));
+
+    seq->type = type;
+    seq->height = sbf->height;
+    seq->width = sbf->width;
+    if (type == SBFITS_SEQ_CUBE) {
+        seq->nframes = nframes > 0 ? nframes : 1;
+        seq->frames = xzmalloc (sizeof (seq->frames[0]) * seq->nframes);
+        sbf->compress = SBFITS_COMPRESS_NONE;
+    }
+    if (sbf->seq) {
+        free (sbf->seq->frames);
+        free (sbf->seq);
+    }
+    sbf->seq = seq;
+    sbf->status = 0;
+    if (sbfits_create_file (sbf, imagedir, prefix) < 0)
+        return -1;
+    reserve_file (sbf, nframes > 0 ? nframes : 1);
+    if (type == SBFITS_SEQ_CUBE) {
+        long naxes[3] = { seq->width, seq->height, seq->nframes };
+        fits_create_img (sbf->fptr, USHORT_IMG, 3, naxes, &sbf->status);
+    } else
+        fits_create_img (sbf->fptr, USHORT_IMG, 0, NULL, &sbf->status);
+    if (sbf->status || sbfits_write_header (sbf, type == SBFITS_SEQ_CUBE) < 0) {
+        close_on_error (sbf);
+        return -1;
+    }
+    return 0;
+}
+
+/* Add a plane to the cube, doubling NAXIS3 if it is full.  The cube is the
+ * last HDU until close, so cfitsio extends it in place.
+ */
+static int write_plane (sbfits_t *sbf)
+{
+    struct seq *seq = sbf->seq;
+    LONGLONG npix = (LONGLONG)seq->height * seq->width;
+    struct seq_frame *f;
+
+    if (seq->count == seq->nframes) {
+        long naxes[3] = { seq->width, seq->height, seq->nframes * 2 };
+
+        if (!(f = realloc (seq->frames, sizeof (*f) * naxes[2]))) {
+            sbf->status = MEMORY_ALLOCATION;
+            return -1;
+        }
+        seq->frames = f;
+        fits_resize_img (sbf->fptr, USHORT_IMG, 3, naxes, &sbf->status);
+        if (sbf->status)
+            return -1;
+        seq->nframes *= 2;
+    }
+    fits_write_img (sbf->fptr, TUSHORT, npix * seq->count + 1, npix,
+                    sbf->data, &sbf->status);
+    if (sbf->status)
+        return -1;
+    f = &seq->frames[seq->count];
+    f->t_obs = sbf->t_obs;
+    f->exposure_time = sbf->exposure_time;
+    f->temperature = sbf->temperature;
+    snprintf (f->filter, sizeof (f->filter), "%s",
+              sbf->filter ? sbf->filter : "");
+    return 0;
+}
+
+static int write_extension (sbfits_t *sbf)
+{
+    struct seq *seq = sbf->seq;
+    long naxes[2] = { seq->width, seq->height };
+
+    if (set_compression (sbf) < 0)
+        return -1;
+    fits_create_img (sbf->fptr, USHORT_IMG, 2, naxes, &sbf->status);
+    write_exposure_keys (sbf);
+    write_filter_key (sbf);
+    fits_write_img (sbf->fptr, TUSHORT, 1, (LONGLONG)seq->height * seq->width,
+                    sbf->data, &sbf->status);
+    return sbf->status ? -1 : 0;
+}
+
+int sbfits_seq_write_frame (sbfits_t *sbf)
+{
+    struct seq *seq = sbf->seq;
+    int rc;
+
+    if (sbf->height != seq->height || sbf->width != seq->width) {
+        sbf->status = BAD_NAXES;
+        return -1;
+    }
+    if (seq->type == SBFITS_SEQ_CUBE)
+        rc = write_plane (sbf);
+    else
+        rc = write_extension (sbf);
+    if (rc == 0)
+        seq->count++;
+    return rc;
+}
+
+int sbfits_seq_get_count (sbfits_t *sbf)
+{
+    return sbf->seq ? sbf->seq->count : 0;
+}
+
+static int write_frame_table (sbfits_t *sbf)
+{
+    struct seq *seq = sbf->seq;
+    char *ttype[] = { "DATE-OBS", "EXPTIME", "CCD-TEMP", "FILTER" };
+    char *tform[] = { "19A", "1D", "1D", "31A" };
+    char *tunit[] = { "", "s", "C", "" };
+    char buf[64];
+    char *s;
+    int i;
+
+    fits_create_tbl (sbf->fptr, BINARY_TBL, seq->count, 4, ttype, tform,
+                     tunit, "FRAMES", &sbf->status);
+    for (i = 0; i < seq->count && !sbf->status; i++) {
+        struct seq_frame *f = &seq->frames[i];
+
+        s = gmtime_str (f->t_obs, buf, sizeof (buf));
+        fits_write_col (sbf->fptr, TSTRING, 1, i + 1, 1, 1, &s, &sbf->status);
+        fits_write_col (sbf->fptr, TDOUBLE, 2, i + 1, 1, 1,
+                        &f->exposure_time, &sbf->status);
+        fits_write_col (sbf->fptr, TDOUBLE, 3, i + 1, 1, 1,
+                        &f->temperature, &sbf->status);
+        s = f->filter;
+        fits_write_col (sbf->fptr, TSTRING, 4, i + 1, 1, 1, &s, &sbf->status);
+    }
+    return sbf->status ? -1 : 0;
+}
+
+int sbfits_seq_close (sbfits_t *sbf)
+{
+    struct seq *seq = sbf->seq;
+
+    if (seq->type == SBFITS_SEQ_CUBE) {
+        if (seq->count < seq->nframes) {
+            long naxes[3] = { seq->width, seq->height, seq->count };
+            fits_resize_img (sbf->fptr, USHORT_IMG, 3, naxes, &sbf->status);
+        }
+        if (sbf->status || write_frame_table (sbf) < 0) {
+            close_on_error (sbf);
+            return -1;
+        }
+    }
+    if (sbfits_close_file (sbf) < 0)
+        return -1;
+    if (trim_file (sbf->filename) < 0) {
+        sbf->status = WRITE_ERROR;
+        return -1;
+    }
+    return 0;
+}
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
@@ -7,9 +7,19 @@ typedef enum {
     SBFITS_TYPE_FF,
 } sbfits_type_t;
 
+typedef enum {
+    SBFITS_COMPRESS_NONE,
+    SBFITS_COMPRESS_RICE,       /* lossless */
+    SBFITS_COMPRESS_HCOMPRESS,  /* lossy if hcomp_scale > 0 */
+} sbfits_compress_t;
+
 sbfits_t *sbfits_create (void);
 void sbfits_destroy (sbfits_t *sbf);
 
+/* An uncompressed file is written without cfitsio's I/O: it is allocated
+ * at its final size, and the pixels are converted straight into a memory
+ * mapping of the data unit.  Closing it syncs the data to disk.
+ */
 int sbfits_create_file (sbfits_t *sbf, const char *imagedir, const char *prefix);
 int sbfits_write_file (sbfits_t *sbf);
 int sbfits_close_file (sbfits_t *sbf);
@@ -18,6 +28,8 @@ const char *sbfits_get_errstr (sbfits_t *sbf);
 const char *sbfits_get_filename (sbfits_t *sbf);
 
 void sbfits_set_ccdinfo (sbfits_t *sbf, sbig_ccd_t *ccd);
+void sbfits_set_data (sbfits_t *sbf, ushort *data, ushort height, ushort width);
+void sbfits_set_start_time (sbfits_t *sbf, time_t t_obs);
 void sbfits_set_num_exposures (sbfits_t *sbf, ushort num_exposures);
 void sbfits_set_observer (sbfits_t *sbf, const char *observer);
 void sbfits_set_telescope (sbfits_t *sbf, const char *telescope);
@@ -36,6 +48,64 @@ void sbfits_add_history (sbfits_t *sbf, const char *swmodify, const char *str);
 void sbfits_set_contrast (sbfits_t *sbf, ulong cblack, ulong cwhite);
 void sbfits_set_pedestal (sbfits_t *sbf, ulong pedestal);
 
+/* Write the image and header to an uncompressed FITS file in memory
+ * instead of to disk, e.g. for preview.  On success the caller owns
+ * *bufp, to be freed with free(3).
+ */
+int sbfits_write_mem (sbfits_t *sbf, void **bufp, size_t *lenp);
+
+/* Write a tile-compressed image.  Set before sbfits_create_file(),
+ * which appends ".fz" to the file name if compression is enabled.
+ */
+void sbfits_set_compression (sbfits_t *sbf, sbfits_compress_t type,
+                             double hcomp_scale);
+
+/* Sequences:  write a series of frames of the same size to one file rather
+ * than a file per frame.  SBFITS_SEQ_CUBE writes a single NAXIS3 image
+ * (never compressed) followed by a FRAMES binary table of each frame's
+ * DATE-OBS, EXPTIME, CCD-TEMP, and FILTER.  SBFITS_SEQ_MEF writes the keys
+ * common to the series in an empty primary HDU and each frame as an IMAGE
+ * extension (compressed if set) carrying its own exposure keys.
+ *
+ * Set up the header and data as for sbfits_write_file() and call
+ * sbfits_seq_create() with the first frame, which fixes the frame size and
+ * reserves space for 'nframes' (0 if unknown); then, after updating the
+ * exposure keys and data, sbfits_seq_write_frame() for each frame
+ * including the first.  More than 'nframes' may be written.  The file is
+ * closed and fsynced by sbfits_seq_close().
+ */
+typedef enum {
+    SBFITS_SEQ_CUBE,
+    SBFITS_SEQ_MEF,
+} sbfits_seq_t;
+
+int sbfits_seq_create (sbfits_t *sbf, const char *imagedir,
+                       const char *prefix, sbfits_seq_t type, int nframes);
+int sbfits_seq_write_frame (sbfits_t *sbf);
+int sbfits_seq_get_count (sbfits_t *sbf);
+int sbfits_seq_close (sbfits_t *sbf);
+
+/* Asynchronous writer.  Submit names and creates the file empty (as in
+ * sbfits_create_file()) and sets its creation time on the calling thread,
+ * returning -1 with errno set if that fails.  A dedicated thread then
+ * opens the file, writes it, closes it, and fsyncs it, and calls 'cb' from that
+ * thread with rc = 0 on success or -1 on failure (see
+ * sbfits_get_filename() and sbfits_get_errstr()).  The sbfits_t and
+ * its image data belong to the writer until the callback, which may
+ * destroy them.  Submit blocks while 'depth' requests are outstanding.
+ * Up to 'nthreads' files are written (and compressed) concurrently, so
+ * callbacks may run concurrently and out of order.  Destroy waits for
+ * outstanding requests to complete.
+ */
+typedef struct sbfits_writer sbfits_writer_t;
+typedef void (*sbfits_writer_f)(sbfits_t *sbf, int rc, void *arg);
+
+sbfits_writer_t *sbfits_writer_create (int depth, int nthreads);
+void sbfits_writer_destroy (sbfits_writer_t *w);
+int sbfits_writer_submit (sbfits_writer_t *w, sbfits_t *sbf,
+                          const char *imagedir, const char *prefix,
+                          sbfits_writer_f cb, void *arg);
+
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
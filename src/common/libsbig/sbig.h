@@ -7,7 +7,12 @@
 #include "camera.h"
 #include "cfw.h"
 #include "ao.h"
+#include "guide.h"
+#include "calib.h"
 #include "temp.h"
+#include "trace.h"
+#include "remote.h"
+#include "ring.h"
 
 #endif
 
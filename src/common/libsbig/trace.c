@@ -0,0 +1,292 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Driver call tracing.
+ *
+ * When enabled, sb->fun is swapped for trace_fun(), which times each call
+ * to the real driver entry point and accumulates per-command statistics.
+ * Latency percentiles come from a log-linear histogram (8 buckets per
+ * power of two, so within ~6% of the true value).  The driver entry point
+ * carries no context pointer, so only one handle per process is traced.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "handle.h"
+#include "handle_impl.h"
+#include "sbigudrv.h"
+#include "trace.h"
+
+#define HIST_BUCKETS    256
+
+struct cmd_stats {
+    unsigned long count;
+    unsigned long errors;
+    uint64_t total;             /* ns */
+    uint32_t min, max;          /* ns */
+    uint32_t hist[HIST_BUCKETS];
+    unsigned long errcount[CE_NEXT_ERROR];
+};
+
+struct sbig_trace {
+    short (*fun)(short cmd, void *parm, void *result);
+    FILE *f;
+    struct timespec t0;
+    struct cmd_stats cmd[CC_LAST_COMMAND];
+};
+
+static struct sbig_trace *active = NULL;
+
+static const char *cmdtab[] = {
+    [CC_NULL] = "NULL",
+    [CC_START_EXPOSURE] = "START_EXPOSURE",
+    [CC_END_EXPOSURE] = "END_EXPOSURE",
+    [CC_READOUT_LINE] = "READOUT_LINE",
+    [CC_DUMP_LINES] = "DUMP_LINES",
+    [CC_SET_TEMPERATURE_REGULATION] = "SET_TEMPERATURE_REGULATION",
+    [CC_QUERY_TEMPERATURE_STATUS] = "QUERY_TEMPERATURE_STATUS",
+    [CC_ACTIVATE_RELAY] = "ACTIVATE_RELAY",
+    [CC_PULSE_OUT] = "PULSE_OUT",
+    [CC_ESTABLISH_LINK] = "ESTABLISH_LINK",
+    [CC_GET_DRIVER_INFO] = "GET_DRIVER_INFO",
+    [CC_GET_CCD_INFO] = "GET_CCD_INFO",
+    [CC_QUERY_COMMAND_STATUS] = "QUERY_COMMAND_STATUS",
+    [CC_MISCELLANEOUS_CONTROL] = "MISCELLANEOUS_CONTROL",
+    [CC_READ_SUBTRACT_LINE] = "READ_SUBTRACT_LINE",
+    [CC_UPDATE_CLOCK] = "UPDATE_CLOCK",
+    [CC_READ_OFFSET] = "READ_OFFSET",
+    [CC_OPEN_DRIVER] = "OPEN_DRIVER",
+    [CC_CLOSE_DRIVER] = "CLOSE_DRIVER",
+    [CC_AO_TIP_TILT] = "AO_TIP_TILT",
+    [CC_AO_SET_FOCUS] = "AO_SET_FOCUS",
+    [CC_AO_DELAY] = "AO_DELAY",
+    [CC_END_READOUT] = "END_READOUT",
+    [CC_OPEN_DEVICE] = "OPEN_DEVICE",
+    [CC_CLOSE_DEVICE] = "CLOSE_DEVICE",
+    [CC_START_READOUT] = "START_READOUT",
+    [CC_GET_ERROR_STRING] = "GET_ERROR_STRING",
+    [CC_QUERY_USB] = "QUERY_USB",
+    [CC_CFW] = "CFW",
+    [CC_AO_CENTER] = "AO_CENTER",
+    [CC_QUERY_ETHERNET] = "QUERY_ETHERNET",
+    [CC_START_EXPOSURE2] = "START_EXPOSURE2",
+    [CC_SET_TEMPERATURE_REGULATION2] = "SET_TEMPERATURE_REGULATION2",
+    [CC_READ_OFFSET2] = "READ_OFFSET2",
+};
+
+static const char *cmdstr (int cmd)
+{
+    static char buf[16];
+    int max = sizeof (cmdtab) / sizeof (cmdtab[0]);
+
+    if (cmd >= 0 && cmd < max && cmdtab[cmd])
+        return cmdtab[cmd];
+    snprintf (buf, sizeof (buf), "CMD_%d", cmd);
+    return buf;
+}
+
+static uint64_t elapsed_ns (struct timespec *t0, struct timespec *t1)
+{
+    return (uint64_t)(t1->tv_sec - t0->tv_sec) * 1000000000ULL
+                    + t1->tv_nsec - t0->tv_nsec;
+}
+
+static int hist_bucket (uint32_t ns)
+{
+    int e;
+
+    if (ns < 8)
+        return ns;
+    e = 31 - __builtin_clz (ns);
+    return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+}
+
+/* Return the midpoint of the range of values covered by bucket 'b'.
+ */
+static uint32_t hist_value (int b)
+{
+    int e;
+    uint64_t lo;
+
+    if (b < 8)
+        return b;
+    e = b / 8 + 2;
+    lo = (uint64_t)(8 + b % 8) << (e - 3);
+    return lo + ((1ULL << (e - 3)) >> 1);
+}
+
+static uint32_t percentile (struct cmd_stats *cs, double p)
+{
+    unsigned long rank = p * cs->count + 0.5;
+    unsigned long sum = 0;
+    uint32_t val = cs->max;
+    int b;
+
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        sum += cs->hist[b];
+        if (sum >= rank) {
+            val = hist_value (b);
+            break;
+        }
+    }
+    if (val < cs->min)
+        val = cs->min;
+    if (val > cs->max)
+        val = cs->max;
+    return val;
+}
+
+static short trace_fun (short cmd, void *parm, void *result)
+{
+    struct sbig_trace *tr = active;
+    struct timespec t0, t1;
+    struct cmd_stats *cs;
+    uint64_t ns;
+    uint32_t dur;
+    short e;
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    e = tr->fun (cmd, parm, result);
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+
+    ns = elapsed_ns (&t0, &t1);
+    dur = ns > UINT32_MAX ? UINT32_MAX : ns;
+    if (cmd >= 0 && cmd < CC_LAST_COMMAND) {
+        cs = &tr->cmd[cmd];
+        if (cs->count == 0 || dur < cs->min)
+            cs->min = dur;
+        if (dur > cs->max)
+            cs->max = dur;
+        cs->count++;
+        cs->total += dur;
+        cs->hist[hist_bucket (dur)]++;
+        if (e != CE_NO_ERROR) {
+            cs->errors++;
+            if (e > 0 && e < CE_NEXT_ERROR)
+                cs->errcount[e]++;
+        }
+    }
+    if (tr->f) {
+        struct sbig_trace_record rec = {
+            .start = elapsed_ns (&tr->t0, &t0),
+            .duration = dur,
+            .cmd = cmd,
+            .error = e,
+        };
+        if (fwrite (&rec, sizeof (rec), 1, tr->f) != 1) {
+            fclose (tr->f);
+            tr->f = NULL;
+        }
+    }
+    return e;
+}
+
+int sbig_trace_enable (sbig_t *sb, const char *path)
+{
+    struct sbig_trace *tr;
+
+    if (!sb->fun || sb->trace || active)
+        return CE_BAD_PARAMETER;
+    if (!(tr = calloc (1, sizeof (*tr))))
+        return CE_MEMORY_ERROR;
+    if (path) {
+        if (!(tr->f = fopen (path, "w"))) {
+            free (tr);
+            return CE_OS_ERROR;
+        }
+        setvbuf (tr->f, NULL, _IOFBF, 1024*1024);
+        if (fwrite (SBIG_TRACE_MAGIC, 8, 1, tr->f) != 1) {
+            fclose (tr->f);
+            free (tr);
+            return CE_OS_ERROR;
+        }
+    }
+    clock_gettime (CLOCK_MONOTONIC, &tr->t0);
+    tr->fun = sb->fun;
+    sb->trace = tr;
+    sb->fun = trace_fun;
+    active = tr;
+    return CE_NO_ERROR;
+}
+
+void sbig_trace_summary (sbig_t *sb, FILE *f)
+{
+    struct sbig_trace *tr = sb->trace;
+    struct timespec now;
+    uint64_t wall, drv = 0;
+    int i, j;
+
+    if (!tr)
+        return;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    wall = elapsed_ns (&tr->t0, &now);
+    fprintf (f, "%-28s %8s %6s %10s %9s %9s %9s %9s %9s\n",
+             "command", "count", "errors", "total-ms",
+             "min-us", "mean-us", "p50-us", "p99-us", "max-us");
+    for (i = 0; i < CC_LAST_COMMAND; i++) {
+        struct cmd_stats *cs = &tr->cmd[i];
+        if (cs->count == 0)
+            continue;
+        drv += cs->total;
+        fprintf (f, "%-28s %8lu %6lu %10.3f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                 cmdstr (i), cs->count, cs->errors, 1E-6 * cs->total,
+                 1E-3 * cs->min, 1E-3 * cs->total / cs->count,
+                 1E-3 * percentile (cs, 0.50), 1E-3 * percentile (cs, 0.99),
+                 1E-3 * cs->max);
+        for (j = 0; j < CE_NEXT_ERROR; j++) {
+            if (cs->errcount[j] > 0)
+                fprintf (f, "%-28s %8lu error %d\n", "", cs->errcount[j], j);
+        }
+    }
+    fprintf (f, "driver time %.3fs of %.3fs elapsed (%.1f%%)\n",
+             1E-9 * drv, 1E-9 * wall, wall > 0 ? 100.0 * drv / wall : 0);
+}
+
+void sbig_trace_disable (sbig_t *sb)
+{
+    struct sbig_trace *tr = sb->trace;
+
+    if (!tr)
+        return;
+    sb->fun = tr->fun;
+    sb->trace = NULL;
+    if (tr->f)
+        fclose (tr->f);
+    if (active == tr)
+        active = NULL;
+    free (tr);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
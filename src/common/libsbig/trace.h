@@ -0,0 +1,37 @@
+#ifndef _SBIG_TRACE_H
+#define _SBIG_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "handle.h"
+
+/* Trace driver calls made through the handle, accumulating per-command
+ * count, error, and latency statistics.  If 'path' is non-NULL, a binary
+ * record of each call is also written there: the 8 byte SBIG_TRACE_MAGIC
+ * followed by one struct sbig_trace_record per call, in host byte order.
+ * Enable after sbig_dlopen().  sbig_dlopen() enables tracing itself if
+ * SBIG_TRACE or SBIG_TRACE_FILE is set in the environment.
+ */
+#define SBIG_TRACE_MAGIC    "SBTRACE1"
+
+struct sbig_trace_record {
+    uint64_t start;     /* ns since tracing was enabled */
+    uint32_t duration;  /* ns */
+    uint16_t cmd;       /* PAR_COMMAND */
+    uint16_t error;     /* PAR_ERROR */
+};
+
+int sbig_trace_enable (sbig_t *sb, const char *path);
+void sbig_trace_disable (sbig_t *sb);
+
+/* Print a per-command latency summary to 'f'.  If tracing is enabled,
+ * sbig_destroy() prints this to stderr.
+ */
+void sbig_trace_summary (sbig_t *sb, FILE *f);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
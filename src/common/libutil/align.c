@@ -0,0 +1,459 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Phase correlation.
+ *
+ * The FFT is an iterative radix 2 transform over single precision
+ * complex values, kept as pairs of floats rather than C99 complex so the
+ * compiler doesn't have to call out for every multiply.  Columns are
+ * copied out to scratch a few at a time, so that each row of the grid is
+ * read a cache line at a time, transformed, and copied back.
+ *
+ * Frames are made zero mean and tapered to zero at the edges with a Hann
+ * window before transforming, so the edges of the frame (which don't
+ * move with the image) don't correlate and pull the peak toward zero.
+ *
+ * The normalized cross power spectrum is tapered with a Gaussian before
+ * it is transformed back.  Its high frequencies are mostly noise, and
+ * depending on the binning and the seeing, the peak would otherwise be
+ * anything from a sampled sinc to a broad hump.  With the taper it is a
+ * Gaussian of PEAK_SIGMA pixels, which three samples locate exactly.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "rowband.h"
+#include "align.h"
+
+#define COL_BLOCK   8       /* columns transformed together */
+#define PEAK_SIGMA  1.0     /* width of the correlation peak, pixels */
+
+typedef struct {
+    float re, im;
+} cpx_t;
+
+struct fft_plan {
+    int n;
+    cpx_t *twiddle;         /* exp(-2 pi i k / n), k < n / 2 */
+    uint32_t *rev;          /* bit reversal permutation */
+};
+
+struct align {
+    int height, width;
+    int bin;
+    int hb, wb;             /* binned frame */
+    int ny, nx;             /* transform size */
+    struct fft_plan py, px;
+    float *wy, *wx;         /* window */
+    float *gy, *gx;         /* spectrum taper */
+    double gsum;
+    cpx_t *grid;
+    cpx_t *ref;             /* reference spectrum */
+    bool have_ref;
+    int col_bands;
+    cpx_t *scratch;         /* COL_BLOCK columns per band */
+};
+
+struct job {
+    align_t *a;
+    const ushort *data;
+    bool inverse;
+    double mean;
+    double sum[ROWBAND_MAX_BANDS];
+    float peak[ROWBAND_MAX_BANDS];
+    size_t peak_at[ROWBAND_MAX_BANDS];
+};
+
+static int plan_init (struct fft_plan *p, int n)
+{
+    int i, j, bits = 0;
+
+    while ((1 << bits) < n)
+        bits++;
+    p->n = n;
+    p->twiddle = malloc (n / 2 * sizeof (p->twiddle[0]));
+    p->rev = malloc (n * sizeof (p->rev[0]));
+    if (!p->twiddle || !p->rev)
+        return -1;
+    for (i = 0; i < n / 2; i++) {
+        p->twiddle[i].re = cos (2 * M_PI * i / n);
+        p->twiddle[i].im = -sin (2 * M_PI * i / n);
+    }
+    for (i = 0; i < n; i++) {
+        uint32_t r = 0;
+        for (j = 0; j < bits; j++)
+            r |= ((i >> j) & 1) << (bits - 1 - j);
+        p->rev[i] = r;
+    }
+    return 0;
+}
+
+static void plan_fini (struct fft_plan *p)
+{
+    free (p->twiddle);
+    free (p->rev);
+}
+
+/* In place transform of n values.  The inverse is unscaled.
+ */
+static void fft (const struct fft_plan *p, cpx_t *x, bool inverse)
+{
+    int n = p->n;
+    float sign = inverse ? -1 : 1;
+    int i, k, len;
+
+    for (i = 0; i < n; i++) {
+        int j = p->rev[i];
+        if (i < j) {
+            cpx_t t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = n / len;
+        for (i = 0; i < n; i += len) {
+            cpx_t *a = x + i;
+            cpx_t *b = x + i + half;
+            for (k = 0; k < half; k++) {
+                float wr = p->twiddle[k * step].re;
+                float wi = sign * p->twiddle[k * step].im;
+                float vr = b[k].re * wr - b[k].im * wi;
+                float vi = b[k].re * wi + b[k].im * wr;
+                b[k].re = a[k].re - vr;
+                b[k].im = a[k].im - vi;
+                a[k].re += vr;
+                a[k].im += vi;
+            }
+        }
+    }
+}
+
+static int pow2 (int n)
+{
+    int p = 1;
+
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static void hann (float *w, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        w[i] = 0.5 - 0.5 * cos (2 * M_PI * (i + 0.5) / n);
+}
+
+/* Transform of a Gaussian of PEAK_SIGMA pixels, for n frequencies.
+ * Returns the sum.
+ */
+static double taper (float *g, int n)
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        double f = (double)(i < n / 2 ? i : i - n) / n;
+        g[i] = exp (-2 * M_PI * M_PI * PEAK_SIGMA * PEAK_SIGMA * f * f);
+        sum += g[i];
+    }
+    return sum;
+}
+
+align_t *align_create (int height, int width, int bin)
+{
+    align_t *a;
+    int longest = height > width ? height : width;
+
+    if (bin == 0)
+        bin = (longest + ALIGN_AUTO_SIZE - 1) / ALIGN_AUTO_SIZE;
+    if (bin < 1 || bin > 16 || height / bin < 8 || width / bin < 8
+            || pow2 (height / bin) > ALIGN_MAX_SIZE
+            || pow2 (width / bin) > ALIGN_MAX_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(a = calloc (1, sizeof (*a))))
+        return NULL;
+    a->height = height;
+    a->width = width;
+    a->bin = bin;
+    a->hb = height / bin;
+    a->wb = width / bin;
+    a->ny = pow2 (a->hb);
+    a->nx = pow2 (a->wb);
+    a->col_bands = rowband_count (a->nx);
+    a->wy = malloc (a->hb * sizeof (a->wy[0]));
+    a->wx = malloc (a->wb * sizeof (a->wx[0]));
+    a->gy = malloc (a->ny * sizeof (a->gy[0]));
+    a->gx = malloc (a->nx * sizeof (a->gx[0]));
+    a->grid = malloc ((size_t)a->ny * a->nx * sizeof (a->grid[0]));
+    a->ref = malloc ((size_t)a->ny * a->nx * sizeof (a->ref[0]));
+    a->scratch = malloc ((size_t)a->col_bands * COL_BLOCK * a->ny
+                                              * sizeof (a->scratch[0]));
+    if (!a->wy || !a->wx || !a->gy || !a->gx || !a->grid || !a->ref || !a->scratch
+               || plan_init (&a->py, a->ny) < 0
+               || plan_init (&a->px, a->nx) < 0) {
+        align_destroy (a);
+        errno = ENOMEM;
+        return NULL;
+    }
+    hann (a->wy, a->hb);
+    hann (a->wx, a->wb);
+    a->gsum = taper (a->gy, a->ny) * taper (a->gx, a->nx);
+    return a;
+}
+
+void align_destroy (align_t *a)
+{
+    if (a) {
+        int saved_errno = errno;
+        plan_fini (&a->py);
+        plan_fini (&a->px);
+        free (a->wy);
+        free (a->wx);
+        free (a->gy);
+        free (a->gx);
+        free (a->grid);
+        free (a->ref);
+        free (a->scratch);
+        free (a);
+        errno = saved_errno;
+    }
+}
+
+int align_get_bin (align_t *a)
+{
+    return a->bin;
+}
+
+/* Bin the frame into the grid, zero padded, summing each band.
+ */
+static void bin_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    align_t *a = job->a;
+    double sum = 0;
+    int x, y, i, j;
+
+    for (y = first; y < last; y++) {
+        cpx_t *row = a->grid + (size_t)y * a->nx;
+
+        memset (row, 0, a->nx * sizeof (row[0]));
+        if (y >= a->hb)
+            continue;
+        for (i = 0; i < a->bin; i++) {
+            const ushort *src = job->data
+                              + ((size_t)y * a->bin + i) * a->width;
+            for (x = 0; x < a->wb; x++) {
+                for (j = 0; j < a->bin; j++)
+                    row[x].re += src[x * a->bin + j];
+            }
+        }
+        for (x = 0; x < a->wb; x++)
+            sum += row[x].re;
+    }
+    job->sum[band] = sum;
+}
+
+/* Remove the mean, apply the window, and transform the rows.
+ */
+static void window_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    align_t *a = job->a;
+    int x, y;
+
+    for (y = first; y < last && y < a->hb; y++) {
+        cpx_t *row = a->grid + (size_t)y * a->nx;
+        for (x = 0; x < a->wb; x++)
+            row[x].re = (row[x].re - job->mean) * a->wy[y] * a->wx[x];
+        fft (&a->px, row, false);
+    }
+}
+
+static void cols_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    align_t *a = job->a;
+    cpx_t *s = a->scratch + (size_t)band * COL_BLOCK * a->ny;
+    int c, k, y, nb;
+
+    for (c = first; c < last; c += nb) {
+        nb = last - c < COL_BLOCK ? last - c : COL_BLOCK;
+        for (y = 0; y < a->ny; y++) {
+            const cpx_t *row = a->grid + (size_t)y * a->nx + c;
+            for (k = 0; k < nb; k++)
+                s[k * a->ny + y] = row[k];
+        }
+        for (k = 0; k < nb; k++)
+            fft (&a->py, s + k * a->ny, job->inverse);
+        for (y = 0; y < a->ny; y++) {
+            cpx_t *row = a->grid + (size_t)y * a->nx + c;
+            for (k = 0; k < nb; k++)
+                row[k] = s[k * a->ny + y];
+        }
+    }
+}
+
+/* Transform a frame into the grid.
+ */
+static void spectrum (align_t *a, const ushort *data)
+{
+    struct job job = { .a = a, .data = data };
+    int i, nbands = rowband_count (a->ny);
+    double sum = 0;
+
+    rowband_run (a->ny, bin_band, &job);
+    for (i = 0; i < nbands; i++)
+        sum += job.sum[i];
+    job.mean = sum / ((double)a->hb * a->wb);
+    rowband_run (a->hb, window_band, &job);
+    rowband_run (a->nx, cols_band, &job);
+}
+
+/* Form the normalized cross power spectrum with the reference, taper
+ * it, and transform its rows back.
+ */
+static void cross_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    align_t *a = job->a;
+    int x, y;
+
+    for (y = first; y < last; y++) {
+        cpx_t *row = a->grid + (size_t)y * a->nx;
+        const cpx_t *ref = a->ref + (size_t)y * a->nx;
+        for (x = 0; x < a->nx; x++) {
+            float re = row[x].re * ref[x].re + row[x].im * ref[x].im;
+            float im = row[x].im * ref[x].re - row[x].re * ref[x].im;
+            float mag = sqrtf (re * re + im * im);
+            if (mag > 1e-20f) {
+                float g = a->gy[y] * a->gx[x] / mag;
+                row[x].re = re * g;
+                row[x].im = im * g;
+            } else
+                row[x].re = row[x].im = 0;
+        }
+        fft (&a->px, row, true);
+    }
+}
+
+static void peak_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    align_t *a = job->a;
+    size_t i = (size_t)first * a->nx, end = (size_t)last * a->nx;
+    size_t at = i;
+    float peak = a->grid[i].re;
+
+    for (; i < end; i++) {
+        if (a->grid[i].re > peak) {
+            peak = a->grid[i].re;
+            at = i;
+        }
+    }
+    job->peak[band] = peak;
+    job->peak_at[band] = at;
+}
+
+/* Offset of the peak of a Gaussian through (-1, l), (0, c), (1, r),
+ * or of a parabola if the samples aren't all positive.
+ */
+static double subpixel (double l, double c, double r)
+{
+    double d, off;
+
+    if (l > 0 && c > 0 && r > 0) {
+        l = log (l);
+        c = log (c);
+        r = log (r);
+    }
+    d = l - 2 * c + r;
+    off = d < 0 ? 0.5 * (l - r) / d : 0;
+    return off < -0.5 ? -0.5 : off > 0.5 ? 0.5 : off;
+}
+
+int align_set_reference (align_t *a, const ushort *data)
+{
+    spectrum (a, data);
+    memcpy (a->ref, a->grid, (size_t)a->ny * a->nx * sizeof (a->ref[0]));
+    a->have_ref = true;
+    return 0;
+}
+
+int align_measure (align_t *a, const ushort *data, struct align_result *r)
+{
+    struct job job = { .a = a, .inverse = true };
+    int i, px, py, nbands = rowband_count (a->ny);
+    size_t at = 0;
+    float peak = -INFINITY;
+    double dx, dy;
+
+    if (!a->have_ref) {
+        errno = EINVAL;
+        return -1;
+    }
+    spectrum (a, data);
+    rowband_run (a->ny, cross_band, &job);
+    rowband_run (a->nx, cols_band, &job);
+    rowband_run (a->ny, peak_band, &job);
+    for (i = 0; i < nbands; i++) {
+        if (job.peak[i] > peak) {
+            peak = job.peak[i];
+            at = job.peak_at[i];
+        }
+    }
+    py = at / a->nx;
+    px = at % a->nx;
+    dx = px + subpixel (a->grid[py * a->nx + (px + a->nx - 1) % a->nx].re, peak,
+                        a->grid[py * a->nx + (px + 1) % a->nx].re);
+    dy = py + subpixel (a->grid[((py + a->ny - 1) % a->ny) * a->nx + px].re,
+                        peak, a->grid[((py + 1) % a->ny) * a->nx + px].re);
+    if (dx >= a->nx / 2)
+        dx -= a->nx;
+    if (dy >= a->ny / 2)
+        dy -= a->ny;
+    r->dx = dx * a->bin;
+    r->dy = dy * a->bin;
+    r->confidence = peak / a->gsum;
+    if (r->confidence < 0)
+        r->confidence = 0;
+    if (r->confidence > 1)
+        r->confidence = 1;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
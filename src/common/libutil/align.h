@@ -0,0 +1,56 @@
+#ifndef _UTIL_ALIGN_H
+#define _UTIL_ALIGN_H
+
+#include <sys/types.h>
+
+/* Frame registration by phase correlation: measure the translation of a
+ * frame of 'height' rows of 'width' pixels from a reference frame.
+ *
+ * Frames are binned, windowed, and padded to a power of two in each
+ * dimension, then transformed.  The normalized cross power spectrum of
+ * the two is transformed back, and the position of its peak, refined to
+ * a fraction of a pixel, is the offset.  The transform plan (twiddle
+ * factors, bit reversal, scratch) is made once for the geometry by
+ * align_create(), and the reference spectrum is kept, so measuring a
+ * frame costs one forward and one inverse transform.  Rows and columns
+ * are transformed in parallel on the rowband thread pool.
+ *
+ * Functions return -1 or NULL with errno set on failure.
+ */
+
+typedef struct align align_t;
+
+struct align_result {
+    double dx, dy;          /* frame position - reference position, pixels */
+    double confidence;      /* correlation peak height, 0 to 1 */
+};
+
+#define ALIGN_MAX_SIZE      4096    /* transform size limit, binned pixels */
+#define ALIGN_AUTO_SIZE     512     /* bin 0 bins to about this size */
+
+/* Create a plan for frames of height x width, binned 'bin' x 'bin'
+ * (1-16), or with 'bin' = 0 just enough to fit ALIGN_AUTO_SIZE.
+ * Returns NULL (errno = EINVAL) if the binned frame would exceed
+ * ALIGN_MAX_SIZE or be smaller than 8 pixels.
+ */
+align_t *align_create (int height, int width, int bin);
+void align_destroy (align_t *a);
+
+/* Get the binning in use.
+ */
+int align_get_bin (align_t *a);
+
+/* Set the frame that offsets are measured from.
+ */
+int align_set_reference (align_t *a, const ushort *data);
+
+/* Measure a frame's offset from the reference.  Returns -1
+ * (errno = EINVAL) if no reference has been set.
+ */
+int align_measure (align_t *a, const ushort *data, struct align_result *r);
+
+#endif /* !_UTIL_ALIGN_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
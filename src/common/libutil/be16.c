@@ -0,0 +1,135 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Unsigned 16 bit pixels to FITS representation.
+ *
+ * FITS stores 16 bit integers big endian and signed; unsigned data is
+ * stored offset by BZERO = 32768, which for 16 bits is flipping the top
+ * bit.  Vector versions do 16 (AVX2) or 8 (SSE2, NEON) pixels at a time:
+ * flip, then swap the bytes of each lane.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "rowband.h"
+#include "be16.h"
+
+#if defined(__AVX2__)
+static size_t be16_vec (void *dst, const ushort *src, size_t n)
+{
+    const __m256i flip = _mm256_set1_epi16 ((short)0x8000);
+    const __m256i swap = _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6,
+                                           9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6,
+                                           9, 8, 11, 10, 13, 12, 15, 14);
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)(src + i));
+        v = _mm256_shuffle_epi8 (_mm256_xor_si256 (v, flip), swap);
+        _mm256_storeu_si256 ((__m256i *)(out + 2 * i), v);
+    }
+    return i;
+}
+#elif defined(__SSE2__)
+static size_t be16_vec (void *dst, const ushort *src, size_t n)
+{
+    const __m128i flip = _mm_set1_epi16 ((short)0x8000);
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(src + i));
+        v = _mm_xor_si128 (v, flip);
+        v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+        _mm_storeu_si128 ((__m128i *)(out + 2 * i), v);
+    }
+    return i;
+}
+#elif defined(__ARM_NEON)
+static size_t be16_vec (void *dst, const ushort *src, size_t n)
+{
+    const uint16x8_t flip = vdupq_n_u16 (0x8000);
+    uint8_t *out = dst;
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint16x8_t v = veorq_u16 (vld1q_u16 (src + i), flip);
+        vst1q_u8 (out + 2 * i, vrev16q_u8 (vreinterpretq_u8_u16 (v)));
+    }
+    return i;
+}
+#else
+static size_t be16_vec (void *dst, const ushort *src, size_t n)
+{
+    return 0;
+}
+#endif
+
+void be16_store_pixels (void *dst, const ushort *src, size_t n)
+{
+    uint8_t *out = dst;
+    size_t i = be16_vec (dst, src, n);
+
+    for (; i < n; i++) {
+        ushort v = src[i] ^ 0x8000;
+
+        out[2 * i] = v >> 8;
+        out[2 * i + 1] = v & 0xff;
+    }
+}
+
+struct be16 {
+    uint8_t *dst;
+    const ushort *src;
+    int width;
+};
+
+static void be16_band (int band, int first, int last, void *arg)
+{
+    struct be16 *b = arg;
+    size_t offset = (size_t)first * b->width;
+
+    be16_store_pixels (b->dst + 2 * offset, b->src + offset,
+                       (size_t)(last - first) * b->width);
+}
+
+void be16_store_frame (void *dst, const ushort *src, int height, int width)
+{
+    struct be16 b = { .dst = dst, .src = src, .width = width };
+
+    rowband_run (height, be16_band, &b);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
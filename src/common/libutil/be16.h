@@ -0,0 +1,21 @@
+#ifndef _UTIL_BE16_H
+#define _UTIL_BE16_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Store 'n' unsigned 16 bit pixels at 'dst' (any alignment) as FITS
+ * 16 bit integers: big endian, signed, offset by BZERO = 32768.
+ */
+void be16_store_pixels (void *dst, const ushort *src, size_t n);
+
+/* Store a frame of 'height' rows of 'width' pixels, spread over the
+ * rowband thread pool.
+ */
+void be16_store_frame (void *dst, const ushort *src, int height, int width);
+
+#endif /* !_UTIL_BE16_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,245 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Dark subtraction and flat fielding.
+ *
+ * Vector versions widen 8 pixels at a time to 32 bit lanes, subtract the
+ * dark, and either add the pedestal as integers or, with a flat, convert
+ * to float and multiply-add gain and pedestal in one step.  The result is
+ * narrowed back to 16 bits with unsigned saturation, which does the
+ * clamping.  Float to integer conversion rounds to nearest even, as
+ * lrintf() does in the scalar version.  Where the multiply-add is fused
+ * (FMA, NEON), results may differ from the scalar version by one when
+ * the unrounded product lands on a rounding boundary.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "rowband.h"
+#include "calibrate.h"
+
+#if defined(__AVX2__)
+static inline __m256i load8 (const ushort *p)
+{
+    return _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *)p));
+}
+
+static inline __m256i scale8 (__m256i v, const float *g, __m256 ped)
+{
+#if defined(__FMA__)
+    __m256 f = _mm256_fmadd_ps (_mm256_cvtepi32_ps (v), _mm256_loadu_ps (g),
+                                ped);
+#else
+    __m256 f = _mm256_add_ps (_mm256_mul_ps (_mm256_cvtepi32_ps (v),
+                                             _mm256_loadu_ps (g)), ped);
+#endif
+    return _mm256_cvtps_epi32 (f);
+}
+
+static size_t calibrate_vec (ushort *data, const ushort *dark,
+                             const float *gain, int pedestal, size_t n)
+{
+    const __m256i ped = _mm256_set1_epi32 (pedestal);
+    const __m256 pedf = _mm256_set1_ps (pedestal);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i a = load8 (data + i);
+        __m256i b = load8 (data + i + 8);
+        __m256i r;
+
+        if (dark) {
+            a = _mm256_sub_epi32 (a, load8 (dark + i));
+            b = _mm256_sub_epi32 (b, load8 (dark + i + 8));
+        }
+        if (gain) {
+            a = scale8 (a, gain + i, pedf);
+            b = scale8 (b, gain + i + 8, pedf);
+        } else {
+            a = _mm256_add_epi32 (a, ped);
+            b = _mm256_add_epi32 (b, ped);
+        }
+        /* packus works within 128 bit lanes, so put the quadwords back
+         * in order afterwards.
+         */
+        r = _mm256_permute4x64_epi64 (_mm256_packus_epi32 (a, b), 0xd8);
+        _mm256_storeu_si256 ((__m256i *)(data + i), r);
+    }
+    return i;
+}
+#elif defined(__SSE2__)
+static inline __m128i scale4 (__m128i v, const float *g, __m128 ped)
+{
+    __m128 f = _mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (v), _mm_loadu_ps (g)),
+                           ped);
+    return _mm_cvtps_epi32 (f);
+}
+
+/* SSE2 has only a signed 32->16 pack, so bias to signed and back,
+ * clamping below at zero first.
+ */
+static inline __m128i pack8 (__m128i lo, __m128i hi)
+{
+    const __m128i bias32 = _mm_set1_epi32 (32768);
+    const __m128i bias16 = _mm_set1_epi16 ((short)0x8000);
+    const __m128i zero = _mm_setzero_si128 ();
+
+    lo = _mm_and_si128 (lo, _mm_cmpgt_epi32 (lo, zero));
+    hi = _mm_and_si128 (hi, _mm_cmpgt_epi32 (hi, zero));
+    return _mm_xor_si128 (_mm_packs_epi32 (_mm_sub_epi32 (lo, bias32),
+                                           _mm_sub_epi32 (hi, bias32)),
+                          bias16);
+}
+
+static size_t calibrate_vec (ushort *data, const ushort *dark,
+                             const float *gain, int pedestal, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i ped = _mm_set1_epi32 (pedestal);
+    const __m128 pedf = _mm_set1_ps (pedestal);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(data + i));
+        __m128i lo = _mm_unpacklo_epi16 (v, zero);
+        __m128i hi = _mm_unpackhi_epi16 (v, zero);
+
+        if (dark) {
+            __m128i d = _mm_loadu_si128 ((const __m128i *)(dark + i));
+            lo = _mm_sub_epi32 (lo, _mm_unpacklo_epi16 (d, zero));
+            hi = _mm_sub_epi32 (hi, _mm_unpackhi_epi16 (d, zero));
+        }
+        if (gain) {
+            lo = scale4 (lo, gain + i, pedf);
+            hi = scale4 (hi, gain + i + 4, pedf);
+        } else {
+            lo = _mm_add_epi32 (lo, ped);
+            hi = _mm_add_epi32 (hi, ped);
+        }
+        _mm_storeu_si128 ((__m128i *)(data + i), pack8 (lo, hi));
+    }
+    return i;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline int32x4_t scale4 (int32x4_t v, const float *g, float32x4_t ped)
+{
+    return vcvtnq_s32_f32 (vfmaq_f32 (ped, vcvtq_f32_s32 (v), vld1q_f32 (g)));
+}
+
+static size_t calibrate_vec (ushort *data, const ushort *dark,
+                             const float *gain, int pedestal, size_t n)
+{
+    const int32x4_t ped = vdupq_n_s32 (pedestal);
+    const float32x4_t pedf = vdupq_n_f32 (pedestal);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16 (data + i);
+        int32x4_t lo = vreinterpretq_s32_u32 (vmovl_u16 (vget_low_u16 (v)));
+        int32x4_t hi = vreinterpretq_s32_u32 (vmovl_u16 (vget_high_u16 (v)));
+
+        if (dark) {
+            uint16x8_t d = vld1q_u16 (dark + i);
+            lo = vsubq_s32 (lo, vreinterpretq_s32_u32 (
+                                    vmovl_u16 (vget_low_u16 (d))));
+            hi = vsubq_s32 (hi, vreinterpretq_s32_u32 (
+                                    vmovl_u16 (vget_high_u16 (d))));
+        }
+        if (gain) {
+            lo = scale4 (lo, gain + i, pedf);
+            hi = scale4 (hi, gain + i + 4, pedf);
+        } else {
+            lo = vaddq_s32 (lo, ped);
+            hi = vaddq_s32 (hi, ped);
+        }
+        vst1q_u16 (data + i, vcombine_u16 (vqmovun_s32 (lo),
+                                           vqmovun_s32 (hi)));
+    }
+    return i;
+}
+#else
+static size_t calibrate_vec (ushort *data, const ushort *dark,
+                             const float *gain, int pedestal, size_t n)
+{
+    return 0;
+}
+#endif
+
+void calibrate_pixels (ushort *data, const ushort *dark, const float *gain,
+                       int pedestal, size_t n)
+{
+    size_t i = calibrate_vec (data, dark, gain, pedestal, n);
+
+    for (; i < n; i++) {
+        long v = data[i];
+
+        if (dark)
+            v -= dark[i];
+        if (gain)
+            v = lrintf ((float)v * gain[i] + pedestal);
+        else
+            v += pedestal;
+        data[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+    }
+}
+
+struct calibrate {
+    ushort *data;
+    const ushort *dark;
+    const float *gain;
+    int pedestal;
+    int width;
+};
+
+static void calibrate_band (int band, int first, int last, void *arg)
+{
+    struct calibrate *c = arg;
+    size_t offset = (size_t)first * c->width;
+
+    calibrate_pixels (c->data + offset, c->dark ? c->dark + offset : NULL,
+                      c->gain ? c->gain + offset : NULL, c->pedestal,
+                      (size_t)(last - first) * c->width);
+}
+
+void calibrate_frame (ushort *data, const ushort *dark, const float *gain,
+                      int pedestal, int height, int width)
+{
+    struct calibrate c = { .data = data, .dark = dark, .gain = gain,
+                           .pedestal = pedestal, .width = width };
+
+    rowband_run (height, calibrate_band, &c);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
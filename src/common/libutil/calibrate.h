@@ -0,0 +1,27 @@
+#ifndef _UTIL_CALIBRATE_H
+#define _UTIL_CALIBRATE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Calibrate 'n' pixels in place:
+ *     data = (data - dark) * gain + pedestal
+ * rounded to nearest and clamped to 0-65535, where 'gain' is the
+ * reciprocal of a flat normalized to a mean of 1.  Either 'dark' or
+ * 'gain' may be NULL to skip that step.  The pedestal keeps pixels
+ * below the dark level (noise) from clipping to zero.
+ */
+void calibrate_pixels (ushort *data, const ushort *dark, const float *gain,
+                       int pedestal, size_t n);
+
+/* Calibrate a frame of 'height' rows of 'width' pixels, spread over the
+ * rowband thread pool.
+ */
+void calibrate_frame (ushort *data, const ushort *dark, const float *gain,
+                      int pedestal, int height, int width);
+
+#endif /* !_UTIL_CALIBRATE_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
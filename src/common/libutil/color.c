@@ -24,45 +24,324 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "color.h"
+#include "xzmalloc.h"
+#include "rowband.h"
+
+/* The kernel is
+ *     1 1 1
+ *     2 4 2
+ *     1 1 1
+ * normalized by the sum of the weights that fall inside the image,
+ * which is 14 for interior pixels.  Each output row is computed from
+ * three input rows: 'a' (above), 'c' (center), and 'b' (below), where
+ * 'a' or 'b' is NULL on the first or last row.
+ */
+
+/* Any pixel, with bounds checking.
+ */
+static ushort edge_pixel (const ushort *a, const ushort *c, const ushort *b,
+                          int width, int col)
+{
+    int lo = col > 0 ? col - 1 : col;
+    int hi = col < width - 1 ? col + 1 : col;
+    int val = 0, count = 0;
+    int i;
+
+    for (i = lo; i <= hi; i++) {
+        int w = (i == col ? 2 : 1);
+        if (a) {
+            val += a[i];
+            count++;
+        }
+        val += c[i] * 2 * w;
+        count += 2 * w;
+        if (b) {
+            val += b[i];
+            count++;
+        }
+    }
+    val /= count;
+    if (val < 0 || val > 65535)
+        val = 65535;
+    return val;
+}
+
+/* Interior pixel: all weights present, so sum <= 14 * 65535 (20 bits).
+ */
+static inline ushort interior_pixel (const ushort *a, const ushort *c,
+                                     const ushort *b, int col)
+{
+    int val = a[col - 1] + a[col] + a[col + 1]
+            + b[col - 1] + b[col] + b[col + 1]
+            + 2 * (c[col - 1] + c[col + 1]) + 4 * c[col];
+    return val / 14;
+}
+
+/* Vector versions compute 8 interior pixels at a time in 32 bit lanes and
+ * divide by 14 as trunc ((val + 0.5) * (1/14)) in single precision.
+ * For val < 2^20 the rounding error is < 0.01 while the fractional part
+ * of (val + 0.5) / 14 lies in [0.5/14, 13.5/14], so this is exact.
+ */
+#if defined(__AVX2__)
+static inline __m256i load8 (const ushort *p)
+{
+    return _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *)p));
+}
+
+static int interior_row8 (const ushort *a, const ushort *c, const ushort *b,
+                          ushort *out, int col, int end)
+{
+    const __m256 half = _mm256_set1_ps (0.5f);
+    const __m256 scale = _mm256_set1_ps (1.0f / 14);
+
+    for (; col + 8 <= end; col += 8) {
+        __m256i edge = _mm256_add_epi32 (
+                       _mm256_add_epi32 (load8 (a + col - 1),
+                                         load8 (a + col + 1)),
+                       _mm256_add_epi32 (load8 (b + col - 1),
+                                         load8 (b + col + 1)));
+        __m256i mid = _mm256_add_epi32 (load8 (a + col), load8 (b + col));
+        __m256i side = _mm256_add_epi32 (load8 (c + col - 1),
+                                         load8 (c + col + 1));
+        __m256i val = _mm256_add_epi32 (
+                      _mm256_add_epi32 (edge, mid),
+                      _mm256_add_epi32 (_mm256_slli_epi32 (side, 1),
+                                        _mm256_slli_epi32 (load8 (c + col), 2)));
+        __m256 f = _mm256_mul_ps (_mm256_add_ps (_mm256_cvtepi32_ps (val),
+                                                 half), scale);
+        __m256i q = _mm256_cvttps_epi32 (f);
+        __m128i r = _mm_packus_epi32 (_mm256_castsi256_si128 (q),
+                                      _mm256_extracti128_si256 (q, 1));
+        _mm_storeu_si128 ((__m128i *)(out + col), r);
+    }
+    return col;
+}
+#elif defined(__SSE2__)
+static inline void load8 (const ushort *p, __m128i *lo, __m128i *hi)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+
+    *lo = _mm_unpacklo_epi16 (v, zero);
+    *hi = _mm_unpackhi_epi16 (v, zero);
+}
+
+static inline __m128i quotient4 (__m128i val)
+{
+    const __m128 half = _mm_set1_ps (0.5f);
+    const __m128 scale = _mm_set1_ps (1.0f / 14);
+
+    return _mm_cvttps_epi32 (_mm_mul_ps (_mm_add_ps (_mm_cvtepi32_ps (val),
+                                                     half), scale));
+}
+
+static int interior_row8 (const ushort *a, const ushort *c, const ushort *b,
+                          ushort *out, int col, int end)
+{
+    const __m128i bias32 = _mm_set1_epi32 (32768);
+    const __m128i bias16 = _mm_set1_epi16 ((short)0x8000);
 
-static void addcell (ushort *frame, int width, int height,
-                    int row, int col, int weight,
-                    int *val, int *count)
+    for (; col + 8 <= end; col += 8) {
+        const ushort *taps[6] = { a + col - 1, a + col, a + col + 1,
+                                  b + col - 1, b + col, b + col + 1 };
+        __m128i lo = _mm_setzero_si128 ();
+        __m128i hi = _mm_setzero_si128 ();
+        __m128i l, h, r;
+        int i;
+
+        for (i = 0; i < 6; i++) {
+            load8 (taps[i], &l, &h);
+            lo = _mm_add_epi32 (lo, l);
+            hi = _mm_add_epi32 (hi, h);
+        }
+        load8 (c + col - 1, &l, &h);
+        lo = _mm_add_epi32 (lo, _mm_slli_epi32 (l, 1));
+        hi = _mm_add_epi32 (hi, _mm_slli_epi32 (h, 1));
+        load8 (c + col + 1, &l, &h);
+        lo = _mm_add_epi32 (lo, _mm_slli_epi32 (l, 1));
+        hi = _mm_add_epi32 (hi, _mm_slli_epi32 (h, 1));
+        load8 (c + col, &l, &h);
+        lo = _mm_add_epi32 (lo, _mm_slli_epi32 (l, 2));
+        hi = _mm_add_epi32 (hi, _mm_slli_epi32 (h, 2));
+
+        /* SSE2 has only a signed 32->16 pack, so bias to signed and back.
+         */
+        r = _mm_packs_epi32 (_mm_sub_epi32 (quotient4 (lo), bias32),
+                             _mm_sub_epi32 (quotient4 (hi), bias32));
+        _mm_storeu_si128 ((__m128i *)(out + col), _mm_xor_si128 (r, bias16));
+    }
+    return col;
+}
+#elif defined(__ARM_NEON)
+static inline uint32x4_t quotient4 (uint32x4_t val)
 {
-    if (row >= 0 && row < height && col >= 0 && col < width) {
-        *val += frame[(row * width) + col] * weight;
-        *count += weight;
+    float32x4_t f = vaddq_f32 (vcvtq_f32_u32 (val), vdupq_n_f32 (0.5f));
+
+    return vcvtq_u32_f32 (vmulq_f32 (f, vdupq_n_f32 (1.0f / 14)));
+}
+
+static int interior_row8 (const ushort *a, const ushort *c, const ushort *b,
+                          ushort *out, int col, int end)
+{
+    for (; col + 8 <= end; col += 8) {
+        uint16x8_t a0 = vld1q_u16 (a + col - 1);
+        uint16x8_t a1 = vld1q_u16 (a + col);
+        uint16x8_t a2 = vld1q_u16 (a + col + 1);
+        uint16x8_t b0 = vld1q_u16 (b + col - 1);
+        uint16x8_t b1 = vld1q_u16 (b + col);
+        uint16x8_t b2 = vld1q_u16 (b + col + 1);
+        uint16x8_t c0 = vld1q_u16 (c + col - 1);
+        uint16x8_t c1 = vld1q_u16 (c + col);
+        uint16x8_t c2 = vld1q_u16 (c + col + 1);
+        uint32x4_t lo, hi;
+
+        lo = vaddl_u16 (vget_low_u16 (a0), vget_low_u16 (a2));
+        hi = vaddl_u16 (vget_high_u16 (a0), vget_high_u16 (a2));
+        lo = vaddw_u16 (lo, vget_low_u16 (a1));
+        hi = vaddw_u16 (hi, vget_high_u16 (a1));
+        lo = vaddw_u16 (lo, vget_low_u16 (b0));
+        hi = vaddw_u16 (hi, vget_high_u16 (b0));
+        lo = vaddw_u16 (lo, vget_low_u16 (b1));
+        hi = vaddw_u16 (hi, vget_high_u16 (b1));
+        lo = vaddw_u16 (lo, vget_low_u16 (b2));
+        hi = vaddw_u16 (hi, vget_high_u16 (b2));
+        lo = vmlal_n_u16 (lo, vget_low_u16 (c0), 2);
+        hi = vmlal_n_u16 (hi, vget_high_u16 (c0), 2);
+        lo = vmlal_n_u16 (lo, vget_low_u16 (c2), 2);
+        hi = vmlal_n_u16 (hi, vget_high_u16 (c2), 2);
+        lo = vmlal_n_u16 (lo, vget_low_u16 (c1), 4);
+        hi = vmlal_n_u16 (hi, vget_high_u16 (c1), 4);
+
+        vst1q_u16 (out + col, vcombine_u16 (vmovn_u32 (quotient4 (lo)),
+                                            vmovn_u32 (quotient4 (hi))));
     }
+    return col;
+}
+#else
+static int interior_row8 (const ushort *a, const ushort *c, const ushort *b,
+                          ushort *out, int col, int end)
+{
+    return col;
 }
+#endif
 
-void color_bayer_to_mono (ushort *in, ushort *out, int width, int height)
+static void convert_row (const ushort *a, const ushort *c, const ushort *b,
+                         ushort *out, int width)
 {
-    int row, col;
-
-    for (row = 0; row < height;  row++) {
-        for (col = 0; col < width; col++) {
-            int count = 0;
-            int val = 0;
-
-            addcell (in, width, height, row - 1, col - 1, 1, &val, &count);
-            addcell (in, width, height, row - 1, col + 0, 1, &val, &count);
-            addcell (in, width, height, row - 1, col + 1, 1, &val, &count);
-
-            addcell (in, width, height, row + 0, col - 1, 2, &val, &count);
-            addcell (in, width, height, row + 0, col + 0, 4, &val, &count);
-            addcell (in, width, height, row + 0, col + 1, 2, &val, &count);
-
-            addcell (in, width, height, row + 1, col - 1, 1, &val, &count);
-            addcell (in, width, height, row + 1, col + 0, 1, &val, &count);
-            addcell (in, width, height, row + 1, col + 1, 1, &val, &count);
-
-            val /= count;
-            if (val < 0 || val > 65535)
-                val = 65535;
-            out[(row * width) + col] = (ushort)val;
-         }
+    int col;
+
+    if (!a || !b || width < 3) {
+        for (col = 0; col < width; col++)
+            out[col] = edge_pixel (a, c, b, width, col);
+        return;
+    }
+    out[0] = edge_pixel (a, c, b, width, 0);
+    col = interior_row8 (a, c, b, out, 1, width - 1);
+    for (; col < width - 1; col++)
+        out[col] = interior_pixel (a, c, b, col);
+    out[width - 1] = edge_pixel (a, c, b, width, width - 1);
+}
+
+struct bayer {
+    ushort *in;
+    ushort *out;
+    int width;
+    int height;
+    ushort *edges;      /* per band: original rows first - 1 and last */
+    ushort *lines;      /* per band: two row line buffer */
+};
+
+/* Rows of a band are converted top to bottom.  Copies of the original
+ * center and above rows are kept in a two row line buffer, so 'out' may
+ * overwrite 'in' as it goes.  The rows just outside the band, which
+ * neighboring bands may overwrite, were copied to 'edges' beforehand.
+ */
+static void bayer_band (int band, int first, int last, void *arg)
+{
+    struct bayer *b = arg;
+    int width = b->width;
+    size_t rowsize = width * sizeof (ushort);
+    ushort *line = b->lines + 2 * band * width;
+    ushort *edge_above = b->edges + 2 * band * width;
+    ushort *edge_below = edge_above + width;
+    ushort *above = first > 0 ? edge_above : NULL;
+    ushort *center = line;
+    ushort *spare = line + width;
+    ushort *below, *next;
+    int row;
+
+    memcpy (center, b->in + first * width, rowsize);
+    for (row = first; row < last; row++) {
+        if (row + 1 < last)
+            below = b->in + (row + 1) * width;
+        else
+            below = row + 1 < b->height ? edge_below : NULL;
+        convert_row (above, center, below, b->out + row * width, width);
+        if (row + 1 < last) {
+            /* Recycle the buffer of the row falling out of the window.
+             */
+            next = above ? above : spare;
+            memcpy (next, below, rowsize);
+            above = center;
+            center = next;
+        }
+    }
+}
+
+void color_init (struct color *c)
+{
+    memset (c, 0, sizeof (*c));
+}
+
+void color_fini (struct color *c)
+{
+    free (c->lines);
+    free (c->edges);
+    c->lines = c->edges = NULL;
+    c->size = 0;
+}
+
+void color_bayer_to_mono (struct color *c, ushort *in, ushort *out,
+                          int width, int height)
+{
+    struct bayer b = { .in = in, .out = out,
+                       .width = width, .height = height };
+    size_t rowsize = width * sizeof (ushort);
+    int nbands, band, first, last;
+    size_t need;
+
+    if (height < 1 || width < 1)
+        return;
+    nbands = rowband_count (height);
+    need = (size_t)2 * nbands * width;
+    if (c->size < need) {
+        color_fini (c);
+        c->lines = xzmalloc (need * sizeof (ushort));
+        c->edges = xzmalloc (need * sizeof (ushort));
+        c->size = need;
+    }
+    b.lines = c->lines;
+    b.edges = c->edges;
+    for (band = 0; band < nbands; band++) {
+        rowband_range (height, band, &first, &last);
+        if (first > 0)
+            memcpy (b.edges + 2 * band * width, in + (first - 1) * width,
+                    rowsize);
+        if (last < height)
+            memcpy (b.edges + (2 * band + 1) * width, in + last * width,
+                    rowsize);
     }
+    rowband_run (height, bayer_band, &b);
 }
 
 /*
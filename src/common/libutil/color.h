@@ -1,16 +1,31 @@
 #ifndef _UTIL_COLOR_H
 #define _UTIL_COLOR_H
 
+#include <stddef.h>
 #include <sys/types.h>
 
+/* Scratch space for color_bayer_to_mono(), kept from frame to frame so
+ * converting doesn't allocate once the frame size is steady.  A struct
+ * color is used by one thread at a time.
+ */
+struct color {
+    ushort *lines;          /* two row line buffer per band */
+    ushort *edges;          /* copies of the rows bordering each band */
+    size_t size;            /* pixels in each of lines, edges */
+};
+
+void color_init (struct color *c);
+void color_fini (struct color *c);
+
 /* Apply 3x3 kernel described in SBIGUDrv sec 5.2 to convert a raw Bayer
  * mosaic image to monochrome, which expects even rows to start with a
  * blue pixel and alternate blue/green and odd rows to start with a green
  * pixel and alternate green/red.  The 'in' and 'out' parameters point to
  * pre-allocated image buffers of 'height' rows and 'width' columns,
- * in row-major order.
+ * in row-major order.  They may be the same buffer.
  */
-void color_bayer_to_mono (ushort *in, ushort *out, int width, int height);
+void color_bayer_to_mono (struct color *c, ushort *in, ushort *out,
+                          int width, int height);
 
 
 #endif /* _UTIL_COLOR_H */
@@ -0,0 +1,140 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Pixel by pixel frame combination.
+ *
+ * Each band gathers the values of one pixel from all frames into a small
+ * array on the stack, so the frames are read row by row in step and no
+ * memory is allocated.  Sigma clipping centers on the median rather than
+ * the mean, so a single cosmic ray can't drag the center toward itself
+ * and hide from the rejection test.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "rowband.h"
+#include "stats.h"
+#include "combine.h"
+
+#define CLIP_ITERATIONS 5   /* rejection passes, at most */
+#define CLIP_MIN_KEEP   3   /* stop rejecting with fewer values left */
+
+struct combine {
+    const ushort *const *frames;
+    int n;
+    int width;
+    enum combine_method method;
+    double kappa;
+    float *out;
+};
+
+static double median (ushort *a, int n)
+{
+    ushort hi = stats_select (a, n, n / 2);
+
+    if (n % 2)
+        return hi;
+    return 0.5 * ((double)stats_select (a, n, n / 2 - 1) + hi);
+}
+
+static double sigma_clip (const ushort *v, int n, double kappa)
+{
+    ushort keep[COMBINE_MAX_FRAMES];
+    ushort tmp[COMBINE_MAX_FRAMES];
+    int i, iter, nkeep = n;
+    double sum, sum2, mean = 0;
+
+    for (i = 0; i < n; i++)
+        keep[i] = v[i];
+    for (iter = 0; iter < CLIP_ITERATIONS; iter++) {
+        double m, sd, lim;
+        int j = 0;
+
+        sum = sum2 = 0;
+        for (i = 0; i < nkeep; i++) {
+            sum += keep[i];
+            sum2 += (double)keep[i] * keep[i];
+            tmp[i] = keep[i];
+        }
+        mean = sum / nkeep;
+        if (nkeep < CLIP_MIN_KEEP)
+            break;
+        sd = sqrt (fmax (0, sum2 / nkeep - mean * mean));
+        m = median (tmp, nkeep);
+        lim = kappa * sd;
+        for (i = 0; i < nkeep; i++) {
+            if (fabs (keep[i] - m) <= lim)
+                keep[j++] = keep[i];
+        }
+        if (j == nkeep || j == 0)
+            break;
+        nkeep = j;
+    }
+    if (iter == CLIP_ITERATIONS) {
+        for (sum = 0, i = 0; i < nkeep; i++)
+            sum += keep[i];
+        mean = sum / nkeep;
+    }
+    return mean;
+}
+
+static void combine_band (int band, int first, int last, void *arg)
+{
+    struct combine *c = arg;
+    ushort v[COMBINE_MAX_FRAMES];
+    size_t i, end = (size_t)last * c->width;
+    int k;
+
+    for (i = (size_t)first * c->width; i < end; i++) {
+        for (k = 0; k < c->n; k++)
+            v[k] = c->frames[k][i];
+        if (c->method == COMBINE_MEDIAN)
+            c->out[i] = median (v, c->n);
+        else
+            c->out[i] = sigma_clip (v, c->n, c->kappa);
+    }
+}
+
+int combine_frames (const ushort *const *frames, int n,
+                    int height, int width,
+                    enum combine_method method, double kappa, float *out)
+{
+    struct combine c = { .frames = frames, .n = n, .width = width,
+                         .method = method, .kappa = kappa, .out = out };
+
+    if (n < 1 || n > COMBINE_MAX_FRAMES
+              || (method == COMBINE_SIGMA_CLIP && kappa <= 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    rowband_run (height, combine_band, &c);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
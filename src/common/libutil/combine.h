@@ -0,0 +1,37 @@
+#ifndef _UTIL_COMBINE_H
+#define _UTIL_COMBINE_H
+
+#include <sys/types.h>
+
+/* Combine a stack of frames pixel by pixel, e.g. into a master bias,
+ * dark, or flat.  Each output pixel is computed from the same pixel of
+ * all 'n' frames of 'height' rows of 'width' pixels:
+ *
+ * COMBINE_MEDIAN: the median.
+ * COMBINE_SIGMA_CLIP: the mean, after iteratively rejecting values more
+ *   than 'kappa' standard deviations from the median of those remaining
+ *   (cosmic rays, satellite trails).
+ *
+ * The result is float so that averaging gains precision.  The work is
+ * spread over the rowband thread pool.
+ */
+
+#define COMBINE_MAX_FRAMES  256
+
+enum combine_method {
+    COMBINE_MEDIAN,
+    COMBINE_SIGMA_CLIP,
+};
+
+/* Returns -1 (errno = EINVAL) if n is out of range (1..COMBINE_MAX_FRAMES)
+ * or kappa is not positive for COMBINE_SIGMA_CLIP.
+ */
+int combine_frames (const ushort *const *frames, int n,
+                    int height, int width,
+                    enum combine_method method, double kappa, float *out);
+
+#endif /* !_UTIL_COMBINE_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
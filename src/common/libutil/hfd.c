@@ -0,0 +1,173 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Half flux diameter and FWHM of a star, for focusing.
+ *
+ * HFD is the diameter of the circle, centered on the star's centroid,
+ * that contains half its flux, estimated as 2 * sum (I * r) / sum (I)
+ * over the aperture.  Unlike FWHM it stays meaningful far from focus,
+ * when the star is a donut rather than a peak.  Pixels are summed
+ * without clipping at the background so noise averages out rather than
+ * inflating the result, but over an aperture only twice the size of the
+ * star's significant pixels, since each pixel of sky adds noise.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <math.h>
+
+#include "stats.h"
+#include "hfd.h"
+
+/* Median and scaled median absolute deviation of the pixels on the edge
+ * of the box [x0,x1] x [y0,y1].
+ */
+static void edge_background (const ushort *data, int width,
+                             int x0, int y0, int x1, int y1,
+                             double *bgp, double *noisep)
+{
+    ushort edge[8 * HFD_MAX_RADIUS + 4];
+    int i, n = 0;
+    ushort median;
+
+    for (i = x0; i <= x1; i++) {
+        edge[n++] = data[y0 * width + i];
+        if (y1 > y0)
+            edge[n++] = data[y1 * width + i];
+    }
+    for (i = y0 + 1; i < y1; i++) {
+        edge[n++] = data[i * width + x0];
+        if (x1 > x0)
+            edge[n++] = data[i * width + x1];
+    }
+    median = stats_select (edge, n, n / 2);
+    for (i = 0; i < n; i++)
+        edge[i] = edge[i] > median ? edge[i] - median : median - edge[i];
+    *bgp = median;
+    *noisep = 1.4826 * stats_select (edge, n, n / 2);
+    if (*noisep < 1)    /* at least the quantization noise, roughly */
+        *noisep = 1;
+}
+
+/* Clip the box of 'radius' around (x, y) to the frame.
+ */
+static void aperture_box (int height, int width, double x, double y,
+                          int radius, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = lround (x) - radius;
+    *y0 = lround (y) - radius;
+    *x1 = lround (x) + radius;
+    *y1 = lround (y) + radius;
+    if (*x0 < 0)
+        *x0 = 0;
+    if (*y0 < 0)
+        *y0 = 0;
+    if (*x1 > width - 1)
+        *x1 = width - 1;
+    if (*y1 > height - 1)
+        *y1 = height - 1;
+}
+
+int hfd_measure (const ushort *data, int height, int width,
+                 double x, double y, int radius, struct hfd_star *s)
+{
+    double r2max = (double)radius * radius;
+    double bg, noise;
+    double sw, sx, sy, sr, sr2, peak, extent;
+    int x0, y0, x1, y1;
+    int i, j, iter, n;
+
+    if (radius < 2 || radius > HFD_MAX_RADIUS)
+        return -1;
+    if (x < 0 || y < 0 || x > width - 1 || y > height - 1)
+        return -1;
+    aperture_box (height, width, x, y, radius, &x0, &y0, &x1, &y1);
+    edge_background (data, width, x0, y0, x1, y1, &bg, &noise);
+
+    /* Centroid from pixels clearly above the background, iterated since
+     * the aperture follows the centroid.
+     */
+    for (iter = 0; iter < 3; iter++) {
+        sw = sx = sy = extent = 0;
+        aperture_box (height, width, x, y, radius, &x0, &y0, &x1, &y1);
+        for (j = y0; j <= y1; j++) {
+            const ushort *row = data + j * width;
+            for (i = x0; i <= x1; i++) {
+                double I = row[i] - bg;
+                double r2 = (i - x) * (i - x) + (j - y) * (j - y);
+                if (I > 5 * noise && r2 <= r2max) {
+                    sw += I;
+                    sx += I * i;
+                    sy += I * j;
+                    if (r2 > extent)
+                        extent = r2;
+                }
+            }
+        }
+        if (sw <= 0)
+            return -1;
+        x = sx / sw;
+        y = sy / sw;
+    }
+    extent = 2 * sqrt (extent) + 2;
+    if (extent < radius) {
+        radius = ceil (extent);
+        r2max = extent * extent;
+    }
+
+    sw = sr = sr2 = peak = 0;
+    n = 0;
+    aperture_box (height, width, x, y, radius, &x0, &y0, &x1, &y1);
+    for (j = y0; j <= y1; j++) {
+        const ushort *row = data + j * width;
+        for (i = x0; i <= x1; i++) {
+            double r2 = (i - x) * (i - x) + (j - y) * (j - y);
+            double I = row[i] - bg;
+            if (r2 > r2max)
+                continue;
+            sw += I;
+            sr += I * sqrt (r2);
+            sr2 += I * r2;
+            if (I > peak)
+                peak = I;
+            n++;
+        }
+    }
+    if (sw <= 0 || sr <= 0 || sr2 <= 0)
+        return -1;
+    s->x = x;
+    s->y = y;
+    s->background = bg;
+    s->noise = noise;
+    s->peak = peak;
+    s->flux = sw;
+    s->snr = sw / (noise * sqrt (n));
+    s->hfd = 2 * sr / sw;
+    s->fwhm = 2.3548 * sqrt (sr2 / (2 * sw));
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,37 @@
+#ifndef _UTIL_HFD_H
+#define _UTIL_HFD_H
+
+#include <sys/types.h>
+
+/* Focus metrics for a single star in a frame of 'height' rows of 'width'
+ * pixels.  Coordinates are in pixels from the top left of the frame, with
+ * pixel centers at integer positions.
+ */
+
+#define HFD_MAX_RADIUS  64
+
+struct hfd_star {
+    double x, y;            /* centroid */
+    double background;      /* per pixel, from the edge of the aperture */
+    double noise;           /* background standard deviation */
+    double peak;            /* brightest pixel, above background */
+    double flux;            /* sum above background */
+    double snr;             /* flux / aperture noise */
+    double hfd;             /* half flux diameter */
+    double fwhm;            /* from the second moment, as for a gaussian */
+};
+
+/* Measure the star near (x, y) within a circular aperture of at most
+ * 'radius' pixels (at most HFD_MAX_RADIUS), narrowed to twice the extent
+ * of the star's significant pixels.  Background and noise come from the
+ * pixels on the edge of the full aperture's bounding box.  Returns 0 on
+ * success, or -1 if the aperture is off the frame or holds no flux.
+ */
+int hfd_measure (const ushort *data, int height, int width,
+                 double x, double y, int radius, struct hfd_star *s);
+
+#endif /* !_UTIL_HFD_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,262 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* ds9 preview over XPA.
+ *
+ * A single sender thread takes the waiting image from a one-deep mailbox,
+ * so the camera thread never waits on the viewer.  Without libxpa, each
+ * image is piped to a spawned xpaset (no shell, no temporary file).
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#if HAVE_XPA
+#include <xpa.h>
+#endif
+
+#include "log.h"
+#include "xzmalloc.h"
+#include "preview.h"
+
+extern char **environ;
+
+struct preview {
+    char *target;
+    pthread_t t;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void *buf;                  /* waiting image */
+    size_t len;
+    bool shutdown;
+#if HAVE_XPA
+    XPA xpa;
+#endif
+};
+
+#if HAVE_XPA
+static void send_image (preview_t *p, void *buf, size_t len)
+{
+    char *names[1] = { NULL };
+    char *messages[1] = { NULL };
+    int n;
+
+    n = XPASet (p->xpa, p->target, "fits", NULL, buf, len,
+                names, messages, 1);
+    if (n == 0)
+        msg ("preview: no XPA access point '%s'", p->target);
+    else if (messages[0])
+        msg ("preview: %s", messages[0]);
+    free (names[0]);
+    free (messages[0]);
+}
+#else
+static int write_all (int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write (fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* This thread blocks all signals, so if xpaset exits early, write fails
+ * with EPIPE and the SIGPIPE left pending is discarded here.  xpaset
+ * itself gets an empty mask and default SIGPIPE, so that Ctrl-C or a
+ * closed pipe still stops it rather than leaving us waiting on it.
+ */
+static void send_image (preview_t *p, void *buf, size_t len)
+{
+    char *argv[] = { "xpaset", p->target, "fits", NULL };
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t no_sigs;
+    struct timespec zero = { 0, 0 };
+    sigset_t pipe_sigs;
+    int pfd[2];
+    pid_t pid;
+    int e, status;
+
+    if (pipe (pfd) < 0) {
+        err ("preview: pipe");
+        return;
+    }
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_adddup2 (&fa, pfd[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose (&fa, pfd[0]);
+    posix_spawn_file_actions_addclose (&fa, pfd[1]);
+    sigemptyset (&no_sigs);
+    sigemptyset (&pipe_sigs);
+    sigaddset (&pipe_sigs, SIGPIPE);
+    posix_spawnattr_init (&attr);
+    posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+                                   | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigmask (&attr, &no_sigs);
+    posix_spawnattr_setsigdefault (&attr, &pipe_sigs);
+    e = posix_spawnp (&pid, "xpaset", &fa, &attr, argv, environ);
+    posix_spawnattr_destroy (&attr);
+    posix_spawn_file_actions_destroy (&fa);
+    close (pfd[0]);
+    if (e != 0) {
+        errn (e, "preview: xpaset");
+        close (pfd[1]);
+        return;
+    }
+    if (write_all (pfd[1], buf, len) < 0 && errno != EPIPE)
+        err ("preview: write");
+    close (pfd[1]);
+    (void)sigtimedwait (&pipe_sigs, NULL, &zero);
+
+    while (waitpid (pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            err ("preview: waitpid");
+            return;
+        }
+    }
+    if (WIFEXITED (status)) {
+        if (WEXITSTATUS (status) != 0)
+            msg ("preview: xpaset exited with rc=%d", WEXITSTATUS (status));
+    } else if (WIFSIGNALED (status)) {
+        msg ("preview: killed by %s", strsignal (WTERMSIG (status)));
+    }
+}
+#endif
+
+static void *sender (void *arg)
+{
+    preview_t *p = arg;
+    void *buf;
+    size_t len;
+
+    pthread_mutex_lock (&p->lock);
+    for (;;) {
+        while (!p->buf && !p->shutdown)
+            pthread_cond_wait (&p->cond, &p->lock);
+        if (!p->buf)
+            break;
+        buf = p->buf;
+        len = p->len;
+        p->buf = NULL;
+        pthread_mutex_unlock (&p->lock);
+
+        send_image (p, buf, len);
+        free (buf);
+
+        pthread_mutex_lock (&p->lock);
+    }
+    pthread_mutex_unlock (&p->lock);
+    return NULL;
+}
+
+preview_t *preview_create (const char *target)
+{
+    preview_t *p = xzmalloc (sizeof (*p));
+    sigset_t sigs, oldsigs;
+    int e;
+
+    p->target = xstrdup (target);
+#if HAVE_XPA
+    if (!(p->xpa = XPAOpen (NULL))) {
+        msg ("preview: XPAOpen failed");
+        goto error;
+    }
+#endif
+    pthread_mutex_init (&p->lock, NULL);
+    pthread_cond_init (&p->cond, NULL);
+
+    /* The sender blocks all signals so they go to app threads.
+     */
+    sigfillset (&sigs);
+    pthread_sigmask (SIG_SETMASK, &sigs, &oldsigs);
+    e = pthread_create (&p->t, NULL, sender, p);
+    pthread_sigmask (SIG_SETMASK, &oldsigs, NULL);
+    if (e != 0) {
+        errn (e, "preview: pthread_create");
+        pthread_cond_destroy (&p->cond);
+        pthread_mutex_destroy (&p->lock);
+#if HAVE_XPA
+        XPAClose (p->xpa);
+#endif
+        goto error;
+    }
+    return p;
+error:
+    free (p->target);
+    free (p);
+    return NULL;
+}
+
+void preview_destroy (preview_t *p)
+{
+    if (p) {
+        pthread_mutex_lock (&p->lock);
+        p->shutdown = true;
+        pthread_cond_signal (&p->cond);
+        pthread_mutex_unlock (&p->lock);
+        pthread_join (p->t, NULL);
+#if HAVE_XPA
+        XPAClose (p->xpa);
+#endif
+        pthread_cond_destroy (&p->cond);
+        pthread_mutex_destroy (&p->lock);
+        free (p->target);
+        free (p);
+    }
+}
+
+int preview_send (preview_t *p, void *buf, size_t len)
+{
+    int dropped = 0;
+
+    pthread_mutex_lock (&p->lock);
+    if (p->buf) {
+        free (p->buf);
+        dropped = 1;
+    }
+    p->buf = buf;
+    p->len = len;
+    pthread_cond_signal (&p->cond);
+    pthread_mutex_unlock (&p->lock);
+    return dropped;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,28 @@
+#ifndef _UTIL_PREVIEW_H
+#define _UTIL_PREVIEW_H
+
+#include <stddef.h>
+
+/* Send FITS images held in memory to a ds9 XPA access point ('target',
+ * e.g. "ds9") from a background thread.  If built with libxpa, one XPA
+ * handle is kept open for the life of the preview; otherwise xpaset is
+ * spawned per image and fed through a pipe.  Either way XPA_NSINET from
+ * the environment selects a remote name server.
+ *
+ * Only the most recent image waits to be sent: if the viewer falls
+ * behind, older images are dropped rather than queued.
+ * preview_send() takes ownership of 'buf' (it is freed with free(3)) and
+ * returns 1 if a waiting image was dropped to make room, else 0.
+ * preview_destroy() sends the waiting image, if any, before returning.
+ */
+typedef struct preview preview_t;
+
+preview_t *preview_create (const char *target);
+void preview_destroy (preview_t *p);
+int preview_send (preview_t *p, void *buf, size_t len);
+
+#endif /* !_UTIL_PREVIEW_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
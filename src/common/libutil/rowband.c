@@ -0,0 +1,211 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Fork-join row-band executor.
+ *
+ * A fixed pool of worker threads is started on first use and lives for
+ * the rest of the process.  rowband_run() splits the rows of a frame
+ * into contiguous bands, one per thread, and the calling thread works
+ * on bands alongside the pool until all are done.  Only one caller uses
+ * the pool at a time; a concurrent (or nested) caller runs its bands
+ * serially rather than waiting, so the camera thread is never blocked
+ * behind image processing on another thread.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "xzmalloc.h"
+#include "rowband.h"
+
+#define MIN_BAND_ROWS   16      /* smaller bands aren't worth a handoff */
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_mutex_t run_lock;   /* held by the caller using the pool */
+    int nthreads;               /* including the caller */
+    unsigned int gen;           /* incremented for each job */
+    rowband_f fn;
+    void *arg;
+    int nrows;
+    int nbands;
+    int next;                   /* next band to hand out */
+    int pending;                /* bands not yet finished */
+};
+
+static struct pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .run_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static int requested_threads = 0;
+
+static int band_first (int nrows, int nbands, int band)
+{
+    return (long)nrows * band / nbands;
+}
+
+/* Run bands of the current job until none are left.
+ * Call with pool.lock held.
+ */
+static void run_bands (void)
+{
+    rowband_f fn;
+    void *arg;
+    int b, nrows, nbands;
+
+    while (pool.next < pool.nbands) {
+        b = pool.next++;
+        fn = pool.fn;
+        arg = pool.arg;
+        nrows = pool.nrows;
+        nbands = pool.nbands;
+        pthread_mutex_unlock (&pool.lock);
+
+        fn (b, band_first (nrows, nbands, b),
+               band_first (nrows, nbands, b + 1), arg);
+
+        pthread_mutex_lock (&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal (&pool.done);
+    }
+}
+
+static void *worker (void *arg)
+{
+    unsigned int gen = 0;
+
+    pthread_mutex_lock (&pool.lock);
+    for (;;) {
+        while (pool.gen == gen)
+            pthread_cond_wait (&pool.work, &pool.lock);
+        gen = pool.gen;
+        run_bands ();
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+static void pool_init (void)
+{
+    const char *s = getenv ("SBIG_THREADS");
+    sigset_t sigs, oldsigs;
+    pthread_t t;
+    int n, e;
+
+    if (requested_threads > 0)
+        n = requested_threads;
+    else if (s && strtol (s, NULL, 10) > 0)
+        n = strtol (s, NULL, 10);
+    else
+        n = sysconf (_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > ROWBAND_MAX_BANDS)
+        n = ROWBAND_MAX_BANDS;
+
+    /* Workers inherit a full signal mask so signals go to app threads.
+     */
+    sigfillset (&sigs);
+    pthread_sigmask (SIG_SETMASK, &sigs, &oldsigs);
+    for (pool.nthreads = 1; pool.nthreads < n; pool.nthreads++) {
+        if ((e = pthread_create (&t, NULL, worker, NULL)) != 0) {
+            errn (e, "rowband: pthread_create");
+            break;
+        }
+        pthread_detach (t);
+    }
+    pthread_sigmask (SIG_SETMASK, &oldsigs, NULL);
+}
+
+void rowband_set_threads (int n)
+{
+    requested_threads = n;
+}
+
+int rowband_get_threads (void)
+{
+    pthread_once (&pool_once, pool_init);
+    return pool.nthreads;
+}
+
+int rowband_count (int nrows)
+{
+    int n = nrows / MIN_BAND_ROWS;
+    int nthreads = rowband_get_threads ();
+
+    if (n > nthreads)
+        n = nthreads;
+    return n > 0 ? n : 1;
+}
+
+void rowband_range (int nrows, int band, int *first, int *last)
+{
+    int nbands = rowband_count (nrows);
+
+    *first = band_first (nrows, nbands, band);
+    *last = band_first (nrows, nbands, band + 1);
+}
+
+void rowband_run (int nrows, rowband_f fn, void *arg)
+{
+    int nbands = rowband_count (nrows);
+    int b;
+
+    if (nrows <= 0)
+        return;
+    if (nbands == 1 || pthread_mutex_trylock (&pool.run_lock) != 0) {
+        for (b = 0; b < nbands; b++)
+            fn (b, band_first (nrows, nbands, b),
+                   band_first (nrows, nbands, b + 1), arg);
+        return;
+    }
+    pthread_mutex_lock (&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.nrows = nrows;
+    pool.nbands = nbands;
+    pool.next = 0;
+    pool.pending = nbands;
+    pool.gen++;
+    pthread_cond_broadcast (&pool.work);
+    run_bands ();
+    while (pool.pending > 0)
+        pthread_cond_wait (&pool.done, &pool.lock);
+    pthread_mutex_unlock (&pool.lock);
+    pthread_mutex_unlock (&pool.run_lock);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
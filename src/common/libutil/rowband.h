@@ -0,0 +1,35 @@
+#ifndef _UTIL_ROWBAND_H
+#define _UTIL_ROWBAND_H
+
+/* Process the rows of an image in parallel bands on a process-wide
+ * thread pool.  'fn' is called once per band with the band index and
+ * the range of rows [first, last), possibly concurrently, and
+ * rowband_run() returns when all bands are done.  Bands are numbered
+ * 0 to rowband_count (nrows) - 1, so results may be accumulated per band
+ * without locking and combined afterwards.
+ */
+typedef void (*rowband_f)(int band, int first, int last, void *arg);
+
+#define ROWBAND_MAX_BANDS   64  /* upper bound on rowband_count() */
+
+void rowband_run (int nrows, rowband_f fn, void *arg);
+int rowband_count (int nrows);
+
+/* Get the rows [first, last) of a band, e.g. to prepare per-band state
+ * before rowband_run().
+ */
+void rowband_range (int nrows, int band, int *first, int *last);
+
+/* The number of threads (including the caller) defaults to SBIG_THREADS
+ * from the environment (set by sbig(1) from "threads" in the config file),
+ * or else the number of online CPUs.  Override with rowband_set_threads()
+ * before first use.
+ */
+void rowband_set_threads (int n);
+int rowband_get_threads (void);
+
+#endif /* !_UTIL_ROWBAND_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,268 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* SER writer.
+ *
+ * All header fields are little endian.  The specification says the
+ * LittleEndian field is 1 for little endian pixels, but capture programs
+ * have always written 0 with little endian pixels and readers expect
+ * that, so we do the same.  Timestamps are in .NET ticks: 100ns units
+ * since 0001-01-01.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "ser.h"
+
+#define HEADER_SIZE     178
+#define OFF_FRAMECOUNT  38
+#define OFF_DATETIME    162
+#define BUFFER_SIZE     (4 << 20)   /* bytes written at a time, about */
+#define TICKS_1970      621355968000000000LL
+#define MONO            0
+
+struct ser {
+    int fd;
+    int height, width;
+    size_t frame_size;
+    char *buf;              /* header (at first), then whole frames */
+    size_t buf_size;
+    size_t buf_len;
+    off_t offset;           /* of the start of buf in the file */
+    int64_t *stamps;        /* per frame */
+    int stamps_size;
+    int count;
+    int flushed;            /* frames in the header frame count */
+    char header[HEADER_SIZE];
+};
+
+static void put32 (char *p, uint32_t v)
+{
+    v = htole32 (v);
+    memcpy (p, &v, sizeof (v));
+}
+
+static void put64 (char *p, int64_t v)
+{
+    uint64_t u = htole64 ((uint64_t)v);
+    memcpy (p, &u, sizeof (u));
+}
+
+static void putstr (char *p, const char *s)
+{
+    if (s)
+        strncpy (p, s, 40);
+}
+
+static int64_t ticks (const struct timespec *t)
+{
+    return TICKS_1970 + (int64_t)t->tv_sec * 10000000 + t->tv_nsec / 100;
+}
+
+static void free_ser (ser_t *s)
+{
+    int saved_errno = errno;
+
+    if (s->fd >= 0)
+        (void)close (s->fd);
+    free (s->buf);
+    free (s->stamps);
+    free (s);
+    errno = saved_errno;
+}
+
+ser_t *ser_create (const char *path, int height, int width, int nframes,
+                   const char *observer, const char *instrument,
+                   const char *telescope)
+{
+    ser_t *s;
+    int nbuf;
+
+    if (height < 1 || width < 1 || nframes < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(s = calloc (1, sizeof (*s))))
+        return NULL;
+    s->fd = -1;
+    s->height = height;
+    s->width = width;
+    s->frame_size = (size_t)height * width * sizeof (ushort);
+    nbuf = BUFFER_SIZE / s->frame_size;
+    s->buf_size = (nbuf > 0 ? nbuf : 1) * s->frame_size;
+    s->stamps_size = nframes > 0 ? nframes : 1024;
+    if (!(s->buf = malloc (s->buf_size))
+            || !(s->stamps = malloc (s->stamps_size * sizeof (s->stamps[0]))))
+        goto error;
+
+    memcpy (s->header, "LUCAM-RECORDER", 14);
+    put32 (s->header + 14, 0);              /* LuID */
+    put32 (s->header + 18, MONO);           /* ColorID */
+    put32 (s->header + 22, 0);              /* LittleEndian (see above) */
+    put32 (s->header + 26, width);
+    put32 (s->header + 30, height);
+    put32 (s->header + 34, 16);             /* PixelDepthPerPlane */
+    putstr (s->header + 42, observer);
+    putstr (s->header + 82, instrument);
+    putstr (s->header + 122, telescope);
+
+    if ((s->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        goto error;
+    if (nframes > 0) {
+        off_t size = HEADER_SIZE + (off_t)nframes * s->frame_size
+                                 + (off_t)nframes * sizeof (s->stamps[0]);
+        if (fallocate (s->fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0
+                && errno != EOPNOTSUPP && errno != ENOSYS)
+            goto error;
+    }
+    memcpy (s->buf, s->header, HEADER_SIZE);
+    s->buf_len = HEADER_SIZE;
+    return s;
+error:
+    free_ser (s);
+    return NULL;
+}
+
+static int write_all (int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite (fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Write the buffer, then bring the header's frame count up to date.
+ */
+static int flush (ser_t *s)
+{
+    char count[4];
+
+    if (s->buf_len == 0)
+        return 0;
+    if (write_all (s->fd, s->buf, s->buf_len, s->offset) < 0)
+        return -1;
+    s->offset += s->buf_len;
+    s->buf_len = 0;
+    if (s->flushed != s->count) {
+        put32 (count, s->count);
+        if (write_all (s->fd, count, sizeof (count), OFF_FRAMECOUNT) < 0)
+            return -1;
+        s->flushed = s->count;
+    }
+    return 0;
+}
+
+int ser_write_frame (ser_t *s, const ushort *data, const struct timespec *t)
+{
+    ushort *dst;
+
+    if (s->count == INT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (s->count == s->stamps_size) {
+        int64_t *p = realloc (s->stamps, 2 * s->stamps_size * sizeof (*p));
+        if (!p)
+            return -1;
+        s->stamps = p;
+        s->stamps_size *= 2;
+    }
+    if (s->buf_len + s->frame_size > s->buf_size && flush (s) < 0)
+        return -1;
+    dst = (ushort *)(s->buf + s->buf_len);
+#if __BYTE_ORDER == __BIG_ENDIAN
+    {
+        size_t i, n = (size_t)s->height * s->width;
+        for (i = 0; i < n; i++)
+            dst[i] = htole16 (data[i]);
+    }
+#else
+    memcpy (dst, data, s->frame_size);
+#endif
+    s->buf_len += s->frame_size;
+    if (s->count == 0) {
+        struct tm tm;
+        time_t sec = t->tv_sec;
+        int64_t utc = ticks (t);
+        long gmtoff = localtime_r (&sec, &tm) ? tm.tm_gmtoff : 0;
+
+        put64 (s->header + OFF_DATETIME, utc + (int64_t)gmtoff * 10000000);
+        put64 (s->header + OFF_DATETIME + 8, utc);
+        if (s->offset == 0)
+            memcpy (s->buf, s->header, HEADER_SIZE);
+    }
+    s->stamps[s->count++] = ticks (t);
+    return 0;
+}
+
+int ser_get_count (ser_t *s)
+{
+    return s->count;
+}
+
+int ser_close (ser_t *s)
+{
+    int i, rc = -1;
+    off_t size;
+
+    if (flush (s) < 0)
+        goto done;
+    for (i = 0; i < s->count; i++)
+        put64 ((char *)&s->stamps[i], s->stamps[i]);
+    if (write_all (s->fd, s->stamps, s->count * sizeof (s->stamps[0]),
+                   s->offset) < 0)
+        goto done;
+    size = s->offset + s->count * sizeof (s->stamps[0]);
+    put32 (s->header + OFF_FRAMECOUNT, s->count);
+    if (write_all (s->fd, s->header, HEADER_SIZE, 0) < 0)
+        goto done;
+    if (ftruncate (s->fd, size) < 0 || fsync (s->fd) < 0)
+        goto done;
+    rc = close (s->fd);
+    s->fd = -1;
+done:
+    free_ser (s);
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
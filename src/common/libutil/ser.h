@@ -0,0 +1,47 @@
+#ifndef _UTIL_SER_H
+#define _UTIL_SER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* SER video files, as used for planetary and lucky imaging: a 178 byte
+ * header, frames of raw 16 bit monochrome pixels back to back, and a
+ * trailer of per-frame UTC timestamps.
+ * Ref: SER format description version 3, Grischa Hahn, 2014.
+ *
+ * Frames are gathered in a large buffer and written sequentially, and the
+ * space for the expected number of frames is reserved when the file is
+ * created, so a capture costs a write every few megabytes rather than a
+ * file per frame.  The header frame count is kept current as the buffer
+ * is written, so a capture cut short by a crash is still readable.
+ *
+ * Functions return -1 or NULL with errno set on failure.
+ */
+
+typedef struct ser ser_t;
+
+/* Create 'path' for frames of 'height' rows of 'width' pixels, reserving
+ * space for 'nframes' (0 if unknown).  'observer', 'instrument', and
+ * 'telescope' go in the header (truncated to 40 characters) and may be
+ * NULL.
+ */
+ser_t *ser_create (const char *path, int height, int width, int nframes,
+                   const char *observer, const char *instrument,
+                   const char *telescope);
+
+/* Append a frame taken at 't' (UTC).
+ */
+int ser_write_frame (ser_t *s, const ushort *data, const struct timespec *t);
+
+int ser_get_count (ser_t *s);
+
+/* Write out buffered frames and the trailer, trim the reserved space,
+ * sync, and close.  The ser_t is freed even on failure.
+ */
+int ser_close (ser_t *s);
+
+#endif /* !_UTIL_SER_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
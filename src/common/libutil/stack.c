@@ -0,0 +1,505 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Incremental frame stacking.
+ *
+ * A handful of frames can't give a trustworthy standard deviation for
+ * each pixel, so the reference pass fits a noise model to the whole
+ * window instead:  variance linear in signal level, as read noise plus
+ * photon noise is.  Pixels are grouped by median level, the median of
+ * their sample variances in each group (unmoved by the odd cosmic ray)
+ * is corrected to an estimate of the variance, and a line is fitted to
+ * the groups.  Values are then tested against the larger of the model's
+ * deviation and the pixel's own running one, which allows for pixels
+ * that vary more than noise alone, e.g. a star under changing seeing.
+ *
+ * Squares are accumulated as deviations from a per-pixel reference value
+ * (the reference window's median, or the first frame's value) so that a
+ * float holds them without the cancellation that would ruin the variance
+ * of bright pixels.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "rowband.h"
+#include "stack.h"
+
+#define SIGMA_MIN       1.0     /* ADU */
+#define LEVEL_SHIFT     8       /* noise model groups are 256 ADU wide */
+#define LEVEL_GROUPS    (65536 >> LEVEL_SHIFT)
+#define GROUP_MIN       64      /* pixels for a group to count in the fit */
+
+struct stacker {
+    int height, width;
+    size_t npix;
+    double kappa;
+    int ref_frames;
+    uint32_t *sum;
+    float *sumsq;           /* of deviations from ref */
+    ushort *count;
+    ushort *ref;
+    ushort *window;         /* reference window, until it is processed */
+    int nwindow;
+    bool referenced;        /* reference pass done */
+    double noise_a;         /* variance = noise_a + noise_b * level */
+    double noise_b;
+    int nframes;
+    ulong rejected;
+};
+
+struct job {
+    stacker_t *st;
+    const ushort *data;
+    ushort *out;
+    float *var;
+    ushort *ref;            /* window medians */
+    double noise_a, noise_b;
+    ulong rejected[ROWBAND_MAX_BANDS];
+};
+
+static void free_window (stacker_t *st)
+{
+    free (st->window);
+    st->window = NULL;
+    st->nwindow = 0;
+}
+
+stacker_t *stacker_create (int height, int width, double kappa,
+                           int ref_frames)
+{
+    stacker_t *st;
+    size_t npix = (size_t)height * width;
+
+    if (height < 1 || width < 1 || kappa < 0
+            || (kappa > 0 && (ref_frames < 3 || ref_frames > STACK_MAX_REF))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(st = calloc (1, sizeof (*st))))
+        return NULL;
+    st->height = height;
+    st->width = width;
+    st->npix = npix;
+    st->kappa = kappa;
+    st->ref_frames = kappa > 0 ? ref_frames : 0;
+    st->sum = calloc (npix, sizeof (st->sum[0]));
+    st->sumsq = calloc (npix, sizeof (st->sumsq[0]));
+    st->count = calloc (npix, sizeof (st->count[0]));
+    st->ref = calloc (npix, sizeof (st->ref[0]));
+    if (st->ref_frames > 0)
+        st->window = malloc (npix * st->ref_frames * sizeof (st->window[0]));
+    if (!st->sum || !st->sumsq || !st->count || !st->ref
+                 || (st->ref_frames > 0 && !st->window)) {
+        stacker_destroy (st);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return st;
+}
+
+void stacker_destroy (stacker_t *st)
+{
+    if (st) {
+        int saved_errno = errno;
+        free (st->sum);
+        free (st->sumsq);
+        free (st->count);
+        free (st->ref);
+        free (st->window);
+        free (st);
+        errno = saved_errno;
+    }
+}
+
+static inline void accept (stacker_t *st, size_t i, ushort v)
+{
+    float d = (float)v - st->ref[i];
+
+    st->sum[i] += v;
+    st->sumsq[i] += d * d;
+    st->count[i]++;
+}
+
+static inline double model_sigma (double noise_a, double noise_b,
+                                  double level)
+{
+    double var = noise_a + noise_b * level;
+
+    return var > SIGMA_MIN * SIGMA_MIN ? sqrt (var) : SIGMA_MIN;
+}
+
+/* Median of a few values, sorting them.
+ */
+static float median (float *a, int n)
+{
+    int i, j;
+
+    for (i = 1; i < n; i++) {
+        float v = a[i];
+        for (j = i; j > 0 && a[j - 1] > v; j--)
+            a[j] = a[j - 1];
+        a[j] = v;
+    }
+    return n % 2 ? a[n / 2] : 0.5f * (a[n / 2 - 1] + a[n / 2]);
+}
+
+/* Return the k-th smallest of 'n' values, reordering them.
+ */
+static float select_k (float *a, size_t n, size_t k)
+{
+    size_t lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        float pivot = a[lo + (hi - lo) / 2];
+        size_t i = lo, j = hi;
+        while (i <= j) {
+            while (a[i] < pivot)
+                i++;
+            while (a[j] > pivot)
+                j--;
+            if (i <= j) {
+                float t = a[i];
+                a[i++] = a[j];
+                a[j] = t;
+                if (j == 0)
+                    break;
+                j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return a[k];
+}
+
+/* Reference pass, part one: each pixel's median over the window, and the
+ * sample variance of its values.
+ */
+static void window_stats_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    stacker_t *st = job->st;
+    size_t i, end = (size_t)last * st->width;
+    int k, n = st->nwindow;
+    float v[STACK_MAX_REF];
+
+    for (i = (size_t)first * st->width; i < end; i++) {
+        double mean = 0, ss = 0;
+
+        for (k = 0; k < n; k++) {
+            v[k] = st->window[k * st->npix + i];
+            mean += v[k];
+        }
+        mean /= n;
+        for (k = 0; k < n; k++)
+            ss += (v[k] - mean) * (v[k] - mean);
+        job->var[i] = ss / (n - 1);
+        job->ref[i] = lrintf (median (v, n));
+    }
+}
+
+/* Fit the noise model to the median sample variance of each group of
+ * pixels at a similar level.  The sample variance of k + 1 normal values
+ * is a chi-square with k degrees of freedom scaled by variance / k, so
+ * its median falls short of the variance by the Wilson-Hilferty factor.
+ */
+static int fit_noise (stacker_t *st, struct job *job)
+{
+    const ushort *ref = job->ref;
+    size_t start[LEVEL_GROUPS + 1] = { 0 };
+    double level[LEVEL_GROUPS] = { 0 };
+    size_t *fill;
+    float *sorted;
+    double k = st->nwindow - 1;
+    double wh = pow (1 - 2 / (9 * k), 3);
+    double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    size_t i;
+    int g;
+
+    if (!(sorted = malloc (st->npix * sizeof (sorted[0]))))
+        return -1;
+    if (!(fill = malloc (LEVEL_GROUPS * sizeof (fill[0])))) {
+        free (sorted);
+        return -1;
+    }
+    for (i = 0; i < st->npix; i++) {
+        g = ref[i] >> LEVEL_SHIFT;
+        start[g + 1]++;
+        level[g] += ref[i];
+    }
+    for (g = 0; g < LEVEL_GROUPS; g++) {
+        start[g + 1] += start[g];
+        fill[g] = start[g];
+    }
+    for (i = 0; i < st->npix; i++)
+        sorted[fill[ref[i] >> LEVEL_SHIFT]++] = job->var[i];
+    for (g = 0; g < LEVEL_GROUPS; g++) {
+        size_t n = start[g + 1] - start[g];
+        double x, y;
+
+        if (n < GROUP_MIN)
+            continue;
+        x = level[g] / n;
+        y = select_k (sorted + start[g], n, n / 2) / wh;
+        sw += n;
+        sx += n * x;
+        sy += n * y;
+        sxx += n * x * x;
+        sxy += n * x * y;
+    }
+    free (fill);
+    free (sorted);
+
+    job->noise_a = job->noise_b = 0;
+    if (sw > 0) {
+        double d = sw * sxx - sx * sx;
+        if (d > 0 && (job->noise_b = (sw * sxy - sx * sy) / d) < 0)
+            job->noise_b = 0;
+        job->noise_a = (sy - job->noise_b * sx) / sw;
+    }
+    return 0;
+}
+
+/* Reference pass, part two: accumulate the values close enough to each
+ * pixel's median.
+ */
+static void reference_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    stacker_t *st = job->st;
+    size_t i, end = (size_t)last * st->width;
+    int k, n = st->nwindow;
+    ulong rejected = 0;
+
+    for (i = (size_t)first * st->width; i < end; i++) {
+        float lim = st->kappa * model_sigma (st->noise_a, st->noise_b,
+                                             st->ref[i]);
+
+        for (k = 0; k < n; k++) {
+            ushort v = st->window[k * st->npix + i];
+            if (fabsf ((float)v - st->ref[i]) <= lim)
+                accept (st, i, v);
+            else
+                rejected++;
+        }
+    }
+    job->rejected[band] = rejected;
+}
+
+/* Mean of the window so far, for a stack taken before it is full, with
+ * values rejected as the reference pass would if there are enough of them
+ * (job->ref and the noise model set).  Nothing is accumulated.
+ */
+static void window_mean_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    stacker_t *st = job->st;
+    size_t i, end = (size_t)last * st->width;
+    int k, n = st->nwindow;
+
+    for (i = (size_t)first * st->width; i < end; i++) {
+        float lim = INFINITY;
+        uint32_t sum = 0, count = 0;
+
+        if (job->ref)
+            lim = st->kappa * model_sigma (job->noise_a, job->noise_b,
+                                           job->ref[i]);
+        for (k = 0; k < n; k++) {
+            ushort v = st->window[k * st->npix + i];
+            if (!job->ref || fabsf ((float)v - job->ref[i]) <= lim) {
+                sum += v;
+                count++;
+            }
+        }
+        job->out[i] = count > 0 ? (sum + count / 2) / count : job->ref[i];
+    }
+}
+
+/* Running pass: test each value against the pixel's running mean.
+ */
+static void add_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    stacker_t *st = job->st;
+    size_t i, end = (size_t)last * st->width;
+    ulong rejected = 0;
+
+    if (st->kappa == 0) {
+        for (i = (size_t)first * st->width; i < end; i++)
+            accept (st, i, job->data[i]);
+        return;
+    }
+    for (i = (size_t)first * st->width; i < end; i++) {
+        ushort v = job->data[i];
+        int n = st->count[i];
+
+        if (n > 0) {
+            double mean = (double)st->sum[i] / n;
+            double d = mean - st->ref[i];
+            double var = st->sumsq[i] / n - d * d;
+            double sd = model_sigma (st->noise_a, st->noise_b, mean);
+
+            if (var > sd * sd)
+                sd = sqrt (var);
+            if (fabs (v - mean) > st->kappa * sd) {
+                rejected++;
+                continue;
+            }
+        }
+        accept (st, i, v);
+    }
+    job->rejected[band] = rejected;
+}
+
+static void run (stacker_t *st, rowband_f fn, const ushort *data, ushort *out)
+{
+    struct job job = { .st = st, .data = data, .out = out };
+    int i, nbands = rowband_count (st->height);
+
+    rowband_run (st->height, fn, &job);
+    for (i = 0; i < nbands; i++)
+        st->rejected += job.rejected[i];
+}
+
+/* Find the window's medians in 'ref' and fit the noise model to it.
+ */
+static int window_model (stacker_t *st, struct job *job, ushort *ref)
+{
+    int rc;
+
+    if (!(job->var = malloc (st->npix * sizeof (job->var[0]))))
+        return -1;
+    job->ref = ref;
+    rowband_run (st->height, window_stats_band, job);
+    rc = fit_noise (st, job);
+    free (job->var);
+    job->var = NULL;
+    return rc;
+}
+
+static int reference (stacker_t *st)
+{
+    struct job job = { .st = st };
+
+    if (window_model (st, &job, st->ref) < 0)
+        return -1;
+    st->noise_a = job.noise_a;
+    st->noise_b = job.noise_b;
+    run (st, reference_band, NULL, NULL);
+    free_window (st);
+    st->referenced = true;
+    return 0;
+}
+
+/* Stack the window without ending the reference pass, so that frames
+ * added afterwards still fill it.  With fewer than 3 frames there is no
+ * median to reject against, and every value is averaged.
+ */
+static int window_mean (stacker_t *st, ushort *out)
+{
+    struct job job = { .st = st, .out = out };
+    ushort *ref = NULL;
+
+    if (st->nwindow >= 3) {
+        if (!(ref = malloc (st->npix * sizeof (ref[0]))))
+            return -1;
+        if (window_model (st, &job, ref) < 0) {
+            free (ref);
+            return -1;
+        }
+    }
+    rowband_run (st->height, window_mean_band, &job);
+    free (ref);
+    return 0;
+}
+
+int stacker_add (stacker_t *st, const ushort *data)
+{
+    if (st->nframes == STACK_MAX_FRAMES) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    st->nframes++;
+    if (st->kappa == 0 && !st->referenced) {
+        memcpy (st->ref, data, st->npix * sizeof (st->ref[0]));
+        st->referenced = true;
+    }
+    if (!st->referenced) {
+        memcpy (st->window + st->nwindow++ * st->npix, data,
+                st->npix * sizeof (st->window[0]));
+        if (st->nwindow == st->ref_frames && reference (st) < 0)
+            return -1;
+        return 0;
+    }
+    run (st, add_band, data, NULL);
+    return 0;
+}
+
+int stacker_get_count (stacker_t *st)
+{
+    return st->nframes;
+}
+
+ulong stacker_get_rejected (stacker_t *st)
+{
+    return st->rejected;
+}
+
+static void mean_band (int band, int first, int last, void *arg)
+{
+    struct job *job = arg;
+    stacker_t *st = job->st;
+    size_t i, end = (size_t)last * st->width;
+
+    for (i = (size_t)first * st->width; i < end; i++) {
+        uint32_t n = st->count[i];
+        job->out[i] = n > 0 ? (st->sum[i] + n / 2) / n : st->ref[i];
+    }
+}
+
+int stacker_get_mean (stacker_t *st, ushort *out)
+{
+    if (st->nframes == 0) {
+        errno = ENODATA;
+        return -1;
+    }
+    if (!st->referenced)
+        return window_mean (st, out);
+    run (st, mean_band, NULL, out);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
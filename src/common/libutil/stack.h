@@ -0,0 +1,61 @@
+#ifndef _UTIL_STACK_H
+#define _UTIL_STACK_H
+
+#include <sys/types.h>
+
+/* Stack a series of frames as they arrive, without keeping them.
+ * Each pixel accumulates a running sum, sum of squares, and count of the
+ * values accepted so far, so the mean and standard deviation are always
+ * at hand and a co-added frame can be produced at any point.
+ *
+ * With 'kappa' > 0, values are rejected (cosmic rays, satellites, hot
+ * pixels that flicker) in two passes.  The first 'ref_frames' frames form
+ * a reference window: they are held until the window is full, then each
+ * pixel's median is found, a noise model is fitted to the whole window,
+ * and only the values within kappa standard deviations of the median are
+ * accumulated.  From then on, each new value is accepted if it lies
+ * within kappa standard deviations of that pixel's running mean.  With
+ * 'kappa' = 0 every value is accepted and nothing is held.
+ *
+ * Functions return -1 or NULL with errno set on failure.  A stacker is
+ * not thread safe, though its work is spread over the rowband pool.
+ */
+
+typedef struct stacker stacker_t;
+
+#define STACK_MAX_FRAMES    65535   /* per stack */
+#define STACK_MAX_REF       32      /* reference window, frames */
+#define STACK_REF_FRAMES    5       /* default reference window */
+
+/* Returns NULL (errno = EINVAL) if kappa is negative, or rejecting with
+ * ref_frames out of range (3..STACK_MAX_REF).
+ */
+stacker_t *stacker_create (int height, int width, double kappa,
+                           int ref_frames);
+void stacker_destroy (stacker_t *st);
+
+/* Add a frame of 'height' rows of 'width' pixels.  Returns -1
+ * (errno = EOVERFLOW) once STACK_MAX_FRAMES frames have been added.
+ */
+int stacker_add (stacker_t *st, const ushort *data);
+
+/* Get the number of frames added, and the number of pixel values
+ * rejected from them.
+ */
+int stacker_get_count (stacker_t *st);
+ulong stacker_get_rejected (stacker_t *st);
+
+/* Store the mean of each pixel's accepted values in 'out', rounded.
+ * If the reference window is not yet full, the frames held so far are
+ * stacked with the values the reference pass would reject left out (or
+ * every value, with fewer than 3 frames), but the window stays open, and
+ * those rejections are not counted.  Returns -1 (errno = ENODATA) if no
+ * frames have been added.
+ */
+int stacker_get_mean (stacker_t *st, ushort *out);
+
+#endif /* !_UTIL_STACK_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
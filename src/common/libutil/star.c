@@ -0,0 +1,599 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Star extraction.
+ *
+ * Three passes over the frame's row bands, on the rowband thread pool:
+ *  1. Background: a median and a noise estimate for each mesh cell, from
+ *     a subsample of its pixels.  Cells are then median filtered so a
+ *     bright star doesn't raise its cell's background.
+ *  2. Detection: each row's threshold is interpolated from the mesh, and
+ *     runs of pixels above it are recorded with their moments.
+ *  3. HFD for each star kept in the catalog (see hfd.c).
+ * In between, runs are joined into components with union-find, which is
+ * cheap since only star pixels produce runs.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/param.h>
+
+#include "xzmalloc.h"
+#include "rowband.h"
+#include "stats.h"
+#include "hfd.h"
+#include "star.h"
+
+#define DEFAULT_MESH        64
+#define DEFAULT_SIGMA       5.0
+#define DEFAULT_MIN_PIXELS  3
+
+#define MESH_STEP           2   /* sample every other row and column */
+#define RUNS_PER_ROW        4   /* workspace for runs, on average */
+#define RUNS_MIN            8192
+
+/* A run of pixels above threshold in one row, which becomes a component
+ * (star) when runs are joined.  The root run of a component accumulates
+ * the totals.
+ */
+struct run {
+    int row, x0, x1;
+    int parent;
+    int xmin, xmax, ymax;       /* bounding box (ymin = row of the root) */
+    uint32_t npix;
+    ushort max;                 /* brightest pixel value */
+    float peak;                 /* brightest pixel above background */
+    double s, sx, sy, sxx, syy, sxy;
+};
+
+struct band {
+    struct run *runs;
+    int nruns;
+    bool full;
+    float *bg, *thr;            /* current row, interpolated */
+    float *col_bg, *col_thr;    /* current row at the mesh columns */
+    ushort *sample;             /* background samples of one cell */
+};
+
+struct star_extractor {
+    struct star_params p;
+    int max_height, max_width;
+    int nbands;
+    int run_cap;                /* per band */
+    struct band band[ROWBAND_MAX_BANDS];
+    struct run *all;            /* runs of all bands, in row order */
+
+    /* mesh */
+    int mrows, mcols;
+    float *mesh_bg, *mesh_noise, *mesh_tmp;
+    int interp_width;           /* xi/xw computed for this width */
+    int *xi;                    /* left mesh column for pixel column */
+    float *xw;                  /* weight of the right mesh column */
+
+    int *best;                  /* runs kept, brightest first */
+    struct star_catalog cat;
+
+    /* current frame */
+    const ushort *data;
+    int height, width;
+};
+
+static float mesh_value (const float *m, int mcols, int my, int mx)
+{
+    return m[my * mcols + mx];
+}
+
+/* Pass 1: the background and noise of each cell whose first row falls in
+ * this band.  Noise is estimated from the lower half of the distribution,
+ * as the median minus the 15.87th percentile, which stars can't inflate.
+ */
+static void mesh_band (int band, int first, int last, void *arg)
+{
+    star_extractor_t *ex = arg;
+    ushort *sample = ex->band[band].sample;
+    int mesh = ex->p.mesh;
+    int my, mx, x, y;
+
+    for (my = (first + mesh - 1) / mesh; my * mesh < last; my++) {
+        int y1 = (my + 1) * mesh < ex->height ? (my + 1) * mesh : ex->height;
+        for (mx = 0; mx < ex->mcols; mx++) {
+            int x1 = (mx + 1) * mesh < ex->width ? (mx + 1) * mesh : ex->width;
+            int n = 0;
+            ushort med, lo;
+
+            for (y = my * mesh; y < y1; y += MESH_STEP) {
+                const ushort *row = ex->data + (size_t)y * ex->width;
+                for (x = mx * mesh; x < x1; x += MESH_STEP)
+                    sample[n++] = row[x];
+            }
+            med = stats_select (sample, n, n / 2);
+            lo = stats_select (sample, n, n * 1587 / 10000);
+            ex->mesh_bg[my * ex->mcols + mx] = med;
+            ex->mesh_noise[my * ex->mcols + mx] = med - lo > 1 ? med - lo : 1;
+        }
+    }
+}
+
+/* 3x3 median filter of a mesh map, in place, using 'tmp'.
+ */
+static void mesh_filter (float *m, float *tmp, int mrows, int mcols)
+{
+    int my, mx, i, j;
+
+    for (my = 0; my < mrows; my++) {
+        for (mx = 0; mx < mcols; mx++) {
+            float v[9], t;
+            int n = 0;
+            for (i = my - 1; i <= my + 1; i++) {
+                for (j = mx - 1; j <= mx + 1; j++) {
+                    if (i >= 0 && i < mrows && j >= 0 && j < mcols)
+                        v[n++] = mesh_value (m, mcols, i, j);
+                }
+            }
+            for (i = 1; i < n; i++) {   /* insertion sort */
+                for (j = i, t = v[i]; j > 0 && v[j - 1] > t; j--)
+                    v[j] = v[j - 1];
+                v[j] = t;
+            }
+            tmp[my * mcols + mx] = v[n / 2];
+        }
+    }
+    memcpy (m, tmp, mrows * mcols * sizeof (m[0]));
+}
+
+/* Mesh values are taken to lie at cell centers and interpolated
+ * bilinearly between them, and held constant beyond the outer centers.
+ */
+static void mesh_coord (double p, int mesh, int n, int *i, float *w)
+{
+    double f = (p + 0.5) / mesh - 0.5;
+
+    if (f <= 0 || n == 1) {
+        *i = 0;
+        *w = 0;
+    } else if (f >= n - 1) {
+        *i = n - 2;
+        *w = 1;
+    } else {
+        *i = f;
+        *w = f - *i;
+    }
+}
+
+static void mesh_interp_setup (star_extractor_t *ex)
+{
+    int x;
+
+    if (ex->interp_width == ex->width)
+        return;
+    for (x = 0; x < ex->width; x++)
+        mesh_coord (x, ex->p.mesh, ex->mcols, &ex->xi[x], &ex->xw[x]);
+    ex->interp_width = ex->width;
+}
+
+static float mesh_at (star_extractor_t *ex, const float *m, double x, double y)
+{
+    int i, j, i1, j1;
+    float wy, wx, a, b;
+
+    mesh_coord (y, ex->p.mesh, ex->mrows, &i, &wy);
+    mesh_coord (x, ex->p.mesh, ex->mcols, &j, &wx);
+    i1 = ex->mrows > 1 ? i + 1 : i;
+    j1 = ex->mcols > 1 ? j + 1 : j;
+    a = mesh_value (m, ex->mcols, i, j) * (1 - wx)
+      + mesh_value (m, ex->mcols, i, j1) * wx;
+    b = mesh_value (m, ex->mcols, i1, j) * (1 - wx)
+      + mesh_value (m, ex->mcols, i1, j1) * wx;
+    return a * (1 - wy) + b * wy;
+}
+
+/* Background and threshold along row y.
+ */
+static void row_interp (star_extractor_t *ex, struct band *b, int y)
+{
+    int my, mx, x;
+    float wy;
+
+    mesh_coord (y, ex->p.mesh, ex->mrows, &my, &wy);
+    for (mx = 0; mx < ex->mcols; mx++) {
+        int my1 = ex->mrows > 1 ? my + 1 : my;
+        float bg = mesh_value (ex->mesh_bg, ex->mcols, my, mx) * (1 - wy)
+                 + mesh_value (ex->mesh_bg, ex->mcols, my1, mx) * wy;
+        float noise = mesh_value (ex->mesh_noise, ex->mcols, my, mx) * (1 - wy)
+                    + mesh_value (ex->mesh_noise, ex->mcols, my1, mx) * wy;
+        b->col_bg[mx] = bg;
+        b->col_thr[mx] = bg + ex->p.sigma * noise;
+    }
+    if (ex->mcols == 1) {
+        for (x = 0; x < ex->width; x++) {
+            b->bg[x] = b->col_bg[0];
+            b->thr[x] = b->col_thr[0];
+        }
+        return;
+    }
+    for (x = 0; x < ex->width; x++) {
+        int i = ex->xi[x];
+        float w = ex->xw[x];
+        b->bg[x] = b->col_bg[i] + (b->col_bg[i + 1] - b->col_bg[i]) * w;
+        b->thr[x] = b->col_thr[i] + (b->col_thr[i + 1] - b->col_thr[i]) * w;
+    }
+}
+
+/* Pass 2: record runs above threshold.
+ */
+static void detect_band (int band, int first, int last, void *arg)
+{
+    star_extractor_t *ex = arg;
+    struct band *b = &ex->band[band];
+    int x, y;
+
+    b->nruns = 0;
+    b->full = false;
+    for (y = first; y < last; y++) {
+        const ushort *row = ex->data + (size_t)y * ex->width;
+
+        row_interp (ex, b, y);
+        for (x = 0; x < ex->width; x++) {
+            struct run *r;
+
+            if (row[x] <= b->thr[x])
+                continue;
+            if (b->nruns == ex->run_cap) {
+                b->full = true;
+                return;
+            }
+            r = &b->runs[b->nruns++];
+            memset (r, 0, sizeof (*r));
+            r->row = r->ymax = y;
+            r->x0 = r->xmin = x;
+            for (; x < ex->width && row[x] > b->thr[x]; x++) {
+                float I = row[x] - b->bg[x];
+                r->s += I;
+                r->sx += I * x;
+                r->sy += (double)I * y;
+                r->sxx += (double)I * x * x;
+                r->syy += (double)I * y * y;
+                r->sxy += (double)I * x * y;
+                if (row[x] > r->max) {
+                    r->max = row[x];
+                    r->peak = I;
+                }
+                r->npix++;
+            }
+            r->x1 = r->xmax = x - 1;
+        }
+    }
+}
+
+static int find (struct run *runs, int i)
+{
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+static void join (struct run *runs, int i, int j)
+{
+    i = find (runs, i);
+    j = find (runs, j);
+    if (i < j)
+        runs[j].parent = i;
+    else if (j < i)
+        runs[i].parent = j;
+}
+
+/* Join runs that touch (8-connected) in adjacent rows.  Runs are in
+ * row order, and in column order within a row.
+ */
+static void join_runs (struct run *runs, int n)
+{
+    int prev_start = 0, prev_end = 0, cur_start = 0, cur_row = -2;
+    int i, j = 0;
+
+    for (i = 0; i < n; i++) {
+        struct run *r = &runs[i];
+        int k;
+
+        r->parent = i;
+        if (r->row != cur_row) {
+            if (r->row == cur_row + 1) {
+                prev_start = cur_start;
+                prev_end = i;
+            } else
+                prev_start = prev_end = i;
+            cur_row = r->row;
+            cur_start = i;
+            j = prev_start;
+        }
+        while (j < prev_end && runs[j].x1 + 1 < r->x0)
+            j++;
+        for (k = j; k < prev_end && runs[k].x0 <= r->x1 + 1; k++)
+            join (runs, i, k);
+    }
+}
+
+/* Add each run's totals to its component's root.
+ */
+static void sum_runs (struct run *runs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int root = find (runs, i);
+        struct run *c = &runs[root];
+        struct run *r = &runs[i];
+
+        if (root == i)
+            continue;
+        c->s += r->s;
+        c->sx += r->sx;
+        c->sy += r->sy;
+        c->sxx += r->sxx;
+        c->syy += r->syy;
+        c->sxy += r->sxy;
+        c->npix += r->npix;
+        if (r->max > c->max) {
+            c->max = r->max;
+            c->peak = r->peak;
+        }
+        if (r->xmin < c->xmin)
+            c->xmin = r->xmin;
+        if (r->xmax > c->xmax)
+            c->xmax = r->xmax;
+        if (r->ymax > c->ymax)
+            c->ymax = r->ymax;
+    }
+}
+
+/* Keep the 'capacity' brightest components, in descending order of flux.
+ */
+static void select_stars (star_extractor_t *ex, struct run *runs, int n)
+{
+    struct star_catalog *cat = &ex->cat;
+    int i, k;
+
+    cat->count = cat->found = 0;
+    for (i = 0; i < n; i++) {
+        struct run *c = &runs[i];
+
+        if (c->parent != i || c->npix < ex->p.min_pixels || c->s <= 0)
+            continue;
+        cat->found++;
+        if (cat->count == cat->capacity
+                && c->s <= runs[ex->best[cat->count - 1]].s)
+            continue;
+        k = cat->count < cat->capacity ? cat->count++ : cat->count - 1;
+        for (; k > 0 && runs[ex->best[k - 1]].s < c->s; k--)
+            ex->best[k] = ex->best[k - 1];
+        ex->best[k] = i;
+    }
+}
+
+/* Second moments give the axes of the star's ellipse.  The variance of a
+ * uniformly lit pixel, 1/12, is added so that components a single pixel
+ * wide have finite elongation.
+ */
+static float elongation (const struct run *c, double x, double y)
+{
+    double mxx = c->sxx / c->s - x * x + 1.0 / 12;
+    double myy = c->syy / c->s - y * y + 1.0 / 12;
+    double mxy = c->sxy / c->s - x * y;
+    double t = (mxx + myy) / 2;
+    double d = sqrt ((mxx - myy) * (mxx - myy) / 4 + mxy * mxy);
+
+    if (t - d <= 0)
+        return INFINITY;
+    return sqrt ((t + d) / (t - d));
+}
+
+/* Pass 3: HFD of the catalog stars [first, last).
+ */
+static void hfd_band (int band, int first, int last, void *arg)
+{
+    star_extractor_t *ex = arg;
+    struct star_catalog *cat = &ex->cat;
+    int i;
+
+    for (i = first; i < last; i++) {
+        const struct run *c = &ex->all[ex->best[i]];
+        int size = MAX (c->xmax - c->xmin, c->ymax - c->row) + 1;
+        int radius = MIN (MAX (size + 4, 4), HFD_MAX_RADIUS);
+        struct hfd_star s;
+
+        if (hfd_measure (ex->data, ex->height, ex->width, cat->x[i],
+                         cat->y[i], radius, &s) == 0)
+            cat->hfd[i] = s.hfd;
+        else {
+            cat->hfd[i] = 0;
+            cat->flags[i] |= STAR_NO_HFD;
+        }
+    }
+}
+
+const struct star_catalog *star_extract (star_extractor_t *ex,
+                                         const ushort *data,
+                                         int height, int width)
+{
+    struct star_catalog *cat = &ex->cat;
+    int nruns, b, i;
+
+    if (height <= 0 || width <= 0 || height > ex->max_height
+                                  || width > ex->max_width) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ex->data = data;
+    ex->height = height;
+    ex->width = width;
+    ex->mrows = (height + ex->p.mesh - 1) / ex->p.mesh;
+    ex->mcols = (width + ex->p.mesh - 1) / ex->p.mesh;
+
+    rowband_run (height, mesh_band, ex);
+    if (ex->mrows * ex->mcols > 1) {
+        mesh_filter (ex->mesh_bg, ex->mesh_tmp, ex->mrows, ex->mcols);
+        mesh_filter (ex->mesh_noise, ex->mesh_tmp, ex->mrows, ex->mcols);
+    }
+    mesh_interp_setup (ex);
+
+    rowband_run (height, detect_band, ex);
+    cat->truncated = 0;
+    for (nruns = 0, b = 0; b < rowband_count (height); b++) {
+        memcpy (ex->all + nruns, ex->band[b].runs,
+                ex->band[b].nruns * sizeof (struct run));
+        nruns += ex->band[b].nruns;
+        if (ex->band[b].full)
+            cat->truncated = 1;
+    }
+    join_runs (ex->all, nruns);
+    sum_runs (ex->all, nruns);
+    select_stars (ex, ex->all, nruns);
+
+    for (i = 0; i < cat->count; i++) {
+        const struct run *c = &ex->all[ex->best[i]];
+        double x = c->sx / c->s;
+        double y = c->sy / c->s;
+
+        cat->x[i] = x;
+        cat->y[i] = y;
+        cat->flux[i] = c->s;
+        cat->peak[i] = c->peak;
+        cat->background[i] = mesh_at (ex, ex->mesh_bg, x, y);
+        cat->elongation[i] = elongation (c, x, y);
+        cat->npix[i] = c->npix;
+        cat->flags[i] = 0;
+        if (c->max >= ex->p.datamax)
+            cat->flags[i] |= STAR_SATURATED;
+        if (c->xmin == 0 || c->row == 0 || c->xmax == width - 1
+                                        || c->ymax == height - 1)
+            cat->flags[i] |= STAR_EDGE;
+    }
+    rowband_run (cat->count, hfd_band, ex);
+    return cat;
+}
+
+star_extractor_t *star_extractor_create (int height, int width, int capacity,
+                                         const struct star_params *p)
+{
+    star_extractor_t *ex = xzmalloc (sizeof (*ex));
+    struct star_catalog *cat = &ex->cat;
+    int mrows, mcols, nsample, total, b;
+
+    if (p)
+        ex->p = *p;
+    if (ex->p.mesh <= 0)
+        ex->p.mesh = DEFAULT_MESH;
+    if (ex->p.sigma <= 0)
+        ex->p.sigma = DEFAULT_SIGMA;
+    if (ex->p.min_pixels <= 0)
+        ex->p.min_pixels = DEFAULT_MIN_PIXELS;
+    if (ex->p.datamax == 0)
+        ex->p.datamax = 65535;
+    ex->max_height = height;
+    ex->max_width = width;
+
+    mrows = (height + ex->p.mesh - 1) / ex->p.mesh;
+    mcols = (width + ex->p.mesh - 1) / ex->p.mesh;
+    ex->mesh_bg = xzmalloc (mrows * mcols * sizeof (float));
+    ex->mesh_noise = xzmalloc (mrows * mcols * sizeof (float));
+    ex->mesh_tmp = xzmalloc (mrows * mcols * sizeof (float));
+    ex->xi = xzmalloc (width * sizeof (int));
+    ex->xw = xzmalloc (width * sizeof (float));
+
+    /* The band count for a given height is fixed once the pool exists,
+     * and smaller frames have no more bands.
+     */
+    ex->nbands = rowband_count (height);
+    total = MAX (height * RUNS_PER_ROW, RUNS_MIN);
+    ex->run_cap = total / ex->nbands;
+    ex->all = xzmalloc ((size_t)ex->run_cap * ex->nbands * sizeof (struct run));
+    nsample = (ex->p.mesh / MESH_STEP + 1) * (ex->p.mesh / MESH_STEP + 1);
+    for (b = 0; b < ex->nbands; b++) {
+        struct band *bp = &ex->band[b];
+        bp->runs = xzmalloc ((size_t)ex->run_cap * sizeof (struct run));
+        bp->bg = xzmalloc (width * sizeof (float));
+        bp->thr = xzmalloc (width * sizeof (float));
+        bp->col_bg = xzmalloc (mcols * sizeof (float));
+        bp->col_thr = xzmalloc (mcols * sizeof (float));
+        bp->sample = xzmalloc (nsample * sizeof (ushort));
+    }
+
+    ex->best = xzmalloc (capacity * sizeof (int));
+    cat->capacity = capacity;
+    cat->x = xzmalloc (capacity * sizeof (float));
+    cat->y = xzmalloc (capacity * sizeof (float));
+    cat->flux = xzmalloc (capacity * sizeof (float));
+    cat->peak = xzmalloc (capacity * sizeof (float));
+    cat->background = xzmalloc (capacity * sizeof (float));
+    cat->hfd = xzmalloc (capacity * sizeof (float));
+    cat->elongation = xzmalloc (capacity * sizeof (float));
+    cat->npix = xzmalloc (capacity * sizeof (uint32_t));
+    cat->flags = xzmalloc (capacity * sizeof (uint8_t));
+    return ex;
+}
+
+void star_extractor_destroy (star_extractor_t *ex)
+{
+    struct star_catalog *cat;
+    int b;
+
+    if (!ex)
+        return;
+    cat = &ex->cat;
+    for (b = 0; b < ex->nbands; b++) {
+        free (ex->band[b].runs);
+        free (ex->band[b].bg);
+        free (ex->band[b].thr);
+        free (ex->band[b].col_bg);
+        free (ex->band[b].col_thr);
+        free (ex->band[b].sample);
+    }
+    free (ex->all);
+    free (ex->mesh_bg);
+    free (ex->mesh_noise);
+    free (ex->mesh_tmp);
+    free (ex->xi);
+    free (ex->xw);
+    free (ex->best);
+    free (cat->x);
+    free (cat->y);
+    free (cat->flux);
+    free (cat->peak);
+    free (cat->background);
+    free (cat->hfd);
+    free (cat->elongation);
+    free (cat->npix);
+    free (cat->flags);
+    free (ex);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,73 @@
+#ifndef _UTIL_STAR_H
+#define _UTIL_STAR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Star extraction: find the stars in a frame of 'height' rows of 'width'
+ * pixels and measure them.
+ *
+ * The sky background and its noise are estimated on a coarse mesh and
+ * interpolated, pixels more than 'sigma' times the noise above the
+ * background are grouped into 8-connected components, and each component
+ * large enough to be a star becomes a catalog entry.  Blended stars are
+ * not separated.  Coordinates are in pixels from the top left of the
+ * frame, with pixel centers at integer positions.
+ *
+ * All memory is allocated by star_extractor_create(), so star_extract()
+ * may be called on every frame of a sequence without allocating.  The
+ * work is spread over the rowband thread pool.
+ */
+
+typedef struct star_extractor star_extractor_t;
+
+struct star_params {
+    int mesh;           /* background mesh cell size (default 64) */
+    double sigma;       /* detection threshold in noise sigma (default 5) */
+    int min_pixels;     /* smallest star, in pixels above threshold (3) */
+    ushort datamax;     /* saturation level (default 65535) */
+};
+
+enum {
+    STAR_SATURATED = 1, /* a pixel is at or above datamax */
+    STAR_EDGE = 2,      /* touches the edge of the frame */
+    STAR_NO_HFD = 4,    /* hfd could not be measured */
+};
+
+/* Catalog in structure of arrays form, brightest first.
+ */
+struct star_catalog {
+    int count;
+    int capacity;
+    int found;          /* stars found, may exceed capacity */
+    int truncated;      /* workspace filled, so some rows were skipped */
+    float *x, *y;       /* centroid of pixels above threshold */
+    float *flux;        /* sum above background, over the same pixels */
+    float *peak;        /* brightest pixel above background */
+    float *background;  /* interpolated background at the centroid */
+    float *hfd;         /* half flux diameter (see hfd.h) */
+    float *elongation;  /* major / minor axis, 1 for a round star */
+    uint32_t *npix;     /* pixels above threshold */
+    uint8_t *flags;
+};
+
+/* Create an extractor for frames up to height x width, keeping up to
+ * 'capacity' stars.  'p' may be NULL, and zero fields select defaults.
+ */
+star_extractor_t *star_extractor_create (int height, int width, int capacity,
+                                         const struct star_params *p);
+void star_extractor_destroy (star_extractor_t *ex);
+
+/* Extract stars.  The catalog belongs to the extractor and is valid until
+ * the next call.  Returns NULL if the frame is larger than the extractor
+ * was created for (errno = EINVAL).
+ */
+const struct star_catalog *star_extract (star_extractor_t *ex,
+                                         const ushort *data,
+                                         int height, int width);
+
+#endif /* !_UTIL_STAR_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,232 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Single pass frame statistics.
+ *
+ * The only per-pixel work is a full resolution (65536 bin) histogram,
+ * built in parallel row bands, each band also noting its min and max.
+ * Everything else (mean, standard deviation, saturated count,
+ * percentiles) is derived exactly from the histogram between min and
+ * max, so a small frame or one with a narrow range of values costs
+ * little more than its pixels.  Band histograms are left zeroed by
+ * clearing just the bins used, and small frames are done in one band.
+ * The histogram kept for the caller may be coarser, with bins
+ * 1 << bin_shift wide.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "xzmalloc.h"
+#include "rowband.h"
+#include "stats.h"
+
+#define FULL_BINS   65536
+#define SMALL_FRAME 65536   /* pixels; fewer aren't worth splitting */
+
+struct hist_band {
+    const ushort *data;
+    int width;
+    uint32_t *hist;     /* FULL_BINS per band, zero on entry */
+    ushort min[ROWBAND_MAX_BANDS];
+    ushort max[ROWBAND_MAX_BANDS];
+};
+
+static void hist_band (int band, int first, int last, void *arg)
+{
+    struct hist_band *hb = arg;
+    const ushort *pp = hb->data + (size_t)first * hb->width;
+    const ushort *end = hb->data + (size_t)last * hb->width;
+    uint32_t *hist = hb->hist + (size_t)band * FULL_BINS;
+    ushort min = 65535, max = 0;
+
+    for (; pp < end; pp++) {
+        hist[*pp]++;
+        if (*pp < min)
+            min = *pp;
+        if (*pp > max)
+            max = *pp;
+    }
+    hb->min[band] = min;
+    hb->max[band] = max;
+}
+
+void stats_init (struct stats *st, int bin_shift)
+{
+    memset (st, 0, sizeof (*st));
+    if (bin_shift < 0)
+        bin_shift = 0;
+    if (bin_shift > 16)
+        bin_shift = 16;
+    st->bin_shift = bin_shift;
+    st->nbins = FULL_BINS >> bin_shift;
+    st->hist = xzmalloc (st->nbins * sizeof (st->hist[0]));
+    st->nbands = rowband_get_threads ();
+    st->band_hist = xzmalloc ((size_t)st->nbands * FULL_BINS
+                              * sizeof (st->band_hist[0]));
+}
+
+void stats_fini (struct stats *st)
+{
+    free (st->hist);
+    st->hist = NULL;
+    free (st->band_hist);
+    st->band_hist = NULL;
+}
+
+void stats_compute (struct stats *st, const ushort *data,
+                    int height, int width, ushort satlevel)
+{
+    struct hist_band hb = { .data = data, .width = width,
+                            .hist = st->band_hist };
+    int nbands = 0;
+    double sum = 0, sumsq = 0;
+    int min = FULL_BINS, max = -1;
+    uint32_t *h;
+    ulong n;
+    int i, b;
+
+    /* The caller's histogram is nonzero only between the last min and max.
+     */
+    if (st->count > 0)
+        memset (st->hist + (st->min >> st->bin_shift), 0,
+                ((st->max >> st->bin_shift) - (st->min >> st->bin_shift) + 1)
+                * sizeof (st->hist[0]));
+    st->count = (ulong)height * width;
+    st->min = st->max = 0;
+    st->saturated = 0;
+    if (height > 0 && width > 0) {
+        if (st->count < SMALL_FRAME || rowband_count (height) > st->nbands) {
+            nbands = 1;
+            hist_band (0, 0, height, &hb);
+        } else {
+            nbands = rowband_count (height);
+            rowband_run (height, hist_band, &hb);
+        }
+    }
+    for (b = 0; b < nbands; b++) {
+        if (hb.min[b] < min)
+            min = hb.min[b];
+        if (hb.max[b] > max)
+            max = hb.max[b];
+    }
+    for (i = min; i <= max; i++) {
+        for (n = 0, b = 0; b < nbands; b++)
+            n += hb.hist[(size_t)b * FULL_BINS + i];
+        if (n == 0)
+            continue;
+        if (i >= satlevel)
+            st->saturated += n;
+        sum += (double)i * n;
+        sumsq += (double)i * i * n;
+        st->hist[i >> st->bin_shift] += n;
+    }
+    for (b = 0; b < nbands; b++) {
+        h = hb.hist + (size_t)b * FULL_BINS;
+        if (hb.min[b] <= hb.max[b])
+            memset (h + hb.min[b], 0,
+                    (hb.max[b] - hb.min[b] + 1) * sizeof (*h));
+    }
+    if (max >= 0) {
+        st->min = min;
+        st->max = max;
+    }
+
+    if (st->count > 0) {
+        st->mean = sum / st->count;
+        st->stddev = sqrt (fmax (0, sumsq / st->count - st->mean * st->mean));
+    } else
+        st->mean = st->stddev = 0;
+}
+
+ushort stats_rank (const struct stats *st, ulong n)
+{
+    ulong sum = 0;
+    int i;
+
+    for (i = 0; i < st->nbins; i++) {
+        sum += st->hist[i];
+        if (sum >= n)
+            return i << st->bin_shift;
+    }
+    return st->max;
+}
+
+ushort stats_percentile (const struct stats *st, double p)
+{
+    ulong n;
+
+    if (p < 0)
+        p = 0;
+    if (p > 100)
+        p = 100;
+    n = ceil (p * st->count / 100);
+    return stats_rank (st, n > 0 ? n : 1);
+}
+
+/* Quickselect (Hoare), with median of three pivots.
+ */
+ushort stats_select (ushort *a, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+
+    while (hi > lo) {
+        int mid = lo + (hi - lo) / 2;
+        ushort x, t;
+        int i = lo, j = hi;
+
+        if (a[mid] < a[lo])
+            t = a[mid], a[mid] = a[lo], a[lo] = t;
+        if (a[hi] < a[lo])
+            t = a[hi], a[hi] = a[lo], a[lo] = t;
+        if (a[hi] < a[mid])
+            t = a[hi], a[hi] = a[mid], a[mid] = t;
+        x = a[mid];
+        while (i <= j) {
+            while (a[i] < x)
+                i++;
+            while (a[j] > x)
+                j--;
+            if (i <= j) {
+                t = a[i], a[i] = a[j], a[j] = t;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return a[k];
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,51 @@
+#ifndef _UTIL_STATS_H
+#define _UTIL_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct stats {
+    ulong count;        /* number of pixels */
+    ushort min;
+    ushort max;
+    double mean;
+    double stddev;
+    ulong saturated;    /* pixels >= satlevel */
+    int bin_shift;      /* histogram bins are 1 << bin_shift wide */
+    int nbins;
+    ulong *hist;        /* 65536 >> bin_shift bins */
+    uint32_t *band_hist;    /* full histogram per row band (scratch) */
+    int nbands;
+};
+
+/* Allocate/free the histograms.  bin_shift = 0 keeps all 65536 bins.
+ * Scratch for the parallel pass is allocated here too, so computing
+ * doesn't allocate.  A struct stats is used by one thread at a time.
+ */
+void stats_init (struct stats *st, int bin_shift);
+void stats_fini (struct stats *st);
+
+/* Compute statistics of an image of 'height' rows of 'width' pixels.
+ */
+void stats_compute (struct stats *st, const ushort *data,
+                    int height, int width, ushort satlevel);
+
+/* Return the lowest pixel value (bin) at which the cumulative histogram
+ * reaches 'n' pixels.
+ */
+ushort stats_rank (const struct stats *st, ulong n);
+
+/* Return the p-th percentile (0 <= p <= 100) pixel value (bin).
+ */
+ushort stats_percentile (const struct stats *st, double p);
+
+/* Return the k-th smallest (0 based) of 'n' values, reordering them.
+ * Runs in linear time without allocating, for medians of small samples.
+ */
+ushort stats_select (ushort *a, int n, int k);
+
+#endif /* !_UTIL_STATS_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,1070 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Simulated SBIG universal driver.
+ *
+ * This is a drop-in replacement for libsbigudrv.so that implements the
+ * subset of SBIGUnivDrvCommand() used by sbig-util, so that the tools can
+ * be exercised and benchmarked without a camera.  Point SBIG_UDRV (or the
+ * sbigudrv config file entry) at the installed libsbigsim.so.
+ *
+ * Environment:
+ *   SBIG_SIM_CAMERA     ST-8 (default), STF-8300, or STT-1603
+ *   SBIG_SIM_LINE_USEC  override modeled per-line readout latency (usec)
+ *   SBIG_SIM_STARS      number of stars in the synthetic field
+ *   SBIG_SIM_SEEING     star FWHM in unbinned pixels (default 3.0)
+ *   SBIG_SIM_SEED       random seed for star field and noise
+ *   SBIG_SIM_DRIFT      mount drift "x,y" in imaging pixels per second
+ *
+ * The star fields of both ccds move together with the mount's pointing,
+ * which drifts at a constant rate, moves at SIM_GUIDE_RATE while a guide
+ * relay is active, and is offset by the AO tip-tilt deflection.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#include "sbigudrv.h"
+
+#define SIM_SERIAL      "SIM00001"
+#define SIM_AMBIENT     20.0    /* ambient temperature, degrees C */
+#define SIM_MAX_DELTA   40.0    /* max TE cooling below ambient */
+#define SIM_TE_TAU      60.0    /* TE time constant, seconds */
+#define SIM_BIAS        100     /* bias level, ADU */
+#define SIM_CFW_SLOT_MS 400     /* filter wheel move time per slot */
+#define SIM_GUIDE_RATE  18.0    /* relay guide rate, microns/s */
+#define SIM_AO_SCALE    0.02    /* AO tip-tilt, microns per unit */
+
+struct sim_chip {
+    const char *name;
+    ushort width, height;       /* unbinned pixels */
+    double pixel_um;            /* microns */
+    double gain;                /* e-/ADU */
+    double line_usec;           /* fixed per-line overhead */
+    double pixel_nsec;          /* digitization time per output pixel */
+    double dark_rate;           /* ADU/pixel/s at ambient */
+    double sky_rate;            /* ADU/pixel/s */
+};
+
+struct sim_model {
+    const char *name;
+    CAMERA_TYPE type;
+    ushort firmware;
+    MY_LOGICAL abg;
+    ushort capabilities;
+    CFW_MODEL_SELECT cfw;
+    int cfw_positions;
+    struct sim_chip imaging;
+    struct sim_chip tracking;   /* width == 0 if none */
+};
+
+static const struct sim_model models[] = {
+    { .name = "ST-8", .type = ST8_CAMERA, .firmware = 0x0242,
+      .abg = ABG_NOT_PRESENT, .capabilities = 0,
+      .cfw = CFWSEL_CFW8, .cfw_positions = 5,
+      .imaging = { "SBIG ST-8 Dual CCD Camera", 1530, 1020, 9.0, 2.78,
+                   900.0, 3500.0, 0.1, 3.0 },
+      .tracking = { "SBIG ST-8 Tracking CCD", 192, 164, 13.75, 2.78,
+                   300.0, 3500.0, 0.1, 3.0 },
+    },
+    { .name = "STF-8300", .type = STF_CAMERA, .firmware = 0x0110,
+      .abg = ABG_PRESENT, .capabilities = CB_REQUIRES_STARTEXP2_YES,
+      .cfw = CFWSEL_FW8_8300, .cfw_positions = 8,
+      .imaging = { "SBIG STF-8300 CCD Camera", 3326, 2504, 5.4, 0.37,
+                   100.0, 80.0, 0.02, 8.0 },
+    },
+    { .name = "STT-1603", .type = STT_CAMERA, .firmware = 0x0124,
+      .abg = ABG_NOT_PRESENT, .capabilities = CB_REQUIRES_STARTEXP2_YES,
+      .cfw = CFWSEL_FW8_STT, .cfw_positions = 8,
+      .imaging = { "SBIG STT-1603 3 CCD Camera", 1536, 1024, 9.0, 1.4,
+                   150.0, 500.0, 0.05, 4.0 },
+    },
+};
+
+struct sim_star {
+    double x, y;                /* unbinned pixel coordinates */
+    double peak;                /* ADU/s at peak, unbinned */
+};
+
+struct sim_ccd {
+    const struct sim_chip *chip;
+    struct sim_star *stars;
+    int nstars;
+    /* exposure */
+    bool exposing;
+    bool complete;
+    struct timespec start;
+    double duration;            /* requested, seconds */
+    ushort shutter;
+    ushort mode;                /* readout mode of the exposure */
+    ushort top, left, height, width;
+    double ox, oy;              /* pointing offset at start, microns */
+    ushort *image;              /* rendered binned image */
+    ushort image_height, image_width;
+    /* readout */
+    bool reading;
+    ushort row;                 /* next row of the readout window */
+    ushort ro_top, ro_height;
+};
+
+struct sim {
+    bool driver_open;
+    bool device_open;
+    bool linked;
+    const struct sim_model *model;
+    struct sim_ccd ccd[2];
+    double line_usec;           /* < 0 means use model */
+    double fwhm;
+    int nstars;
+    uint64_t seed;
+    uint64_t rng;
+    /* temperature */
+    bool cooling;
+    double setpoint;
+    double temp;
+    struct timespec temp_t;
+    /* filter wheel */
+    int cfw_position;
+    struct timespec cfw_done;
+    /* pointing, in microns at the focal plane */
+    struct timespec epoch;
+    double drift_x, drift_y;    /* microns/s */
+    double guide_x, guide_y;    /* relay motion before the current pulse */
+    struct timespec relay_start;
+    double relay[4];            /* X+, X-, Y+, Y- pulse lengths, seconds */
+    double ao_x, ao_y;
+};
+
+static struct sim sim;
+
+static double timespec_since (struct timespec *t0)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec) + 1E-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+static void usec_sleep (double usec)
+{
+    struct timespec ts;
+
+    if (usec <= 0)
+        return;
+    ts.tv_sec = usec / 1E6;
+    ts.tv_nsec = (usec - ts.tv_sec * 1E6) * 1E3;
+    while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* xorshift64* - fast, and good enough for synthetic noise.
+ */
+static uint64_t rng_next (void)
+{
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return sim.rng * 2685821657736338717ULL;
+}
+
+static double rng_uniform (void)
+{
+    return (rng_next () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Approximately normal (Irwin-Hall, n=4), unit variance.
+ */
+static double rng_normal (void)
+{
+    double s = rng_uniform () + rng_uniform () + rng_uniform ()
+             + rng_uniform ();
+    return (s - 2.0) * 1.7320508;
+}
+
+/* Seconds of pulse 'i' completed by time 't' after the relay command.
+ */
+static double relay_done (int i, double t)
+{
+    return t < sim.relay[i] ? t : sim.relay[i];
+}
+
+/* Current pointing offset in microns.
+ */
+static void pointing (double *x, double *y)
+{
+    double t = timespec_since (&sim.relay_start);
+    double te = timespec_since (&sim.epoch);
+
+    *x = sim.drift_x * te + sim.guide_x + sim.ao_x
+       + SIM_GUIDE_RATE * (relay_done (0, t) - relay_done (1, t));
+    *y = sim.drift_y * te + sim.guide_y + sim.ao_y
+       + SIM_GUIDE_RATE * (relay_done (2, t) - relay_done (3, t));
+}
+
+/* A relay command replaces any pulses still in progress.
+ */
+static int cmd_activate_relay (ActivateRelayParams *in)
+{
+    double t = timespec_since (&sim.relay_start);
+    int i;
+
+    sim.guide_x += SIM_GUIDE_RATE * (relay_done (0, t) - relay_done (1, t));
+    sim.guide_y += SIM_GUIDE_RATE * (relay_done (2, t) - relay_done (3, t));
+    clock_gettime (CLOCK_MONOTONIC, &sim.relay_start);
+    sim.relay[0] = 1E-2 * in->tXPlus;
+    sim.relay[1] = 1E-2 * in->tXMinus;
+    sim.relay[2] = 1E-2 * in->tYPlus;
+    sim.relay[3] = 1E-2 * in->tYMinus;
+    for (i = 0; i < 4; i++)
+        if (sim.relay[i] < 0)
+            sim.relay[i] = 0;
+    return CE_NO_ERROR;
+}
+
+static int cmd_ao_tip_tilt (AOTipTiltParams *in)
+{
+    if (in->xDeflection > 4095 || in->yDeflection > 4095)
+        return CE_BAD_PARAMETER;
+    sim.ao_x = SIM_AO_SCALE * ((int)in->xDeflection - 2048);
+    sim.ao_y = SIM_AO_SCALE * ((int)in->yDeflection - 2048);
+    return CE_NO_ERROR;
+}
+
+static const struct sim_model *lookup_model (const char *name)
+{
+    int i, max = sizeof (models) / sizeof (models[0]);
+
+    if (!name)
+        return &models[0];
+    for (i = 0; i < max; i++)
+        if (!strcasecmp (models[i].name, name))
+            return &models[i];
+    return &models[0];
+}
+
+static void sim_init (void)
+{
+    const char *s;
+    int i;
+
+    sim.model = lookup_model (getenv ("SBIG_SIM_CAMERA"));
+    sim.line_usec = (s = getenv ("SBIG_SIM_LINE_USEC")) ? strtod (s, NULL)
+                                                         : -1;
+    sim.fwhm = (s = getenv ("SBIG_SIM_SEEING")) ? strtod (s, NULL) : 3.0;
+    if (sim.fwhm < 0.5)
+        sim.fwhm = 0.5;
+    sim.nstars = (s = getenv ("SBIG_SIM_STARS")) ? strtol (s, NULL, 10) : -1;
+    sim.seed = (s = getenv ("SBIG_SIM_SEED")) ? strtoull (s, NULL, 10) : 42;
+    sim.rng = sim.seed * 2654435761ULL + 1;
+    if ((s = getenv ("SBIG_SIM_DRIFT"))) {
+        double dx = 0, dy = 0;
+        (void)sscanf (s, "%lf,%lf", &dx, &dy);
+        sim.drift_x = dx * sim.model->imaging.pixel_um;
+        sim.drift_y = dy * sim.model->imaging.pixel_um;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &sim.epoch);
+    clock_gettime (CLOCK_MONOTONIC, &sim.relay_start);
+    sim.temp = SIM_AMBIENT;
+    sim.setpoint = SIM_AMBIENT;
+    clock_gettime (CLOCK_MONOTONIC, &sim.temp_t);
+    sim.cfw_position = 1;
+    clock_gettime (CLOCK_MONOTONIC, &sim.cfw_done);
+    sim.ccd[CCD_IMAGING].chip = &sim.model->imaging;
+    sim.ccd[CCD_TRACKING].chip = &sim.model->tracking;
+    for (i = 0; i < 2; i++) {
+        const struct sim_chip *chip = sim.ccd[i].chip;
+        int j, n;
+
+        if (chip->width == 0)
+            continue;
+        n = sim.nstars >= 0 ? sim.nstars
+                            : (long)chip->width * chip->height / 20000 + 5;
+        sim.ccd[i].stars = calloc (n, sizeof (struct sim_star));
+        if (!sim.ccd[i].stars)
+            continue;
+        for (j = 0; j < n; j++) {
+            sim.ccd[i].stars[j].x = rng_uniform () * chip->width;
+            sim.ccd[i].stars[j].y = rng_uniform () * chip->height;
+            /* power law: many faint stars, few bright ones */
+            sim.ccd[i].stars[j].peak = 20.0 / pow (rng_uniform () + 1E-3, 1.2);
+        }
+        sim.ccd[i].nstars = n;
+    }
+}
+
+static void sim_fini (void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        free (sim.ccd[i].stars);
+        free (sim.ccd[i].image);
+    }
+    memset (&sim, 0, sizeof (sim));
+}
+
+static struct sim_ccd *lookup_ccd (ushort ccd)
+{
+    ccd &= 0xff;
+    if (ccd > CCD_TRACKING || !sim.ccd[ccd].chip
+                           || sim.ccd[ccd].chip->width == 0)
+        return NULL;
+    return &sim.ccd[ccd];
+}
+
+/* Horizontal and vertical binning factors for a readout mode.
+ */
+static bool mode_binning (ushort mode, int *hbin, int *vbin)
+{
+    int n = (mode >> 8) & 0xff;
+
+    switch (mode & 0xff) {
+        case RM_1X1:
+        case RM_1X1_VOFFCHIP:
+            *hbin = *vbin = 1;
+            break;
+        case RM_2X2:
+        case RM_2X2_VOFFCHIP:
+            *hbin = *vbin = 2;
+            break;
+        case RM_3X3:
+        case RM_3X3_VOFFCHIP:
+            *hbin = *vbin = 3;
+            break;
+        case RM_9X9:
+            *hbin = *vbin = 9;
+            break;
+        case RM_NX1:
+        case RM_NX2:
+        case RM_NX3:
+            *hbin = (mode & 0xff) - RM_NX1 + 1;
+            *vbin = n > 0 ? n : 1;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+static bool mode_size (const struct sim_chip *chip, ushort mode,
+                       ushort *height, ushort *width)
+{
+    int hbin, vbin;
+
+    if (!mode_binning (mode, &hbin, &vbin))
+        return false;
+    *width = chip->width / hbin;
+    *height = chip->height / vbin;
+    return true;
+}
+
+static double line_latency (const struct sim_chip *chip, ushort len)
+{
+    if (sim.line_usec >= 0)
+        return sim.line_usec;
+    return chip->line_usec + 1E-3 * chip->pixel_nsec * len;
+}
+
+/* Render the exposure into the binned image buffer: bias, dark current,
+ * sky, a gaussian star field (light frames only), and read/shot noise.
+ */
+static int render_image (struct sim_ccd *c, double t)
+{
+    const struct sim_chip *chip = c->chip;
+    int hbin, vbin, x, y, i;
+    double sigma = sim.fwhm / 2.3548;
+    double dark, base, ox, oy;
+    size_t size;
+
+    if (!mode_binning (c->mode, &hbin, &vbin))
+        return CE_BAD_PARAMETER;
+    size = (size_t)c->height * c->width;
+    if (size != (size_t)c->image_height * c->image_width || !c->image) {
+        free (c->image);
+        if (!(c->image = malloc (size * sizeof (ushort)))) {
+            c->image_height = c->image_width = 0;
+            return CE_MEMORY_ERROR;
+        }
+    }
+    c->image_height = c->height;
+    c->image_width = c->width;
+
+    /* Dark current halves every 6C of cooling.
+     */
+    dark = chip->dark_rate * pow (2.0, (sim.temp - SIM_AMBIENT) / 6.0);
+    base = (dark + (c->shutter == SC_CLOSE_SHUTTER ? 0 : chip->sky_rate))
+         * t * hbin * vbin;
+
+    float *acc = malloc (size * sizeof (float));
+    if (!acc)
+        return CE_MEMORY_ERROR;
+    for (i = 0; i < size; i++)
+        acc[i] = base;
+
+    /* Stars sit where the mount pointed halfway through the exposure.
+     */
+    pointing (&ox, &oy);
+    ox = (ox + c->ox) / (2 * chip->pixel_um);
+    oy = (oy + c->oy) / (2 * chip->pixel_um);
+
+    if (c->shutter != SC_CLOSE_SHUTTER) {
+        int r = ceil (4 * sigma);
+        for (i = 0; i < c->nstars; i++) {
+            struct sim_star *s = &c->stars[i];
+            double sx = s->x + ox, sy = s->y + oy;
+            int x0 = floor (sx) - r, x1 = floor (sx) + r;
+            int y0 = floor (sy) - r, y1 = floor (sy) + r;
+
+            for (y = y0; y <= y1; y++) {
+                int by = y / vbin - c->top;
+                if (y < 0 || by < 0 || by >= c->height)
+                    continue;
+                double dy = y + 0.5 - sy;
+                for (x = x0; x <= x1; x++) {
+                    int bx = x / hbin - c->left;
+                    if (x < 0 || bx < 0 || bx >= c->width)
+                        continue;
+                    double dx = x + 0.5 - sx;
+                    acc[by * c->width + bx] += s->peak * t
+                            * exp (-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                }
+            }
+        }
+    }
+    for (i = 0; i < size; i++) {
+        double v = acc[i];
+        v += SIM_BIAS + rng_normal () * sqrt (v + 64.0);
+        c->image[i] = v < 0 ? 0 : v > 65535 ? 65535 : (ushort)v;
+    }
+    free (acc);
+    return CE_NO_ERROR;
+}
+
+static void update_exposure (struct sim_ccd *c)
+{
+    if (c->exposing && !c->complete && timespec_since (&c->start) >= c->duration)
+        c->complete = true;
+}
+
+static void update_temp (void)
+{
+    double dt = timespec_since (&sim.temp_t);
+    double target = SIM_AMBIENT;
+
+    clock_gettime (CLOCK_MONOTONIC, &sim.temp_t);
+    if (sim.cooling) {
+        target = sim.setpoint;
+        if (target < SIM_AMBIENT - SIM_MAX_DELTA)
+            target = SIM_AMBIENT - SIM_MAX_DELTA;
+    }
+    sim.temp = target + (sim.temp - target) * exp (-dt / SIM_TE_TAU);
+}
+
+static int cmd_start_exposure (ushort ccd, ulong exptime, ushort shutter,
+                               ushort mode, ushort top, ushort left,
+                               ushort height, ushort width)
+{
+    struct sim_ccd *c = lookup_ccd (ccd);
+    ushort h, w;
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    if (!mode_size (c->chip, mode, &h, &w))
+        return CE_BAD_PARAMETER;
+    if (height == 0 && width == 0) {
+        height = h;
+        width = w;
+    }
+    if (top + height > h || left + width > w)
+        return CE_BAD_PARAMETER;
+    c->exposing = true;
+    c->complete = false;
+    c->reading = false;
+    clock_gettime (CLOCK_MONOTONIC, &c->start);
+    pointing (&c->ox, &c->oy);
+    if (exptime & EXP_MS_EXPOSURE)
+        c->duration = 1E-3 * (exptime & EXP_TIME_MASK);
+    else
+        c->duration = 1E-2 * (exptime & EXP_TIME_MASK);
+    c->shutter = shutter;
+    c->mode = mode;
+    c->top = top;
+    c->left = left;
+    c->height = height;
+    c->width = width;
+    return CE_NO_ERROR;
+}
+
+static int cmd_end_exposure (EndExposureParams *in)
+{
+    struct sim_ccd *c = lookup_ccd (in->ccd);
+    double t;
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    if (!c->exposing)
+        return CE_NO_ERROR;
+    c->exposing = false;
+    if ((in->ccd & ABORT_DONT_END))
+        return CE_NO_ERROR;
+    t = timespec_since (&c->start);
+    if (t > c->duration)
+        t = c->duration;
+    update_temp ();
+    return render_image (c, t);
+}
+
+static int cmd_start_readout (StartReadoutParams *in)
+{
+    struct sim_ccd *c = lookup_ccd (in->ccd);
+
+    if (!c || !c->image)
+        return CE_BAD_PARAMETER;
+    if (in->top < c->top || in->top - c->top + in->height > c->image_height)
+        return CE_BAD_PARAMETER;
+    c->reading = true;
+    c->row = 0;
+    c->ro_top = in->top - c->top;
+    c->ro_height = in->height;
+    return CE_NO_ERROR;
+}
+
+static int cmd_readout_line (ReadoutLineParams *in, ushort *out, bool subtract)
+{
+    struct sim_ccd *c = lookup_ccd (in->ccd);
+    ushort *src;
+    int i;
+
+    if (!c || !c->image || !out)
+        return CE_BAD_PARAMETER;
+    if (!c->reading) {          /* CC_START_READOUT is optional */
+        c->reading = true;
+        c->row = 0;
+        c->ro_top = 0;
+        c->ro_height = c->image_height;
+    }
+    if (c->row >= c->ro_height
+            || in->pixelStart < c->left
+            || in->pixelStart - c->left + in->pixelLength > c->image_width)
+        return CE_BAD_PARAMETER;
+    usec_sleep (line_latency (c->chip, in->pixelLength));
+    src = c->image + (size_t)(c->ro_top + c->row) * c->image_width
+                   + (in->pixelStart - c->left);
+    if (subtract) {
+        /* Driver subtracts the line already in the buffer (the dark),
+         * clipping at zero and adding an offset of 100.
+         */
+        for (i = 0; i < in->pixelLength; i++) {
+            int v = (int)src[i] - out[i];
+            v = (v < 0 ? 0 : v) + 100;
+            out[i] = v > 65535 ? 65535 : v;
+        }
+    } else
+        memcpy (out, src, in->pixelLength * sizeof (ushort));
+    c->row++;
+    return CE_NO_ERROR;
+}
+
+static int cmd_dump_lines (DumpLinesParams *in)
+{
+    struct sim_ccd *c = lookup_ccd (in->ccd);
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    c->row += in->lineLength;
+    return CE_NO_ERROR;
+}
+
+static int cmd_end_readout (EndReadoutParams *in)
+{
+    struct sim_ccd *c = lookup_ccd (in->ccd);
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    c->reading = false;
+    return CE_NO_ERROR;
+}
+
+static int cmd_query_status (QueryCommandStatusParams *in,
+                             QueryCommandStatusResults *out)
+{
+    int i;
+
+    if (!out)
+        return CE_BAD_PARAMETER;
+    out->status = 0;
+    switch (in->command) {
+        case CC_START_EXPOSURE:
+        case CC_START_EXPOSURE2:
+        case CC_END_EXPOSURE:
+            for (i = 0; i < 2; i++) {
+                struct sim_ccd *c = &sim.ccd[i];
+                ushort s = CS_IDLE;
+                update_exposure (c);
+                if (c->exposing)
+                    s = c->complete ? CS_INTEGRATION_COMPLETE : CS_INTEGRATING;
+                out->status |= s << (2 * i);
+            }
+            break;
+        case CC_ACTIVATE_RELAY: {
+            double t = timespec_since (&sim.relay_start);
+            for (i = 0; i < 4; i++)  /* X+ in bit 3 ... Y- in bit 0 */
+                if (t < sim.relay[i])
+                    out->status |= 8 >> i;
+            break;
+        }
+        default:
+            break;
+    }
+    return CE_NO_ERROR;
+}
+
+/* Convert a non-negative value to BCD with two decimal places (e.g. 6.2).
+ */
+static ulong to_bcd (double val)
+{
+    ulong x = llround (val * 100);
+    ulong bcd = 0;
+    int shift = 0;
+
+    while (x > 0 && shift < 32) {
+        bcd |= (x % 10) << shift;
+        x /= 10;
+        shift += 4;
+    }
+    return bcd;
+}
+
+/* N x M modes report zero height and unbinned pixel height, as the
+ * driver does; the caller derives height from the mode's high byte.
+ */
+static void fill_readout_info (const struct sim_chip *chip,
+                               READOUT_INFO *ri, ushort mode)
+{
+    int hbin, vbin;
+    bool nx = (mode >= RM_NX1 && mode <= RM_NX3);
+
+    mode_binning (mode, &hbin, &vbin);
+    if (nx)
+        vbin = 1;
+    ri->mode = mode;
+    ri->width = chip->width / hbin;
+    ri->height = nx ? 0 : chip->height / vbin;
+    ri->gain = to_bcd (chip->gain);
+    ri->pixelWidth = to_bcd (chip->pixel_um * hbin);
+    ri->pixelHeight = to_bcd (chip->pixel_um * vbin);
+}
+
+static int cmd_get_ccd_info (GetCCDInfoParams *in, void *out)
+{
+    const struct sim_model *m = sim.model;
+
+    if (!out)
+        return CE_BAD_PARAMETER;
+    switch (in->request) {
+        case CCD_INFO_IMAGING:
+        case CCD_INFO_TRACKING: {
+            GetCCDInfoResults0 *info = out;
+            const struct sim_chip *chip = in->request == CCD_INFO_IMAGING
+                                        ? &m->imaging : &m->tracking;
+            static const ushort modes[] = { RM_1X1, RM_2X2, RM_3X3,
+                                            RM_NX1, RM_NX2, RM_NX3,
+                                            RM_1X1_VOFFCHIP, RM_2X2_VOFFCHIP,
+                                            RM_3X3_VOFFCHIP, RM_9X9 };
+            int i, n = in->request == CCD_INFO_IMAGING ? 10 : 3;
+
+            if (chip->width == 0)
+                return CE_BAD_PARAMETER;
+            memset (info, 0, sizeof (*info));
+            info->firmwareVersion = m->firmware;
+            info->cameraType = m->type;
+            snprintf (info->name, sizeof (info->name), "%s", chip->name);
+            info->readoutModes = n;
+            for (i = 0; i < n; i++)
+                fill_readout_info (chip, &info->readoutInfo[i], modes[i]);
+            break;
+        }
+        case CCD_INFO_EXTENDED: {
+            GetCCDInfoResults2 *info = out;
+            memset (info, 0, sizeof (*info));
+            info->imagingABG = m->abg;
+            snprintf (info->serialNumber, sizeof (info->serialNumber),
+                      "%s", SIM_SERIAL);
+            break;
+        }
+        case CCD_INFO_EXTENDED2_IMAGING:
+        case CCD_INFO_EXTENDED2_TRACKING: {
+            GetCCDInfoResults4 *info = out;
+            memset (info, 0, sizeof (*info));
+            info->capabilitiesBits = m->capabilities;
+            break;
+        }
+        case CCD_INFO_EXTENDED3: {
+            GetCCDInfoResults6 *info = out;
+            memset (info, 0, sizeof (*info));
+            break;
+        }
+        case CCD_INFO_EXTENDED_5C:
+        default:
+            return CE_BAD_PARAMETER;
+    }
+    return CE_NO_ERROR;
+}
+
+static int cmd_cfw (CFWParams *in, CFWResults *out)
+{
+    const struct sim_model *m = sim.model;
+    struct timespec now;
+    bool busy;
+
+    if (!out)
+        return CE_BAD_PARAMETER;
+    memset (out, 0, sizeof (*out));
+    out->cfwModel = m->cfw;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    busy = timespec_since (&sim.cfw_done) < 0;
+    switch (in->cfwCommand) {
+        case CFWC_QUERY:
+            out->cfwStatus = busy ? CFWS_BUSY : CFWS_IDLE;
+            out->cfwPosition = busy ? CFWP_UNKNOWN : sim.cfw_position;
+            break;
+        case CFWC_GOTO: {
+            int slots;
+            long ms;
+            if (in->cfwParam1 < 1 || in->cfwParam1 > m->cfw_positions) {
+                out->cfwError = CFWE_BAD_COMMAND;
+                return CE_CFW_ERROR;
+            }
+            if (busy) {
+                out->cfwError = CFWE_BUSY;
+                return CE_CFW_ERROR;
+            }
+            slots = abs ((int)in->cfwParam1 - sim.cfw_position);
+            ms = SIM_CFW_SLOT_MS * slots;
+            sim.cfw_done = now;
+            sim.cfw_done.tv_sec += ms / 1000;
+            sim.cfw_done.tv_nsec += (ms % 1000) * 1000000L;
+            if (sim.cfw_done.tv_nsec >= 1000000000L) {
+                sim.cfw_done.tv_sec++;
+                sim.cfw_done.tv_nsec -= 1000000000L;
+            }
+            sim.cfw_position = in->cfwParam1;
+            out->cfwStatus = CFWS_BUSY;
+            break;
+        }
+        case CFWC_INIT:
+            sim.cfw_position = 1;
+            sim.cfw_done = now;
+            sim.cfw_done.tv_sec += 2;
+            break;
+        case CFWC_GET_INFO:
+            out->cfwResult1 = 0x0200;
+            out->cfwResult2 = m->cfw_positions;
+            break;
+        default:
+            out->cfwError = CFWE_BAD_COMMAND;
+            return CE_CFW_ERROR;
+    }
+    return CE_NO_ERROR;
+}
+
+static int cmd_set_temp (ushort regulation, double setpoint)
+{
+    update_temp ();
+    switch (regulation) {
+        case REGULATION_ON:
+            sim.cooling = true;
+            sim.setpoint = setpoint;
+            break;
+        case REGULATION_OFF:
+            sim.cooling = false;
+            break;
+        case REGULATION_OVERRIDE:
+        case REGULATION_FREEZE:
+        case REGULATION_UNFREEZE:
+        case REGULATION_ENABLE_AUTOFREEZE:
+        case REGULATION_DISABLE_AUTOFREEZE:
+            break;
+        default:
+            return CE_BAD_PARAMETER;
+    }
+    return CE_NO_ERROR;
+}
+
+static int cmd_query_temp (QueryTemperatureStatusParams *in,
+                           QueryTemperatureStatusResults2 *out)
+{
+    double power;
+
+    if (in->request != TEMP_STATUS_ADVANCED2 || !out)
+        return CE_BAD_PARAMETER;
+    update_temp ();
+    power = sim.cooling ? 100.0 * (SIM_AMBIENT - sim.temp) / SIM_MAX_DELTA : 0;
+    memset (out, 0, sizeof (*out));
+    out->coolingEnabled = sim.cooling;
+    out->fanEnabled = FS_AUTOCONTROL;
+    out->ccdSetpoint = sim.setpoint;
+    out->imagingCCDTemperature = sim.temp;
+    out->trackingCCDTemperature = sim.temp;
+    out->externalTrackingCCDTemperature = SIM_AMBIENT;
+    out->ambientTemperature = SIM_AMBIENT;
+    out->imagingCCDPower = power < 0 ? 0 : power;
+    out->trackingCCDPower = 0;
+    out->heatsinkTemperature = SIM_AMBIENT + 0.1 * power;
+    out->fanPower = 50;
+    out->fanSpeed = 2000;
+    out->trackingCCDSetpoint = sim.setpoint;
+    return CE_NO_ERROR;
+}
+
+static const char *errtab[] = {
+    [CE_NO_ERROR] = "No Error",
+    [CE_CAMERA_NOT_FOUND] = "Camera Not Found",
+    [CE_EXPOSURE_IN_PROGRESS] = "Exposure In Progress",
+    [CE_NO_EXPOSURE_IN_PROGRESS] = "No Exposure In Progress",
+    [CE_UNKNOWN_COMMAND] = "Unknown Command",
+    [CE_BAD_CAMERA_COMMAND] = "Bad Camera Command",
+    [CE_BAD_PARAMETER] = "Bad Parameter",
+    [CE_MEMORY_ERROR] = "Memory Error",
+    [CE_DRIVER_NOT_OPEN] = "Driver Not Open",
+    [CE_DRIVER_NOT_CLOSED] = "Driver Not Closed",
+    [CE_DEVICE_NOT_FOUND] = "Device Not Found",
+    [CE_DEVICE_NOT_OPEN] = "Device Not Open",
+    [CE_DEVICE_NOT_CLOSED] = "Device Not Closed",
+    [CE_OS_ERROR] = "OS Error",
+    [CE_CFW_ERROR] = "CFW Error",
+};
+
+static int cmd_get_error_string (GetErrorStringParams *in,
+                                 GetErrorStringResults *out)
+{
+    int max = sizeof (errtab) / sizeof (errtab[0]);
+
+    if (!out)
+        return CE_BAD_PARAMETER;
+    if (in->errorNo < max && errtab[in->errorNo])
+        snprintf (out->errorString, sizeof (out->errorString), "%s",
+                  errtab[in->errorNo]);
+    else
+        snprintf (out->errorString, sizeof (out->errorString),
+                  "Error %d", in->errorNo);
+    return CE_NO_ERROR;
+}
+
+static int cmd_open_device (OpenDeviceParams *in)
+{
+    if (sim.device_open)
+        return CE_DEVICE_NOT_CLOSED;
+    switch (in->deviceType) {
+        case DEV_USB:
+        case DEV_USB1:
+        case DEV_ETH:
+            break;
+        default:
+            return CE_DEVICE_NOT_FOUND;
+    }
+    sim.device_open = true;
+    return CE_NO_ERROR;
+}
+
+short SBIGUnivDrvCommand (short command, void *Params, void *Results)
+{
+    /* Commands that work with the driver closed.
+     */
+    switch (command) {
+        case CC_OPEN_DRIVER:
+            if (sim.driver_open)
+                return CE_DRIVER_NOT_CLOSED;
+            sim_init ();
+            sim.driver_open = true;
+            return CE_NO_ERROR;
+        case CC_GET_ERROR_STRING:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_get_error_string (Params, Results);
+        default:
+            break;
+    }
+    if (!sim.driver_open)
+        return CE_DRIVER_NOT_OPEN;
+
+    /* Commands that work with the device closed.
+     */
+    switch (command) {
+        case CC_CLOSE_DRIVER:
+            sim_fini ();
+            return CE_NO_ERROR;
+        case CC_GET_DRIVER_INFO: {
+            GetDriverInfoResults0 *out = Results;
+            if (!Params || !out || ((GetDriverInfoParams *)Params)->request
+                                                            != DRIVER_STD)
+                return CE_BAD_PARAMETER;
+            out->version = 0x0440;
+            snprintf (out->name, sizeof (out->name),
+                      "SBIG Simulated Universal Driver");
+            out->maxRequest = CC_LAST_COMMAND;
+            return CE_NO_ERROR;
+        }
+        case CC_OPEN_DEVICE:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_open_device (Params);
+        case CC_QUERY_USB: {
+            QueryUSBResults *out = Results;
+            if (!out)
+                return CE_BAD_PARAMETER;
+            memset (out, 0, sizeof (*out));
+            out->camerasFound = 1;
+            out->usbInfo[0].cameraFound = TRUE;
+            out->usbInfo[0].cameraType = sim.model->type;
+            snprintf (out->usbInfo[0].name, sizeof (out->usbInfo[0].name),
+                      "%s", sim.model->imaging.name);
+            snprintf (out->usbInfo[0].serialNumber,
+                      sizeof (out->usbInfo[0].serialNumber), "%s", SIM_SERIAL);
+            return CE_NO_ERROR;
+        }
+        case CC_QUERY_ETHERNET: {
+            QueryEthernetResults *out = Results;
+            if (!out)
+                return CE_BAD_PARAMETER;
+            memset (out, 0, sizeof (*out));
+            return CE_NO_ERROR;
+        }
+        default:
+            break;
+    }
+    if (!sim.device_open)
+        return CE_DEVICE_NOT_OPEN;
+
+    switch (command) {
+        case CC_CLOSE_DEVICE:
+            sim.device_open = false;
+            sim.linked = false;
+            return CE_NO_ERROR;
+        case CC_ESTABLISH_LINK: {
+            EstablishLinkResults *out = Results;
+            if (!out)
+                return CE_BAD_PARAMETER;
+            out->cameraType = sim.model->type;
+            sim.linked = true;
+            return CE_NO_ERROR;
+        }
+        default:
+            break;
+    }
+    if (!sim.linked)
+        return CE_CAMERA_NOT_FOUND;
+
+    switch (command) {
+        case CC_GET_CCD_INFO:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_get_ccd_info (Params, Results);
+        case CC_START_EXPOSURE: {
+            StartExposureParams *in = Params;
+            struct sim_ccd *c;
+            if (!in || !(c = lookup_ccd (in->ccd)))
+                return CE_BAD_PARAMETER;
+            return cmd_start_exposure (in->ccd, in->exposureTime,
+                                       in->openShutter, RM_1X1, 0, 0, 0, 0);
+        }
+        case CC_START_EXPOSURE2: {
+            StartExposureParams2 *in = Params;
+            if (!in)
+                return CE_BAD_PARAMETER;
+            return cmd_start_exposure (in->ccd, in->exposureTime,
+                                       in->openShutter, in->readoutMode,
+                                       in->top, in->left,
+                                       in->height, in->width);
+        }
+        case CC_END_EXPOSURE:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_end_exposure (Params);
+        case CC_START_READOUT:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_start_readout (Params);
+        case CC_READOUT_LINE:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_readout_line (Params, Results, false);
+        case CC_READ_SUBTRACT_LINE:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_readout_line (Params, Results, true);
+        case CC_DUMP_LINES:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_dump_lines (Params);
+        case CC_END_READOUT:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_end_readout (Params);
+        case CC_QUERY_COMMAND_STATUS:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_query_status (Params, Results);
+        case CC_SET_TEMPERATURE_REGULATION2: {
+            SetTemperatureRegulationParams2 *in = Params;
+            if (!in)
+                return CE_BAD_PARAMETER;
+            return cmd_set_temp (in->regulation, in->ccdSetpoint);
+        }
+        case CC_QUERY_TEMPERATURE_STATUS:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_query_temp (Params, Results);
+        case CC_CFW:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_cfw (Params, Results);
+        case CC_ACTIVATE_RELAY:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_activate_relay (Params);
+        case CC_AO_TIP_TILT:
+            if (!Params)
+                return CE_BAD_PARAMETER;
+            return cmd_ao_tip_tilt (Params);
+        case CC_AO_CENTER:
+            sim.ao_x = sim.ao_y = 0;
+            return CE_NO_ERROR;
+        case CC_AO_DELAY:
+            return Params ? CE_NO_ERROR : CE_BAD_PARAMETER;
+        default:
+            return CE_UNKNOWN_COMMAND;
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */